@@ -7,13 +7,34 @@
 #ifndef INC_COMMS_CANBUS_H_
 #define INC_COMMS_CANBUS_H_
 
+#include <assert.h>
+#include "toolbox.h"
 #include "utility/FastDelegate.h"
+#include "utility/Timer.h"
+#include "generics/LockFreeQueue.h"
+#include "CanFilter.h"
+#include "CanTxQueue.h"
+#include "CanStatistics.h"
+
+#ifndef CAN_FILTER_BANKS
+#define CAN_FILTER_BANKS (14)
+#endif
 
 class CanBus
 {
 public:
 	bool is_alive = false;
 
+	/**
+	 * A received frame, as held in the software receive queue.
+	 */
+	typedef struct Frame
+	{
+		uint16_t cob;
+		uint8_t length;
+		uint8_t data[8];
+	} Frame;
+
 	/**
 	 * Creates a \ref CanBus instance.
 	 * @param hcan Handle to the hardware resource.
@@ -35,6 +56,22 @@ public:
 		}
 	};
 
+	/**
+	 * Receives a copy of every frame sent or received, such as for recording. See set_tap().
+	 */
+	class ITap
+	{
+	public:
+		/**
+		 * Called for each frame received or sent, possibly from an interrupt.
+		 * @param cob The COB-ID.
+		 * @param data The data.
+		 * @param length The length of the data.
+		 * @param tx True if the frame was sent; false if received.
+		 */
+		virtual void on_tap(uint16_t cob, const uint8_t* data, uint8_t length, bool tx) = 0;
+	};
+
 	/**
 	 * Performs initialization tasks.
 	 * @param returns 0 on success; otherwise the error code.
@@ -45,19 +82,15 @@ public:
 		can_tx_header.RTR = CAN_RTR_DATA; // Normal data
 		can_tx_header.TransmitGlobalTime = DISABLE;
 
-		CAN_FilterTypeDef can_filter;
-		can_filter.FilterBank = 0;
-		can_filter.FilterMode = CAN_FILTERMODE_IDMASK;
-		can_filter.FilterScale = CAN_FILTERSCALE_32BIT;
-		can_filter.FilterIdHigh = 0x0000;
-		can_filter.FilterIdLow = 0x0000;
-		can_filter.FilterMaskIdHigh = 0x0000;
-		can_filter.FilterMaskIdLow = 0x0000;
-		can_filter.FilterFIFOAssignment = CAN_RX_FIFO0;
-		can_filter.FilterActivation = CAN_FILTER_ENABLE;
-		can_filter.SlaveStartFilterBank = 14;
-		if (HAL_CAN_ConfigFilter(hcan, &can_filter) != HAL_OK)
-			return HAL_CAN_GetError(hcan);
+		uint32_t error = configure_filters();
+		if (error != HAL_OK)
+			return error;
+
+		// bxCAN sends the lowest ID among its mailboxes first, and equal IDs lowest mailbox first, whatever order
+		// they were added in. Without a transmit queue, send in the order of the requests instead, so that frames
+		// with the same COB-ID, such as SDO segments, reach the bus in order.
+		if (tx_queue.get_capacity() == 0)
+			hcan->Instance->MCR |= CAN_MCR_TXFP;
 
 		if (HAL_CAN_Start(hcan) != HAL_OK)
 			return HAL_CAN_GetError(hcan);
@@ -65,6 +98,80 @@ public:
 		if (HAL_CAN_ActivateNotification(hcan, CAN_IT_RX_FIFO0_MSG_PENDING) != HAL_OK)
 			return HAL_CAN_GetError(hcan);
 
+		if (HAL_CAN_ActivateNotification(hcan, CAN_IT_TX_MAILBOX_EMPTY) != HAL_OK)
+			return HAL_CAN_GetError(hcan);
+
+		return HAL_OK;
+	}
+
+
+	/**
+	 * Accepts frames whose COB-ID matches under a mask. Call before setup(), or call configure_filters() afterwards.
+	 * If no filters are added, every frame is accepted.
+	 * @param cob The COB-ID.
+	 * @param mask The bits of the COB-ID that must match; 0x7ff for an exact match.
+	 * @returns True if added; false if CAN_FILTER_MAX_ENTRIES is exceeded.
+	 */
+	bool add_filter(uint16_t cob, uint16_t mask=CanFilter::AllIds)
+	{
+		return filter.add(cob, mask);
+	}
+
+
+	/**
+	 * Accepts frames whose COB-ID is within a range. Call before setup(), or call configure_filters() afterwards.
+	 * @param first The first COB-ID.
+	 * @param last The last COB-ID, inclusive.
+	 * @returns True if added; false if CAN_FILTER_MAX_ENTRIES is exceeded.
+	 */
+	bool add_filter_range(uint16_t first, uint16_t last)
+	{
+		return filter.add_range(first, last);
+	}
+
+
+	/**
+	 * Programs the hardware filter banks from the filters added, packing them into CAN_FILTER_BANKS banks.
+	 * @returns 0 on success; otherwise the error code.
+	 */
+	uint32_t configure_filters(void)
+	{
+		CanFilter::Bank banks[CAN_FILTER_BANKS];
+		uint32_t used = filter.solve(banks, CAN_FILTER_BANKS);
+
+		CAN_FilterTypeDef can_filter;
+		can_filter.FilterFIFOAssignment = CAN_RX_FIFO0;
+		can_filter.SlaveStartFilterBank = 14;
+		for (uint32_t i=0; i < CAN_FILTER_BANKS; i++)
+		{
+			can_filter.FilterBank = i;
+			if (used == 0 && i == 0)
+			{
+				// Nothing registered: accept everything.
+				can_filter.FilterMode = CAN_FILTERMODE_IDMASK;
+				can_filter.FilterScale = CAN_FILTERSCALE_32BIT;
+				can_filter.FilterIdHigh = 0x0000;
+				can_filter.FilterIdLow = 0x0000;
+				can_filter.FilterMaskIdHigh = 0x0000;
+				can_filter.FilterMaskIdLow = 0x0000;
+				can_filter.FilterActivation = CAN_FILTER_ENABLE;
+			}
+			else if (i < used)
+			{
+				can_filter.FilterMode = banks[i].list ? CAN_FILTERMODE_IDLIST : CAN_FILTERMODE_IDMASK;
+				can_filter.FilterScale = CAN_FILTERSCALE_16BIT;
+				can_filter.FilterIdHigh = banks[i].id_high;
+				can_filter.FilterIdLow = banks[i].id_low;
+				can_filter.FilterMaskIdHigh = banks[i].mask_high;
+				can_filter.FilterMaskIdLow = banks[i].mask_low;
+				can_filter.FilterActivation = CAN_FILTER_ENABLE;
+			}
+			else
+				can_filter.FilterActivation = CAN_FILTER_DISABLE;
+
+			if (HAL_CAN_ConfigFilter(hcan, &can_filter) != HAL_OK)
+				return HAL_CAN_GetError(hcan);
+		}
 		return HAL_OK;
 	}
 
@@ -83,40 +190,315 @@ public:
 
 
 	/**
-	 * Sends data on the bus.
+	 * Sends data on the bus. Without a transmit queue, frames leave the mailboxes in the order they were sent.
 	 * @param address The recipient address.
 	 * @param data Pointer to the data bytes.
 	 * @param length Length of the message (maximum 8).
+	 * @returns 0 on success; otherwise the error code. With a transmit queue, success means the frame was queued.
 	 */
 	uint32_t send(uint16_t address, uint8_t* data, uint8_t length)
 	{
+		if (tx_queue.get_capacity() > 0)
+			return enqueue(address, data, length);
+
 		can_tx_header.DLC = length;
 		can_tx_header.StdId = address;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
 		uint8_t ret = HAL_CAN_AddTxMessage(hcan, &can_tx_header, data, &can_tx_mailbox);
+		if (ret == HAL_OK)
+		{
+			// Kept for on_tx_complete(), which reports the frame once it is on the bus.
+			CanTxQueue::Entry* e = &tx_frames[mailbox_index(can_tx_mailbox)];
+			e->cob = address;
+			e->length = length > 8 ? 8 : length;
+			memcpy(e->data, data, e->length);
+			tx_mailboxes |= can_tx_mailbox;
+		}
+		__set_PRIMASK(primask);
 
 		if(ret != HAL_OK)
 			return HAL_CAN_GetError(hcan);
-
 		return 0;
 	}
 
 
+	/**
+	 * Gets the number of frames that can be sent now without send() failing.
+	 * @returns The number of free mailboxes (0-3), or the free space in the transmit queue.
+	 */
+	uint32_t get_free_mailboxes(void)
+	{
+		if (tx_queue.get_capacity() > 0)
+			return tx_queue.get_capacity() - tx_queue.get_length();
+		return HAL_CAN_GetTxMailboxesFreeLevel(hcan);
+	}
+
+
+	/**
+	 * Queues frames in software when the three transmit mailboxes are busy. Queued frames are released lowest
+	 * COB-ID first as mailboxes empty, and a queued frame that outranks every frame in the mailboxes preempts the
+	 * lowest-priority one. At most one frame per COB-ID is in the mailboxes at a time, so frames with the same
+	 * COB-ID reach the bus in the order they were sent. Call before setup(), and call on_tx_complete() and
+	 * on_tx_abort() from the HAL callbacks.
+	 * @param buffer Storage for the queue.
+	 * @param length The number of frames in the buffer.
+	 * @param timeout When the queue is full, the longest send() blocks for space, in milliseconds. If zero, the
+	 *                oldest queued frame is dropped instead, and send() never blocks, so it can be used in interrupts.
+	 */
+	void set_tx_queue(CanTxQueue::Entry* buffer, uint32_t length, uint32_t timeout=0)
+	{
+		tx_queue.set_buffer(buffer, length);
+		tx_timeout = timeout;
+	}
+
+
+	/**
+	 * Called from HAL_CAN_TxMailboxNCompleteCallback() to count and tap the frame that was sent, and refill the mailbox.
+	 * @param mailbox The mailbox, such as CAN_TX_MAILBOX0.
+	 */
+	void on_tx_complete(uint32_t mailbox)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (tx_mailboxes & mailbox)
+		{
+			CanTxQueue::Entry& e = tx_frames[mailbox_index(mailbox)];
+			if (statistics != nullptr)
+				statistics->on_tx(e.length);
+			if (tap != nullptr)
+				tap->on_tap(e.cob, e.data, e.length, true);
+		}
+		tx_mailboxes &= ~mailbox;
+		tx_aborting &= ~mailbox;
+		fill_mailboxes();
+		__set_PRIMASK(primask);
+	}
+
+
+	/**
+	 * Called from HAL_CAN_TxMailboxNAbortCallback() to put a preempted frame back in the queue. An aborted frame was
+	 * not sent, so it is not counted.
+	 * @param mailbox The mailbox, such as CAN_TX_MAILBOX0.
+	 */
+	void on_tx_abort(uint32_t mailbox)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		bool queued = tx_queue.get_capacity() > 0;
+		if (tx_mailboxes & mailbox && (!queued || !tx_queue.requeue(tx_frames[mailbox_index(mailbox)])))
+			tx_dropped++;
+		tx_mailboxes &= ~mailbox;
+		tx_aborting &= ~mailbox;
+		fill_mailboxes();
+		__set_PRIMASK(primask);
+	}
+
+
+	/**
+	 * Attaches a statistics collector, which then counts every frame received, and every frame sent once it has left
+	 * its mailbox. Call on_tx_complete() from the HAL callbacks, or sent frames are not counted.
+	 * @param statistics The collector, or nullptr to detach it.
+	 */
+	void set_statistics(CanStatistics* statistics)
+	{
+		this->statistics = statistics;
+	}
+
+
+	/**
+	 * Attaches a tap, which is then given every frame as it is received from the hardware or as it completes sending,
+	 * so a frame that is preempted and sent later is tapped once, at about the time it left the wire. Frames are
+	 * tapped before deferred dispatch, so the tap sees them in bus order. Call on_tx_complete() from the HAL
+	 * callbacks, or sent frames are not tapped.
+	 * @param tap The tap, or nullptr to detach it.
+	 */
+	void set_tap(ITap* tap)
+	{
+		this->tap = tap;
+	}
+
+
+	/**
+	 * Closes a statistics window and samples the error counters. Call about once a second.
+	 */
+	void update_statistics(void)
+	{
+		if (statistics != nullptr)
+			statistics->update(hcan->Instance->ESR);
+	}
+
+
+	/**
+	 * Called from HAL_CAN_ErrorCallback() to record bus-off events.
+	 */
+	void on_error(void)
+	{
+		if (statistics != nullptr && HAL_CAN_GetError(hcan) & HAL_CAN_ERROR_BOF)
+			statistics->on_bus_off();
+	}
+
+
+	/**
+	 * Gets the number of frames dropped because the transmit queue was full.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_tx_dropped(void)
+	{
+		return tx_dropped;
+	}
+
+
+	/**
+	 * Gets the number of times a frame in a mailbox was aborted to make way for a higher-priority one.
+	 * @returns The number of preemptions.
+	 */
+	uint32_t get_tx_preemptions(void)
+	{
+		return tx_preemptions;
+	}
+
+
 	void reset_error(void)
 	{
 		HAL_CAN_ResetError(hcan);
 	}
 
 
+	/**
+	 * Enables deferred dispatch. The interrupt routine then only moves frames from the hardware FIFO into this
+	 * queue, and a task calls dispatch() to handle them, so slow handlers cannot overrun the hardware FIFO.
+	 * @param buffer Storage for the queue.
+	 * @param length The number of frames in the buffer. Must be a power of two.
+	 */
+	void set_rx_queue(Frame* buffer, uint32_t length)
+	{
+		assert(length != 0 && (length & (length - 1)) == 0);
+		rx_queue.set_buffer(buffer, length);
+		deferred = true;
+	}
+
+
+#if USING_FREERTOS
+	/**
+	 * Sets a thread to be signalled whenever frames are queued, for use with wait().
+	 * @param thread The thread that calls dispatch().
+	 * @param flag The thread flag to set.
+	 */
+	void set_rx_thread(osThreadId_t thread, uint32_t flag=0x01)
+	{
+		rx_thread = thread;
+		rx_thread_flag = flag;
+	}
+
+
+	/**
+	 * Blocks the calling thread until frames are queued or the timeout expires.
+	 * @param timeout The maximum time to wait, in kernel ticks.
+	 * @returns True if frames are queued; otherwise false.
+	 */
+	bool wait(uint32_t timeout=osWaitForever)
+	{
+		if (!rx_queue.is_empty())
+			return true;
+		osThreadFlagsWait(rx_thread_flag, osFlagsWaitAny, timeout);
+		return !rx_queue.is_empty();
+	}
+#endif
+
+
+	/**
+	 * Handles frames held in the software receive queue. Call from a task when deferred dispatch is enabled.
+	 * @param max The most frames to handle in this call.
+	 * @returns The number of frames handled.
+	 */
+	uint32_t dispatch(uint32_t max=0xffffffff)
+	{
+		Frame frame;
+		uint32_t count = 0;
+		while (count < max && rx_queue.dequeue(frame))
+		{
+			on_frame(frame.cob, frame.data);
+			count++;
+		}
+		return count;
+	}
+
+
+	/**
+	 * Gets the number of frames dropped because the software receive queue was full.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_rx_overflows(void)
+	{
+		return rx_overflows;
+	}
+
+
+	/**
+	 * Gets the number of times the hardware FIFO overran while deferred dispatch was enabled.
+	 * @returns The number of overruns.
+	 */
+	uint32_t get_hardware_overruns(void)
+	{
+		return hardware_overruns;
+	}
+
+
 	/**
 	 * Called by interrupt routine to handle a received message.
 	 */
 	virtual void on_message(void)
 	{
 		CAN_RxHeaderTypeDef can_rx_header;
+		if (deferred)
+		{
+			// Drain every mailbox, so the hardware FIFO is empty when the interrupt returns.
+			Frame frame;
+			while (HAL_CAN_GetRxFifoFillLevel(hcan, CAN_RX_FIFO0) > 0)
+			{
+				if (HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &can_rx_header, frame.data) != HAL_OK)
+					break;
+				frame.cob = can_rx_header.StdId;
+				frame.length = can_rx_header.DLC;
+				if (statistics != nullptr)
+					statistics->on_rx(frame.cob, frame.length);
+				if (tap != nullptr)
+					tap->on_tap(frame.cob, frame.data, frame.length, false);
+				if (!rx_queue.enqueue(frame))
+					rx_overflows++;
+			}
+			if (__HAL_CAN_GET_FLAG(hcan, CAN_FLAG_FOV0))
+			{
+				hardware_overruns++;
+				__HAL_CAN_CLEAR_FLAG(hcan, CAN_FLAG_FOV0);
+			}
+#if USING_FREERTOS
+			if (rx_thread != nullptr)
+				osThreadFlagsSet(rx_thread, rx_thread_flag);
+#endif
+			return;
+		}
+
 		uint8_t data[8];
 		HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &can_rx_header, data);
+		if (statistics != nullptr)
+			statistics->on_rx(can_rx_header.StdId, can_rx_header.DLC);
+		if (tap != nullptr)
+			tap->on_tap(can_rx_header.StdId, data, can_rx_header.DLC, false);
+		on_frame(can_rx_header.StdId, data);
+	}
+
+
+	/**
+	 * Handles a received frame, either from the interrupt routine or from dispatch().
+	 * @param cob The COB-ID.
+	 * @param data The data (1-8 bytes).
+	 */
+	virtual void on_frame(uint16_t cob, uint8_t* data)
+	{
 		if (message_callback != nullptr)
-			message_callback(can_rx_header.StdId, data);
+			message_callback(cob, data);
 	}
 	
 
@@ -130,8 +512,127 @@ protected:
 	FastDelegate2<uint16_t, uint8_t*> message_callback;
 
 private:
+	/**
+	 * Queues a frame and starts transmission if a mailbox is free.
+	 */
+	uint32_t enqueue(uint16_t address, uint8_t* data, uint8_t length)
+	{
+		Timer timer;
+		timer.start(milliseconds(tx_timeout));
+		for (;;)
+		{
+			uint32_t primask = __get_PRIMASK();
+			__disable_irq();
+			bool queued = true;
+			if (tx_timeout == 0)
+			{
+				if (tx_queue.push_drop_oldest(address, data, length))
+					tx_dropped++;
+			}
+			else
+				queued = tx_queue.push(address, data, length);
+			if (queued)
+				fill_mailboxes();
+			__set_PRIMASK(primask);
+
+			if (queued)
+				return HAL_OK;
+			if (timer.is_elapsed())
+			{
+				tx_dropped++;
+				return HAL_CAN_ERROR_TIMEOUT;
+			}
+			osDelay(1);
+		}
+	}
+
+
+	/**
+	 * Moves queued frames into free mailboxes, and preempts a mailbox if the head of the queue outranks all of them.
+	 * Call with interrupts disabled.
+	 */
+	void fill_mailboxes(void)
+	{
+		CanTxQueue::Entry* e;
+		while ((e = tx_queue.peek()) != nullptr)
+		{
+			// The hardware sends equal IDs lowest mailbox first, not in the order they were added, so a frame waits
+			// until the one before it with the same COB-ID has left its mailbox.
+			if (is_in_mailbox(e->cob))
+				return;
+
+			if (HAL_CAN_GetTxMailboxesFreeLevel(hcan) > 0)
+			{
+				can_tx_header.DLC = e->length;
+				can_tx_header.StdId = e->cob;
+				uint32_t mailbox;
+				if (HAL_CAN_AddTxMessage(hcan, &can_tx_header, e->data, &mailbox) != HAL_OK)
+					return;
+				tx_queue.pop(tx_frames[mailbox_index(mailbox)]);
+				tx_mailboxes |= mailbox;
+				continue;
+			}
+
+			// All mailboxes are busy. The hardware sends the lowest ID among them first, so the queue head is only
+			// held back if it outranks the lowest-priority frame in a mailbox.
+			uint32_t victim = 0;
+			for (uint32_t i=0; i < 3; i++)
+			{
+				uint32_t mailbox = CAN_TX_MAILBOX0 << i;
+				if (!(tx_mailboxes & mailbox) || tx_aborting & mailbox)
+					continue;
+				if (victim == 0 || CanTxQueue::is_before(tx_frames[mailbox_index(victim)], tx_frames[i]))
+					victim = mailbox;
+			}
+			if (victim != 0 && CanTxQueue::is_before(*e, tx_frames[mailbox_index(victim)]))
+			{
+				tx_aborting |= victim;
+				tx_preemptions++;
+				HAL_CAN_AbortTxRequest(hcan, victim);
+			}
+			return;
+		}
+	}
+
+
+	/**
+	 * Determines whether a frame from the queue with a COB-ID is in a mailbox, including one being aborted.
+	 */
+	bool is_in_mailbox(uint16_t cob)
+	{
+		for (uint32_t i=0; i < 3; i++)
+			if (tx_mailboxes & CAN_TX_MAILBOX0 << i && tx_frames[i].cob == cob)
+				return true;
+		return false;
+	}
+
+
+	static uint32_t mailbox_index(uint32_t mailbox)
+	{
+		return mailbox == CAN_TX_MAILBOX0 ? 0 : mailbox == CAN_TX_MAILBOX1 ? 1 : 2;
+	}
+
+
 	CAN_TxHeaderTypeDef can_tx_header;
 	uint32_t can_tx_mailbox;
+	CanTxQueue tx_queue;
+	CanTxQueue::Entry tx_frames[3];  // Copies of the frames in the mailboxes, to count when sent or requeue if preempted.
+	volatile uint32_t tx_mailboxes = 0;  // Mailboxes holding frames that were sent through this instance.
+	volatile uint32_t tx_aborting = 0;  // Mailboxes with an abort request outstanding.
+	uint32_t tx_timeout = 0;
+	volatile uint32_t tx_dropped = 0;
+	volatile uint32_t tx_preemptions = 0;
+	CanStatistics* statistics = nullptr;
+	ITap* tap = nullptr;
+	CanFilter filter;
+	LockFreeQueue<Frame> rx_queue;
+	bool deferred = false;
+	volatile uint32_t rx_overflows = 0;
+	volatile uint32_t hardware_overruns = 0;
+#if USING_FREERTOS
+	osThreadId_t rx_thread = nullptr;
+	uint32_t rx_thread_flag = 0x01;
+#endif
 };
 
 #endif /* INC_COMMS_CANBUS_H_ */
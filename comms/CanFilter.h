@@ -0,0 +1,310 @@
+/**
+ * \file       comms/CanFilter.h
+ * \class      CanFilter
+ * \brief      Packs the COB-IDs wanted by handlers into bxCAN acceptance filter banks.
+ */
+
+#ifndef INC_COMMS_CANFILTER_H_
+#define INC_COMMS_CANFILTER_H_
+
+#include <stdint.h>
+
+#ifndef CAN_FILTER_MAX_ENTRIES
+#define CAN_FILTER_MAX_ENTRIES (32)
+#endif
+
+
+/**
+ * Collects the standard (11-bit) COB-IDs that handlers want, as masks or ranges, and packs them into as few bxCAN
+ * filter banks as possible. This class is pure logic, with no dependency on the HAL.
+ *
+ * Standard IDs fit the 16-bit filter scale, so each bank holds either four exact IDs (list mode) or two ID/mask pairs
+ * (mask mode); 32-bit scale is never denser for standard IDs. When the entries need more banks than are available,
+ * the pair of entries whose merger admits the fewest unwanted IDs is merged, and this repeats until they fit. In the
+ * worst case everything merges into a single mask, so the result always fits and never loses a wanted frame.
+ */
+class CanFilter
+{
+public:
+	static constexpr uint16_t AllIds = 0x7ff;
+
+	/**
+	 * An accepted set of IDs: every ID for which (id & mask) == this->id.
+	 */
+	typedef struct Entry
+	{
+		uint16_t id;
+		uint16_t mask;
+	} Entry;
+
+	/**
+	 * One filter bank, in the register layout used by CAN_FilterTypeDef at 16-bit scale.
+	 */
+	typedef struct Bank
+	{
+		bool list;  /// True for list mode (four IDs); false for mask mode (two ID/mask pairs).
+		uint16_t id_high;
+		uint16_t id_low;
+		uint16_t mask_high;
+		uint16_t mask_low;
+	} Bank;
+
+
+	/**
+	 * Accepts IDs that match under a mask.
+	 * @param id The ID.
+	 * @param mask The bits of the ID that must match; AllIds for an exact match.
+	 * @returns True if added; false if the entry table is full.
+	 */
+	bool add(uint16_t id, uint16_t mask=AllIds)
+	{
+		if (count == CAN_FILTER_MAX_ENTRIES)
+			return false;
+		mask &= AllIds;
+		entries[count].id = id & mask;
+		entries[count].mask = mask;
+		count++;
+		return true;
+	}
+
+
+	/**
+	 * Accepts a range of IDs, which is split into aligned blocks that each map to one mask.
+	 * @param first The first ID.
+	 * @param last The last ID, inclusive. IDs above AllIds are not standard IDs and are ignored.
+	 * @returns True if added; false if the entry table is full.
+	 */
+	bool add_range(uint16_t first, uint16_t last)
+	{
+		if (last > AllIds)
+			last = AllIds;
+		uint32_t id = first;
+		while (id <= last)
+		{
+			// The largest aligned block that starts at id and does not pass last.
+			uint32_t size = 1;
+			while (size < 0x800 && (id & (size * 2 - 1)) == 0 && id + size * 2 - 1 <= last)
+				size *= 2;
+			if (!add(id, AllIds & ~(size - 1)))
+				return false;
+			id += size;
+		}
+		return true;
+	}
+
+
+	/**
+	 * Removes all entries.
+	 */
+	void clear(void)
+	{
+		count = 0;
+	}
+
+
+	/**
+	 * Gets the number of entries.
+	 * @returns The number of entries.
+	 */
+	uint32_t get_count(void)
+	{
+		return count;
+	}
+
+
+	/**
+	 * Packs the entries into filter banks.
+	 * @param banks Array to receive the banks.
+	 * @param available The number of banks available.
+	 * @returns The number of banks used. Zero means no entries were added, and the caller should accept everything.
+	 */
+	uint32_t solve(Bank* banks, uint32_t available)
+	{
+		if (count == 0 || available == 0)
+			return 0;
+
+		Entry work[CAN_FILTER_MAX_ENTRIES];
+		uint32_t n = 0;
+		for (uint32_t i=0; i < count; i++)
+			n = insert(work, n, entries[i]);
+
+		while (banks_needed(work, n) > available)
+		{
+			// Merge the pair that admits the fewest unwanted IDs.
+			uint32_t best_a = 0, best_b = 1, best_cost = 0xffffffff;
+			for (uint32_t a=0; a < n; a++)
+				for (uint32_t b=a+1; b < n; b++)
+				{
+					uint32_t cost = merge_cost(work[a], work[b]);
+					if (cost < best_cost)
+						best_cost = cost, best_a = a, best_b = b;
+				}
+			Entry merged = merge(work[best_a], work[best_b]);
+			work[best_b] = work[--n];
+			work[best_a] = work[--n];
+			n = insert(work, n, merged);
+		}
+
+		return pack(work, n, banks);
+	}
+
+
+	/**
+	 * Gets the number of IDs that an entry accepts.
+	 * @param e The entry.
+	 * @returns The number of IDs.
+	 */
+	static uint32_t size(Entry e)
+	{
+		return 1u << (11 - popcount(e.mask));
+	}
+
+
+	/**
+	 * Gets the number of IDs accepted by a merger of two entries that neither entry accepts.
+	 * @param a The first entry.
+	 * @param b The second entry.
+	 * @returns The number of unwanted IDs.
+	 */
+	static uint32_t merge_cost(Entry a, Entry b)
+	{
+		uint32_t both = size(a) + size(b);
+		if (((a.id ^ b.id) & a.mask & b.mask) == 0)  // They overlap.
+			both -= 1u << (11 - popcount(a.mask | b.mask));
+		return size(merge(a, b)) - both;
+	}
+
+
+	/**
+	 * Merges two entries into the smallest single entry that accepts both.
+	 * @param a The first entry.
+	 * @param b The second entry.
+	 * @returns The merged entry.
+	 */
+	static Entry merge(Entry a, Entry b)
+	{
+		Entry e;
+		e.mask = a.mask & b.mask & ~(a.id ^ b.id) & AllIds;
+		e.id = a.id & e.mask;
+		return e;
+	}
+
+
+private:
+	/**
+	 * Determines whether every ID accepted by a is accepted by b.
+	 */
+	static bool is_subset(Entry a, Entry b)
+	{
+		return (a.mask & b.mask) == b.mask && (a.id & b.mask) == b.id;
+	}
+
+
+	/**
+	 * Adds an entry to a working set, dropping entries that it covers and skipping it if it is already covered.
+	 * @returns The new number of entries.
+	 */
+	static uint32_t insert(Entry* work, uint32_t n, Entry e)
+	{
+		for (uint32_t i=0; i < n; i++)
+			if (is_subset(e, work[i]))
+				return n;
+		for (uint32_t i=0; i < n; )
+		{
+			if (is_subset(work[i], e))
+				work[i] = work[--n];
+			else
+				i++;
+		}
+		work[n++] = e;
+		return n;
+	}
+
+
+	/**
+	 * Counts the banks needed: masks pair up, an odd mask slot takes one exact ID, and exact IDs fill lists of four.
+	 */
+	static uint32_t banks_needed(Entry* work, uint32_t n)
+	{
+		uint32_t exact = 0;
+		for (uint32_t i=0; i < n; i++)
+			if (work[i].mask == AllIds)
+				exact++;
+		uint32_t masked = n - exact;
+		if (masked % 2 && exact)
+			masked++, exact--;
+		return (masked + 1) / 2 + (exact + 3) / 4;
+	}
+
+
+	/**
+	 * Lays out the entries in banks.
+	 * @returns The number of banks used.
+	 */
+	static uint32_t pack(Entry* work, uint32_t n, Bank* banks)
+	{
+		Entry exact[CAN_FILTER_MAX_ENTRIES], masked[CAN_FILTER_MAX_ENTRIES];
+		uint32_t exact_count = 0, masked_count = 0;
+		for (uint32_t i=0; i < n; i++)
+		{
+			if (work[i].mask == AllIds)
+				exact[exact_count++] = work[i];
+			else
+				masked[masked_count++] = work[i];
+		}
+		if (masked_count % 2 && exact_count)
+			masked[masked_count++] = exact[--exact_count];
+
+		uint32_t used = 0;
+		for (uint32_t i=0; i < masked_count; i += 2)
+		{
+			Entry second = i + 1 < masked_count ? masked[i + 1] : masked[i];
+			Bank& bank = banks[used++];
+			bank.list = false;
+			bank.id_low = to_register(masked[i].id);
+			bank.mask_low = to_register(masked[i].mask) | FlagBits;
+			bank.id_high = to_register(second.id);
+			bank.mask_high = to_register(second.mask) | FlagBits;
+		}
+		for (uint32_t i=0; i < exact_count; i += 4)
+		{
+			// Unused slots repeat the first ID of the bank.
+			uint16_t ids[4];
+			for (uint32_t j=0; j < 4; j++)
+				ids[j] = to_register(exact[i + j < exact_count ? i + j : i].id);
+			Bank& bank = banks[used++];
+			bank.list = true;
+			bank.id_low = ids[0];
+			bank.mask_low = ids[1];
+			bank.id_high = ids[2];
+			bank.mask_high = ids[3];
+		}
+		return used;
+	}
+
+
+	/**
+	 * Converts an 11-bit value to its position in a 16-bit filter register (STID[10:0] in bits 15:5).
+	 */
+	static uint16_t to_register(uint16_t value)
+	{
+		return value << 5;
+	}
+
+
+	static uint32_t popcount(uint32_t value)
+	{
+		uint32_t n = 0;
+		for (; value; value &= value - 1)
+			n++;
+		return n;
+	}
+
+	static constexpr uint16_t FlagBits = 0x0018;  // RTR and IDE must match (be zero): standard data frames only.
+
+	Entry entries[CAN_FILTER_MAX_ENTRIES];
+	uint32_t count = 0;
+};
+
+
+#endif /* INC_COMMS_CANFILTER_H_ */
@@ -3,6 +3,7 @@
  * \class      CanOpen
  * \brief      Encapsulates CANopen communications.
  * \notes	   Configure the CAN port using STM32CubeIDE normally. Create an interrupt, and put a call to on_message in the interrupt.
+ *             To keep callbacks out of the interrupt, call set_rx_queue() and then dispatch() from a task.
  */
 
 #ifndef INC_COMMS_CANOPEN_H_
@@ -23,6 +24,11 @@ public:
 	static constexpr uint8_t NMT_ResetNode = 0x81;
 	static constexpr uint8_t NMT_ResetCommunications = 0x82;
 
+	// SDO command specifiers in the first byte of a reply from a server.
+	static constexpr uint8_t SDO_UploadResponse = 0x40;  // Masked with 0xe0; the low bits give the size.
+	static constexpr uint8_t SDO_DownloadResponse = 0x60;
+	static constexpr uint8_t SDO_Abort = 0x80;  // The data is the abort code.
+
 	// Indices 0x1000 to 0x1fff are defined by CIA 301.
 	static constexpr uint16_t Index_DeviceType = 0x1000;  // 32-ro
 	static constexpr uint16_t Index_ErrorRegister = 0x1001;  // 8-ro
@@ -107,6 +113,22 @@ public:
 		}
 
 
+		/**
+		 * Called when an sdo message is received, with its command specifier, so that a write being acknowledged
+		 * can be told from a value being read or an abort. Passes the message on to on_sdo() unless overridden.
+		 * @param node The node ID of the sender.
+		 * @param command The command specifier, such as SDO_DownloadResponse or SDO_Abort.
+		 * @param index The SDO index.
+		 * @param subindex The SDO subindex.
+		 * @param data The data (1-4 bytes), or the abort code.
+		 */
+		virtual void on_sdo_reply(uint16_t node, uint8_t command, uint16_t index, uint8_t subindex, uint8_t* data)
+		{
+			(void) command;
+			on_sdo(node, index, subindex, data);
+		}
+
+
 		/**
 		 * Called when an pdo message is received.
 		 * @param address The address ID of the receiver.
@@ -155,6 +177,22 @@ public:
 	};
 
 
+	/**
+	 * Receives SDO frames before they are decoded, so that multi-frame transfers can be handled. See CanOpenSdo.
+	 */
+	class ISdoHandler
+	{
+	public:
+		/**
+		 * Called when an SDO request or response is received.
+		 * @param cob The COB-ID.
+		 * @param data The data (8 bytes).
+		 * @returns True if the frame was consumed; false to pass it on to ICanOpenCallback::on_sdo_reply().
+		 */
+		virtual bool on_sdo_frame(uint16_t cob, uint8_t* data) = 0;
+	};
+
+
 	/**
 	 * Constructs a CanOpen object.
 	 * @param hcan Pointer to CAN device handle.
@@ -175,17 +213,21 @@ public:
 	{
 		uint8_t data[] = { 0xff, 0xff };
 		sync_count++;
-		return send(0x080, data, 2);
+		uint32_t error = send(0x080, data, 2);
+		if (sync_callback != nullptr)
+			sync_callback();
+		return error;
 	}
 
 
 	/**
 	 * Sends the CANopen NMT message.
 	 * @param state The state to transition to.
+	 * @param node The node ID, or 0 for all nodes.
 	 */
-	uint32_t nmt(uint8_t state)
+	uint32_t nmt(uint8_t state, uint8_t node=0)
 	{
-		uint8_t data[] = { state, 0x00 };
+		uint8_t data[] = { state, node };
 		return send(0x000, data, 2);
 	}
 
@@ -200,6 +242,24 @@ public:
 	 * @returns 0 on success; otherwise the error value.
 	 */
 	uint32_t sdo(uint16_t cob, uint16_t index, uint8_t subindex=0, uint32_t value=0, uint8_t size=0)
+	{
+		uint32_t error = send_sdo(cob, index, subindex, value, size);
+		osDelay(1);  // Keep this.
+		return error;
+	}
+
+
+	/**
+	 * Sends an SDO request message without pausing afterwards, for callers that wait for the reply themselves.
+	 * Safe to call from an interrupt.
+	 * @param address The address ID of the receiver.
+	 * @param index The SDO index.
+	 * @param subindex The SDO subindex.
+	 * @param value The optional data (1-4 bytes).
+	 * @param size The number of value bytes.
+	 * @returns 0 on success; otherwise the error value.
+	 */
+	uint32_t send_sdo(uint16_t cob, uint16_t index, uint8_t subindex=0, uint32_t value=0, uint8_t size=0)
 	{
 		cob += role==Master ? 0x600 : 0x580;
 		uint8_t data[] = {
@@ -213,9 +273,7 @@ public:
 				(uint8_t)((value & 0x00ff0000) >> 16),
 				(uint8_t)((value & 0xff000000) >> 24)
 		};
-		uint32_t error = send(cob, data, size == 0 ? 8 : 4 + size);
-		osDelay(1);  // Keep this.
-		return error;
+		return send(cob, data, size == 0 ? 8 : 4 + size);
 	}
 
 
@@ -243,53 +301,15 @@ public:
 
 
 	/**
-	 * Called by interrupt routine to handle a received message.
+	 * Called to handle a received message, from the interrupt routine or from dispatch().
+	 * @param cob The COB-ID.
+	 * @param data The data (1-8 bytes).
+	 * @remarks The function code (the top four bits of the COB-ID) indexes a jump table, so classification takes
+	 *          the same time for every frame.
 	 */
-	void on_message(void) override
+	void on_frame(uint16_t cob, uint8_t* data) override
 	{
-		CAN_RxHeaderTypeDef can_rx_header;
-		uint8_t data[8];
-		HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &can_rx_header, data);
-		uint16_t cob = can_rx_header.StdId;
-		uint16_t node = cob_to_node(cob);
-
-		if (cob == 0x000)
-		{
-			if (callback != nullptr)
-				callback->on_nmt(*data);
-		}
-
-		else if (cob == 0x7e4 || cob == 0x7e5)
-		{
-			if (callback != nullptr)
-				callback->on_lss(cob, data);
-		}
-
-		else if ((cob & 0x700) == 0x700)
-		{
-			if (callback != nullptr)
-				callback->on_heartbeat(node);
-		}
-
-		else if ((cob & 0x580) == 0x580)
-		{
-			uint16_t index = Conversion::lsb_uint16_to_uint16(data+1);
-			uint8_t subindex = data[3];
-			if (callback != nullptr)
-				callback->on_sdo(node, index, subindex, data+4);
-		}
-
-		else if ((cob & 0x180) == 0x180 || (cob & 0x280) == 0x280 || (cob & 0x380) == 0x380 || (cob & 0x480) == 0x480 || (cob & 0x190) == 0x190 || (cob & 0x290) == 0x290)
-		{
-			if (callback != nullptr)
-				callback->on_pdo(cob, data);
-		}
-
-		else
-		{
-			if (callback != nullptr)
-				callback->on_other_message(cob, data);
-		}
+		(this->*function_codes[cob >> 7 & 0x0f])(cob, data);
 
 		if (message_callback != nullptr)
 			message_callback(cob, data);
@@ -298,12 +318,46 @@ public:
 
 	/**
 	 * Registers the instance of the class that implements ICanOpenCallback.
+	 * @remarks This instance receives broadcast messages, and node-addressed messages for nodes without their own
+	 *          callback. See set_node_callback().
 	 */
 	void set_callback(CanOpen::ICanOpenCallback* instance)
 	{
 		this->callback = instance;
 	}
 
+
+	/**
+	 * Registers a callback that receives the PDO, SDO and heartbeat messages of one node, in place of the
+	 * callback registered with set_callback().
+	 * @param node The node ID (1-127).
+	 * @param instance The instance, or nullptr to remove it.
+	 */
+	void set_node_callback(uint8_t node, CanOpen::ICanOpenCallback* instance)
+	{
+		node_callbacks[node & 0x7f] = instance;
+	}
+
+	/**
+	 * Sets a callback that is called when a SYNC message is received or sent by sync().
+	 * @param callback The callback.
+	 */
+	void set_sync_callback(FastDelegate0<> callback)
+	{
+		this->sync_callback = callback;
+	}
+
+
+	/**
+	 * Registers a handler that sees every SDO frame first.
+	 * @param handler The handler, or nullptr to remove it.
+	 */
+	void set_sdo_handler(ISdoHandler* handler)
+	{
+		this->sdo_handler = handler;
+	}
+
+
 	void set_message_callback(FastDelegate2<uint16_t, uint8_t*> callback)
 	{
 		this->message_callback = callback;
@@ -344,12 +398,124 @@ public:
 
 
 private:
+	typedef void (CanOpen::*FunctionCodeHandler)(uint16_t cob, uint8_t* data);
+	static const FunctionCodeHandler function_codes[16];
+
+
+	/**
+	 * Gets the callback for a node.
+	 * @param cob The COB-ID.
+	 * @returns The node's callback if there is one; otherwise the default callback.
+	 */
+	ICanOpenCallback* node_callback(uint16_t cob)
+	{
+		ICanOpenCallback* c = node_callbacks[cob_to_node(cob)];
+		return c != nullptr ? c : callback;
+	}
+
+
+	void on_nmt_frame(uint16_t cob, uint8_t* data)
+	{
+		if (cob != 0x000)
+			return on_other_frame(cob, data);
+		if (callback != nullptr)
+			callback->on_nmt(*data);
+	}
+
+
+	void on_sync_frame(uint16_t cob, uint8_t* data)
+	{
+		if (cob == 0x080 && sync_callback != nullptr)
+			sync_callback();
+		on_other_frame(cob, data);
+	}
+
+
+	void on_pdo_frame(uint16_t cob, uint8_t* data)
+	{
+		ICanOpenCallback* c = node_callback(cob);
+		if (c != nullptr)
+			c->on_pdo(cob, data);
+	}
+
+
+	void on_sdo_frame(uint16_t cob, uint8_t* data)
+	{
+		if (sdo_handler != nullptr && sdo_handler->on_sdo_frame(cob, data))
+			return;
+		ICanOpenCallback* c = node_callback(cob);
+		if (c != nullptr)
+			c->on_sdo_reply(cob_to_node(cob), data[0], Conversion::lsb_uint16_to_uint16(data+1), data[3], data+4);
+	}
+
+
+	void on_sdo_request_frame(uint16_t cob, uint8_t* data)
+	{
+		// Requests are only of interest to a server.
+		if (role == Slave)
+			on_sdo_frame(cob, data);
+		else if (sdo_handler == nullptr || !sdo_handler->on_sdo_frame(cob, data))
+			on_other_frame(cob, data);
+	}
+
+
+	void on_heartbeat_frame(uint16_t cob, uint8_t* data)
+	{
+		(void) data;
+		ICanOpenCallback* c = node_callback(cob);
+		if (c != nullptr)
+			c->on_heartbeat(cob_to_node(cob));
+	}
+
+
+	void on_lss_frame(uint16_t cob, uint8_t* data)
+	{
+		if (cob != 0x7e4 && cob != 0x7e5)
+			return on_other_frame(cob, data);
+		if (callback != nullptr)
+			callback->on_lss(cob, data);
+	}
+
+
+	void on_other_frame(uint16_t cob, uint8_t* data)
+	{
+		if (callback != nullptr)
+			callback->on_other_message(cob, data);
+	}
+
+
 	uint32_t sync_count = 0;
 	ICanOpenCallback* callback = nullptr;
+	ICanOpenCallback* node_callbacks[128] = {nullptr};
+	ISdoHandler* sdo_handler = nullptr;
+	FastDelegate0<> sync_callback;
 	roles role = Master;
 	FastDelegate2<uint16_t, uint8_t*> message_callback;
 	bool allow_tpdo5 = false;
 };
 
 
+/**
+ * Handlers by function code (COB-ID bits 10-7), per the CiA 301 predefined connection set.
+ */
+inline const CanOpen::FunctionCodeHandler CanOpen::function_codes[16] = {
+	&CanOpen::on_nmt_frame,  // 0x000 NMT
+	&CanOpen::on_sync_frame,  // 0x080 SYNC, 0x081-0x0ff EMCY
+	&CanOpen::on_other_frame,  // 0x100 TIME
+	&CanOpen::on_pdo_frame,  // 0x180 TPDO1
+	&CanOpen::on_pdo_frame,  // 0x200 RPDO1
+	&CanOpen::on_pdo_frame,  // 0x280 TPDO2
+	&CanOpen::on_pdo_frame,  // 0x300 RPDO2
+	&CanOpen::on_pdo_frame,  // 0x380 TPDO3
+	&CanOpen::on_pdo_frame,  // 0x400 RPDO3
+	&CanOpen::on_pdo_frame,  // 0x480 TPDO4
+	&CanOpen::on_pdo_frame,  // 0x500 RPDO4
+	&CanOpen::on_sdo_frame,  // 0x580 SDO server to client
+	&CanOpen::on_sdo_request_frame,  // 0x600 SDO client to server
+	&CanOpen::on_other_frame,  // 0x680 unused
+	&CanOpen::on_heartbeat_frame,  // 0x700 NMT error control (heartbeat)
+	&CanOpen::on_lss_frame,  // 0x780 LSS at 0x7e4 and 0x7e5
+};
+
+
 #endif /* INC_COMMS_CANOPEN_H_ */
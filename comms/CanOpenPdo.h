@@ -0,0 +1,158 @@
+/**
+ * \file       comms/CanOpenPdo.h
+ * \class      CanOpenPdo
+ * \brief      Compile-time PDO mappings that pack and unpack frames directly to and from typed variables.
+ */
+
+#ifndef INC_COMMS_CANOPENPDO_H_
+#define INC_COMMS_CANOPENPDO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "CanOpen.h"
+
+
+/**
+ * Describes one object of an object dictionary.
+ * @tparam Index The index.
+ * @tparam Subindex The subindex.
+ * @tparam T The type of the value: an integer or float of 1, 2 or 4 bytes.
+ */
+template <uint16_t Index, uint8_t Subindex, typename T> struct CanOpenObject
+{
+	typedef T type;
+	static constexpr uint16_t index = Index;
+	static constexpr uint8_t subindex = Subindex;
+	static constexpr uint8_t size = sizeof(T);
+
+	/**
+	 * The value written to a PDO mapping parameter (0x1600/0x1a00 subindex 1-8) to map this object.
+	 */
+	static constexpr uint32_t mapping = (uint32_t) Index << 16 | (uint32_t) Subindex << 8 | sizeof(T) * 8;
+
+	static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4, "Mapped objects must be 1, 2 or 4 bytes.");
+};
+
+
+/**
+ * A PDO mapping, which lays out objects in a frame in the order given.
+ * The layout is fixed at compile time, so pack() and unpack() compile to one load and store per object, with no table
+ * to walk at runtime. CANopen and Cortex-M are both little-endian, so values are copied without conversion.
+ *
+ * <code>
+ * typedef CanOpenObject<CanOpen::Index_StatusWord, 0, uint16_t> StatusWord;
+ * typedef CanOpenObject<CanOpen::Index_ActualPosition, 0, int32_t> ActualPosition;
+ * typedef CanOpenPdo<StatusWord, ActualPosition> Tpdo1;
+ *
+ * uint16_t status; int32_t position;
+ * Tpdo1::unpack(data, status, position);
+ * </code>
+ * @tparam Objects The mapped objects, each a CanOpenObject.
+ */
+template <typename... Objects> class CanOpenPdo
+{
+public:
+	static constexpr uint8_t count = sizeof...(Objects);
+	static constexpr uint8_t length = (0 + ... + Objects::size);
+
+	static_assert(count <= 8, "A PDO maps at most eight objects.");
+	static_assert(length <= 8, "A PDO carries at most eight bytes.");
+
+
+	/**
+	 * Packs values into a frame.
+	 * @param data The frame data, at least length bytes.
+	 * @param values The values, in mapping order.
+	 */
+	static void pack(uint8_t* data, const typename Objects::type&... values)
+	{
+		uint8_t offset = 0;
+		((memcpy(data + offset, &values, Objects::size), offset += Objects::size), ...);
+	}
+
+
+	/**
+	 * Unpacks values from a frame.
+	 * @param data The frame data, at least length bytes.
+	 * @param values Set to the values, in mapping order.
+	 */
+	static void unpack(const uint8_t* data, typename Objects::type&... values)
+	{
+		uint8_t offset = 0;
+		((memcpy(&values, data + offset, Objects::size), offset += Objects::size), ...);
+	}
+
+
+	/**
+	 * Gets the offset of an object in the frame.
+	 * @tparam Object The object, which must be mapped.
+	 * @returns The offset in bytes.
+	 */
+	template <typename Object> static constexpr uint8_t offset_of(void)
+	{
+		static_assert((0 + ... + (Objects::mapping == Object::mapping ? 1 : 0)) == 1, "The object is not mapped.");
+		uint8_t offset = 0;
+		bool found = false;
+		((found = found || Objects::mapping == Object::mapping, offset += found ? 0 : Objects::size), ...);
+		return offset;
+	}
+
+
+	/**
+	 * Reads one object from a frame.
+	 * @tparam Object The object, which must be mapped.
+	 * @param data The frame data.
+	 * @returns The value.
+	 */
+	template <typename Object> static typename Object::type get(const uint8_t* data)
+	{
+		typename Object::type value;
+		memcpy(&value, data + offset_of<Object>(), Object::size);
+		return value;
+	}
+
+
+	/**
+	 * Writes one object to a frame.
+	 * @tparam Object The object, which must be mapped.
+	 * @param data The frame data.
+	 * @param value The value.
+	 */
+	template <typename Object> static void set(uint8_t* data, const typename Object::type& value)
+	{
+		memcpy(data + offset_of<Object>(), &value, Object::size);
+	}
+
+
+	/**
+	 * Gets the value that maps an object, as written to the mapping parameter.
+	 * @param i The position of the object in the mapping (0 to count-1).
+	 * @returns The mapping value, or 0 if out of range.
+	 */
+	static constexpr uint32_t get_mapping(uint8_t i)
+	{
+		constexpr uint32_t mappings[] = { Objects::mapping..., 0 };
+		return i < count ? mappings[i] : 0;
+	}
+
+
+	/**
+	 * Writes this mapping to a node's mapping parameter over SDO. The PDO should be disabled while it is remapped.
+	 * @param canopen The CanOpen instance.
+	 * @param node The node ID.
+	 * @param mapping_index The mapping parameter, such as CanOpen::Index_Tpdo0Mapping.
+	 * @returns 0 on success; otherwise the error value of the first failed send.
+	 */
+	static uint32_t configure(CanOpen* canopen, uint8_t node, uint16_t mapping_index)
+	{
+		uint32_t error = canopen->sdo(node, mapping_index, CanOpen::Subindex_NumberOfEntries, 0, 1);
+		for (uint8_t i=0; i < count && error == 0; i++)
+			error = canopen->sdo(node, mapping_index, i + 1, get_mapping(i), 4);
+		if (error == 0)
+			error = canopen->sdo(node, mapping_index, CanOpen::Subindex_NumberOfEntries, count, 1);
+		return error;
+	}
+};
+
+
+#endif /* INC_COMMS_CANOPENPDO_H_ */
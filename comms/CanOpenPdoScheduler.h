@@ -0,0 +1,228 @@
+/**
+ * \file       comms/CanOpenPdoScheduler.h
+ * \class      CanOpenPdoScheduler
+ * \brief      Sends TPDOs in batches when SYNC arrives, or on change and event timers, subject to inhibit times.
+ */
+
+#ifndef INC_COMMS_CANOPENPDOSCHEDULER_H_
+#define INC_COMMS_CANOPENPDOSCHEDULER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "CanOpen.h"
+#include "utility/Timer.h"
+
+#ifndef CANOPEN_PDO_SCHEDULER_MAX_PDOS
+#define CANOPEN_PDO_SCHEDULER_MAX_PDOS (8)
+#endif
+
+
+/**
+ * Schedules the transmission of TPDOs, following the transmission types of CiA 301.
+ *
+ * A synchronous PDO is sent in the pass that runs when SYNC is received (or sent by CanOpen::sync()), either every
+ * nth SYNC (cyclic) or at the first SYNC after its value changes (acyclic). All due PDOs go out back-to-back in
+ * registration order, so the bus sees one burst per SYNC instead of frames spread across the cycle; use a transmit
+ * queue (CanBus::set_tx_queue()) so the burst is not limited by the three mailboxes.
+ *
+ * An event-driven PDO is sent by poll() when its value changes or its event timer expires.
+ *
+ * The scheduler owns no data: each PDO points at an application buffer (typically filled with CanOpenPdo::pack()),
+ * and is compared against a copy of the last value sent. Inhibit times and event timers are measured against the
+ * time each PDO was last sent, using the free-running microsecond clock of Timer, so no timer per PDO is needed.
+ */
+class CanOpenPdoScheduler
+{
+public:
+	/**
+	 * Constructs a scheduler and registers it for SYNC with the CanOpen instance.
+	 * @param canopen The CanOpen instance.
+	 */
+	CanOpenPdoScheduler(CanOpen* canopen)
+	{
+		this->canopen = canopen;
+		canopen->set_sync_callback(MakeDelegate(this, &CanOpenPdoScheduler::on_sync));
+	}
+
+
+	/**
+	 * Registers a synchronous PDO.
+	 * @param cob The COB-ID.
+	 * @param data The application buffer holding the value.
+	 * @param length The length of the value (maximum 8).
+	 * @param every Send at every nth SYNC (1-240), or 0 to send at the first SYNC after the value changes.
+	 * @param inhibit The minimum time between transmissions, in multiples of 100 µs. A PDO held back by it stays due,
+	 *        and goes out at the next SYNC that it allows.
+	 * @returns True if registered; false if CANOPEN_PDO_SCHEDULER_MAX_PDOS are already registered.
+	 */
+	bool add_sync(uint16_t cob, uint8_t* data, uint8_t length, uint8_t every=1, uint16_t inhibit=0)
+	{
+		Pdo* pdo = add(cob, data, length, inhibit);
+		if (pdo == nullptr)
+			return false;
+		pdo->every = every;
+		return true;
+	}
+
+
+	/**
+	 * Registers an event-driven PDO, which is sent when its value changes.
+	 * @param cob The COB-ID.
+	 * @param data The application buffer holding the value.
+	 * @param length The length of the value (maximum 8).
+	 * @param event_timer If not zero, the PDO is also sent when it has not been sent for this many milliseconds.
+	 * @param inhibit The minimum time between transmissions, in multiples of 100 µs.
+	 * @returns True if registered; false if CANOPEN_PDO_SCHEDULER_MAX_PDOS are already registered.
+	 */
+	bool add_event(uint16_t cob, uint8_t* data, uint8_t length, uint16_t event_timer=0, uint16_t inhibit=0)
+	{
+		Pdo* pdo = add(cob, data, length, inhibit);
+		if (pdo == nullptr)
+			return false;
+		pdo->event = true;
+		pdo->event_timer = event_timer;
+		return true;
+	}
+
+
+	/**
+	 * Sends the synchronous PDOs that are due. Called by CanOpen when SYNC is received or sent.
+	 */
+	void on_sync(void)
+	{
+		uint32_t now = Timer::now();
+		for (uint32_t i=0; i < count; i++)
+		{
+			Pdo* pdo = &pdos[i];
+			if (pdo->event)
+				continue;
+
+			bool due;
+			if (pdo->every == 0)
+				due = is_changed(pdo);
+			else
+			{
+				if (pdo->syncs < pdo->every)
+					pdo->syncs++;
+				due = pdo->syncs >= pdo->every;
+			}
+
+			// The count restarts only once the frame is sent, so one held back goes at the next SYNC.
+			if (due && transmit(pdo, now))
+				pdo->syncs = 0;
+		}
+	}
+
+
+	/**
+	 * Sends the event-driven PDOs that have changed or whose event timers have expired. Call regularly.
+	 */
+	void poll(void)
+	{
+		uint32_t now = Timer::now();
+		for (uint32_t i=0; i < count; i++)
+		{
+			Pdo* pdo = &pdos[i];
+			if (!pdo->event)
+				continue;
+			bool expired = pdo->event_timer && now - pdo->sent_at >= milliseconds((uint32_t) pdo->event_timer);
+			if (expired || is_changed(pdo))
+				transmit(pdo, now);
+		}
+	}
+
+
+	/**
+	 * Gets the number of PDOs sent.
+	 * @returns The number of PDOs.
+	 */
+	uint32_t get_sent(void)
+	{
+		return sent;
+	}
+
+
+	/**
+	 * Gets the number of times a due PDO was held back by its inhibit time.
+	 * @returns The number of times.
+	 */
+	uint32_t get_inhibited(void)
+	{
+		return inhibited;
+	}
+
+
+private:
+	/**
+	 * A registered PDO.
+	 */
+	typedef struct Pdo
+	{
+		uint16_t cob;
+		uint8_t length;
+		bool event;  /// True if event-driven; false if synchronous.
+		bool never_sent;
+		uint8_t every;  /// Synchronous: SYNCs per transmission, or 0 for acyclic.
+		uint8_t syncs;  /// Synchronous: SYNCs since the last transmission.
+		uint16_t event_timer;  /// Event-driven: milliseconds.
+		uint16_t inhibit;  /// 100 µs units.
+		uint8_t* data;  /// Application buffer.
+		uint8_t last[8];  /// Value last sent.
+		uint32_t sent_at;  /// Timer::now() when last sent.
+	} Pdo;
+
+
+	Pdo* add(uint16_t cob, uint8_t* data, uint8_t length, uint16_t inhibit)
+	{
+		if (count == CANOPEN_PDO_SCHEDULER_MAX_PDOS)
+			return nullptr;
+		Pdo* pdo = &pdos[count++];
+		memset(pdo, 0, sizeof(Pdo));
+		pdo->cob = cob;
+		pdo->data = data;
+		pdo->length = length > 8 ? 8 : length;
+		pdo->inhibit = inhibit;
+		pdo->never_sent = true;
+		return pdo;
+	}
+
+
+	bool is_changed(Pdo* pdo)
+	{
+		return pdo->never_sent || memcmp(pdo->data, pdo->last, pdo->length) != 0;
+	}
+
+
+	/**
+	 * Sends a PDO unless its inhibit time has not passed.
+	 * @returns True if sent; false if held back or not accepted by CanBus.
+	 */
+	bool transmit(Pdo* pdo, uint32_t now)
+	{
+		if (!pdo->never_sent && now - pdo->sent_at < pdo->inhibit * 100u)
+		{
+			inhibited++;
+			return false;
+		}
+		uint8_t frame[8];
+		memcpy(frame, pdo->data, pdo->length);
+		if (canopen->send(pdo->cob, frame, pdo->length) != 0)
+			return false;
+		memcpy(pdo->last, frame, pdo->length);
+		pdo->sent_at = now;
+		pdo->never_sent = false;
+		sent++;
+		return true;
+	}
+
+
+	CanOpen* canopen;
+	Pdo pdos[CANOPEN_PDO_SCHEDULER_MAX_PDOS];
+	uint32_t count = 0;
+	uint32_t sent = 0;
+	uint32_t inhibited = 0;
+};
+
+
+#endif /* INC_COMMS_CANOPENPDOSCHEDULER_H_ */
@@ -0,0 +1,1026 @@
+/**
+ * \file       comms/CanOpenSdo.h
+ * \class      CanOpenSdo
+ * \brief      Segmented and block SDO transfers, as client and server.
+ * \notes	   Enable deferred dispatch with CanBus::set_rx_queue(), and call poll() from the task that calls dispatch(),
+ *             so that frames and polling are handled in the same context.
+ */
+
+#ifndef INC_COMMS_CANOPENSDO_H_
+#define INC_COMMS_CANOPENSDO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "CanOpen.h"
+#include "utility/FastDelegate.h"
+#include "utility/Timer.h"
+#include "utility/Crc.h"
+
+#ifndef CANOPEN_SDO_MAX_TRANSFERS
+#define CANOPEN_SDO_MAX_TRANSFERS (4)
+#endif
+
+#ifndef CANOPEN_SDO_TIMEOUT
+#define CANOPEN_SDO_TIMEOUT (500)
+#endif
+
+#ifndef CANOPEN_SDO_BLOCK_SIZE
+#define CANOPEN_SDO_BLOCK_SIZE (127)
+#endif
+
+
+/**
+ * An asynchronous SDO engine that implements the expedited, segmented and block protocols of CiA 301.
+ *
+ * As a client, upload() and download() start a transfer with a remote node and return immediately; the completion
+ * callback reports the result. One transfer can be in progress with each node, and up to CANOPEN_SDO_MAX_TRANSFERS at
+ * once. Block transfers move up to CANOPEN_SDO_BLOCK_SIZE segments of seven bytes per acknowledgement and are checked
+ * with a CRC.
+ *
+ * As a server, requests addressed to this node are answered from an ISdoServer, which locates the objects.
+ *
+ * A transfer that sees no progress for CANOPEN_SDO_TIMEOUT milliseconds is aborted with AbortTimeout.
+ */
+class CanOpenSdo : public CanOpen::ISdoHandler
+{
+public:
+	// Abort codes, from CiA 301.
+	static constexpr uint32_t AbortToggle = 0x05030000;
+	static constexpr uint32_t AbortTimeout = 0x05040000;
+	static constexpr uint32_t AbortCommand = 0x05040001;
+	static constexpr uint32_t AbortSequence = 0x05040003;
+	static constexpr uint32_t AbortCrc = 0x05040004;
+	static constexpr uint32_t AbortOutOfMemory = 0x05040005;
+	static constexpr uint32_t AbortNoObject = 0x06020000;
+	static constexpr uint32_t AbortLength = 0x06070010;
+	static constexpr uint32_t AbortGeneral = 0x08000000;
+
+	/**
+	 * Called when a client transfer finishes.
+	 * @param node The node ID of the server.
+	 * @param abort_code Zero on success; otherwise the abort code.
+	 * @param length The number of bytes transferred.
+	 */
+	typedef FastDelegate3<uint8_t, uint32_t, uint32_t> CompletionCallback;
+
+	/**
+	 * Locates the objects served by this node.
+	 */
+	class ISdoServer
+	{
+	public:
+		/**
+		 * Called when a client reads an object.
+		 * @param index The index.
+		 * @param subindex The subindex.
+		 * @param data Set to point to the value, which must remain valid until the transfer finishes.
+		 * @param length Set to the length of the value.
+		 * @returns Zero, or the abort code to send.
+		 */
+		virtual uint32_t on_read(uint16_t index, uint8_t subindex, uint8_t** data, uint32_t* length)
+		{
+			(void) index;
+			(void) subindex;
+			(void) data;
+			(void) length;
+			return AbortNoObject;
+		}
+
+
+		/**
+		 * Called when a client starts to write an object.
+		 * @param index The index.
+		 * @param subindex The subindex.
+		 * @param buffer Set to point to a buffer to receive the value.
+		 * @param size Set to the size of the buffer.
+		 * @returns Zero, or the abort code to send.
+		 */
+		virtual uint32_t on_write(uint16_t index, uint8_t subindex, uint8_t** buffer, uint32_t* size)
+		{
+			(void) index;
+			(void) subindex;
+			(void) buffer;
+			(void) size;
+			return AbortNoObject;
+		}
+
+
+		/**
+		 * Called when the value has been received into the buffer.
+		 * @param index The index.
+		 * @param subindex The subindex.
+		 * @param length The length of the value.
+		 * @returns Zero, or the abort code to send.
+		 */
+		virtual uint32_t on_written(uint16_t index, uint8_t subindex, uint32_t length)
+		{
+			(void) index;
+			(void) subindex;
+			(void) length;
+			return 0;
+		}
+	};
+
+
+	/**
+	 * Constructs an engine and registers it with the CanOpen instance.
+	 * @param canopen The CanOpen instance.
+	 */
+	CanOpenSdo(CanOpen* canopen)
+	{
+		this->canopen = canopen;
+		canopen->set_sdo_handler(this);
+	}
+
+
+	/**
+	 * Serves requests addressed to this node.
+	 * @param node This node's ID.
+	 * @param server The object locator, or nullptr to stop serving.
+	 */
+	void set_server(uint8_t node, ISdoServer* server)
+	{
+		this->node = node;
+		this->server = server;
+	}
+
+
+	/**
+	 * Sets the callback that reports the completion of client transfers.
+	 * @param callback The callback.
+	 */
+	void set_callback(CompletionCallback callback)
+	{
+		this->callback = callback;
+	}
+
+
+	/**
+	 * Starts reading an object from a node.
+	 * @param node The node ID of the server.
+	 * @param index The index.
+	 * @param subindex The subindex.
+	 * @param buffer The buffer to receive the value, which must remain valid until the transfer finishes.
+	 * @param size The size of the buffer.
+	 * @param block True to use block transfer; false to use expedited or segmented transfer.
+	 * @returns True if started; false if a transfer with the node is in progress or no slots are free.
+	 */
+	bool upload(uint8_t node, uint16_t index, uint8_t subindex, uint8_t* buffer, uint32_t size, bool block=false)
+	{
+		Transfer* t = begin(node, false, index, subindex, buffer, size, 0);
+		if (t == nullptr)
+			return false;
+
+		uint8_t data[8];
+		if (block)
+		{
+			t->state = BlockUploadInitiate;
+			header(t, data, 0xa4);  // Block upload, CRC supported.
+			data[4] = t->blksize;
+			data[5] = 0;  // No protocol switch.
+		}
+		else
+		{
+			t->state = UploadInitiate;
+			header(t, data, 0x40);
+		}
+		transmit(t, data);
+		return true;
+	}
+
+
+	/**
+	 * Starts writing an object to a node.
+	 * @param node The node ID of the server.
+	 * @param index The index.
+	 * @param subindex The subindex.
+	 * @param value The value, which must remain valid until the transfer finishes.
+	 * @param length The length of the value.
+	 * @param block True to use block transfer; false to use expedited or segmented transfer.
+	 * @returns True if started; false if a transfer with the node is in progress or no slots are free.
+	 */
+	bool download(uint8_t node, uint16_t index, uint8_t subindex, const uint8_t* value, uint32_t length, bool block=false)
+	{
+		Transfer* t = begin(node, false, index, subindex, (uint8_t*) value, length, length);
+		if (t == nullptr)
+			return false;
+
+		uint8_t data[8];
+		if (block)
+		{
+			t->state = BlockDownloadInitiate;
+			header(t, data, 0xc6);  // Block download, CRC supported, size indicated.
+			put_uint32(data + 4, length);
+		}
+		else if (length > 0 && length <= 4)
+		{
+			t->state = DownloadInitiate;
+			header(t, data, 0x23 | (4 - length) << 2);  // Expedited, size indicated.
+			memcpy(data + 4, value, length);
+			t->offset = length;
+		}
+		else
+		{
+			t->state = DownloadInitiate;
+			header(t, data, 0x21);  // Segmented, size indicated.
+			put_uint32(data + 4, length);
+		}
+		transmit(t, data);
+		return true;
+	}
+
+
+	/**
+	 * Determines whether a client transfer with a node is in progress.
+	 * @param node The node ID.
+	 * @returns True if in progress; otherwise false.
+	 */
+	bool is_busy(uint8_t node)
+	{
+		return find(node, false) != nullptr;
+	}
+
+
+	/**
+	 * Aborts a client transfer.
+	 * @param node The node ID.
+	 * @param abort_code The abort code to send.
+	 */
+	void abort(uint8_t node, uint32_t abort_code=AbortGeneral)
+	{
+		Transfer* t = find(node, false);
+		if (t != nullptr)
+			finish(t, abort_code, true);
+	}
+
+
+	/**
+	 * Retries frames that could not be sent, streams block segments, and times out stalled transfers.
+	 * Call regularly, from the task that calls CanBus::dispatch().
+	 */
+	void poll(void)
+	{
+		for (uint32_t i=0; i < CANOPEN_SDO_MAX_TRANSFERS; i++)
+		{
+			Transfer* t = &transfers[i];
+			if (t->state == Idle)
+				continue;
+
+			if (t->timer.is_elapsed())
+			{
+				if (t->state == Closing)
+				{
+					t->state = Idle;
+					continue;
+				}
+				timeouts++;
+				finish(t, AbortTimeout, true);
+				continue;
+			}
+
+			if (t->tx_pending)
+			{
+				if (canopen->get_free_mailboxes() == 0)
+					continue;
+				t->tx_pending = canopen->send(tx_cob(t), t->tx, 8) != 0;
+			}
+
+			if (t->state == Closing && !t->tx_pending)
+				t->state = Idle;
+
+			if (!t->tx_pending && (t->state == BlockDownloadSending || t->state == ServerBlockUploadSending))
+				send_segments(t);
+		}
+	}
+
+
+	/**
+	 * Gets the number of transfers that have timed out.
+	 * @returns The number of timeouts.
+	 */
+	uint32_t get_timeouts(void)
+	{
+		return timeouts;
+	}
+
+
+	/**
+	 * Gets the number of transfers that were aborted, by either side, for reasons other than a timeout.
+	 * @returns The number of aborts.
+	 */
+	uint32_t get_aborts(void)
+	{
+		return aborts;
+	}
+
+
+	/**
+	 * Handles an SDO frame. Called by CanOpen.
+	 * @param cob The COB-ID.
+	 * @param data The data.
+	 * @returns True if the frame belongs to a transfer handled here; otherwise false.
+	 */
+	bool on_sdo_frame(uint16_t cob, uint8_t* data) override
+	{
+		uint8_t n = cob & 0x7f;
+		if ((cob & 0x780) == 0x580)
+		{
+			Transfer* t = find(n, false);
+			if (t == nullptr)
+				return false;  // A response to CanOpen::sdo().
+			on_response(t, data);
+			return true;
+		}
+
+		if ((cob & 0x780) == 0x600 && server != nullptr && n == node)
+		{
+			on_request(data);
+			return true;
+		}
+
+		return false;
+	}
+
+
+private:
+	enum states
+	{
+		Idle,
+		Closing,  // Finished, but the last frame is waiting for a mailbox.
+		// Client.
+		DownloadInitiate,
+		DownloadSegment,
+		UploadInitiate,
+		UploadSegment,
+		BlockDownloadInitiate,
+		BlockDownloadSending,
+		BlockDownloadAck,
+		BlockDownloadEnd,
+		BlockUploadInitiate,
+		BlockUploadReceiving,
+		BlockUploadEnd,
+		// Server.
+		ServerDownloadSegment,
+		ServerUploadSegment,
+		ServerBlockDownloadReceiving,
+		ServerBlockDownloadEnd,
+		ServerBlockUploadStart,
+		ServerBlockUploadSending,
+		ServerBlockUploadAck,
+		ServerBlockUploadEnd,
+	};
+
+	/**
+	 * The state of one transfer.
+	 */
+	typedef struct Transfer
+	{
+		states state;
+		bool server;  /// True if this node is the server.
+		uint8_t node;  /// The node ID of the server.
+		uint16_t index;
+		uint8_t subindex;
+		uint8_t* buffer;
+		uint32_t size;  /// Size of the buffer.
+		uint32_t length;  /// Length of the value, when known.
+		uint32_t offset;  /// Bytes transferred and acknowledged.
+		uint32_t block_start;  /// Offset of the first segment of the current block.
+		uint8_t toggle;  /// Toggle bit of the next segment.
+		uint8_t seqno;  /// Last block segment sent or received in sequence.
+		uint8_t blksize;  /// Segments per block.
+		bool last;  /// The last block segment has been sent or received.
+		bool tx_pending;  /// tx could not be sent yet.
+		uint8_t tx[8];
+		Timer timer;
+	} Transfer;
+
+
+	/**
+	 * Handles a frame from a server.
+	 */
+	void on_response(Transfer* t, uint8_t* data)
+	{
+		uint8_t command = data[0];
+		if (command == 0x80)
+			return finish(t, get_uint32(data + 4), false);
+
+		touch(t);
+		uint8_t reply[8];
+		switch (t->state)
+		{
+			case DownloadInitiate:
+				if (command != 0x60)
+					return finish(t, AbortCommand, true);
+				if (t->length > 0 && t->offset == t->length)
+					return finish(t, 0, false);  // Expedited.
+				t->state = DownloadSegment;
+				return send_segment(t);
+
+			case DownloadSegment:
+				if ((command & 0xe0) != 0x20)
+					return finish(t, AbortCommand, true);
+				if ((command >> 4 & 1) != t->toggle)
+					return finish(t, AbortToggle, true);
+				t->toggle ^= 1;
+				t->offset += segment_length(t);
+				if (t->offset == t->length)
+					return finish(t, 0, false);
+				return send_segment(t);
+
+			case UploadInitiate:
+				if ((command & 0xe0) != 0x40)
+					return finish(t, AbortCommand, true);
+				if (command & 0x02)
+				{
+					// Expedited.
+					uint32_t n = command & 0x01 ? 4 - (command >> 2 & 3) : 4;
+					if (n > t->size)
+						return finish(t, AbortOutOfMemory, true);
+					memcpy(t->buffer, data + 4, n);
+					t->offset = n;
+					return finish(t, 0, false);
+				}
+				if (command & 0x01 && get_uint32(data + 4) > t->size)
+					return finish(t, AbortOutOfMemory, true);
+				t->state = UploadSegment;
+				reply[0] = 0x60 | t->toggle << 4;
+				memset(reply + 1, 0, 7);
+				return transmit(t, reply);
+
+			case UploadSegment:
+			{
+				if ((command & 0xe0) != 0x00)
+					return finish(t, AbortCommand, true);
+				if ((command >> 4 & 1) != t->toggle)
+					return finish(t, AbortToggle, true);
+				uint32_t n = 7 - (command >> 1 & 7);
+				if (t->offset + n > t->size)
+					return finish(t, AbortOutOfMemory, true);
+				memcpy(t->buffer + t->offset, data + 1, n);
+				t->offset += n;
+				t->toggle ^= 1;
+				if (command & 0x01)
+					return finish(t, 0, false);
+				reply[0] = 0x60 | t->toggle << 4;
+				memset(reply + 1, 0, 7);
+				return transmit(t, reply);
+			}
+
+			case BlockDownloadInitiate:
+				if ((command & 0xe3) != 0xa0)
+					return finish(t, AbortCommand, true);
+				start_block(t, data[4]);
+				t->state = BlockDownloadSending;
+				return send_segments(t);
+
+			case BlockDownloadAck:
+				if (command != 0xa2)
+					return finish(t, AbortCommand, true);
+				return on_block_ack(t, data[1], data[2], BlockDownloadSending, BlockDownloadEnd);
+
+			case BlockDownloadEnd:
+				if (command != 0xa1)
+					return finish(t, AbortCommand, true);
+				return finish(t, 0, false);
+
+			case BlockUploadInitiate:
+				if ((command & 0xe1) != 0xc0)
+					return finish(t, AbortCommand, true);
+				if (command & 0x02 && get_uint32(data + 4) > t->size)
+					return finish(t, AbortOutOfMemory, true);
+				start_block(t, t->blksize);
+				t->state = BlockUploadReceiving;
+				reply[0] = 0xa3;  // Start upload.
+				memset(reply + 1, 0, 7);
+				return transmit(t, reply);
+
+			case BlockUploadReceiving:
+				return receive_segment(t, data, BlockUploadEnd);
+
+			case BlockUploadEnd:
+				if ((command & 0xe3) != 0xc1)
+					return finish(t, AbortCommand, true);
+				if (!end_block(t, data))
+					return;
+				reply[0] = 0xa1;
+				memset(reply + 1, 0, 7);
+				transmit(t, reply);
+				return finish(t, 0, false);
+
+			default:
+				return finish(t, AbortCommand, true);
+		}
+	}
+
+
+	/**
+	 * Handles a frame from a client.
+	 */
+	void on_request(uint8_t* data)
+	{
+		uint8_t command = data[0];
+		Transfer* t = find(node, true);
+
+		// A transfer in progress takes every frame except an abort or a new initiation, which replaces it.
+		bool initiate = (command & 0xe0) == 0x20 || command == 0x40 || (command & 0xe3) == 0xa0
+				|| (command & 0xe1) == 0xc0;
+		if (t != nullptr && (t->state == ServerBlockDownloadReceiving || !initiate))
+		{
+			if (command == 0x80 && t->state != ServerBlockDownloadReceiving)
+				return finish(t, get_uint32(data + 4), false);
+			touch(t);
+			return on_server_frame(t, data);
+		}
+		if (command == 0x80)
+			return;
+		if (!initiate)
+			return abort_frame(Conversion::lsb_uint16_to_uint16(data + 1), data[3], AbortCommand);
+		if (t != nullptr)
+			finish(t, AbortCommand, false);
+
+		uint16_t index = Conversion::lsb_uint16_to_uint16(data + 1);
+		uint8_t subindex = data[3];
+		uint8_t* buffer = nullptr;
+		uint32_t size = 0;
+		uint32_t error;
+		bool upload = command == 0x40 || (command & 0xe3) == 0xa0;
+		if (upload)
+			error = server->on_read(index, subindex, &buffer, &size);
+		else
+			error = server->on_write(index, subindex, &buffer, &size);
+
+		t = begin(node, true, index, subindex, buffer, size, upload ? size : 0);
+		if (t == nullptr)
+			return abort_frame(index, subindex, AbortOutOfMemory);
+		if (error)
+			return finish(t, error, true);
+
+		uint8_t reply[8];
+		if ((command & 0xe0) == 0x20)
+		{
+			// Initiate download.
+			if (command & 0x02)
+			{
+				uint32_t n = command & 0x01 ? 4 - (command >> 2 & 3) : 4;
+				if (n > t->size)
+					return finish(t, AbortOutOfMemory, true);
+				memcpy(t->buffer, data + 4, n);
+				error = server->on_written(index, subindex, n);
+				if (error)
+					return finish(t, error, true);
+				header(t, reply, 0x60);
+				transmit(t, reply);
+				return finish(t, 0, false);
+			}
+			if (command & 0x01 && get_uint32(data + 4) > t->size)
+				return finish(t, AbortOutOfMemory, true);
+			t->state = ServerDownloadSegment;
+			header(t, reply, 0x60);
+		}
+		else if (command == 0x40)
+		{
+			// Initiate upload.
+			if (t->length > 0 && t->length <= 4)
+			{
+				header(t, reply, 0x43 | (4 - t->length) << 2);
+				memcpy(reply + 4, t->buffer, t->length);
+				transmit(t, reply);
+				return finish(t, 0, false);
+			}
+			t->state = ServerUploadSegment;
+			header(t, reply, 0x41);
+			put_uint32(reply + 4, t->length);
+		}
+		else if ((command & 0xe3) == 0xa0)
+		{
+			// Initiate block upload.
+			if (data[4] == 0 || data[4] > 127)
+				return finish(t, AbortCommand, true);
+			t->blksize = data[4];
+			t->state = ServerBlockUploadStart;
+			header(t, reply, 0xc6);  // CRC supported, size indicated.
+			put_uint32(reply + 4, t->length);
+		}
+		else
+		{
+			// Initiate block download.
+			if (command & 0x02 && get_uint32(data + 4) > t->size)
+				return finish(t, AbortOutOfMemory, true);
+			start_block(t, CANOPEN_SDO_BLOCK_SIZE);
+			t->state = ServerBlockDownloadReceiving;
+			header(t, reply, 0xa4);  // CRC supported.
+			reply[4] = t->blksize;
+		}
+		transmit(t, reply);
+	}
+
+
+	/**
+	 * Handles a client frame that continues a server transfer.
+	 */
+	void on_server_frame(Transfer* t, uint8_t* data)
+	{
+		uint8_t command = data[0];
+		uint8_t reply[8];
+		switch (t->state)
+		{
+			case ServerDownloadSegment:
+			{
+				if ((command & 0xe0) != 0x00)
+					return finish(t, AbortCommand, true);
+				if ((command >> 4 & 1) != t->toggle)
+					return finish(t, AbortToggle, true);
+				uint32_t n = 7 - (command >> 1 & 7);
+				if (t->offset + n > t->size)
+					return finish(t, AbortOutOfMemory, true);
+				memcpy(t->buffer + t->offset, data + 1, n);
+				t->offset += n;
+				reply[0] = 0x20 | t->toggle << 4;
+				memset(reply + 1, 0, 7);
+				t->toggle ^= 1;
+				if (command & 0x01)
+				{
+					uint32_t error = server->on_written(t->index, t->subindex, t->offset);
+					if (error)
+						return finish(t, error, true);
+					transmit(t, reply);
+					return finish(t, 0, false);
+				}
+				return transmit(t, reply);
+			}
+
+			case ServerUploadSegment:
+				if ((command & 0xe0) != 0x60)
+					return finish(t, AbortCommand, true);
+				if ((command >> 4 & 1) != t->toggle)
+					return finish(t, AbortToggle, true);
+				send_segment(t);
+				t->toggle ^= 1;
+				t->offset += segment_length(t);
+				if (t->offset == t->length)
+					finish(t, 0, false);
+				return;
+
+			case ServerBlockDownloadReceiving:
+				return receive_segment(t, data, ServerBlockDownloadEnd);
+
+			case ServerBlockDownloadEnd:
+			{
+				if ((command & 0xe3) != 0xc1)
+					return finish(t, AbortCommand, true);
+				if (!end_block(t, data))
+					return;
+				uint32_t error = server->on_written(t->index, t->subindex, t->offset);
+				if (error)
+					return finish(t, error, true);
+				reply[0] = 0xa1;
+				memset(reply + 1, 0, 7);
+				transmit(t, reply);
+				return finish(t, 0, false);
+			}
+
+			case ServerBlockUploadStart:
+				if (command != 0xa3)
+					return finish(t, AbortCommand, true);
+				start_block(t, t->blksize);
+				t->state = ServerBlockUploadSending;
+				return send_segments(t);
+
+			case ServerBlockUploadAck:
+				if (command != 0xa2)
+					return finish(t, AbortCommand, true);
+				return on_block_ack(t, data[1], data[2], ServerBlockUploadSending, ServerBlockUploadEnd);
+
+			case ServerBlockUploadEnd:
+				if (command != 0xa1)
+					return finish(t, AbortCommand, true);
+				return finish(t, 0, false);
+
+			default:
+				return finish(t, AbortCommand, true);
+		}
+	}
+
+
+	/**
+	 * Sends the segment at the current offset of a segmented transfer.
+	 */
+	void send_segment(Transfer* t)
+	{
+		uint32_t n = segment_length(t);
+		bool last = t->offset + n == t->length;
+		uint8_t data[8] = {0};
+		data[0] = t->toggle << 4 | (7 - n) << 1 | (last ? 0x01 : 0x00);
+		memcpy(data + 1, t->buffer + t->offset, n);
+		transmit(t, data);
+	}
+
+
+	/**
+	 * Gets the length of the segment at the current offset.
+	 */
+	uint32_t segment_length(Transfer* t)
+	{
+		uint32_t n = t->length - t->offset;
+		return n > 7 ? 7 : n;
+	}
+
+
+	/**
+	 * Prepares to send or receive a block.
+	 */
+	void start_block(Transfer* t, uint8_t blksize)
+	{
+		t->blksize = blksize == 0 || blksize > 127 ? 127 : blksize;
+		t->block_start = t->offset;
+		t->seqno = 0;
+		t->last = false;
+	}
+
+
+	/**
+	 * Sends the segments of the current block while transmit mailboxes are free. The segments share one COB-ID, so
+	 * this relies on CanBus to put them on the bus in the order they are sent.
+	 */
+	void send_segments(Transfer* t)
+	{
+		uint32_t offset = t->block_start + t->seqno * 7;
+		while (t->seqno < t->blksize && !t->last && canopen->get_free_mailboxes() > 0)
+		{
+			uint32_t n = t->length - offset > 7 ? 7 : t->length - offset;
+			bool last = offset + n >= t->length;
+			uint8_t data[8] = {0};
+			data[0] = (t->seqno + 1) | (last ? 0x80 : 0x00);
+			memcpy(data + 1, t->buffer + offset, n);
+			if (canopen->send(tx_cob(t), data, 8) != 0)
+				return;
+			t->seqno++;
+			t->last = last;
+			offset += n;
+		}
+		if (t->seqno == t->blksize || t->last)
+			t->state = t->server ? ServerBlockUploadAck : BlockDownloadAck;
+	}
+
+
+	/**
+	 * Handles the acknowledgement of a block that was sent.
+	 */
+	void on_block_ack(Transfer* t, uint8_t ackseq, uint8_t blksize, states sending, states end)
+	{
+		if (ackseq > t->seqno)
+			return finish(t, AbortSequence, true);
+		uint32_t offset = t->block_start + ackseq * 7;
+		t->offset = offset < t->length ? offset : t->length;
+		if (t->last && ackseq == t->seqno)
+		{
+			// Everything has been received; send the end of the transfer.
+			uint8_t data[8] = {0};
+			data[0] = 0xc1 | unused_bytes(t->length) << 2;
+			uint16_t crc = Crc::crc16_ccitt(t->buffer, t->length);
+			data[1] = crc & 0xff;
+			data[2] = crc >> 8;
+			t->state = end;
+			return transmit(t, data);
+		}
+		start_block(t, blksize);
+		t->state = sending;
+		send_segments(t);
+	}
+
+
+	/**
+	 * Handles a segment of a block being received, and acknowledges the block when it is complete.
+	 */
+	void receive_segment(Transfer* t, uint8_t* data, states end)
+	{
+		uint8_t seqno = data[0] & 0x7f;
+		bool last = data[0] & 0x80;
+		if (seqno == 0)
+		{
+			// Only an abort has no sequence number.
+			if (data[0] == 0x80)
+				finish(t, get_uint32(data + 4), false);
+			return;
+		}
+
+		if (seqno == t->seqno + 1)
+		{
+			if (t->offset < t->size)
+			{
+				uint32_t n = t->size - t->offset > 7 ? 7 : t->size - t->offset;
+				memcpy(t->buffer + t->offset, data + 1, n);
+			}
+			t->offset += 7;  // Corrected by the end frame.
+			t->seqno = seqno;
+			t->last = last;
+		}
+
+		if (seqno == t->blksize || last)
+		{
+			uint8_t reply[8] = {0};
+			reply[0] = 0xa2;
+			reply[1] = t->seqno;
+			reply[2] = CANOPEN_SDO_BLOCK_SIZE;
+			if (t->last)
+				t->state = end;
+			else
+				start_block(t, CANOPEN_SDO_BLOCK_SIZE);
+			transmit(t, reply);
+		}
+	}
+
+
+	/**
+	 * Handles the end frame of a block transfer being received.
+	 * @returns True if the length and CRC are correct; otherwise false, and the transfer has been aborted.
+	 */
+	bool end_block(Transfer* t, uint8_t* data)
+	{
+		uint32_t n = data[0] >> 2 & 7;
+		if (n > t->offset)
+		{
+			finish(t, AbortCommand, true);
+			return false;
+		}
+		t->offset -= n;
+		if (t->offset > t->size)
+		{
+			finish(t, AbortOutOfMemory, true);
+			return false;
+		}
+		uint16_t crc = Conversion::lsb_uint16_to_uint16(data + 1);
+		if (Crc::crc16_ccitt(t->buffer, t->offset) != crc)
+		{
+			finish(t, AbortCrc, true);
+			return false;
+		}
+		t->length = t->offset;
+		return true;
+	}
+
+
+	/**
+	 * Gets the number of bytes in the last segment of a block transfer that do not contain data.
+	 */
+	static uint8_t unused_bytes(uint32_t length)
+	{
+		uint32_t n = length % 7;
+		return length == 0 ? 7 : n == 0 ? 0 : 7 - n;
+	}
+
+
+	/**
+	 * Claims a slot for a transfer.
+	 * @returns The slot, or nullptr if the node is busy or no slots are free.
+	 */
+	Transfer* begin(uint8_t node, bool server, uint16_t index, uint8_t subindex, uint8_t* buffer, uint32_t size,
+			uint32_t length)
+	{
+		if (find(node, server) != nullptr)
+			return nullptr;
+		for (uint32_t i=0; i < CANOPEN_SDO_MAX_TRANSFERS; i++)
+		{
+			Transfer* t = &transfers[i];
+			if (t->state != Idle)
+				continue;
+			t->server = server;
+			t->node = node;
+			t->index = index;
+			t->subindex = subindex;
+			t->buffer = buffer;
+			t->size = size;
+			t->length = length;
+			t->offset = 0;
+			t->toggle = 0;
+			t->blksize = CANOPEN_SDO_BLOCK_SIZE;
+			t->tx_pending = false;
+			t->state = server ? ServerDownloadSegment : DownloadInitiate;  // Replaced by the caller.
+			touch(t);
+			return t;
+		}
+		return nullptr;
+	}
+
+
+	/**
+	 * Finds the transfer in progress with a node.
+	 */
+	Transfer* find(uint8_t node, bool server)
+	{
+		for (uint32_t i=0; i < CANOPEN_SDO_MAX_TRANSFERS; i++)
+			if (transfers[i].state > Closing && transfers[i].node == node && transfers[i].server == server)
+				return &transfers[i];
+		return nullptr;
+	}
+
+
+	/**
+	 * Ends a transfer and reports the result.
+	 * @param send_abort True to send an abort frame to the other side.
+	 */
+	void finish(Transfer* t, uint32_t abort_code, bool send_abort)
+	{
+		if (abort_code != 0 && abort_code != AbortTimeout)
+			aborts++;
+		if (abort_code != 0 && send_abort)
+		{
+			uint8_t data[8];
+			header(t, data, 0x80);
+			put_uint32(data + 4, abort_code);
+			transmit(t, data);
+		}
+		if (t->tx_pending)
+		{
+			t->state = Closing;
+			touch(t);
+		}
+		else
+		{
+			t->state = Idle;
+			t->timer.reset();
+		}
+		if (!t->server && callback != nullptr)
+			callback(t->node, abort_code, t->offset);
+	}
+
+
+	/**
+	 * Sends an abort for a request that could not be given a slot.
+	 */
+	void abort_frame(uint16_t index, uint8_t subindex, uint32_t abort_code)
+	{
+		uint8_t data[8] = { 0x80, (uint8_t)(index & 0xff), (uint8_t)(index >> 8), subindex };
+		put_uint32(data + 4, abort_code);
+		canopen->send(0x580 + node, data, 8);
+	}
+
+
+	/**
+	 * Sends a frame, or holds it for poll() to retry if no mailbox is free.
+	 */
+	void transmit(Transfer* t, uint8_t* data)
+	{
+		memcpy(t->tx, data, 8);
+		t->tx_pending = canopen->get_free_mailboxes() == 0 || canopen->send(tx_cob(t), t->tx, 8) != 0;
+	}
+
+
+	/**
+	 * Gets the COB-ID that frames of a transfer are sent to.
+	 */
+	uint16_t tx_cob(Transfer* t)
+	{
+		return (t->server ? 0x580 : 0x600) + t->node;
+	}
+
+
+	/**
+	 * Restarts the timeout of a transfer.
+	 */
+	void touch(Transfer* t)
+	{
+		t->timer.start(milliseconds(CANOPEN_SDO_TIMEOUT));
+	}
+
+
+	/**
+	 * Fills a frame with a command byte and the multiplexer of a transfer.
+	 */
+	static void header(Transfer* t, uint8_t* data, uint8_t command)
+	{
+		data[0] = command;
+		data[1] = t->index & 0xff;
+		data[2] = t->index >> 8;
+		data[3] = t->subindex;
+		memset(data + 4, 0, 4);
+	}
+
+
+	static void put_uint32(uint8_t* data, uint32_t value)
+	{
+		data[0] = value & 0xff;
+		data[1] = value >> 8 & 0xff;
+		data[2] = value >> 16 & 0xff;
+		data[3] = value >> 24;
+	}
+
+
+	static uint32_t get_uint32(uint8_t* data)
+	{
+		return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+	}
+
+
+	CanOpen* canopen;
+	ISdoServer* server = nullptr;
+	uint8_t node = 0;
+	CompletionCallback callback;
+	Transfer transfers[CANOPEN_SDO_MAX_TRANSFERS] = {};
+	uint32_t timeouts = 0;
+	uint32_t aborts = 0;
+};
+
+
+#endif /* INC_COMMS_CANOPENSDO_H_ */
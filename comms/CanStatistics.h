@@ -0,0 +1,346 @@
+/**
+ * \file       comms/CanStatistics.h
+ * \class      CanStatistics
+ * \brief      Measures CAN bus load, error counters and the arrival jitter of selected COB-IDs.
+ */
+
+#ifndef INC_COMMS_CANSTATISTICS_H_
+#define INC_COMMS_CANSTATISTICS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "diagnostics/Log.h"
+#include "utility/Timer.h"
+
+#ifndef CAN_DEFAULT_BITRATE
+#define CAN_DEFAULT_BITRATE (125000)
+#endif
+
+#ifndef CAN_STATISTICS_WATCH_MAX
+#define CAN_STATISTICS_WATCH_MAX (4)
+#endif
+
+#ifndef CAN_STATISTICS_JITTER_BINS
+#define CAN_STATISTICS_JITTER_BINS (16)
+#endif
+
+#ifndef CAN_STATISTICS_HISTORY
+#define CAN_STATISTICS_HISTORY (60)
+#endif
+
+
+/**
+ * Collects statistics for a CanBus: frames and bits per second in each direction, bus load, the history of the
+ * transmit and receive error counters, bus-off events, and inter-arrival histograms for a watch list of COB-IDs.
+ *
+ * Frame counting and arrival times are recorded by CanBus as frames pass, and are cheap enough for the receive
+ * interrupt. A sent frame is counted when its mailbox reports completion, so a frame that is preempted and sent
+ * again counts once. Rates and error counters are sampled by CanBus::update_statistics(), which should be called
+ * about once a second; each call closes one measurement window and adds an entry to the error counter history.
+ *
+ * Bits are counted as the worst case for a standard data frame, including the most stuff bits the frame could need
+ * and the interframe space. Only the frames this node sends or accepts are seen, though: frames rejected by the
+ * acceptance filters, error frames and retransmissions are not counted. The load is therefore an upper bound only
+ * while the filters accept everything; once they are narrowed, it is the load of this node's traffic and a lower
+ * bound for the bus, and SYNC periods should be sized from a node that accepts every frame.
+ */
+class CanStatistics
+{
+public:
+	/**
+	 * @brief	Rates and error state over the last window.
+	 */
+	typedef struct Snapshot
+	{
+		uint32_t rx_frames;  /// Frames received per second.
+		uint32_t tx_frames;  /// Frames sent per second.
+		uint32_t rx_bits;  /// Bits received per second.
+		uint32_t tx_bits;  /// Bits sent per second.
+		uint32_t load;  /// Load of the frames seen, in tenths of a percent of the bitrate.
+		uint32_t peak_load;  /// Highest load of any window, in tenths of a percent.
+		uint8_t tec;  /// Transmit error counter.
+		uint8_t rec;  /// Receive error counter.
+		uint8_t peak_tec;  /// Highest transmit error counter seen.
+		uint8_t peak_rec;  /// Highest receive error counter seen.
+		uint32_t bus_off;  /// Number of bus-off events.
+	} Snapshot;
+
+	/**
+	 * @brief	One sample of the error counters.
+	 */
+	typedef struct ErrorSample
+	{
+		uint8_t tec;
+		uint8_t rec;
+		bool bus_off;
+	} ErrorSample;
+
+	/**
+	 * @brief	The inter-arrival histogram of a watched COB-ID.
+	 * @note	Bin i counts intervals of period + (i - CAN_STATISTICS_JITTER_BINS/2) * bin_width to the next bin;
+	 *          the first and last bins also count everything beyond them.
+	 */
+	typedef struct Watch
+	{
+		uint16_t cob;
+		uint32_t period;  /// Expected interval, in microseconds.
+		uint32_t bin_width;  /// Microseconds per bin.
+		uint32_t count;  /// Intervals measured.
+		uint32_t min;  /// Shortest interval, in microseconds.
+		uint32_t max;  /// Longest interval, in microseconds.
+		uint32_t bins[CAN_STATISTICS_JITTER_BINS];
+		uint32_t last;  /// DWT cycle count of the last arrival.
+		bool seen;
+	} Watch;
+
+
+	/**
+	 * Constructs an instance.
+	 * @param bitrate The bus bitrate.
+	 */
+	CanStatistics(uint32_t bitrate=CAN_DEFAULT_BITRATE)
+	{
+		this->bitrate = bitrate;
+		window_start = HAL_GetTick();
+	}
+
+
+	/**
+	 * Adds a COB-ID to the watch list.
+	 * @param cob The COB-ID.
+	 * @param period The expected interval between frames, in microseconds.
+	 * @param bin_width The width of each histogram bin, in microseconds.
+	 * @returns True if added; false if CAN_STATISTICS_WATCH_MAX are already watched.
+	 */
+	bool watch(uint16_t cob, uint32_t period, uint32_t bin_width)
+	{
+		if (watch_count == CAN_STATISTICS_WATCH_MAX)
+			return false;
+		Watch* w = &watches[watch_count];
+		memset(w, 0, sizeof(Watch));
+		w->cob = cob;
+		w->period = period;
+		w->bin_width = bin_width ? bin_width : 1;
+		w->min = 0xffffffff;
+		// Read here rather than in the constructor, which for a static instance runs before the clock is configured.
+		cycles_per_us = HAL_RCC_GetHCLKFreq() / 1000000;
+		watch_count++;
+		return true;
+	}
+
+
+	/**
+	 * Records a received frame. Called by CanBus.
+	 * @param cob The COB-ID.
+	 * @param length The data length.
+	 */
+	void on_rx(uint16_t cob, uint8_t length)
+	{
+		rx_frames++;
+		rx_bits += frame_bits(length);
+
+		for (uint32_t i=0; i < watch_count; i++)
+		{
+			Watch* w = &watches[i];
+			if (w->cob != cob)
+				continue;
+			uint32_t now = DWT->CYCCNT;
+			if (w->seen)
+				record(w, (now - w->last) / cycles_per_us);
+			w->last = now;
+			w->seen = true;
+		}
+	}
+
+
+	/**
+	 * Records a sent frame. Called by CanBus.
+	 * @param length The data length.
+	 */
+	void on_tx(uint8_t length)
+	{
+		tx_frames++;
+		tx_bits += frame_bits(length);
+	}
+
+
+	/**
+	 * Records a bus-off event reported by HAL_CAN_ErrorCallback(). Called by CanBus.
+	 * @note	The event is counted once, however often the callback reports it, and update() does not count it again
+	 *          when the error status register shows it.
+	 */
+	void on_bus_off(void)
+	{
+		if (!bus_off_now)
+			bus_off_events++;
+		bus_off_now = true;
+	}
+
+
+	/**
+	 * Closes the measurement window and samples the error counters. Called by CanBus::update_statistics().
+	 * @param esr The value of the CAN error status register.
+	 */
+	void update(uint32_t esr)
+	{
+		uint32_t now = HAL_GetTick();
+		uint32_t elapsed = now - window_start;
+		if (elapsed == 0)
+			return;
+		window_start = now;
+
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		uint32_t rx_f = rx_frames, tx_f = tx_frames, rx_b = rx_bits, tx_b = tx_bits;
+		rx_frames = tx_frames = rx_bits = tx_bits = 0;
+		__set_PRIMASK(primask);
+
+		last.rx_frames = rx_f * 1000 / elapsed;
+		last.tx_frames = tx_f * 1000 / elapsed;
+		last.rx_bits = (uint64_t) rx_b * 1000 / elapsed;
+		last.tx_bits = (uint64_t) tx_b * 1000 / elapsed;
+		last.load = (uint64_t) (last.rx_bits + last.tx_bits) * 1000 / bitrate;
+		if (last.load > last.peak_load)
+			last.peak_load = last.load;
+
+		ErrorSample sample;
+		sample.tec = (esr & CAN_ESR_TEC_Msk) >> CAN_ESR_TEC_Pos;
+		sample.rec = (esr & CAN_ESR_REC_Msk) >> CAN_ESR_REC_Pos;
+		sample.bus_off = esr & CAN_ESR_BOFF;
+		if (sample.bus_off && !bus_off_now)
+			bus_off_events++;  // In case the error interrupt is not enabled.
+		bus_off_now = sample.bus_off;
+		history[history_head++ % CAN_STATISTICS_HISTORY] = sample;
+
+		last.tec = sample.tec;
+		last.rec = sample.rec;
+		if (sample.tec > last.peak_tec)
+			last.peak_tec = sample.tec;
+		if (sample.rec > last.peak_rec)
+			last.peak_rec = sample.rec;
+		last.bus_off = bus_off_events;
+	}
+
+
+	/**
+	 * Gets the statistics of the last window.
+	 * @returns Pointer to the snapshot.
+	 */
+	Snapshot* get_snapshot(void)
+	{
+		return &last;
+	}
+
+
+	/**
+	 * Gets a sample from the error counter history.
+	 * @param age 0 for the most recent sample, 1 for the one before, and so on.
+	 * @returns Pointer to the sample, or nullptr if there is no sample that old.
+	 */
+	ErrorSample* get_error_history(uint32_t age)
+	{
+		if (age >= history_head || age >= CAN_STATISTICS_HISTORY)
+			return nullptr;
+		return &history[(history_head - 1 - age) % CAN_STATISTICS_HISTORY];
+	}
+
+
+	/**
+	 * Gets a watched COB-ID's histogram.
+	 * @param index The position in the watch list.
+	 * @returns Pointer to the histogram, or nullptr if the index is out of range.
+	 */
+	Watch* get_watch(uint32_t index)
+	{
+		return index < watch_count ? &watches[index] : nullptr;
+	}
+
+
+	/**
+	 * Clears the peaks and histograms.
+	 */
+	void reset(void)
+	{
+		last.peak_load = 0;
+		last.peak_tec = 0;
+		last.peak_rec = 0;
+		for (uint32_t i=0; i < watch_count; i++)
+		{
+			Watch* w = &watches[i];
+			w->count = 0;
+			w->min = 0xffffffff;
+			w->max = 0;
+			memset(w->bins, 0, sizeof(w->bins));
+		}
+	}
+
+
+	/**
+	 * Logs the statistics of the last window and the watched histograms.
+	 * @param log The log to write to.
+	 */
+	void report(Log* log)
+	{
+		log->log(LOGLEVEL_INFO, "CAN rx %d f/s %d b/s, tx %d f/s %d b/s, load %d.%d%% (peak %d.%d%%)",
+				last.rx_frames, last.rx_bits, last.tx_frames, last.tx_bits, last.load / 10, last.load % 10,
+				last.peak_load / 10, last.peak_load % 10);
+		log->log(LOGLEVEL_INFO, "CAN TEC %d (peak %d), REC %d (peak %d), bus-off %d",
+				last.tec, last.peak_tec, last.rec, last.peak_rec, last.bus_off);
+		for (uint32_t i=0; i < watch_count; i++)
+		{
+			Watch* w = &watches[i];
+			log->log(LOGLEVEL_INFO, "CAN %x: %d intervals, min %d us, max %d us", w->cob, w->count,
+					w->count ? w->min : 0, w->max);
+		}
+	}
+
+
+private:
+	/**
+	 * Gets the most bits a standard data frame can occupy: 44 bits of framing, the data, up to one stuff bit per four
+	 * bits of the stuffed region (34 + 8n bits), and 3 bits of interframe space.
+	 */
+	static uint32_t frame_bits(uint8_t length)
+	{
+		uint32_t n = length > 8 ? 8 : length;
+		return 47 + 8 * n + (34 + 8 * n - 1) / 4;
+	}
+
+
+	void record(Watch* w, uint32_t interval)
+	{
+		w->count++;
+		if (interval < w->min)
+			w->min = interval;
+		if (interval > w->max)
+			w->max = interval;
+
+		int32_t bin = ((int32_t) interval - (int32_t) w->period) / (int32_t) w->bin_width + CAN_STATISTICS_JITTER_BINS / 2;
+		if (bin < 0)
+			bin = 0;
+		if (bin >= CAN_STATISTICS_JITTER_BINS)
+			bin = CAN_STATISTICS_JITTER_BINS - 1;
+		w->bins[bin]++;
+	}
+
+
+	Timer timer;  // Enables the DWT cycle counter.
+	uint32_t bitrate;
+	uint32_t cycles_per_us = 1;
+	uint32_t window_start;
+	volatile uint32_t rx_frames = 0;
+	volatile uint32_t tx_frames = 0;
+	volatile uint32_t rx_bits = 0;
+	volatile uint32_t tx_bits = 0;
+	volatile uint32_t bus_off_events = 0;
+	bool bus_off_now = false;
+	Snapshot last = {};
+	ErrorSample history[CAN_STATISTICS_HISTORY];
+	uint32_t history_head = 0;
+	Watch watches[CAN_STATISTICS_WATCH_MAX];
+	uint32_t watch_count = 0;
+};
+
+
+#endif /* INC_COMMS_CANSTATISTICS_H_ */
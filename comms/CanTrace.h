@@ -0,0 +1,326 @@
+/**
+ * \file       comms/CanTrace.h
+ * \class      CanTrace
+ * \brief      Records timestamped CAN frames to SPI flash.
+ */
+
+#ifndef INC_COMMS_CANTRACE_H_
+#define INC_COMMS_CANTRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "CanBus.h"
+#include "CanTraceExporter.h"
+#include "generics/LockFreeQueue.h"
+#include "utility/Timer.h"
+#include "devices/flash/external/SpiFlashMemoryFilesystem.h"
+
+#ifndef CAN_TRACE_FILTERS
+#define CAN_TRACE_FILTERS (8)
+#endif
+
+
+/**
+ * Records the frames on a CanBus to a SpiFlashMemoryFilesystem, for field debugging without a laptop.
+ *
+ * Attach the recorder with CanBus::set_tap(). Each frame that passes the pre-filter is stamped with the DWT cycle
+ * counter and put in a RAM ring, which is all the interrupt does. A task calls poll(), which converts the stamps to
+ * microseconds since start(), packs the records into a block of exactly one sector's payload, and writes each full
+ * block as a file of its own. Blocks are page-aligned and a whole number of pages, so every flash write is a full
+ * page program, and no file is ever rewritten.
+ *
+ * A recording session is a series of files named <prefix><session>.<block>, such as can002.0017. Each start() begins
+ * a new session after the highest one already on the flash, so earlier recordings are kept until they are removed.
+ *
+ * At 500 kbit/s and 100% load the bus carries at most about 4,500 frames a second (fewer with stuff bits), which is
+ * 72 KB/s of records, or one block every 53 ms. Writing a block costs one sector erase plus 15 page programs, which
+ * is within that budget for common NOR flash, but erase time varies by several times between parts and with wear.
+ * Size the ring to hold the frames that arrive during the slowest block write: 1024 records (16 KB) covers 220 ms.
+ * Frames that arrive when the ring is full are counted by get_dropped().
+ *
+ * Sent frames are tapped when CanBus reports them complete, so like received frames they are stamped at about the
+ * time they left the wire. CanTraceExporter converts the recorded blocks to candump log text, on the target or on a
+ * host with tools/CanTraceDump.cpp.
+ */
+class CanTrace : public CanBus::ITap
+{
+public:
+	typedef CanTraceExporter::Record Record;  /// One recorded frame, as stored on the flash.
+
+	static constexpr uint8_t FlagTx = CanTraceExporter::FlagTx;
+	static constexpr uint8_t FlagTime = CanTraceExporter::FlagTime;
+	static constexpr uint32_t RecordsPerBlock = SpiFlashMemoryFilesystem::UsableSectorSize / sizeof(Record);
+	static constexpr uint32_t BlockSize = RecordsPerBlock * sizeof(Record);
+
+	static_assert(BlockSize % SpiFlashMemory::PageSize == 0, "Blocks must be a whole number of pages.");
+
+
+	/**
+	 * Constructs a recorder.
+	 * @param fs The filesystem to record to.
+	 * @param buffer Storage for the RAM ring.
+	 * @param length The number of records in the ring. Must be a power of two.
+	 */
+	CanTrace(SpiFlashMemoryFilesystem* fs, Record* buffer, uint32_t length)
+	{
+		this->fs = fs;
+		ring.set_buffer(buffer, length);
+	}
+
+
+	/**
+	 * Records only frames whose COB-ID matches under a mask. If no filters are added, every frame is recorded.
+	 * @param cob The COB-ID.
+	 * @param mask The bits of the COB-ID that must match; 0x7ff for an exact match.
+	 * @returns True if added; false if CAN_TRACE_FILTERS are already added.
+	 */
+	bool add_filter(uint16_t cob, uint16_t mask=0x7ff)
+	{
+		if (filter_count == CAN_TRACE_FILTERS)
+			return false;
+		filters[filter_count].cob = cob & mask;
+		filters[filter_count].mask = mask;
+		filter_count++;
+		return true;
+	}
+
+
+	/**
+	 * Starts a new recording session.
+	 * @param prefix The start of each file name, at most 8 characters.
+	 * @returns The session number.
+	 */
+	uint32_t start(const char* prefix="can")
+	{
+		stop();
+		strncpy(this->prefix, prefix, sizeof(this->prefix) - 1);
+		this->prefix[sizeof(this->prefix) - 1] = '\0';
+
+		// Continue after the last session on the flash.
+		session = 0;
+		for (SpiFlashMemoryFilesystem::DirectoryEntry* entry = fs->iterate_files(true); entry != nullptr;
+				entry = fs->iterate_files())
+		{
+			uint32_t n, block;
+			if (CanTraceExporter::parse_filename(entry->filename, this->prefix, &n, &block) && n >= session)
+				session = n + 1;
+		}
+
+		block_number = 0;
+		block_count = 0;
+		time = 0;
+		remainder = 0;
+		marked = 0;
+		cycles_per_us = HAL_RCC_GetHCLKFreq() / 1000000;  // Here, as a static recorder is built before the clock is set.
+		ring.clear();
+		last_cycles = DWT->CYCCNT;
+		recording = true;
+		return session;
+	}
+
+
+	/**
+	 * Stops recording, and writes the frames already captured.
+	 * @returns 0 on success; otherwise the filesystem error.
+	 */
+	uint32_t stop(void)
+	{
+		if (!recording)
+			return 0;
+		recording = false;
+		uint32_t error = poll();
+		if (error == 0 && block_count > 0)
+			error = write_block();
+		return error;
+	}
+
+
+	/**
+	 * Moves captured frames from the RAM ring to flash. Call often from a task, and at least every 2^32 CPU cycles
+	 * (25 seconds at 168 MHz) so the cycle counter cannot wrap unnoticed. Each full block blocks for one sector write.
+	 * @returns 0 on success; otherwise the filesystem error.
+	 */
+	uint32_t poll(void)
+	{
+		Record record;
+		while (ring.dequeue(record))
+		{
+			advance(record.timestamp);
+			record.timestamp = (uint32_t) time;
+			uint32_t error = append(record);
+			if (error != 0)
+				return error;
+		}
+
+		// Bring the clock up to date while the bus is quiet. Frames are stamped with interrupts disabled, so none
+		// queued after this can carry an earlier stamp.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (ring.is_empty())
+			advance(DWT->CYCCNT);
+		__set_PRIMASK(primask);
+
+		if (recording && time - marked >= 0x80000000u)
+		{
+			memset(&record, 0, sizeof(Record));
+			record.timestamp = (uint32_t) time;
+			record.flags = FlagTime;
+			return append(record);
+		}
+		return 0;
+	}
+
+
+	/**
+	 * Captures a frame. Called by CanBus.
+	 */
+	void on_tap(uint16_t cob, const uint8_t* data, uint8_t length, bool tx) override
+	{
+		if (!recording || !is_accepted(cob))
+			return;
+
+		Record record;
+		record.cob = cob;
+		record.length = length > 8 ? 8 : length;
+		record.flags = tx ? FlagTx : 0;
+		memcpy(record.data, data, record.length);
+		memset(record.data + record.length, 0, 8 - record.length);
+
+		// Frames are tapped from both interrupts and tasks, and the ring has one producer.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		record.timestamp = DWT->CYCCNT;
+		if (ring.enqueue(record))
+			captured++;
+		else
+			dropped++;
+		__set_PRIMASK(primask);
+	}
+
+
+	/**
+	 * Determines whether a session is being recorded.
+	 * @returns True if recording; otherwise false.
+	 */
+	bool is_recording(void)
+	{
+		return recording;
+	}
+
+
+	/**
+	 * Gets the number of frames captured into the RAM ring.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_captured(void)
+	{
+		return captured;
+	}
+
+
+	/**
+	 * Gets the number of frames lost because the RAM ring was full.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_dropped(void)
+	{
+		return dropped;
+	}
+
+
+	/**
+	 * Gets the number of blocks written in this session.
+	 * @returns The number of blocks.
+	 */
+	uint32_t get_blocks(void)
+	{
+		return block_number;
+	}
+
+
+	/**
+	 * Gets the name of a block of a session.
+	 * @param name Set to the name; at least 24 bytes.
+	 * @param session The session number.
+	 * @param block The block number.
+	 */
+	void get_filename(char* name, uint32_t session, uint32_t block)
+	{
+		CanTraceExporter::get_filename(name, prefix, session, block);
+	}
+
+
+private:
+	/**
+	 * Adds cycles up to a stamp to the microsecond clock, keeping the fraction.
+	 */
+	void advance(uint32_t cycles)
+	{
+		remainder += cycles - last_cycles;
+		last_cycles = cycles;
+		time += remainder / cycles_per_us;
+		remainder %= cycles_per_us;
+	}
+
+
+	uint32_t append(const Record& record)
+	{
+		block[block_count++] = record;
+		marked = time;
+		if (block_count < RecordsPerBlock)
+			return 0;
+		return write_block();
+	}
+
+
+	uint32_t write_block(void)
+	{
+		char name[24];
+		get_filename(name, session, block_number);
+		uint32_t error = fs->write_file(name, block, block_count * sizeof(Record), false);
+		block_count = 0;
+		block_number++;
+		return error;
+	}
+
+
+	bool is_accepted(uint16_t cob)
+	{
+		if (filter_count == 0)
+			return true;
+		for (uint32_t i=0; i < filter_count; i++)
+			if ((cob & filters[i].mask) == filters[i].cob)
+				return true;
+		return false;
+	}
+
+
+	struct
+	{
+		uint16_t cob;
+		uint16_t mask;
+	} filters[CAN_TRACE_FILTERS];
+	uint32_t filter_count = 0;
+
+	Timer timer;  // Enables the DWT cycle counter.
+	SpiFlashMemoryFilesystem* fs;
+	LockFreeQueue<Record> ring;
+	Record block[RecordsPerBlock];
+	uint32_t block_count = 0;
+	uint32_t block_number = 0;
+	uint32_t session = 0;
+	char prefix[9] = "can";
+	volatile bool recording = false;
+	volatile uint32_t captured = 0;
+	volatile uint32_t dropped = 0;
+
+	uint32_t cycles_per_us = 1;
+	uint32_t last_cycles = 0;
+	uint32_t remainder = 0;
+	uint64_t time = 0;  // Microseconds since start().
+	uint64_t marked = 0;  // The time of the last record appended.
+};
+
+
+#endif /* INC_COMMS_CANTRACE_H_ */
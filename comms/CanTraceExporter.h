@@ -0,0 +1,198 @@
+/**
+ * \file       comms/CanTraceExporter.h
+ * \class      CanTraceExporter
+ * \brief      Converts the blocks recorded by CanTrace to candump log text.
+ * \notes      Uses nothing from the HAL or the filesystem, so it builds both on the target and on a host, where
+ *             tools/CanTraceDump.cpp uses it to convert block files copied off the flash.
+ */
+
+#ifndef INC_COMMS_CANTRACEEXPORTER_H_
+#define INC_COMMS_CANTRACEEXPORTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "utility/IWrite.h"
+
+
+/**
+ * Converts recorded blocks to candump log lines, such as "(12.345678) can0 181#0102030405060708".
+ * Feed it the blocks of one session in order; it carries the timestamp across them.
+ */
+class CanTraceExporter
+{
+public:
+	/**
+	 * One recorded frame, as stored on the flash.
+	 */
+	typedef struct Record
+	{
+		uint32_t timestamp;  /// Microseconds since CanTrace::start(), modulo 2^32. In the RAM ring, the DWT cycle count.
+		uint16_t cob;
+		uint8_t length;
+		uint8_t flags;  /// FlagTx and FlagTime.
+		uint8_t data[8];
+	} Record;
+
+	static constexpr uint8_t FlagTx = 0x01;  /// The frame was sent by this node.
+	static constexpr uint8_t FlagTime = 0x80;  /// Not a frame; marks the passage of time so timestamps can be unwrapped.
+
+	static_assert(sizeof(Record) == 16, "Records must pack into flash pages.");
+
+
+	/**
+	 * Constructs an exporter.
+	 * @param interface The interface name to write in each line.
+	 */
+	CanTraceExporter(const char* interface="can0")
+	{
+		this->interface = interface;
+	}
+
+
+	/**
+	 * Formats one record.
+	 * @param record The record.
+	 * @param line Set to the line, including the newline and a terminating NUL; at least 64 bytes.
+	 * @returns The length of the line, or 0 if the record is not a frame.
+	 */
+	uint32_t format(const Record& record, char* line)
+	{
+		// Timestamps are 32 bits of microseconds; the recorder guarantees no gap longer than 2^31 between them.
+		if (record.timestamp < last)
+			epoch++;
+		last = record.timestamp;
+		if (record.flags & FlagTime)
+			return 0;
+
+		uint64_t time = (uint64_t) epoch << 32 | record.timestamp;
+		char* p = line;
+		*p++ = '(';
+		p = digits(p, (uint32_t) (time / 1000000), 1);
+		*p++ = '.';
+		p = digits(p, (uint32_t) (time % 1000000), 6);
+		*p++ = ')';
+		*p++ = ' ';
+		for (const char* c = interface; *c; c++)
+			*p++ = *c;
+		*p++ = ' ';
+		p = hex(p, record.cob, 3);
+		*p++ = '#';
+		for (uint8_t i=0; i < record.length && i < 8; i++)
+			p = hex(p, record.data[i], 2);
+		*p++ = '\n';
+		*p = '\0';
+		return p - line;
+	}
+
+
+	/**
+	 * Formats a block, writing each line to an output.
+	 * @param block The block, as read from a file.
+	 * @param length The length of the block in bytes.
+	 * @param out The output.
+	 * @returns The number of frames written.
+	 */
+	uint32_t export_block(const uint8_t* block, uint32_t length, IWrite* out)
+	{
+		uint32_t frames = 0;
+		char line[64];
+		for (uint32_t offset=0; offset + sizeof(Record) <= length; offset += sizeof(Record))
+		{
+			Record record;
+			memcpy(&record, block + offset, sizeof(Record));
+			uint32_t n = format(record, line);
+			for (uint32_t i=0; i < n; i++)
+				out->write(line[i]);
+			if (n)
+				frames++;
+		}
+		return frames;
+	}
+
+
+	/**
+	 * Gets the name of a block of a session, <prefix><session>.<block>, such as can002.0017.
+	 * @param name Set to the name; at least 24 bytes.
+	 * @param prefix The start of the name, at most 8 characters.
+	 * @param session The session number.
+	 * @param block The block number.
+	 */
+	static void get_filename(char* name, const char* prefix, uint32_t session, uint32_t block)
+	{
+		strcpy(name, prefix);
+		char* p = name + strlen(name);
+		p = digits(p, session, 3);
+		*p++ = '.';
+		p = digits(p, block, 4);
+		*p = '\0';
+	}
+
+
+	/**
+	 * Parses the name of a block. Only the whole pattern <prefix><digits>.<digits> matches, so other files that
+	 * start with the prefix, such as canopen.cfg, are not taken for recordings.
+	 * @param name The name.
+	 * @param prefix The start of the name.
+	 * @param session Set to the session number.
+	 * @param block Set to the block number.
+	 * @returns True if the name is that of a block; otherwise false.
+	 */
+	static bool parse_filename(const char* name, const char* prefix, uint32_t* session, uint32_t* block)
+	{
+		uint32_t prefix_length = strlen(prefix);
+		if (strncmp(name, prefix, prefix_length) != 0)
+			return false;
+		const char* p = name + prefix_length;
+		return parse_number(&p, session) && *p++ == '.' && parse_number(&p, block) && *p == '\0';
+	}
+
+
+private:
+	/**
+	 * Parses a run of up to nine decimal digits.
+	 * @returns True if there was at least one digit.
+	 */
+	static bool parse_number(const char** p, uint32_t* value)
+	{
+		uint32_t n = 0;
+		*value = 0;
+		while (**p >= '0' && **p <= '9' && n < 9)
+		{
+			*value = *value * 10 + *(*p)++ - '0';
+			n++;
+		}
+		return n > 0;
+	}
+
+
+	static char* digits(char* p, uint32_t value, uint8_t width)
+	{
+		char buffer[10];
+		uint8_t n = 0;
+		do
+		{
+			buffer[n++] = '0' + value % 10;
+			value /= 10;
+		} while (value || n < width);
+		while (n)
+			*p++ = buffer[--n];
+		return p;
+	}
+
+
+	static char* hex(char* p, uint32_t value, uint8_t digits)
+	{
+		while (digits--)
+			*p++ = "0123456789ABCDEF"[value >> (digits * 4) & 0x0f];
+		return p;
+	}
+
+
+	const char* interface;
+	uint32_t epoch = 0;
+	uint32_t last = 0;
+};
+
+
+#endif /* INC_COMMS_CANTRACEEXPORTER_H_ */
@@ -0,0 +1,253 @@
+/**
+ * \file       comms/CanTxQueue.h
+ * \class      CanTxQueue
+ * \brief      A transmit queue that releases CAN frames in bus priority order.
+ */
+
+#ifndef INC_COMMS_CANTXQUEUE_H_
+#define INC_COMMS_CANTXQUEUE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+
+/**
+ * Holds frames waiting for a transmit mailbox, and releases them lowest COB-ID first, which is the order in which
+ * they would win arbitration. Frames with the same COB-ID are released in the order they were queued. The hardware
+ * does not keep that order among frames in its mailboxes, so CanBus holds a frame back while another with the same
+ * COB-ID is in a mailbox.
+ *
+ * The queue is a binary heap over a buffer supplied by the caller, so adding and removing frames takes O(log n) time.
+ * This class is pure logic, with no dependency on the HAL, and does no locking; see CanBus::set_tx_queue().
+ */
+class CanTxQueue
+{
+public:
+	/**
+	 * A queued frame.
+	 */
+	typedef struct Entry
+	{
+		uint16_t cob;
+		uint8_t length;
+		uint8_t data[8];
+		uint32_t sequence;  /// Order in which the frame was first queued.
+	} Entry;
+
+
+	/**
+	 * Sets the buffer, emptying the queue.
+	 * @param buffer Storage for the queue.
+	 * @param capacity The number of frames in the buffer.
+	 */
+	void set_buffer(Entry* buffer, uint32_t capacity)
+	{
+		this->buffer = buffer;
+		this->capacity = capacity;
+		count = 0;
+	}
+
+
+	/**
+	 * Adds a frame.
+	 * @param cob The COB-ID.
+	 * @param data The data.
+	 * @param length The length of the data (maximum 8).
+	 * @returns True if added; false if the queue is full.
+	 */
+	bool push(uint16_t cob, const uint8_t* data, uint8_t length)
+	{
+		if (count == capacity)
+			return false;
+		Entry e;
+		e.cob = cob;
+		e.length = length > 8 ? 8 : length;
+		memcpy(e.data, data, e.length);
+		e.sequence = next_sequence++;
+		insert(e);
+		return true;
+	}
+
+
+	/**
+	 * Adds a frame, first discarding the oldest frame if the queue is full.
+	 * @param cob The COB-ID.
+	 * @param data The data.
+	 * @param length The length of the data (maximum 8).
+	 * @returns True if a frame was discarded; otherwise false.
+	 */
+	bool push_drop_oldest(uint16_t cob, const uint8_t* data, uint8_t length)
+	{
+		bool dropped = false;
+		if (count == capacity && count > 0)
+		{
+			uint32_t oldest = 0;
+			for (uint32_t i=1; i < count; i++)
+				if (is_older(buffer[i], buffer[oldest]))
+					oldest = i;
+			remove(oldest);
+			dropped = true;
+		}
+		push(cob, data, length);
+		return dropped;
+	}
+
+
+	/**
+	 * Puts back a frame that was taken out, such as one whose transmission was aborted, keeping its place among
+	 * frames with the same COB-ID.
+	 * @param e The frame.
+	 * @returns True if added; false if the queue is full.
+	 */
+	bool requeue(const Entry& e)
+	{
+		if (count == capacity)
+			return false;
+		insert(e);
+		return true;
+	}
+
+
+	/**
+	 * Gets the frame that should be sent next, without removing it.
+	 * @returns Pointer to the frame, or nullptr if the queue is empty.
+	 */
+	Entry* peek(void)
+	{
+		return count ? &buffer[0] : nullptr;
+	}
+
+
+	/**
+	 * Removes the frame that should be sent next.
+	 * @param e Set to the frame.
+	 * @returns True if a frame was removed; false if the queue is empty.
+	 */
+	bool pop(Entry& e)
+	{
+		if (count == 0)
+			return false;
+		e = buffer[0];
+		remove(0);
+		return true;
+	}
+
+
+	/**
+	 * Gets the number of frames in the queue.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_length(void)
+	{
+		return count;
+	}
+
+
+	/**
+	 * Gets the number of frames the queue can hold.
+	 * @returns The capacity.
+	 */
+	uint32_t get_capacity(void)
+	{
+		return capacity;
+	}
+
+
+	/**
+	 * Determines whether the queue is empty.
+	 * @returns True if empty; otherwise false.
+	 */
+	bool is_empty(void)
+	{
+		return count == 0;
+	}
+
+
+	/**
+	 * Determines whether the queue is full.
+	 * @returns True if full; otherwise false.
+	 */
+	bool is_full(void)
+	{
+		return count == capacity;
+	}
+
+
+	/**
+	 * Discards all frames.
+	 */
+	void clear(void)
+	{
+		count = 0;
+	}
+
+
+	/**
+	 * Determines whether a frame is sent before another.
+	 * @returns True if a has the higher priority.
+	 */
+	static bool is_before(const Entry& a, const Entry& b)
+	{
+		return a.cob < b.cob || (a.cob == b.cob && is_older(a, b));
+	}
+
+
+private:
+	static bool is_older(const Entry& a, const Entry& b)
+	{
+		return (int32_t) (a.sequence - b.sequence) < 0;
+	}
+
+
+	void insert(const Entry& e)
+	{
+		uint32_t i = count++;
+		while (i > 0)
+		{
+			uint32_t parent = (i - 1) / 2;
+			if (!is_before(e, buffer[parent]))
+				break;
+			buffer[i] = buffer[parent];
+			i = parent;
+		}
+		buffer[i] = e;
+	}
+
+
+	void remove(uint32_t i)
+	{
+		Entry e = buffer[--count];
+		if (i == count)
+			return;
+
+		// Sift up, in case the moved entry outranks the parent of the hole.
+		while (i > 0 && is_before(e, buffer[(i - 1) / 2]))
+		{
+			buffer[i] = buffer[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		// Sift down.
+		for (;;)
+		{
+			uint32_t child = 2 * i + 1;
+			if (child >= count)
+				break;
+			if (child + 1 < count && is_before(buffer[child + 1], buffer[child]))
+				child++;
+			if (!is_before(buffer[child], e))
+				break;
+			buffer[i] = buffer[child];
+			i = child;
+		}
+		buffer[i] = e;
+	}
+
+
+	Entry* buffer = nullptr;
+	uint32_t capacity = 0;
+	uint32_t count = 0;
+	uint32_t next_sequence = 0;
+};
+
+
+#endif /* INC_COMMS_CANTXQUEUE_H_ */
@@ -70,8 +70,7 @@ public:
 	 */
 	void write_bytes(uint8_t *data, uint16_t len)
 	{
-		for (int i=0; i < len; i++)
-			last_error = HAL_SPI_Transmit(hspi, &data[i], 1, 100);
+		last_error = HAL_SPI_Transmit(hspi, data, len, 100);
 	}
 
 
@@ -108,8 +107,18 @@ public:
 	 */
 	void read_bytes(uint8_t *data, uint16_t len)
 	{
-		for(int i = 0; i < len; i++)
-			last_error = HAL_SPI_Receive(hspi, &data[i], 1, 100);
+		last_error = HAL_SPI_Receive(hspi, data, len, 100);
+	}
+
+
+	/**
+	 * @brief	Aborts any transfer in progress and releases the bus.
+	 * @note	Intended for fault handlers, where the peripheral may have been interrupted mid-transfer.
+	 */
+	void abort(void)
+	{
+		HAL_SPI_Abort(hspi);
+		cs_deselect();
 	}
 
 
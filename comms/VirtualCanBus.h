@@ -0,0 +1,826 @@
+/**
+ * \file       comms/VirtualCanBus.h
+ * \class      VirtualCanBus
+ * \brief      Simulates a multi-node CAN bus in memory, with arbitration, bit timing, error frames and virtual time.
+ */
+
+#ifndef INC_COMMS_VIRTUALCANBUS_H_
+#define INC_COMMS_VIRTUALCANBUS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef VIRTUAL_CAN_MAX_NODES
+#define VIRTUAL_CAN_MAX_NODES (16)
+#endif
+
+
+/**
+ * A CAN bus that exists only in memory, for running CanBus and CanOpen on a host without hardware. See
+ * VirtualCanHal.h, which presents each node to CanBus as a CAN_HandleTypeDef.
+ *
+ * Each attached Node models a bxCAN controller: three transmit mailboxes, a three-frame receive FIFO that overruns
+ * when full, and the transmit and receive error counters with the error-active, error-passive and bus-off states.
+ *
+ * Time is virtual and only moves when advance() is called, so a simulation runs the same way every time and as fast
+ * as the host allows. When the bus is idle, each node offers one pending mailbox, chosen as bxCAN chooses it: the
+ * lowest COB-ID, the lowest mailbox among equal COB-IDs, or with set_fifo_priority() the oldest request. The lowest
+ * COB-ID offered wins arbitration, as it would on the wire. A frame occupies the bus for its exact length, including the stuff bits its
+ * contents need and the interframe space, at the configured bitrate.
+ *
+ * Errors come from three places: a frame that no other node acknowledges, frames corrupted by inject_errors(), and
+ * frames corrupted at random by set_error_rate(). Each costs an error frame on the bus and raises the error counters
+ * as ISO 11898-1 prescribes, and the frame is sent again, so a faulty node ends up error-passive and then bus-off.
+ */
+class VirtualCanBus
+{
+public:
+	enum ErrorState { ErrorActive, ErrorPassive, BusOff };
+
+	// Causes passed to Node::on_error().
+	static constexpr uint32_t ErrorAck = 0x01;  /// No other node acknowledged a frame.
+	static constexpr uint32_t ErrorBit = 0x02;  /// A frame was corrupted on the bus.
+	static constexpr uint32_t ErrorPassiveEntered = 0x04;  /// The node became error-passive.
+	static constexpr uint32_t ErrorBusOff = 0x08;  /// The node went bus-off.
+	static constexpr uint32_t ErrorOverrun = 0x10;  /// A frame was lost because the receive FIFO was full.
+
+	static constexpr uint32_t Mailboxes = 3;
+	static constexpr uint32_t FifoDepth = 3;
+
+
+	/**
+	 * A frame as seen by a node.
+	 */
+	typedef struct Frame
+	{
+		uint16_t cob;
+		uint8_t length;
+		uint8_t data[8];
+	} Frame;
+
+
+	/**
+	 * One CAN controller on the bus. Override the virtual methods to be told of events, as the interrupt routines of
+	 * a real controller would be.
+	 */
+	class Node
+	{
+	public:
+		virtual ~Node()
+		{
+		}
+
+
+		/**
+		 * Called to ask whether the acceptance filter passes a frame.
+		 * @param cob The COB-ID.
+		 * @returns True to receive the frame.
+		 */
+		virtual bool accepts(uint16_t cob)
+		{
+			(void) cob;
+			return true;
+		}
+
+
+		/**
+		 * Called when a frame has been put in the receive FIFO.
+		 */
+		virtual void on_rx_pending(void)
+		{
+		}
+
+
+		/**
+		 * Called when a mailbox's frame has been sent.
+		 * @param mailbox The mailbox (0-2).
+		 */
+		virtual void on_tx_complete(uint32_t mailbox)
+		{
+			(void) mailbox;
+		}
+
+
+		/**
+		 * Called when a mailbox's frame has been aborted.
+		 * @param mailbox The mailbox (0-2).
+		 */
+		virtual void on_tx_abort(uint32_t mailbox)
+		{
+			(void) mailbox;
+		}
+
+
+		/**
+		 * Called when an error involves this node.
+		 * @param errors The causes, such as ErrorAck | ErrorPassiveEntered.
+		 */
+		virtual void on_error(uint32_t errors)
+		{
+			(void) errors;
+		}
+
+
+		/**
+		 * Puts a frame in a free mailbox.
+		 * @param cob The COB-ID.
+		 * @param data The data.
+		 * @param length The length of the data (maximum 8).
+		 * @param mailbox Set to the mailbox used.
+		 * @returns True if accepted; false if all mailboxes are full.
+		 */
+		bool transmit(uint16_t cob, const uint8_t* data, uint8_t length, uint32_t* mailbox=nullptr)
+		{
+			for (uint32_t i=0; i < Mailboxes; i++)
+			{
+				if (tx[i].pending)
+					continue;
+				tx[i].frame.cob = cob & 0x7ff;
+				tx[i].frame.length = length > 8 ? 8 : length;
+				memset(tx[i].frame.data, 0, 8);
+				memcpy(tx[i].frame.data, data, tx[i].frame.length);
+				tx[i].pending = true;
+				tx[i].abort = false;
+				tx[i].request = requests++;
+				if (mailbox != nullptr)
+					*mailbox = i;
+				return true;
+			}
+			return false;
+		}
+
+
+		/**
+		 * Requests that a mailbox be aborted. A frame already on the bus finishes first, and is only aborted if it
+		 * fails.
+		 * @param mailbox The mailbox (0-2).
+		 */
+		void abort(uint32_t mailbox)
+		{
+			if (mailbox >= Mailboxes || !tx[mailbox].pending)
+				return;
+			if (bus != nullptr && bus->is_sending(this, mailbox))
+			{
+				tx[mailbox].abort = true;
+				return;
+			}
+			tx[mailbox].pending = false;
+			on_tx_abort(mailbox);
+		}
+
+
+		/**
+		 * Gets the number of empty mailboxes.
+		 * @returns The number of mailboxes (0-3).
+		 */
+		uint32_t get_free_mailboxes(void)
+		{
+			uint32_t free = 0;
+			for (uint32_t i=0; i < Mailboxes; i++)
+				if (!tx[i].pending)
+					free++;
+			return free;
+		}
+
+
+		/**
+		 * Takes the oldest frame from the receive FIFO.
+		 * @param frame Set to the frame.
+		 * @returns True if a frame was taken; false if the FIFO is empty.
+		 */
+		bool receive(Frame& frame)
+		{
+			if (fifo_count == 0)
+				return false;
+			frame = fifo[fifo_head];
+			fifo_head = (fifo_head + 1) % FifoDepth;
+			fifo_count--;
+			return true;
+		}
+
+
+		/**
+		 * Gets the number of frames in the receive FIFO.
+		 * @returns The number of frames (0-3).
+		 */
+		uint32_t get_fifo_level(void)
+		{
+			return fifo_count;
+		}
+
+
+		/**
+		 * Gets the overrun flag, which is set when a frame arrives while the FIFO is full.
+		 * @returns True if an overrun has occurred since the flag was cleared.
+		 */
+		bool is_overrun(void)
+		{
+			return overrun;
+		}
+
+
+		/**
+		 * Clears the overrun flag.
+		 */
+		void clear_overrun(void)
+		{
+			overrun = false;
+		}
+
+
+		/**
+		 * Takes the node off the bus and back on, as reinitializing the controller does: the mailboxes and FIFO are
+		 * emptied and the error counters cleared. A node that is bus-off without automatic recovery needs this.
+		 */
+		void restart(void)
+		{
+			for (uint32_t i=0; i < Mailboxes; i++)
+				tx[i].pending = false;
+			fifo_count = 0;
+			overrun = false;
+			tec = 0;
+			rec = 0;
+			state = ErrorActive;
+		}
+
+
+		/**
+		 * Sets the order in which the node offers its mailboxes for arbitration, like the TXFP bit of bxCAN.
+		 * @param enabled True for the order of the transmit requests; false for the lowest COB-ID first, with equal
+		 *                COB-IDs taken lowest mailbox first.
+		 */
+		void set_fifo_priority(bool enabled)
+		{
+			fifo_priority = enabled;
+		}
+
+
+		/**
+		 * Sets whether the node leaves bus-off by itself after 128 occurrences of 11 recessive bits, like the ABOM bit
+		 * of bxCAN.
+		 * @param enabled True to recover automatically.
+		 */
+		void set_auto_recovery(bool enabled)
+		{
+			auto_recovery = enabled;
+		}
+
+
+		uint8_t get_tec(void)
+		{
+			return tec > 255 ? 255 : tec;
+		}
+
+
+		uint8_t get_rec(void)
+		{
+			return rec > 255 ? 255 : rec;
+		}
+
+
+		ErrorState get_state(void)
+		{
+			return state;
+		}
+
+
+		/**
+		 * Determines whether the node takes part in the bus. Nodes that are bus-off or not started do not.
+		 * @returns True if online; otherwise false.
+		 */
+		bool is_online(void)
+		{
+			return online && state != BusOff;
+		}
+
+
+		/**
+		 * Sets whether the node takes part in the bus, as starting and stopping the controller do.
+		 * @param online True to take part.
+		 */
+		void set_online(bool online)
+		{
+			this->online = online;
+		}
+
+
+	private:
+		friend class VirtualCanBus;
+
+		struct
+		{
+			Frame frame;
+			bool pending = false;
+			bool abort = false;
+			uint32_t request = 0;  // Order of the transmit request.
+		} tx[Mailboxes];
+
+		/**
+		 * Chooses the mailbox that the node offers for arbitration.
+		 * @returns The mailbox, or Mailboxes if none is pending.
+		 */
+		uint32_t next_mailbox(void)
+		{
+			uint32_t next = Mailboxes;
+			for (uint32_t m=0; m < Mailboxes; m++)
+			{
+				if (!tx[m].pending)
+					continue;
+				if (next == Mailboxes || (fifo_priority ? (int32_t) (tx[m].request - tx[next].request) < 0
+						: tx[m].frame.cob < tx[next].frame.cob))
+					next = m;
+			}
+			return next;
+		}
+
+		uint32_t requests = 0;
+		bool fifo_priority = false;
+
+		Frame fifo[FifoDepth];
+		uint32_t fifo_head = 0;
+		uint32_t fifo_count = 0;
+		bool overrun = false;
+		uint32_t tec = 0;
+		uint32_t rec = 0;
+		ErrorState state = ErrorActive;
+		bool auto_recovery = true;
+		bool online = true;
+		uint64_t bus_off_at = 0;
+		VirtualCanBus* bus = nullptr;
+	};
+
+
+	/**
+	 * Constructs a bus.
+	 * @param bitrate The bitrate in bits per second.
+	 */
+	VirtualCanBus(uint32_t bitrate=500000)
+	{
+		set_bitrate(bitrate);
+	}
+
+
+	/**
+	 * Sets the bitrate.
+	 * @param bitrate The bitrate in bits per second.
+	 */
+	void set_bitrate(uint32_t bitrate)
+	{
+		bit_time = 1000000000000ull / bitrate;
+	}
+
+
+	/**
+	 * Connects a node to the bus.
+	 * @param node The node.
+	 * @returns True if connected; false if VIRTUAL_CAN_MAX_NODES are already connected.
+	 */
+	bool attach(Node* node)
+	{
+		if (node_count == VIRTUAL_CAN_MAX_NODES)
+			return false;
+		nodes[node_count++] = node;
+		node->bus = this;
+		return true;
+	}
+
+
+	/**
+	 * Corrupts the next frames to be sent, each of which then costs an error frame and is sent again.
+	 * @param count The number of frames to corrupt.
+	 */
+	void inject_errors(uint32_t count)
+	{
+		injected += count;
+	}
+
+
+	/**
+	 * Corrupts frames at random. The sequence is the same for the same seed.
+	 * @param per_million The chance of corrupting each frame, in parts per million.
+	 * @param seed The seed.
+	 */
+	void set_error_rate(uint32_t per_million, uint32_t seed=1)
+	{
+		error_rate = per_million;
+		random = seed ? seed : 1;
+	}
+
+
+	/**
+	 * Runs the bus for a while: frames are sent, delivered and acknowledged, and the nodes' callbacks are called, in
+	 * the order they would happen on the wire. Callbacks may queue more frames.
+	 * @param nanoseconds How long to run.
+	 */
+	void advance(uint64_t nanoseconds)
+	{
+		run(now + nanoseconds * 1000);
+	}
+
+
+	/**
+	 * Runs the bus until no node has anything left to send.
+	 * @param limit The longest to run, in nanoseconds.
+	 * @returns True if the bus went idle; false if the limit was reached.
+	 */
+	bool run_until_idle(uint64_t limit=1000000000ull)
+	{
+		uint64_t end = now + limit * 1000;
+		while (current.node != nullptr || is_pending())
+		{
+			if (now >= end)
+				return false;
+			if (current.node == nullptr)
+				run(now);  // Starts the next frame.
+			uint64_t next = current.node != nullptr ? current.end : next_recovery();  // Nodes left are bus-off.
+			run(next < end ? next : end);
+		}
+		return true;
+	}
+
+
+	/**
+	 * Gets the virtual time.
+	 * @returns The time in nanoseconds since the bus was created.
+	 */
+	uint64_t get_time(void)
+	{
+		return now / 1000;
+	}
+
+
+	/**
+	 * Gets the number of frames sent successfully.
+	 * @returns The number of frames.
+	 */
+	uint32_t get_frames(void)
+	{
+		return frames;
+	}
+
+
+	/**
+	 * Gets the number of error frames.
+	 * @returns The number of error frames.
+	 */
+	uint32_t get_error_frames(void)
+	{
+		return error_frames;
+	}
+
+
+	/**
+	 * Gets the time the bus has been busy, for computing bus load.
+	 * @returns The time in nanoseconds.
+	 */
+	uint64_t get_busy_time(void)
+	{
+		return busy / 1000;
+	}
+
+
+	/**
+	 * Counts the bits a standard data frame occupies on the wire, from the start of frame to the end of the
+	 * interframe space, including the stuff bits its contents need.
+	 * @param cob The COB-ID.
+	 * @param data The data.
+	 * @param length The length of the data (maximum 8).
+	 * @returns The number of bits.
+	 */
+	static uint32_t frame_bits(uint16_t cob, const uint8_t* data, uint8_t length)
+	{
+		// Build the stuffed region: SOF, identifier, RTR, IDE, r0, DLC, data, then the CRC over all of those.
+		uint8_t bits[1 + 11 + 3 + 4 + 64 + 15];
+		uint32_t n = 0;
+		bits[n++] = 0;
+		for (int32_t i=10; i >= 0; i--)
+			bits[n++] = cob >> i & 1;
+		bits[n++] = 0;
+		bits[n++] = 0;
+		bits[n++] = 0;
+		for (int32_t i=3; i >= 0; i--)
+			bits[n++] = length >> i & 1;
+		for (uint32_t byte=0; byte < length; byte++)
+			for (int32_t i=7; i >= 0; i--)
+				bits[n++] = data[byte] >> i & 1;
+
+		uint16_t crc = 0;
+		for (uint32_t i=0; i < n; i++)
+		{
+			bool next = bits[i] ^ (crc >> 14 & 1);
+			crc = (crc << 1) & 0x7fff;
+			if (next)
+				crc ^= 0x4599;
+		}
+		for (int32_t i=14; i >= 0; i--)
+			bits[n++] = crc >> i & 1;
+
+		uint32_t stuffed = 0;
+		uint32_t run = 0;
+		uint8_t last = 2;
+		for (uint32_t i=0; i < n; i++)
+		{
+			if (bits[i] == last)
+				run++;
+			else
+			{
+				last = bits[i];
+				run = 1;
+			}
+			if (run == 5)
+			{
+				// The stuff bit is the complement, and starts the next run.
+				stuffed++;
+				last ^= 1;
+				run = 1;
+			}
+		}
+
+		// CRC delimiter, ACK slot, ACK delimiter, end of frame, interframe space.
+		return n + stuffed + 1 + 1 + 1 + 7 + 3;
+	}
+
+
+private:
+	/**
+	 * Runs the bus until a point in time.
+	 * @param target The time in picoseconds.
+	 */
+	void run(uint64_t target)
+	{
+		for (;;)
+		{
+			recover();
+
+			if (current.node != nullptr)
+			{
+				if (current.end > target)
+					break;
+				now = current.end;
+				finish();
+				continue;
+			}
+
+			if (arbitrate())
+				continue;
+
+			// Idle: skip ahead to the next node that comes back from bus-off, if it is before the target.
+			uint64_t next = next_recovery();
+			if (next > target)
+				break;
+			now = next;
+		}
+		if (now < target)
+			now = target;
+	}
+
+
+	/**
+	 * Determines whether a mailbox's frame is on the bus now.
+	 */
+	bool is_sending(Node* node, uint32_t mailbox)
+	{
+		return current.node == node && current.mailbox == mailbox;
+	}
+
+
+	/**
+	 * Determines whether any node has a frame to send, including bus-off nodes that will recover and send it.
+	 */
+	bool is_pending(void)
+	{
+		for (uint32_t i=0; i < node_count; i++)
+			if (nodes[i]->online && (nodes[i]->state != BusOff || nodes[i]->auto_recovery))
+				for (uint32_t m=0; m < Mailboxes; m++)
+					if (nodes[i]->tx[m].pending)
+						return true;
+		return false;
+	}
+
+
+	/**
+	 * Starts the frame that wins arbitration, if any node has one pending.
+	 * @returns True if a frame was started.
+	 */
+	bool arbitrate(void)
+	{
+		Node* winner = nullptr;
+		uint32_t mailbox = 0;
+		for (uint32_t i=0; i < node_count; i++)
+		{
+			Node* node = nodes[i];
+			if (!node->is_online())
+				continue;
+			uint32_t m = node->next_mailbox();
+			if (m == Mailboxes)
+				continue;
+			if (winner == nullptr || node->tx[m].frame.cob < winner->tx[mailbox].frame.cob)
+			{
+				winner = node;
+				mailbox = m;
+			}
+		}
+		if (winner == nullptr)
+			return false;
+
+		Frame& frame = winner->tx[mailbox].frame;
+		uint32_t bits = frame_bits(frame.cob, frame.data, frame.length);
+
+		current.node = winner;
+		current.mailbox = mailbox;
+		current.errors = 0;
+		if (!has_receiver(winner))
+			current.errors = ErrorAck;
+		else if (injected > 0)
+		{
+			injected--;
+			current.errors = ErrorBit;
+		}
+		else if (error_rate && next_random() % 1000000 < error_rate)
+			current.errors = ErrorBit;
+
+		if (current.errors)
+		{
+			// Signalled at the ACK slot for an ACK error, otherwise part way through; then the error flag, the error
+			// delimiter and the interframe space.
+			uint32_t at = current.errors == ErrorAck ? bits - 11 : bits / 2;
+			bits = at + 6 + 8 + 3;
+		}
+		current.end = now + bits * bit_time;
+		busy += bits * bit_time;
+		return true;
+	}
+
+
+	/**
+	 * Completes the frame on the bus: delivers and acknowledges it, or applies the error rules.
+	 */
+	void finish(void)
+	{
+		Node* sender = current.node;
+		uint32_t mailbox = current.mailbox;
+		uint32_t errors = current.errors;
+		current.node = nullptr;
+		Frame frame = sender->tx[mailbox].frame;
+
+		if (errors == 0)
+		{
+			frames++;
+			sender->tx[mailbox].pending = false;
+			if (sender->tec > 0)
+				sender->tec--;
+			update_state(sender);
+			for (uint32_t i=0; i < node_count; i++)
+			{
+				Node* node = nodes[i];
+				if (node == sender || !node->is_online())
+					continue;
+				if (node->rec > 127)
+					node->rec = 127;
+				else if (node->rec > 0)
+					node->rec--;
+				update_state(node);
+				if (!node->accepts(frame.cob))
+					continue;
+				if (node->fifo_count == FifoDepth)
+				{
+					node->overrun = true;
+					node->on_error(ErrorOverrun);
+					continue;
+				}
+				node->fifo[(node->fifo_head + node->fifo_count) % FifoDepth] = frame;
+				node->fifo_count++;
+				node->on_rx_pending();
+			}
+			sender->on_tx_complete(mailbox);
+			return;
+		}
+
+		error_frames++;
+		// An error-passive sender does not count ACK errors (ISO 11898-1 exception 1).
+		if (!(errors == ErrorAck && sender->state == ErrorPassive))
+			sender->tec += 8;
+		errors |= update_state(sender);
+		if (errors & ErrorBit)
+		{
+			for (uint32_t i=0; i < node_count; i++)
+			{
+				Node* node = nodes[i];
+				if (node == sender || !node->is_online())
+					continue;
+				node->rec++;
+				uint32_t changed = update_state(node);
+				node->on_error(ErrorBit | changed);
+			}
+		}
+
+		// A frame that fails is sent again, unless it was asked to abort. A bus-off node keeps its mailboxes, and
+		// sends them once it recovers.
+		sender->on_error(errors);
+		if (sender->tx[mailbox].abort)
+		{
+			sender->tx[mailbox].pending = false;
+			sender->on_tx_abort(mailbox);
+		}
+	}
+
+
+	/**
+	 * Moves a node between the error states after its counters change.
+	 * @returns ErrorPassiveEntered or ErrorBusOff if the node entered that state; otherwise 0.
+	 */
+	uint32_t update_state(Node* node)
+	{
+		ErrorState was = node->state;
+		if (node->tec > 255)
+		{
+			node->state = BusOff;
+			node->bus_off_at = now;
+		}
+		else if (node->state != BusOff)
+			node->state = node->tec > 127 || node->rec > 127 ? ErrorPassive : ErrorActive;
+
+		if (node->state == was)
+			return 0;
+		return node->state == BusOff ? ErrorBusOff : node->state == ErrorPassive ? ErrorPassiveEntered : 0;
+	}
+
+
+	/**
+	 * Brings back nodes that have been bus-off for 128 occurrences of 11 recessive bits.
+	 */
+	void recover(void)
+	{
+		for (uint32_t i=0; i < node_count; i++)
+		{
+			Node* node = nodes[i];
+			if (node->state == BusOff && node->auto_recovery && now >= node->bus_off_at + 128 * 11 * bit_time)
+			{
+				node->tec = 0;
+				node->rec = 0;
+				node->state = ErrorActive;
+			}
+		}
+	}
+
+
+	/**
+	 * Gets the time the next bus-off node recovers.
+	 * @returns The time in picoseconds, or the largest time if no node is waiting to recover.
+	 */
+	uint64_t next_recovery(void)
+	{
+		uint64_t next = UINT64_MAX;
+		for (uint32_t i=0; i < node_count; i++)
+		{
+			Node* node = nodes[i];
+			uint64_t at = node->bus_off_at + 128 * 11 * bit_time;
+			if (node->state == BusOff && node->auto_recovery && at < next)
+				next = at;
+		}
+		return next;
+	}
+
+
+	bool has_receiver(Node* sender)
+	{
+		for (uint32_t i=0; i < node_count; i++)
+			if (nodes[i] != sender && nodes[i]->is_online())
+				return true;
+		return false;
+	}
+
+
+	uint32_t next_random(void)
+	{
+		// xorshift32, so a seed always gives the same errors.
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return random;
+	}
+
+
+	Node* nodes[VIRTUAL_CAN_MAX_NODES];
+	uint32_t node_count = 0;
+	uint64_t bit_time;  // Picoseconds.
+	uint64_t now = 0;  // Picoseconds.
+	uint64_t busy = 0;  // Picoseconds.
+
+	struct
+	{
+		Node* node = nullptr;
+		uint32_t mailbox = 0;
+		uint32_t errors = 0;
+		uint64_t end = 0;
+	} current;
+
+	uint32_t injected = 0;
+	uint32_t error_rate = 0;
+	uint32_t random = 1;
+	uint32_t frames = 0;
+	uint32_t error_frames = 0;
+};
+
+
+#endif /* INC_COMMS_VIRTUALCANBUS_H_ */
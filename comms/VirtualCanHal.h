@@ -0,0 +1,524 @@
+/**
+ * \file       comms/VirtualCanHal.h
+ * \brief      The subset of the STM32 HAL that CanBus and CanOpen use, implemented over VirtualCanBus for host builds.
+ * \notes	   Include this from the toolbox.h of a host build, in place of the HAL. Each CAN_HandleTypeDef is one node on
+ *             a VirtualCanBus, and time is the virtual time of that bus, so HAL_GetTick(), the DWT cycle counter,
+ *             Timer and osDelay() all follow the simulation. The HAL's weak callbacks are called as the interrupts
+ *             would call them, so the same application code runs on the target and on the host.
+ *
+ * <code>
+ * VirtualCanBus bus(500000);
+ * CAN_HandleTypeDef hcan1(&bus), hcan2(&bus);
+ * CanOpen master(&hcan1), slave(&hcan2, CanOpen::Slave);
+ *
+ * void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan)
+ * {
+ *     (hcan == &hcan1 ? master : slave).on_message();
+ * }
+ *
+ * master.setup(); slave.setup();
+ * master.sdo(5, CanOpen::Index_DeviceType);  // osDelay() inside runs the bus for 1 ms.
+ * </code>
+ */
+
+#ifndef INC_COMMS_VIRTUALCANHAL_H_
+#define INC_COMMS_VIRTUALCANHAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "VirtualCanBus.h"
+
+#ifndef VIRTUAL_HCLK_FREQUENCY
+#define VIRTUAL_HCLK_FREQUENCY (168000000)
+#endif
+
+// There are no threads in a simulation. Defining this selects the RTOS path of Timer, whose stubs are below.
+#ifndef USING_FREERTOS
+#define USING_FREERTOS (0)
+#endif
+
+
+/**
+ * The clock of the simulation, which is the virtual time of one bus.
+ */
+class VirtualHal
+{
+public:
+	/**
+	 * Sets the bus whose time is the system time. The first CAN_HandleTypeDef created sets it if it is not set.
+	 * @param bus The bus.
+	 */
+	static void set_bus(VirtualCanBus* bus)
+	{
+		VirtualHal::bus = bus;
+	}
+
+
+	/**
+	 * Gets the system time.
+	 * @returns The time in nanoseconds.
+	 */
+	static uint64_t get_time(void)
+	{
+		return bus != nullptr ? bus->get_time() : time;
+	}
+
+
+	/**
+	 * Lets time pass, running the bus meanwhile.
+	 * @param nanoseconds The time to pass.
+	 */
+	static void advance(uint64_t nanoseconds)
+	{
+		if (bus != nullptr)
+			bus->advance(nanoseconds);
+		else
+			time += nanoseconds;
+	}
+
+
+	/**
+	 * Gets the DWT cycle count that corresponds to the system time.
+	 * @returns The cycle count.
+	 */
+	static uint32_t get_cycles(void)
+	{
+		uint64_t ns = get_time();
+		uint64_t per_us = VIRTUAL_HCLK_FREQUENCY / 1000000;
+		return (uint32_t) (ns / 1000 * per_us + ns % 1000 * per_us / 1000);
+	}
+
+	inline static VirtualCanBus* bus = nullptr;
+
+private:
+	inline static uint64_t time = 0;
+};
+
+
+// Core.
+inline uint32_t __get_PRIMASK(void) { return 0; }
+inline void __disable_irq(void) {}
+inline void __set_PRIMASK(uint32_t primask) { (void) primask; }
+inline uint32_t __get_MSP(void) { return 0; }  // There is no main stack to paint on the host.
+
+/**
+ * Reads as the cycle count of the virtual clock.
+ */
+typedef struct VirtualCycleCounter
+{
+	operator uint32_t() const { return VirtualHal::get_cycles(); }
+	VirtualCycleCounter& operator=(uint32_t value) { (void) value; return *this; }
+} VirtualCycleCounter;
+
+typedef struct { uint32_t CTRL; VirtualCycleCounter CYCCNT; } DWT_Type;
+typedef struct { uint32_t DEMCR; } CoreDebug_Type;
+inline DWT_Type virtual_dwt;
+inline CoreDebug_Type virtual_core_debug;
+#define DWT (&virtual_dwt)
+#define CoreDebug (&virtual_core_debug)
+#define DWT_CTRL_CYCCNTENA_Msk (0x00000001)
+#define CoreDebug_DEMCR_TRCENA_Msk (0x01000000)
+
+inline uint32_t HAL_GetTick(void) { return (uint32_t) (VirtualHal::get_time() / 1000000); }
+inline uint32_t HAL_RCC_GetHCLKFreq(void) { return VIRTUAL_HCLK_FREQUENCY; }
+
+
+// RTOS: a delay runs the simulation.
+typedef void* osMutexId_t;
+typedef void* osThreadId_t;
+#define osOK (0)
+#define osWaitForever (0xffffffffu)
+#define osFlagsWaitAny (0x00000000u)
+inline osMutexId_t osMutexNew(void) { return nullptr; }
+inline int32_t osAcquireMutex(osMutexId_t mutex, uint32_t timeout) { (void) mutex; (void) timeout; return osOK; }
+inline int32_t osReleaseMutex(osMutexId_t mutex) { (void) mutex; return osOK; }
+inline int32_t osDelay(uint32_t ticks) { VirtualHal::advance((uint64_t) ticks * 1000000); return osOK; }
+
+
+// HAL status and configuration values.
+typedef enum { HAL_OK = 0x00, HAL_ERROR = 0x01, HAL_BUSY = 0x02, HAL_TIMEOUT = 0x03 } HAL_StatusTypeDef;
+#define ENABLE (1)
+#define DISABLE (0)
+
+#define CAN_ID_STD (0x00000000)
+#define CAN_RTR_DATA (0x00000000)
+#define CAN_TX_MAILBOX0 (0x00000001)
+#define CAN_TX_MAILBOX1 (0x00000002)
+#define CAN_TX_MAILBOX2 (0x00000004)
+#define CAN_RX_FIFO0 (0x00000000)
+#define CAN_FILTER_FIFO0 (0x00000000)
+#define CAN_FILTERMODE_IDMASK (0x00000000)
+#define CAN_FILTERMODE_IDLIST (0x00000001)
+#define CAN_FILTERSCALE_16BIT (0x00000000)
+#define CAN_FILTERSCALE_32BIT (0x00000001)
+#define CAN_FILTER_DISABLE (0x00000000)
+#define CAN_FILTER_ENABLE (0x00000001)
+#define CAN_FLAG_FOV0 (0x00000204)
+
+#define CAN_IT_TX_MAILBOX_EMPTY (0x00000001)
+#define CAN_IT_RX_FIFO0_MSG_PENDING (0x00000002)
+#define CAN_IT_RX_FIFO0_OVERRUN (0x00000008)
+#define CAN_IT_ERROR_WARNING (0x00000100)
+#define CAN_IT_ERROR_PASSIVE (0x00000200)
+#define CAN_IT_BUSOFF (0x00000400)
+#define CAN_IT_LAST_ERROR_CODE (0x00000800)
+#define CAN_IT_ERROR (0x00008000)
+
+#define HAL_CAN_ERROR_NONE (0x00000000)
+#define HAL_CAN_ERROR_EPV (0x00000002)
+#define HAL_CAN_ERROR_BOF (0x00000004)
+#define HAL_CAN_ERROR_ACK (0x00000020)
+#define HAL_CAN_ERROR_BD (0x00000080)
+#define HAL_CAN_ERROR_RX_FOV0 (0x00000200)
+#define HAL_CAN_ERROR_TIMEOUT (0x00020000)
+#define HAL_CAN_ERROR_PARAM (0x00200000)
+
+#define CAN_MCR_TXFP (0x00000004)
+
+#define CAN_ESR_EPVF (0x00000002)
+#define CAN_ESR_BOFF (0x00000004)
+#define CAN_ESR_TEC_Pos (16)
+#define CAN_ESR_TEC_Msk (0xffu << CAN_ESR_TEC_Pos)
+#define CAN_ESR_REC_Pos (24)
+#define CAN_ESR_REC_Msk (0xffu << CAN_ESR_REC_Pos)
+
+typedef struct
+{
+	uint32_t StdId;
+	uint32_t ExtId;
+	uint32_t IDE;
+	uint32_t RTR;
+	uint32_t DLC;
+	uint32_t TransmitGlobalTime;
+} CAN_TxHeaderTypeDef;
+
+typedef struct
+{
+	uint32_t StdId;
+	uint32_t ExtId;
+	uint32_t IDE;
+	uint32_t RTR;
+	uint32_t DLC;
+	uint32_t Timestamp;
+	uint32_t FilterMatchIndex;
+} CAN_RxHeaderTypeDef;
+
+typedef struct
+{
+	uint32_t FilterIdHigh;
+	uint32_t FilterIdLow;
+	uint32_t FilterMaskIdHigh;
+	uint32_t FilterMaskIdLow;
+	uint32_t FilterFIFOAssignment;
+	uint32_t FilterBank;
+	uint32_t FilterMode;
+	uint32_t FilterScale;
+	uint32_t FilterActivation;
+	uint32_t SlaveStartFilterBank;
+} CAN_FilterTypeDef;
+
+/**
+ * Reads as the error status register of a node.
+ */
+typedef struct VirtualEsr
+{
+	VirtualCanBus::Node* node;
+
+	operator uint32_t() const
+	{
+		uint32_t esr = (uint32_t) node->get_tec() << CAN_ESR_TEC_Pos | (uint32_t) node->get_rec() << CAN_ESR_REC_Pos;
+		if (node->get_state() == VirtualCanBus::ErrorPassive)
+			esr |= CAN_ESR_EPVF;
+		if (node->get_state() == VirtualCanBus::BusOff)
+			esr |= CAN_ESR_BOFF;
+		return esr;
+	}
+} VirtualEsr;
+
+typedef struct
+{
+	uint32_t MCR;
+	VirtualEsr ESR;
+} CAN_TypeDef;
+
+
+struct __CAN_HandleTypeDef;
+typedef struct __CAN_HandleTypeDef CAN_HandleTypeDef;
+
+// The HAL's callbacks. These are weak references, so the application defines only those it needs.
+extern void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+extern void HAL_CAN_ErrorCallback(CAN_HandleTypeDef* hcan) __attribute__((weak));
+
+
+/**
+ * A CAN peripheral, which is one node on a VirtualCanBus.
+ */
+struct __CAN_HandleTypeDef : public VirtualCanBus::Node
+{
+	static constexpr uint32_t FilterBanks = 28;
+
+	CAN_TypeDef* Instance;
+	volatile uint32_t ErrorCode = HAL_CAN_ERROR_NONE;
+	uint32_t notifications = 0;
+	CAN_FilterTypeDef filters[FilterBanks] = {};
+
+
+	/**
+	 * Creates a peripheral and connects it to a bus. It stays off the bus until HAL_CAN_Start().
+	 * @param bus The bus.
+	 */
+	__CAN_HandleTypeDef(VirtualCanBus* bus)
+	{
+		registers.MCR = 0;
+		registers.ESR.node = this;
+		Instance = &registers;
+		set_online(false);
+		bus->attach(this);
+		if (VirtualHal::bus == nullptr)
+			VirtualHal::set_bus(bus);
+	}
+
+
+	/**
+	 * Applies the filter banks, as the bxCAN hardware does. With no bank active, nothing is received.
+	 */
+	bool accepts(uint16_t cob) override
+	{
+		uint32_t value16 = (uint32_t) cob << 5;
+		uint32_t value32 = (uint32_t) cob << 21;
+		for (uint32_t i=0; i < FilterBanks; i++)
+		{
+			CAN_FilterTypeDef& f = filters[i];
+			if (f.FilterActivation != CAN_FILTER_ENABLE)
+				continue;
+			if (f.FilterScale == CAN_FILTERSCALE_32BIT)
+			{
+				uint32_t id = f.FilterIdHigh << 16 | f.FilterIdLow;
+				uint32_t mask = f.FilterMaskIdHigh << 16 | f.FilterMaskIdLow;
+				if (f.FilterMode == CAN_FILTERMODE_IDLIST ? (value32 == id || value32 == mask) : !((value32 ^ id) & mask))
+					return true;
+			}
+			else if (f.FilterMode == CAN_FILTERMODE_IDLIST)
+			{
+				if (value16 == f.FilterIdLow || value16 == f.FilterMaskIdLow || value16 == f.FilterIdHigh
+						|| value16 == f.FilterMaskIdHigh)
+					return true;
+			}
+			else if (!((value16 ^ f.FilterIdLow) & f.FilterMaskIdLow) || !((value16 ^ f.FilterIdHigh) & f.FilterMaskIdHigh))
+				return true;
+		}
+		return false;
+	}
+
+
+	void on_rx_pending(void) override
+	{
+		if (notifications & CAN_IT_RX_FIFO0_MSG_PENDING)
+			call(HAL_CAN_RxFifo0MsgPendingCallback);
+	}
+
+
+	void on_tx_complete(uint32_t mailbox) override
+	{
+		if (notifications & CAN_IT_TX_MAILBOX_EMPTY)
+			call(mailbox == 0 ? HAL_CAN_TxMailbox0CompleteCallback
+					: mailbox == 1 ? HAL_CAN_TxMailbox1CompleteCallback : HAL_CAN_TxMailbox2CompleteCallback);
+	}
+
+
+	void on_tx_abort(uint32_t mailbox) override
+	{
+		if (notifications & CAN_IT_TX_MAILBOX_EMPTY)
+			call(mailbox == 0 ? HAL_CAN_TxMailbox0AbortCallback
+					: mailbox == 1 ? HAL_CAN_TxMailbox1AbortCallback : HAL_CAN_TxMailbox2AbortCallback);
+	}
+
+
+	void on_error(uint32_t errors) override
+	{
+		if (errors & VirtualCanBus::ErrorAck)
+			ErrorCode |= HAL_CAN_ERROR_ACK;
+		if (errors & VirtualCanBus::ErrorBit)
+			ErrorCode |= HAL_CAN_ERROR_BD;
+		if (errors & VirtualCanBus::ErrorPassiveEntered)
+			ErrorCode |= HAL_CAN_ERROR_EPV;
+		if (errors & VirtualCanBus::ErrorBusOff)
+			ErrorCode |= HAL_CAN_ERROR_BOF;
+		if (errors & VirtualCanBus::ErrorOverrun)
+			ErrorCode |= HAL_CAN_ERROR_RX_FOV0;
+		if (notifications & (CAN_IT_ERROR | CAN_IT_BUSOFF | CAN_IT_ERROR_PASSIVE | CAN_IT_LAST_ERROR_CODE
+				| CAN_IT_RX_FIFO0_OVERRUN))
+			call(HAL_CAN_ErrorCallback);
+	}
+
+
+private:
+	/**
+	 * Calls a callback if the application defines it.
+	 */
+	void call(void (*callback)(CAN_HandleTypeDef*))
+	{
+		if (callback != nullptr)
+			callback(this);
+	}
+
+
+	CAN_TypeDef registers;
+};
+
+
+inline HAL_StatusTypeDef HAL_CAN_Start(CAN_HandleTypeDef* hcan)
+{
+	if (hcan->get_state() == VirtualCanBus::BusOff)
+		hcan->restart();
+	hcan->set_fifo_priority(hcan->Instance->MCR & CAN_MCR_TXFP);
+	hcan->set_online(true);
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_Stop(CAN_HandleTypeDef* hcan)
+{
+	hcan->set_online(false);
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef* hcan, CAN_FilterTypeDef* filter)
+{
+	if (filter->FilterBank >= CAN_HandleTypeDef::FilterBanks)
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+	hcan->filters[filter->FilterBank] = *filter;
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_ActivateNotification(CAN_HandleTypeDef* hcan, uint32_t interrupts)
+{
+	hcan->notifications |= interrupts;
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_DeactivateNotification(CAN_HandleTypeDef* hcan, uint32_t interrupts)
+{
+	hcan->notifications &= ~interrupts;
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef* hcan, CAN_TxHeaderTypeDef* header, uint8_t data[],
+		uint32_t* mailbox)
+{
+	uint32_t index;
+	if (!hcan->transmit(header->StdId, data, header->DLC, &index))
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+	if (mailbox != nullptr)
+		*mailbox = CAN_TX_MAILBOX0 << index;
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_AbortTxRequest(CAN_HandleTypeDef* hcan, uint32_t mailboxes)
+{
+	for (uint32_t i=0; i < VirtualCanBus::Mailboxes; i++)
+		if (mailboxes & CAN_TX_MAILBOX0 << i)
+			hcan->abort(i);
+	return HAL_OK;
+}
+
+
+inline uint32_t HAL_CAN_GetTxMailboxesFreeLevel(CAN_HandleTypeDef* hcan)
+{
+	return hcan->get_free_mailboxes();
+}
+
+
+inline uint32_t HAL_CAN_GetRxFifoFillLevel(CAN_HandleTypeDef* hcan, uint32_t fifo)
+{
+	return fifo == CAN_RX_FIFO0 ? hcan->get_fifo_level() : 0;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_GetRxMessage(CAN_HandleTypeDef* hcan, uint32_t fifo, CAN_RxHeaderTypeDef* header,
+		uint8_t data[])
+{
+	VirtualCanBus::Frame frame;
+	if (fifo != CAN_RX_FIFO0 || !hcan->receive(frame))
+	{
+		hcan->ErrorCode |= HAL_CAN_ERROR_PARAM;
+		return HAL_ERROR;
+	}
+	memset(header, 0, sizeof(CAN_RxHeaderTypeDef));
+	header->StdId = frame.cob;
+	header->IDE = CAN_ID_STD;
+	header->RTR = CAN_RTR_DATA;
+	header->DLC = frame.length;
+	header->Timestamp = (uint32_t) (VirtualHal::get_time() / 1000);
+	memcpy(data, frame.data, frame.length);
+	return HAL_OK;
+}
+
+
+inline uint32_t HAL_CAN_GetError(CAN_HandleTypeDef* hcan)
+{
+	return hcan->ErrorCode;
+}
+
+
+inline HAL_StatusTypeDef HAL_CAN_ResetError(CAN_HandleTypeDef* hcan)
+{
+	hcan->ErrorCode = HAL_CAN_ERROR_NONE;
+	return HAL_OK;
+}
+
+
+// UART, which CanBus uses through Log. Whatever is written appears on standard output.
+typedef struct { FILE* file; } UART_HandleTypeDef;
+#define HAL_MAX_DELAY (0xffffffffu)
+
+inline HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, const uint8_t* data, uint16_t size,
+		uint32_t timeout)
+{
+	(void) timeout;
+	fwrite(data, 1, size, huart->file != nullptr ? huart->file : stdout);
+	return HAL_OK;
+}
+
+inline HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef* huart, const uint8_t* data, uint16_t size)
+{
+	return HAL_UART_Transmit(huart, data, size, HAL_MAX_DELAY);
+}
+
+inline HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, const uint8_t* data, uint16_t size)
+{
+	return HAL_UART_Transmit(huart, data, size, HAL_MAX_DELAY);
+}
+
+inline HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+	(void) huart;
+	(void) data;
+	(void) size;
+	return HAL_OK;
+}
+
+
+#define __HAL_CAN_GET_FLAG(hcan, flag) ((flag) == CAN_FLAG_FOV0 && (hcan)->is_overrun())
+#define __HAL_CAN_CLEAR_FLAG(hcan, flag) do { if ((flag) == CAN_FLAG_FOV0) (hcan)->clear_overrun(); } while (0)
+
+
+#endif /* INC_COMMS_VIRTUALCANHAL_H_ */
@@ -11,6 +11,7 @@
 #define	W5500_H_INCLUDED
 
 #include <stdint.h>
+#include <string.h>
 #include "toolbox.h"
 #include "utility/Timer.h"
 
@@ -35,14 +36,37 @@
  * 
  *  (c) 02 September 2015 By Vassilis Serasidis 
  *   cleaned up and extended by stevestrong - 2017.07
+ *
+ *  Here the split is made at run time, per socket, with Ethernet::set_buffer_sizes().
  */
 
 typedef uint8_t SOCKET;
 
+/**
+ * @brief	One piece of data to be sent, for gathering several into one transfer.
+ */
+typedef struct IoVec
+{
+	const void* data;
+	uint16_t length;
+} IoVec;
+
 #ifndef MAX_SOCK_NUM
 #define MAX_SOCK_NUM 8   // Select the number of Sockets (1-8)
 #endif
 
+#ifndef W5500_USE_DMA
+#define W5500_USE_DMA (0)  // Whether to move socket data with DMA.
+#endif
+
+#ifndef W5500_DMA_THRESHOLD
+#define W5500_DMA_THRESHOLD (64)  // Transfers shorter than this are not worth setting up DMA for.
+#endif
+
+#ifndef W5500_SPI_TIMEOUT
+#define W5500_SPI_TIMEOUT (100)  // Milliseconds allowed for one SPI transfer.
+#endif
+
 class SnMR {
 public:
 	static const uint8_t CLOSE  = 0x00;
@@ -114,9 +138,54 @@ class Ethernet
 {
 public:
 
+	/**
+	 * @brief	The socket registers that are needed together to send or receive, as read by read_socket_state().
+	 */
+	typedef struct SocketState
+	{
+		uint8_t mode;  /// Sn_MR.
+		uint8_t interrupt;  /// Sn_IR.
+		uint8_t status;  /// Sn_SR.
+		uint16_t tx_free;  /// Sn_TX_FSR.
+		uint16_t tx_read;  /// Sn_TX_RD.
+		uint16_t tx_write;  /// Sn_TX_WR.
+		uint16_t rx_received;  /// Sn_RX_RSR.
+		uint16_t rx_read;  /// Sn_RX_RD.
+	} SocketState;
+
+
+	/**
+	 * @brief	What the driver knows of a socket without reading it over SPI.
+	 *
+	 * Sn_TX_WR and Sn_RX_RD are moved only by this driver, so once read they are kept until a command other than SEND
+	 * or RECV resets them. Sn_TX_FSR and Sn_RX_RSR are only grown by the chip, so a value read, less what the driver
+	 * has used since, is a lower bound that saves reading them again while it is enough. Sn_SR changes only with a
+	 * command or a CON, DISCON or TIMEOUT event, so it is kept only for sockets whose events are tracked; see
+	 * track_status().
+	 */
+	typedef struct SocketShadow
+	{
+		uint16_t tx_write;  /// Sn_TX_WR, if known.
+		uint16_t rx_read;  /// Sn_RX_RD, if known.
+		uint16_t tx_free;  /// Sn_TX_FSR is at least this.
+		uint16_t rx_received;  /// Sn_RX_RSR is at least this.
+		uint8_t status;  /// Sn_SR, if known.
+		uint8_t known;  /// KNOWN_TX_WR and KNOWN_RX_RD.
+	} SocketShadow;
+
+	static const uint8_t KNOWN_TX_WR = 0x01;
+	static const uint8_t KNOWN_RX_RD = 0x02;
+
+
+	/**
+	 * Constructs an instance and resets the chip.
+	 * @param _spi The SPI peripheral. It is used by reference, so that DMA transfers see the live handle.
+	 * @param cs_port The port of the chip select pin.
+	 * @param cs_pin The chip select pin.
+	 */
 	Ethernet(SPI_HandleTypeDef & _spi, GPIO_TypeDef* cs_port, uint16_t cs_pin)
 	{
-		this->hspi = _spi;
+		this->hspi = &_spi;
 		this->cs_port = cs_port;
 		this->cs_pin = cs_pin;
 		writeMR(0x81); // software reset the W5500 chip
@@ -143,6 +212,225 @@ public:
 	}
 
 
+	/**
+	 * @brief	Copies data from an application buffer to a socket's transmit buffer in the chip.
+	 * @param	s The socket.
+	 * @param	dst The address in the transmit buffer, normally Sn_TX_WR.
+	 * @param	src The data.
+	 * @param	len The number of bytes.
+	 */
+	void write_data(SOCKET s, uint16_t dst, const void* src, uint16_t len)
+	{
+		write(dst, (0x14+(s<<5)), src, len);
+	}
+
+
+	/**
+	 * @brief	Copies several pieces of data to consecutive addresses of a socket's transmit buffer in one SPI frame.
+	 * @param	s The socket.
+	 * @param	dst The address in the transmit buffer of the first byte.
+	 * @param	iov The pieces.
+	 * @param	count The number of pieces.
+	 */
+	void write_data(SOCKET s, uint16_t dst, const IoVec* iov, uint8_t count)
+	{
+		begin_frame(dst, (0x14+(s<<5)));
+		for (uint8_t i=0; i < count; i++)
+			if (iov[i].length > 0)
+				spi_transmit(iov[i].data, iov[i].length);
+		deselect_ss();
+	}
+
+
+	/**
+	 * @brief	Reads the mode, interrupt, status and buffer pointer registers of a socket in one SPI frame.
+	 *
+	 * The registers from Sn_MR to Sn_RX_RD are read with a single variable-length burst, which costs less than the
+	 * three or four separate frames needed to read the ones of interest. Sn_TX_FSR and Sn_RX_RSR are not read twice
+	 * as get_tx_free_size() and get_rx_received_size() do: the high byte is read first and both only grow until this
+	 * driver moves the pointers, so a value read as the chip updates it is smaller than the truth, never larger.
+	 * @param	s The socket.
+	 * @param	state Receives the registers.
+	 */
+	void read_socket_state(SOCKET s, SocketState* state)
+	{
+		uint8_t buf[0x002A];
+		uint8_t epoch = status_epoch;
+		readSn(s, 0x0000, buf, sizeof(buf));
+		state->mode = buf[0x0000];
+		state->interrupt = buf[0x0002];
+		state->status = buf[0x0003];
+		state->tx_free = word16(buf + 0x0020);
+		state->tx_read = word16(buf + 0x0022);
+		state->tx_write = word16(buf + 0x0024);
+		state->rx_received = word16(buf + 0x0026);
+		state->rx_read = word16(buf + 0x0028);
+
+		SocketShadow* shadow = &shadows[s];
+		shadow->tx_write = state->tx_write;
+		shadow->rx_read = state->rx_read;
+		shadow->tx_free = state->tx_free;
+		shadow->rx_received = state->rx_received;
+		shadow->known = KNOWN_TX_WR | KNOWN_RX_RD;
+		remember_status(s, state->status, epoch);
+	}
+
+
+	/**
+	 * @brief	Gets the status (Sn_SR) of a socket, from the shadow if it is known.
+	 * @param	s The socket.
+	 * @returns	The status (SnSR::ESTABLISHED etc.).
+	 */
+	uint8_t get_status(SOCKET s)
+	{
+		if (status_known & (1 << s))
+			return shadows[s].status;
+		uint8_t epoch = status_epoch;
+		uint8_t status = readSnSR(s);
+		remember_status(s, status, epoch);
+		return status;
+	}
+
+
+	/**
+	 * @brief	Allows the status of a socket to be kept in the shadow. Only call this for a socket whose CON, DISCON
+	 *          and TIMEOUT events all cause forget_status() to be called, as SocketEvents does.
+	 * @param	s The socket.
+	 * @param	track True to keep the status; false to read it every time.
+	 */
+	void track_status(SOCKET s, bool track)
+	{
+		forget_status(1 << s);
+		if (track)
+			status_tracked |= 1 << s;
+		else
+			status_tracked &= ~(1 << s);
+	}
+
+
+	/**
+	 * @brief	Discards the shadowed status of sockets, so that it is read again when next needed. Safe to call from
+	 *          an interrupt handler.
+	 * @param	sockets A bit for each socket.
+	 */
+	void forget_status(uint8_t sockets)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		status_known &= ~sockets;
+		status_epoch++;
+		__set_PRIMASK(primask);
+	}
+
+
+	/**
+	 * @brief	Gets Sn_TX_WR of a socket, reading it only if it is not known.
+	 * @param	s The socket.
+	 * @returns	The transmit write pointer.
+	 */
+	uint16_t get_tx_write(SOCKET s)
+	{
+		SocketShadow* shadow = &shadows[s];
+		if (!(shadow->known & KNOWN_TX_WR))
+		{
+			shadow->tx_write = readSnTX_WR(s);
+			shadow->known |= KNOWN_TX_WR;
+		}
+		return shadow->tx_write;
+	}
+
+
+	/**
+	 * @brief	Sets Sn_TX_WR of a socket, which uses up that much of the known free space.
+	 * @param	s The socket.
+	 * @param	ptr The transmit write pointer.
+	 */
+	void set_tx_write(SOCKET s, uint16_t ptr)
+	{
+		SocketShadow* shadow = &shadows[s];
+		uint16_t used = ptr - shadow->tx_write;
+		shadow->tx_free = (shadow->known & KNOWN_TX_WR) && used <= shadow->tx_free ? shadow->tx_free - used : 0;
+		writeSnTX_WR(s, ptr);
+		shadow->tx_write = ptr;
+		shadow->known |= KNOWN_TX_WR;
+	}
+
+
+	/**
+	 * @brief	Gets Sn_RX_RD of a socket, reading it only if it is not known.
+	 * @param	s The socket.
+	 * @returns	The receive read pointer.
+	 */
+	uint16_t get_rx_read(SOCKET s)
+	{
+		SocketShadow* shadow = &shadows[s];
+		if (!(shadow->known & KNOWN_RX_RD))
+		{
+			shadow->rx_read = readSnRX_RD(s);
+			shadow->known |= KNOWN_RX_RD;
+		}
+		return shadow->rx_read;
+	}
+
+
+	/**
+	 * @brief	Sets Sn_RX_RD of a socket, which uses up that much of the known received data.
+	 * @param	s The socket.
+	 * @param	ptr The receive read pointer.
+	 */
+	void set_rx_read(SOCKET s, uint16_t ptr)
+	{
+		SocketShadow* shadow = &shadows[s];
+		uint16_t used = ptr - shadow->rx_read;
+		shadow->rx_received = (shadow->known & KNOWN_RX_RD) && used <= shadow->rx_received ?
+				shadow->rx_received - used : 0;
+		writeSnRX_RD(s, ptr);
+		shadow->rx_read = ptr;
+		shadow->known |= KNOWN_RX_RD;
+	}
+
+
+	/**
+	 * @brief	Gets the free space in a socket's transmit buffer, reading Sn_TX_FSR only if less than needed is known
+	 *          to be free. A single read is enough, for the reason given for read_socket_state().
+	 * @param	s The socket.
+	 * @param	needed The space needed.
+	 * @returns	At least this much is free; not less than needed unless that much is not free.
+	 */
+	uint16_t get_tx_free(SOCKET s, uint16_t needed)
+	{
+		SocketShadow* shadow = &shadows[s];
+		if (shadow->tx_free < needed)
+			shadow->tx_free = readSnTX_FSR(s);
+		return shadow->tx_free;
+	}
+
+
+	/**
+	 * @brief	Gets the number of bytes waiting in a socket's receive buffer, reading Sn_RX_RSR only if fewer than
+	 *          wanted are known to be waiting.
+	 * @param	s The socket.
+	 * @param	wanted The number of bytes wanted.
+	 * @returns	At least this many are waiting; not less than wanted unless fewer are waiting.
+	 */
+	uint16_t get_rx_received(SOCKET s, uint16_t wanted)
+	{
+		SocketShadow* shadow = &shadows[s];
+		if (shadow->rx_received < wanted)
+			shadow->rx_received = readSnRX_RSR(s);
+		return shadow->rx_received;
+	}
+
+
+	/**
+	 * @brief	Gets the number of SPI transactions (chip selects) made so far, for measuring the cost of operations.
+	 */
+	uint32_t get_transactions(void)
+	{
+		return transactions;
+	}
+
+
 	/**
 	 * @brief	 This function is being called by send() and sendto() function also.
 	 *
@@ -167,12 +455,11 @@ public:
 	 */
 	void send_data_processing_offset(SOCKET s, uint16_t data_offset, const void *data, uint16_t len)
 	{
-		uint16_t ptr = readSnTX_WR(s);
-		uint8_t cntl_byte = (0x14 + (s << 5));
+		uint16_t ptr = get_tx_write(s);
 		ptr += data_offset;
-		write(ptr, cntl_byte, data, len);
+		write_data(s, ptr, data, len);
 		ptr += len;
-		writeSnTX_WR(s, ptr);
+		set_tx_write(s, ptr);
 	}
 
 
@@ -185,12 +472,12 @@ public:
 	 */
 	void recv_data_processing(SOCKET s, void *data, uint16_t len, uint8_t peek=0)
 	{
-		uint16_t ptr = readSnRX_RD(s);
+		uint16_t ptr = get_rx_read(s);
 		read_data(s, ptr, (uint8_t*)data, len);
 		if (!peek)
 		{
 			ptr += len;
-			writeSnRX_RD(s, ptr);
+			set_rx_read(s, ptr);
 		}
 	}
 
@@ -209,15 +496,101 @@ public:
 	void set_retransmission_time(uint16_t timeout) { writeRTR(timeout); }
 	void set_retransmission_count(uint8_t retry)  { writeRCR(retry); }
 
+	void set_socket_interrupt_mask(uint8_t mask) { writeSIMR(mask); }
+	uint8_t get_socket_interrupts() { return readSIR(); }
+
 	void set_phy_config(uint8_t val) { writePHYCFGR(val); }
 	uint8_t get_phy_config() { return read(0x002E, 0x00); }
 
 
+	/**
+	 * @brief	Divides the buffer memory of the chip among the sockets.
+	 *
+	 * Each socket may have 0, 1, 2, 4, 8 or 16 KB to transmit and the same choice to receive, and the sizes in each
+	 * direction may add up to at most BUFFER_BUDGET_KB; a socket with no buffer cannot be opened. After a reset every
+	 * socket has 2 KB each way. The sockets should be closed when their sizes change, since data in them is lost.
+	 * @param	tx_kb The transmit buffer size of each of the eight sockets, in KB.
+	 * @param	rx_kb The receive buffer size of each of the eight sockets, in KB.
+	 * @returns	True if the sizes were set; false if a size is not allowed or a total is over budget, in which case
+	 *          nothing is changed.
+	 */
+	bool set_buffer_sizes(const uint8_t tx_kb[8], const uint8_t rx_kb[8])
+	{
+		uint8_t tx_total = 0, rx_total = 0;
+		for (SOCKET s=0; s < 8; s++)
+		{
+			if (!is_buffer_size(tx_kb[s]) || !is_buffer_size(rx_kb[s]))
+				return false;
+			tx_total += tx_kb[s];
+			rx_total += rx_kb[s];
+		}
+		if (tx_total > BUFFER_BUDGET_KB || rx_total > BUFFER_BUDGET_KB)
+			return false;
+
+		for (SOCKET s=0; s < 8; s++)
+		{
+			writeSnTXBUF_SIZE(s, tx_kb[s]);
+			writeSnRXBUF_SIZE(s, rx_kb[s]);
+			tx_buffer_kb[s] = tx_kb[s];
+			rx_buffer_kb[s] = rx_kb[s];
+			memset(&shadows[s], 0, sizeof(SocketShadow));
+		}
+		return true;
+	}
+
+
+	/**
+	 * @brief	Sets the buffer sizes of one socket, leaving the others as they are.
+	 * @param	s The socket.
+	 * @param	tx_kb The transmit buffer size in KB.
+	 * @param	rx_kb The receive buffer size in KB.
+	 * @returns	True if the sizes were set; false if a size is not allowed or does not fit beside the other sockets.
+	 */
+	bool set_buffer_size(SOCKET s, uint8_t tx_kb, uint8_t rx_kb)
+	{
+		uint8_t tx[8], rx[8];
+		memcpy(tx, tx_buffer_kb, sizeof(tx));
+		memcpy(rx, rx_buffer_kb, sizeof(rx));
+		tx[s] = tx_kb;
+		rx[s] = rx_kb;
+		return set_buffer_sizes(tx, rx);
+	}
+
+
+	/**
+	 * @brief	Gets the size of a socket's transmit buffer, which is the most that one SEND command can carry.
+	 * @param	s The socket.
+	 * @returns	The size in bytes.
+	 */
+	uint16_t get_tx_buffer_size(SOCKET s)
+	{
+		return tx_buffer_kb[s] * 1024;
+	}
+
+
+	/**
+	 * @brief	Gets the size of a socket's receive buffer.
+	 * @param	s The socket.
+	 * @returns	The size in bytes.
+	 */
+	uint16_t get_rx_buffer_size(SOCKET s)
+	{
+		return rx_buffer_kb[s] * 1024;
+	}
+
+
 	void execute_command(SOCKET s, SockCMD _cmd)
 	{
 		writeSnCR(s, _cmd);
 		// Wait for command to complete
 		while (readSnCR(s));
+
+		// Only SEND and RECV leave the pointers and status as they were.
+		if (_cmd != Sock_SEND && _cmd != Sock_SEND_MAC && _cmd != Sock_SEND_KEEP && _cmd != Sock_RECV)
+		{
+			memset(&shadows[s], 0, sizeof(SocketShadow));
+			forget_status(1 << s);
+		}
 	}
 
 
@@ -229,6 +602,7 @@ public:
 			if (val1 != 0)
 				val = readSnTX_FSR(s);
 		} while (val != val1);
+		shadows[s].tx_free = val;
 		return val;
 	}
 
@@ -241,142 +615,176 @@ public:
 			if (val1 != 0)
 				val = readSnRX_RSR(s);
 		} while (val != val1);
+		shadows[s].rx_received = val;
 		return val;
 	}
 
 
 private:
+	static bool is_buffer_size(uint8_t kb)
+	{
+		return kb == 0 || kb == 1 || kb == 2 || kb == 4 || kb == 8 || kb == 16;
+	}
+
+
 	/**
-	 * Sends 8-bit data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
-	 * @param data The data to send.
+	 * Keeps a status that was read, if the socket's status is tracked, no event has been seen since the read began,
+	 * and it is not one the chip leaves on its own without an event.
 	 */
-	void spi_transmit8(SPI_HandleTypeDef spi, uint8_t data)
+	void remember_status(SOCKET s, uint8_t status, uint8_t epoch)
 	{
-		spi_transmit_buf(spi, &data, 1);
+		if (!(status_tracked & (1 << s)))
+			return;
+		switch (status)
+		{
+			case SnSR::CLOSED:
+			case SnSR::INIT:
+			case SnSR::LISTEN:
+			case SnSR::ESTABLISHED:
+			case SnSR::CLOSE_WAIT:
+			case SnSR::UDP:
+			case SnSR::IPRAW:
+			case SnSR::MACRAW:
+				break;
+			default:
+				return;
+		}
+
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (epoch == status_epoch)
+		{
+			shadows[s].status = status;
+			status_known |= 1 << s;
+		}
+		__set_PRIMASK(primask);
 	}
 
 
 	/**
-	 * Sends 16-bit data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
+	 * Sends bytes over the SPI peripheral in one transfer, using DMA for long ones if W5500_USE_DMA is set.
 	 * @param data The data to send.
+	 * @param len The number of bytes.
 	 */
-	void spi_transmit16(SPI_HandleTypeDef spi, uint16_t data)
+	void spi_transmit(const void *data, uint16_t len)
 	{
-		spi_transmit8(spi, (uint8_t)((data >> 8) & 0xFF));
-		spi_transmit8(spi, (uint8_t)(data & 0xFF));
+#if W5500_USE_DMA
+		if (len >= W5500_DMA_THRESHOLD && HAL_SPI_Transmit_DMA(hspi, (uint8_t*)data, len) == HAL_OK)
+		{
+			wait_dma();
+			return;
+		}
+#endif
+		HAL_SPI_Transmit(hspi, (uint8_t*)data, len, W5500_SPI_TIMEOUT);
 	}
 
 
 	/**
-	 * Sends a buffer of bytes data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
-	 * @param data The data to send.
+	 * Receives bytes over the SPI peripheral in one transfer, using DMA for long ones if W5500_USE_DMA is set.
+	 * @param data Pointer to store the data.
+	 * @param len The number of bytes.
 	 */
-	void spi_transmit_buf(SPI_HandleTypeDef spi, const void *data, uint16_t len)
+	void spi_receive(uint8_t *data, uint16_t len)
 	{
-		for (int i = 0; i < len; i++)
-			HAL_SPI_Transmit(&spi, &(((uint8_t*)data)[i]), 1, 100);
+#if W5500_USE_DMA
+		if (len >= W5500_DMA_THRESHOLD && HAL_SPI_Receive_DMA(hspi, data, len) == HAL_OK)
+		{
+			wait_dma();
+			return;
+		}
+#endif
+		HAL_SPI_Receive(hspi, data, len, W5500_SPI_TIMEOUT);
 	}
 
 
+#if W5500_USE_DMA
 	/**
-	 * Receives 8-bit data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
-	 * @returns The received byte.
+	 * Waits for a DMA transfer to finish, or aborts it after W5500_SPI_TIMEOUT. The buffer must be in memory that
+	 * the DMA controller can reach (not CCM RAM on the F4).
 	 */
-	uint8_t spi_receive8(SPI_HandleTypeDef spi)
+	void wait_dma(void)
 	{
-		uint8_t data;
-		spi_receive_buf(spi, &data, 1);
-		return data;
+		uint32_t start = HAL_GetTick();
+		while (HAL_SPI_GetState(hspi) != HAL_SPI_STATE_READY)
+		{
+			if (HAL_GetTick() - start > W5500_SPI_TIMEOUT)
+			{
+				HAL_SPI_Abort(hspi);
+				return;
+			}
+		}
 	}
+#endif
 
 
 	/**
-	 * Receives 16-bit data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
-	 * @returns The received word.
+	 * Starts a frame: selects the chip and sends the address and control phases together.
+	 * @param _addr The offset address.
+	 * @param _cb The control byte (block select, read/write and mode).
 	 */
-	uint16_t spi_receive16(SPI_HandleTypeDef spi)
+	void begin_frame(uint16_t _addr, uint8_t _cb)
 	{
-		uint16_t dato_recibido;
-		dato_recibido = spi_receive8(spi) << 8;
-		dato_recibido |= spi_receive8(spi);
-		return dato_recibido;
+		uint8_t header[] = { (uint8_t)(_addr >> 8), (uint8_t)_addr, _cb };
+		select_ss();
+		spi_transmit(header, sizeof(header));
 	}
 
 
 	/**
-	 * Receives a buffer of bytes data over the SPI peripheral.
-	 * @param spi SPI peripheral handle.
-	 * @param data Pointer to store the data.
+	 * Gets a big-endian 16-bit value from a buffer.
 	 */
-	void spi_receive_buf(SPI_HandleTypeDef spi, uint8_t *data, uint16_t _len)
+	static uint16_t word16(const uint8_t* buf)
 	{
-		for(int i = 0; i < _len; i++)
-			HAL_SPI_Receive(&spi, &data[i], 1, 100);
+		return (uint16_t)(buf[0] << 8) | buf[1];
 	}
 
 
 	void write(uint16_t _addr, uint8_t _cb, uint8_t _data)
 	{
+		uint8_t frame[] = { (uint8_t)(_addr >> 8), (uint8_t)_addr, _cb, _data };
 		select_ss();
-		spi_transmit16(hspi, _addr);
-		spi_transmit16(hspi,(uint16_t) (_cb << 8) | _data);
+		spi_transmit(frame, sizeof(frame));
 		deselect_ss();
 	}
 
 
 	void write16(uint16_t _addr, uint8_t _cb, uint16_t _data)
 	{
+		uint8_t frame[] = { (uint8_t)(_addr >> 8), (uint8_t)_addr, _cb, (uint8_t)(_data >> 8), (uint8_t)_data };
 		select_ss();
-		spi_transmit16(hspi,_addr);
-		spi_transmit8(hspi, _cb);
-		spi_transmit16(hspi,_data);
+		spi_transmit(frame, sizeof(frame));
 		deselect_ss();
 	}
 
 
 	void write(uint16_t _addr, uint8_t _cb, const void *_buf, uint16_t _len)
 	{
-		select_ss();
-		spi_transmit16(hspi,_addr);
-		spi_transmit8(hspi, _cb);
-		spi_transmit_buf(hspi, (uint8_t *)_buf, _len);
+		begin_frame(_addr, _cb);
+		spi_transmit(_buf, _len);
 		deselect_ss();
 	}
 
 
 	uint8_t read(uint16_t _addr, uint8_t _cb)
 	{
-		select_ss();
-		spi_transmit16(hspi,_addr);
-		spi_transmit8(hspi, _cb);
-		uint8_t _data = spi_receive8(hspi);
-		deselect_ss();
+		uint8_t _data;
+		read(_addr, _cb, &_data, 1);
 		return _data;
 	}
 
 
 	uint16_t read16(uint16_t _addr, uint8_t _cb)
 	{
-		select_ss();
-		spi_transmit16(hspi,_addr);
-		spi_transmit8(hspi, _cb);
-		uint16_t _data = spi_receive16(hspi);
-		deselect_ss();
-		return _data;
+		uint8_t _data[2];
+		read(_addr, _cb, _data, 2);
+		return word16(_data);
 	}
 
 
 	uint16_t read(uint16_t _addr, uint8_t _cb, void* buf, uint16_t len)
 	{
-		select_ss();
-		spi_transmit16(hspi,_addr);
-		spi_transmit8(hspi, _cb);
-		spi_receive_buf(hspi, (uint8_t*)buf , len);
+		begin_frame(_addr, _cb);
+		spi_receive((uint8_t*)buf, len);
 		deselect_ss();
 		return len;
 	}
@@ -404,6 +812,8 @@ private:
 	__GP_REGISTER_N(SIPR,    0x000F, 4); // Source IP address
 	__GP_REGISTER8 (IR,      0x0015);    // Interrupt
 	__GP_REGISTER8 (IMR,     0x0016);    // Interrupt Mask
+	__GP_REGISTER8 (SIR,     0x0017);    // Socket Interrupt
+	__GP_REGISTER8 (SIMR,    0x0018);    // Socket Interrupt Mask
 	__GP_REGISTER16(RTR,     0x0019);    // Timeout address
 	__GP_REGISTER8 (RCR,     0x001B);    // Retry count
 	__GP_REGISTER8 (PTIMER,  0x001C);    // PPP LCP Request Timer
@@ -453,27 +863,39 @@ public:
 	__SOCKET_REGISTER8(SnPROTO,     0x0014)        // Protocol in IP RAW Mode
 	__SOCKET_REGISTER8(SnTOS,       0x0015)        // IP TOS
 	__SOCKET_REGISTER8(SnTTL,       0x0016)        // IP TTL
+	__SOCKET_REGISTER8(SnRXBUF_SIZE, 0x001E)       // Receive Buffer Size (KB)
+	__SOCKET_REGISTER8(SnTXBUF_SIZE, 0x001F)       // Transmit Buffer Size (KB)
 	__SOCKET_REGISTER16(SnTX_FSR,   0x0020)        // TX Free Size
 	__SOCKET_REGISTER16(SnTX_RD,    0x0022)        // TX Read Pointer
 	__SOCKET_REGISTER16(SnTX_WR,    0x0024)        // TX Write Pointer
 	__SOCKET_REGISTER16(SnRX_RSR,   0x0026)        // RX Free Size
 	__SOCKET_REGISTER16(SnRX_RD,    0x0028)        // RX Read Pointer
 	__SOCKET_REGISTER16(SnRX_WR,    0x002A)        // RX Write Pointer (supported?)
+	__SOCKET_REGISTER8(SnIMR,       0x002C)        // Interrupt Mask
 
 #undef __SOCKET_REGISTER8
 #undef __SOCKET_REGISTER16
 #undef __SOCKET_REGISTER_N
 
 public:
-	static const uint16_t SSIZE = 2048; // Max Tx buffer size
+	static const uint16_t SSIZE = 2048; // Tx buffer size of each socket after a reset.
+	static const uint8_t BUFFER_BUDGET_KB = 16; // Buffer memory for each direction, shared by all sockets.
 
 private:
-	SPI_HandleTypeDef hspi;
+	SPI_HandleTypeDef* hspi;
 	GPIO_TypeDef* cs_port;
 	uint16_t cs_pin;
+	uint8_t tx_buffer_kb[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	uint8_t rx_buffer_kb[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	SocketShadow shadows[8] = {};
+	uint8_t status_tracked = 0;
+	volatile uint8_t status_known = 0;
+	volatile uint8_t status_epoch = 0;
+	uint32_t transactions = 0;
 
 	void select_ss()
 	{
+		transactions++;
 		HAL_GPIO_WritePin(cs_port, cs_pin, GPIO_PIN_RESET);
 	}
 
@@ -3,6 +3,7 @@
 
 #include <comms/tcpip/IPv4Address.h>
 #include "Ethernet.h"
+#include "SocketEvents.h"
 #include "TcpIp.h"
 #include "utility/Timer.h"
 #include <memory.h>
@@ -14,6 +15,26 @@
 class Socket : public TcpIp
 {
 public:
+	/**
+	 * @brief	The number of calls of one kind of operation and the SPI transactions they made.
+	 */
+	typedef struct OpCount
+	{
+		uint32_t calls;
+		uint32_t transactions;
+	} OpCount;
+
+	/**
+	 * @brief	SPI transactions made by this socket, by operation.
+	 */
+	typedef struct Counters
+	{
+		OpCount send;  /// send(), and packets sent with end_packet().
+		OpCount recv;  /// recv() and recvfrom().
+		OpCount status;  /// status().
+	} Counters;
+
+
 	Socket(Ethernet* w5500) : TcpIp(w5500)
 	{
 		this->w5500 = w5500;
@@ -38,9 +59,12 @@ public:
 			default:
 				return false;
 		}
-		w5500->writeSnMR(socket_no, mode | flag);
+		this->mode = mode | flag;
+		w5500->writeSnMR(socket_no, this->mode);
 		w5500->writeSnPORT(socket_no, port);
 		w5500->execute_command(socket_no, Sock_OPEN);
+		if (events != nullptr)
+			events->enable(socket_no);
 		return true;
 	}
 
@@ -64,9 +88,12 @@ public:
 			default:
 				return false;
 		}
+		this->mode = mode;
 		w5500->writeSnMR(socket_no, mode);
 		w5500->writeSnPROTO(socket_no, protocol);
 		w5500->execute_command(socket_no, Sock_OPEN);
+		if (events != nullptr)
+			events->enable(socket_no);
 		return true;
 	}
 
@@ -79,6 +106,8 @@ public:
 		sending = false;
 		w5500->execute_command(socket_no, Sock_CLOSE);
 		w5500->writeSnIR(socket_no, 0xFF);
+		if (events != nullptr)
+			events->clear(socket_no);
 		reservations[socket_no] = false;
 	}
 
@@ -89,7 +118,7 @@ public:
 	 */
 	bool listen(void)
 	{
-		if (w5500->readSnSR(socket_no) != SnSR::INIT)
+		if (w5500->get_status(socket_no) != SnSR::INIT)
 			return false;
 		w5500->execute_command(socket_no, Sock_LISTEN);
 		return true;
@@ -127,56 +156,31 @@ public:
 	 */
 	uint16_t send(const void* buf, uint16_t len)
 	{
+		Meter meter(w5500, &counters.send);
 		uint16_t ret = 0;
 		while (ret < len)
 		{
-			if (sending)
-			{
-				sending = false;
-				while (!(w5500->readSnIR(socket_no) & SnIR::SEND_OK))
-				{
-					uint8_t snSR = w5500->readSnSR(socket_no);
-					if((snSR != SnSR::ESTABLISHED) && (snSR != SnSR::CLOSE_WAIT))
-					{
-						close();
-						return 0;
-					}
-					if (w5500->readSnIR(socket_no) & SnIR::TIMEOUT)
-					{
-						w5500->writeSnIR(socket_no, (SnIR::SEND_OK | SnIR::TIMEOUT)); /* clear SEND_OK & TIMEOUT */
-						close();
-						return 0;
-					}
-				}
-				w5500->writeSnIR(socket_no, SnIR::SEND_OK);
-			}
+			if (!wait_sent())
+				return 0;
 
 			uint16_t trx = len - ret;
-			if (trx > w5500->SSIZE)
-				trx = w5500->SSIZE; // check size not to exceed MAX size.
+			if (trx > w5500->get_tx_buffer_size(socket_no))
+				trx = w5500->get_tx_buffer_size(socket_no); // check size not to exceed MAX size.
 
-			// Wait for data in the send buffer to be sent.
-			while (w5500->get_tx_free_size(socket_no) < trx)
-			{
-				uint8_t status = w5500->readSnSR(socket_no);
-				if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT))
-				{
-					// The connection has been closed. Give up.
-					close();
-					return 0;
-				}
-			}
+			if (!wait_free(trx))
+				return 0;
 
 			// copy data
 			if (is_buffered)
 			{
-				w5500->send_data_processing_offset(socket_no, buffer_offset, (uint8_t*)buf, trx);
-				buffer_offset += trx;
+				w5500->send_data_processing(socket_no, (uint8_t*)buf+ret, trx);
 				ret += trx;
 			}
 			else
 			{
-				w5500->send_data_processing(socket_no, (uint8_t*)buf+ret, trx);
+				uint16_t ptr = w5500->get_tx_write(socket_no);
+				w5500->write_data(socket_no, ptr, (uint8_t*)buf+ret, trx);
+				w5500->set_tx_write(socket_no, ptr + trx);
 				w5500->execute_command(socket_no, Sock_SEND);
 				sending = true;
 				ret += trx;
@@ -186,6 +190,137 @@ public:
 	}
 
 
+	/**
+	 * @brief	Sends several pieces of data as one packet: they are written to the transmit buffer in a single SPI
+	 *          burst and sent with one SEND command.
+	 * @param	iov The pieces.
+	 * @param	count The number of pieces.
+	 * @return	The number of bytes sent, or 0 if they do not fit in the transmit buffer or the connection closed.
+	 */
+	uint16_t sendv(const IoVec* iov, uint8_t count)
+	{
+		uint32_t total = 0;
+		for (uint8_t i=0; i < count; i++)
+			total += iov[i].length;
+		if (total > w5500->get_tx_buffer_size(socket_no) || !begin_packet(total))
+			return 0;
+		append(iov, count);
+		return end_packet();
+	}
+
+
+	/**
+	 * @brief	Starts a packet that is assembled in the transmit buffer of the chip, so that fields such as lengths can
+	 *          be reserved with reserve(), filled in with fill() when known, and nothing is copied in between.
+	 * @param	capacity The most bytes the packet will hold. Waits until this much of the transmit buffer is free.
+	 * @return	True if the packet was started; false if the capacity is too large or the connection closed.
+	 */
+	bool begin_packet(uint16_t capacity)
+	{
+		packet_transactions = w5500->get_transactions();
+		packet_open = false;
+		if (capacity > w5500->get_tx_buffer_size(socket_no) || !wait_sent() || !wait_free(capacity))
+			return false;
+		packet_start = w5500->get_tx_write(socket_no);
+		packet_length = 0;
+		packet_capacity = capacity;
+		packet_open = true;
+		return true;
+	}
+
+
+	/**
+	 * @brief	Reserves space in the packet for a field to be filled in later.
+	 * @param	length The size of the field.
+	 * @return	The offset of the field in the packet, for fill(); or -1 if no packet is open or the field would exceed
+	 *          the capacity given to begin_packet().
+	 */
+	int32_t reserve(uint16_t length)
+	{
+		if (!packet_open || (uint32_t) packet_length + length > packet_capacity)
+			return -1;
+		uint16_t offset = packet_length;
+		packet_length += length;
+		return offset;
+	}
+
+
+	/**
+	 * @brief	Adds data to the packet.
+	 * @param	data The data.
+	 * @param	length The number of bytes.
+	 * @return	True if added; false if no packet is open or it would exceed the capacity given to begin_packet().
+	 */
+	bool append(const void* data, uint16_t length)
+	{
+		IoVec iov = { data, length };
+		return append(&iov, 1);
+	}
+
+
+	/**
+	 * @brief	Adds several pieces of data to the packet in a single SPI burst.
+	 * @param	iov The pieces.
+	 * @param	count The number of pieces.
+	 * @return	True if added; false if no packet is open or they would exceed the capacity given to begin_packet().
+	 */
+	bool append(const IoVec* iov, uint8_t count)
+	{
+		uint32_t total = packet_length;
+		for (uint8_t i=0; i < count; i++)
+			total += iov[i].length;
+		if (!packet_open || total > packet_capacity)
+			return false;
+		w5500->write_data(socket_no, packet_start + packet_length, iov, count);
+		packet_length = total;
+		return true;
+	}
+
+
+	/**
+	 * @brief	Fills in a field reserved with reserve().
+	 * @param	offset The offset returned by reserve().
+	 * @param	data The value.
+	 * @param	length The number of bytes.
+	 * @return	True if filled in; false if no packet is open or the bytes are not all within the packet so far.
+	 */
+	bool fill(uint16_t offset, const void* data, uint16_t length)
+	{
+		if (!packet_open || (uint32_t) offset + length > packet_length)
+			return false;
+		w5500->write_data(socket_no, packet_start + offset, data, length);
+		return true;
+	}
+
+
+	/**
+	 * @brief	Gets the number of bytes in the packet so far, including reserved fields.
+	 */
+	uint16_t get_packet_length(void)
+	{
+		return packet_length;
+	}
+
+
+	/**
+	 * @brief	Sends the packet started with begin_packet().
+	 * @return	The number of bytes sent, or 0 if no packet is open.
+	 */
+	uint16_t end_packet(void)
+	{
+		if (!packet_open)
+			return 0;
+		w5500->set_tx_write(socket_no, packet_start + packet_length);
+		w5500->execute_command(socket_no, Sock_SEND);
+		sending = true;
+		packet_open = false;
+		packet_capacity = 0;
+		counters.send.calls++;
+		counters.send.transactions += w5500->get_transactions() - packet_transactions;
+		return packet_length;
+	}
+
+
 	/**
 	 * @brief	This function is an application I/F function which is used to receive the data in TCP mode.
 	 * 		It continues to wait for data as much as the application wants to receive.
@@ -194,12 +329,13 @@ public:
 	 */
 	int16_t recv(void *buf, int16_t len)
 	{
+		Meter meter(w5500, &counters.recv);
 		// Check how much data is available
-		int16_t ret = w5500->get_rx_received_size(socket_no);
+		int16_t ret = w5500->get_rx_received(socket_no, len > 0 ? len : 1);
 		if (ret == 0)
 		{
 			// No data available.
-			uint8_t status = w5500->readSnSR(socket_no);
+			uint8_t status = w5500->get_status(socket_no);
 			if (status == SnSR::LISTEN || status == SnSR::CLOSED || status == SnSR::CLOSE_WAIT)
 			{
 				// The remote end has closed its side of the connection, so this is the eof state
@@ -218,7 +354,9 @@ public:
 
 		if (ret > 0)
 		{
-			w5500->recv_data_processing(socket_no, buf, ret);
+			uint16_t ptr = w5500->get_rx_read(socket_no);
+			w5500->read_data(socket_no, ptr, buf, ret);
+			w5500->set_rx_read(socket_no, ptr + ret);
 			w5500->execute_command(socket_no, Sock_RECV);
 		}
 		return ret;
@@ -233,7 +371,8 @@ public:
 	 */
 	uint16_t sendto(const void *buf, uint16_t len, uint8_t *addr, uint16_t port)
 	{
-		if (len > w5500->SSIZE) len = w5500->SSIZE; // check size not to exceed MAX size.
+		if (len > w5500->get_tx_buffer_size(socket_no))
+			len = w5500->get_tx_buffer_size(socket_no); // check size not to exceed MAX size.
 
 		assert(*((uint32_t*)addr) != 0);
 		assert(len != 0);
@@ -252,14 +391,15 @@ public:
 	 */
 	uint16_t recvfrom(void *buf, uint16_t len, uint8_t *addr, uint16_t *port)
 	{
+		Meter meter(w5500, &counters.recv);
 		uint8_t head[8];
 		uint16_t data_len = 0;
-		int16_t ret = w5500->get_rx_received_size(socket_no);
+		int16_t ret = w5500->get_rx_received(socket_no, 1);
 
 		if (ret > 0)
 		{
-			uint16_t ptr = w5500->readSnRX_RD(socket_no);
-			switch (w5500->readSnMR(socket_no) & 0x07)
+			uint16_t ptr = w5500->get_rx_read(socket_no);
+			switch (mode & 0x07)
 			{
 			case SnMR::UDP:
 				w5500->read_data(socket_no, ptr, head, 0x08);
@@ -269,10 +409,12 @@ public:
 				*port = (uint16_t)(head[4]<<8) | head[5];
 				data_len = (uint16_t)(head[6]<<8) | head[7];
 
-				w5500->read_data(socket_no, ptr, buf, data_len); // data copy.
+				// Whatever does not fit is discarded, so that the next datagram is found.
+				w5500->read_data(socket_no, ptr, buf, data_len < len ? data_len : len); // data copy.
 				ptr += data_len;
+				if (data_len > len) data_len = len;
 
-				w5500->writeSnRX_RD(socket_no, ptr);
+				w5500->set_rx_read(socket_no, ptr);
 				break;
 
 			case SnMR::IPRAW:
@@ -286,7 +428,7 @@ public:
 				w5500->read_data(socket_no, ptr, buf, data_len); // data copy.
 				ptr += data_len;
 
-				w5500->writeSnRX_RD(socket_no, ptr);
+				w5500->set_rx_read(socket_no, ptr);
 				break;
 
 			case SnMR::MACRAW:
@@ -296,7 +438,7 @@ public:
 
 				w5500->read_data(socket_no, ptr, buf, data_len);
 				ptr += data_len;
-				w5500->writeSnRX_RD(socket_no, ptr);
+				w5500->set_rx_read(socket_no, ptr);
 				break;
 
 			default :
@@ -312,7 +454,6 @@ public:
 	 */
 	void flush(void)
 	{
-		buffer_offset = 0;
 		send_udp();
 		//w5500->execute_command(socket_no, Sock_SEND);
 	}
@@ -321,8 +462,8 @@ public:
 	{
 		uint16_t ret=0;
 
-		if (len > w5500->SSIZE)
-			ret = w5500->SSIZE; // check size not to exceed MAX size.
+		if (len > w5500->get_tx_buffer_size(socket_no))
+			ret = w5500->get_tx_buffer_size(socket_no); // check size not to exceed MAX size.
 		else
 			ret = len;
 
@@ -332,6 +473,14 @@ public:
 		w5500->send_data_processing(socket_no, (uint8_t *)buf, ret);
 		w5500->execute_command(socket_no, Sock_SEND);
 
+		if (events != nullptr)
+		{
+			if (events->wait(socket_no, SnIR::SEND_OK | SnIR::TIMEOUT) & SnIR::SEND_OK)
+				return ret;
+			close();
+			return 0;
+		}
+
 		while ( !(w5500->readSnIR(socket_no) & SnIR::SEND_OK) )
 		{
 			if (w5500->readSnIR(socket_no) & SnIR::TIMEOUT)
@@ -356,13 +505,9 @@ public:
 	 */
 	uint16_t bufferData(const void* buf, uint16_t len)
 	{
-		uint16_t ret = 0;
-		if (len > w5500->get_tx_free_size(socket_no))
-			ret = w5500->get_tx_free_size(socket_no); // check size not to exceed MAX size.
-		else
-			ret = len;
-		w5500->send_data_processing_offset(socket_no, buffer_offset, buf, ret);
-		buffer_offset += ret;
+		uint16_t free = w5500->get_tx_free(socket_no, len);
+		uint16_t ret = len > free ? free : len; // check size not to exceed MAX size.
+		w5500->send_data_processing(socket_no, buf, ret);  // Each call moves Sn_TX_WR on past what it wrote.
 		return ret;
 	}
 
@@ -376,7 +521,6 @@ public:
 	{
 		assert (!addr.is_empty());
 		assert (port != 0);
-		buffer_offset = 0;
 
 		w5500->writeSnDIPR(socket_no, addr.raw_address());
 		w5500->writeSnDPORT(socket_no, port);
@@ -391,6 +535,9 @@ public:
 	{
 		w5500->execute_command(socket_no, Sock_SEND);
 
+		if (events != nullptr)
+			return events->wait(socket_no, SnIR::SEND_OK | SnIR::TIMEOUT) & SnIR::SEND_OK;
+
 		while (!(w5500->readSnIR(socket_no) & SnIR::SEND_OK))
 		{
 			if (w5500->readSnIR(socket_no) & SnIR::TIMEOUT)
@@ -415,7 +562,10 @@ public:
 
 	uint8_t status(void)
 	{
-		return w5500->readSnSR(socket_no);
+		Meter meter(w5500, &counters.status);
+		if (events != nullptr)
+			events->service();
+		return w5500->get_status(socket_no);
 	}
 
 	int16_t available(void)
@@ -445,40 +595,240 @@ public:
 		is_buffered = value;
 	}
 
+
+	/**
+	 * @brief	Sets the smallest buffers this socket can work with, for when the buffer memory has been divided unevenly
+	 *          with Ethernet::set_buffer_sizes(). Call before open().
+	 * @param	tx_size The smallest transmit buffer in bytes.
+	 * @param	rx_size The smallest receive buffer in bytes.
+	 */
+	void set_buffer_needs(uint16_t tx_size, uint16_t rx_size)
+	{
+		tx_needed = tx_size > 0 ? tx_size : 1;
+		rx_needed = rx_size > 0 ? rx_size : 1;
+	}
+
+
+	/**
+	 * @brief	Delivers this socket's events through the INTn interrupt instead of polling Sn_IR. Call before open().
+	 * @param	events The event dispatcher, or nullptr to poll.
+	 */
+	void set_events(SocketEvents* events)
+	{
+		this->events = events;
+	}
+
+
+	/**
+	 * @brief	Waits for socket events. Without a SocketEvents, returns 0 at once so that the caller polls instead.
+	 * @param	events The Sn_IR bits of interest (SnIR::CON etc.).
+	 * @param	timeout The maximum time to wait in milliseconds, or W5500_WAIT_FOREVER.
+	 * @returns	The bits of interest that occurred, or 0.
+	 */
+	uint8_t wait(uint8_t events, uint32_t timeout)
+	{
+		if (this->events == nullptr)
+			return 0;
+		return this->events->wait(socket_no, events, timeout);
+	}
+
+
+	/**
+	 * @brief	Gets the number of the chip socket in use, valid after open().
+	 */
+	SOCKET get_socket(void)
+	{
+		return socket_no;
+	}
+
+
+	/**
+	 * @brief	Gets the size of the receive buffer of the chip socket in use, valid after open().
+	 */
+	uint16_t get_rx_buffer_size(void)
+	{
+		return w5500->get_rx_buffer_size(socket_no);
+	}
+
+
+	/**
+	 * @brief	Determines whether a SEND command has been issued whose completion has not yet been seen.
+	 * @returns	True if the next send will first wait for SEND_OK; otherwise false.
+	 */
+	bool is_sending(void)
+	{
+		return sending;
+	}
+
+
+	/**
+	 * @brief	Notes that the previous SEND command has completed, for a caller that has seen and cleared SEND_OK in
+	 *          Sn_IR itself, as SocketPoll does.
+	 */
+	void set_sent(void)
+	{
+		sending = false;
+	}
+
+
+	/**
+	 * @brief	Gets the SPI transactions made by this socket, by operation.
+	 * @returns	Pointer to the counts.
+	 */
+	Counters* get_counters(void)
+	{
+		return &counters;
+	}
+
 private:
 	/**
-	 * @brief Selects an available socket.
+	 * Adds the SPI transactions made during its lifetime to an OpCount.
+	 */
+	class Meter
+	{
+	public:
+		Meter(Ethernet* w5500, OpCount* count)
+		{
+			this->w5500 = w5500;
+			this->count = count;
+			start = w5500->get_transactions();
+		}
+
+		~Meter()
+		{
+			count->calls++;
+			count->transactions += w5500->get_transactions() - start;
+		}
+
+	private:
+		Ethernet* w5500;
+		OpCount* count;
+		uint32_t start;
+	};
+
+
+	/**
+	 * @brief Waits for the previous SEND command to complete.
+	 * @returns True when it has; false if the connection closed, in which case the socket is closed.
+	 */
+	bool wait_sent(void)
+	{
+		if (!sending)
+			return true;
+		sending = false;
+
+		if (events != nullptr)
+		{
+			for (;;)
+			{
+				uint8_t ir = events->wait(socket_no, SnIR::SEND_OK | SnIR::TIMEOUT | SnIR::DISCON);
+				if (ir & SnIR::SEND_OK)
+					return true;
+				// A FIN from the peer still allows sending in CLOSE_WAIT.
+				uint8_t snSR = w5500->get_status(socket_no);
+				if ((ir & SnIR::TIMEOUT) || ((snSR != SnSR::ESTABLISHED) && (snSR != SnSR::CLOSE_WAIT)))
+				{
+					close();
+					return false;
+				}
+			}
+		}
+
+		while (!(w5500->readSnIR(socket_no) & SnIR::SEND_OK))
+		{
+			uint8_t snSR = w5500->get_status(socket_no);
+			if((snSR != SnSR::ESTABLISHED) && (snSR != SnSR::CLOSE_WAIT))
+			{
+				close();
+				return false;
+			}
+			if (w5500->readSnIR(socket_no) & SnIR::TIMEOUT)
+			{
+				w5500->writeSnIR(socket_no, (SnIR::SEND_OK | SnIR::TIMEOUT)); /* clear SEND_OK & TIMEOUT */
+				close();
+				return false;
+			}
+		}
+		w5500->writeSnIR(socket_no, SnIR::SEND_OK);
+		return true;
+	}
+
+
+	/**
+	 * @brief Waits for space in the transmit buffer, as data already sent is acknowledged.
+	 * @param len The space needed.
+	 * @returns True when there is space; false if the connection closed, in which case the socket is closed.
+	 */
+	bool wait_free(uint16_t len)
+	{
+		while (w5500->get_tx_free(socket_no, len) < len)
+		{
+			uint8_t status = w5500->get_status(socket_no);
+			if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT))
+			{
+				// The connection has been closed. Give up.
+				close();
+				return false;
+			}
+			wait(SnIR::DISCON | SnIR::TIMEOUT, 1);  // Space frees as the peer acknowledges; check each tick.
+		}
+		return true;
+	}
+
+
+	/**
+	 * @brief Selects an available socket. Of those whose buffers are at least the sizes given to set_buffer_needs(),
+	 *        the one with the smallest buffers is taken, so that larger ones stay free for sockets that need them.
 	 * @returns True if a socket is available; otherwise false.
 	 */
 	bool get_available_socket(void)
 	{
 		// MAX_SOCK_NUM is invalid, so if it is the result, we failed.
-		uint8_t statuses[MAX_SOCK_NUM];
+		SOCKET best = MAX_SOCK_NUM;
+		uint32_t best_size = UINT32_MAX;
 		for (uint8_t i = 0; i < MAX_SOCK_NUM; i++)
 		{
 			if (reservations[i])
 				continue;
 
-			socket_no = i;
-			uint8_t s = status();
-			statuses[i] = s;
+			uint16_t tx_size = w5500->get_tx_buffer_size(i);
+			uint16_t rx_size = w5500->get_rx_buffer_size(i);
+			uint32_t size = tx_size + rx_size;
+			if (tx_size == 0 || rx_size == 0 || tx_size < tx_needed || rx_size < rx_needed || size >= best_size)
+				continue;
+
+			uint8_t s = w5500->get_status(i);
 			if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT)
 			{
-				reservations[socket_no] = true;
-				return true;
+				best = i;
+				best_size = size;
 			}
 		}
 
-		assert (false);
+		assert (best != MAX_SOCK_NUM);
+		if (best == MAX_SOCK_NUM)
+			return false;
+		socket_no = best;
+		reservations[socket_no] = true;
+		return true;
 	}
 
 
 	Ethernet* w5500;
+	SocketEvents* events = nullptr;
 	uint8_t socket_no;
 	inline static uint16_t local_port = 0;
 	bool sending = false;
 	bool is_buffered = false;
-	uint16_t buffer_offset = 0;
+	uint16_t packet_start = 0;  /// Sn_TX_WR when begin_packet() was called.
+	uint16_t packet_length = 0;
+	uint16_t packet_capacity = 0;
+	bool packet_open = false;  /// Between a successful begin_packet() and end_packet().
+	uint32_t packet_transactions = 0;  /// The transaction count when begin_packet() was called.
+	uint8_t mode = SnMR::CLOSE;  /// Sn_MR as set by open().
+	Counters counters = {};
+	uint16_t tx_needed = 1;
+	uint16_t rx_needed = 1;
 	static inline bool reservations[8] = {0};
 };
 
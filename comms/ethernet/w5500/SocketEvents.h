@@ -0,0 +1,401 @@
+/**
+ * \file       comms/ethernet/w5500/SocketEvents.h
+ * \class      SocketEvents
+ * \brief      Delivers W5500 socket events from the INTn pin, so that sockets wait without polling over SPI.
+ * \notes	   Configure the pin wired to INTn as an external interrupt on the falling edge, and call on_interrupt()
+ *             from HAL_GPIO_EXTI_Callback().
+ */
+
+#ifndef INC_COMMS_ETHERNET_W5500_SOCKETEVENTS_H_
+#define INC_COMMS_ETHERNET_W5500_SOCKETEVENTS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "Ethernet.h"
+
+#ifndef W5500_EVENTS_THREAD_FLAG
+#define W5500_EVENTS_THREAD_FLAG (0x10)
+#endif
+
+#define W5500_WAIT_FOREVER (0xffffffff)
+
+
+/**
+ * Collects the socket interrupts of a W5500 and passes each one to the owner of that socket only.
+ *
+ * The interrupt handler does no SPI: it only notes that INTn fell. dispatch() then reads SIR to find the sockets that
+ * need attention, reads and clears their Sn_IR, and latches the events until the owner takes them with wait() or
+ * take(), optionally calling an IHandler as well. Because Sn_IR is cleared here, a socket that uses SocketEvents must
+ * not also poll Sn_IR itself; Socket takes care of this when it is given a SocketEvents with Socket::set_events().
+ *
+ * Without an RTOS, wait() calls dispatch() itself and otherwise spins on a flag in RAM. With an RTOS, a thread can be
+ * made the dispatcher with set_dispatcher_thread() and run(); waiting threads then sleep until the dispatcher sets
+ * W5500_EVENTS_THREAD_FLAG on the thread that owns a socket with new events.
+ */
+class SocketEvents
+{
+public:
+	/**
+	 * Receives the events of one socket. Called by dispatch(), in thread context.
+	 */
+	class IHandler
+	{
+	public:
+		/**
+		 * Called when a socket has events.
+		 * @param s The socket.
+		 * @param events The Sn_IR bits (SnIR::CON etc.).
+		 */
+		virtual void on_socket_event(SOCKET s, uint8_t events) = 0;
+	};
+
+	/**
+	 * @brief	Event counts for one socket.
+	 */
+	typedef struct Counters
+	{
+		uint32_t connected;  /// CON events.
+		uint32_t disconnected;  /// DISCON events.
+		uint32_t received;  /// RECV events.
+		uint32_t timeouts;  /// TIMEOUT events.
+		uint32_t sent;  /// SEND_OK events.
+		uint32_t reads;  /// Reads of Sn_IR by dispatch().
+		uint32_t wakeups;  /// Calls to wait() that returned events.
+	} Counters;
+
+	static constexpr uint8_t AllEvents = SnIR::CON | SnIR::DISCON | SnIR::RECV | SnIR::TIMEOUT | SnIR::SEND_OK;
+	static constexpr uint8_t StatusEvents = SnIR::CON | SnIR::DISCON | SnIR::TIMEOUT;  /// The events that change Sn_SR.
+
+
+	/**
+	 * Constructs an instance.
+	 * @param w5500 The chip.
+	 */
+	SocketEvents(Ethernet* w5500)
+	{
+		this->w5500 = w5500;
+	}
+
+
+	/**
+	 * Enables the interrupts of a socket and discards any events it has latched. If they include StatusEvents, the
+	 * chip driver is allowed to keep the socket's status instead of reading it each time.
+	 * @param s The socket.
+	 * @param events The Sn_IR bits that raise an interrupt.
+	 */
+	void enable(SOCKET s, uint8_t events=AllEvents)
+	{
+		w5500->track_status(s, (events & StatusEvents) == StatusEvents);
+		w5500->writeSnIMR(s, events);
+		w5500->writeSnIR(s, 0xff);
+		clear(s);
+		mask |= 1 << s;
+		w5500->set_socket_interrupt_mask(mask);
+		pending = true;  // In case INTn is already low.
+	}
+
+
+	/**
+	 * Disables the interrupts of a socket.
+	 * @param s The socket.
+	 */
+	void disable(SOCKET s)
+	{
+		mask &= ~(1 << s);
+		w5500->set_socket_interrupt_mask(mask);
+		w5500->track_status(s, false);
+		clear(s);
+	}
+
+
+	/**
+	 * Determines whether a socket's interrupts are enabled.
+	 * @param s The socket.
+	 * @returns True if enabled; otherwise false.
+	 */
+	bool is_enabled(SOCKET s)
+	{
+		return mask & (1 << s);
+	}
+
+
+	/**
+	 * Notes that INTn fell. Call from HAL_GPIO_EXTI_Callback().
+	 */
+	void on_interrupt(void)
+	{
+		pending = true;
+		interrupts++;
+		w5500->forget_status(mask);  // Which socket changed is not known until dispatch() reads SIR.
+#if USING_FREERTOS
+		if (dispatcher != nullptr)
+			osThreadFlagsSet(dispatcher, dispatcher_flag);
+#endif
+	}
+
+
+	/**
+	 * Reads and clears the interrupts of the sockets that have any, latches them for their owners, and wakes the
+	 * owners. Does nothing unless INTn has fallen since the last call.
+	 */
+	void dispatch(void)
+	{
+		if (!pending)
+			return;
+		pending = false;
+
+		// INTn stays low while any enabled interrupt is set, so no edge is seen for events that arrive before the
+		// last one is cleared. Keep going until SIR reads zero.
+		for (uint8_t sir = w5500->get_socket_interrupts() & mask; sir != 0;
+				sir = w5500->get_socket_interrupts() & mask)
+		{
+			for (SOCKET s=0; s < MAX_SOCK_NUM; s++)
+			{
+				if (!(sir & (1 << s)))
+					continue;
+				uint8_t ir = w5500->readSnIR(s);
+				counters[s].reads++;
+				if (ir == 0)
+					continue;
+				w5500->writeSnIR(s, ir);
+				if (ir & StatusEvents)
+					w5500->forget_status(1 << s);
+				count(s, ir);
+
+				uint32_t primask = __get_PRIMASK();
+				__disable_irq();
+				latched[s] |= ir;
+				__set_PRIMASK(primask);
+
+				if (handlers[s] != nullptr)
+					handlers[s]->on_socket_event(s, ir);
+#if USING_FREERTOS
+				if (owners[s] != nullptr)
+					osThreadFlagsSet(owners[s], W5500_EVENTS_THREAD_FLAG);
+#endif
+			}
+		}
+	}
+
+
+	/**
+	 * Takes latched events of a socket without waiting.
+	 * @param s The socket.
+	 * @param events The Sn_IR bits of interest.
+	 * @returns The bits of interest that were latched, which are now cleared.
+	 */
+	uint8_t take(SOCKET s, uint8_t events)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		uint8_t found = latched[s] & events;
+		latched[s] &= ~found;
+		__set_PRIMASK(primask);
+		return found;
+	}
+
+
+	/**
+	 * Gets latched events of a socket without taking them.
+	 * @param s The socket.
+	 * @param events The Sn_IR bits of interest.
+	 * @returns The bits of interest that are latched.
+	 */
+	uint8_t peek(SOCKET s, uint8_t events)
+	{
+		return latched[s] & events;
+	}
+
+
+	/**
+	 * Makes the calling thread the owner of several sockets, so that sleep() wakes when any of them has events. Call
+	 * before looking at the sockets, so that events that arrive in between are not missed.
+	 * @param sockets A bit for each socket.
+	 */
+	void watch(uint8_t sockets)
+	{
+#if USING_FREERTOS
+		osThreadId_t self = osThreadGetId();
+		for (SOCKET s=0; s < MAX_SOCK_NUM; s++)
+			if (sockets & (1 << s))
+				owners[s] = self;
+#else
+		(void) sockets;
+#endif
+	}
+
+
+	/**
+	 * Sleeps until a socket owned by the calling thread may have new events. Without an RTOS, returns at once and the
+	 * caller spins on service(), which costs no SPI until INTn falls.
+	 * @param timeout The maximum time to sleep in milliseconds, or W5500_WAIT_FOREVER.
+	 */
+	void sleep(uint32_t timeout=W5500_WAIT_FOREVER)
+	{
+#if USING_FREERTOS
+		if (dispatcher != nullptr)
+			osThreadFlagsWait(W5500_EVENTS_THREAD_FLAG, osFlagsWaitAny,
+					timeout == W5500_WAIT_FOREVER ? osWaitForever : timeout);
+		else
+			osDelay(1);
+#else
+		(void) timeout;
+#endif
+	}
+
+
+	/**
+	 * Waits for events of a socket. The calling thread becomes the owner of the socket.
+	 * @param s The socket.
+	 * @param events The Sn_IR bits of interest.
+	 * @param timeout The maximum time to wait in milliseconds, or W5500_WAIT_FOREVER.
+	 * @returns The bits of interest that occurred, which are now cleared; or 0 on timeout.
+	 */
+	uint8_t wait(SOCKET s, uint8_t events, uint32_t timeout=W5500_WAIT_FOREVER)
+	{
+		uint32_t start = HAL_GetTick();
+#if USING_FREERTOS
+		owners[s] = osThreadGetId();
+#endif
+		for (;;)
+		{
+			service();
+			uint8_t found = take(s, events);
+			if (found)
+			{
+				counters[s].wakeups++;
+				return found;
+			}
+
+			uint32_t elapsed = HAL_GetTick() - start;
+			if (timeout != W5500_WAIT_FOREVER && elapsed >= timeout)
+				return 0;
+#if USING_FREERTOS
+			if (dispatcher != nullptr)
+				osThreadFlagsWait(W5500_EVENTS_THREAD_FLAG, osFlagsWaitAny,
+						timeout == W5500_WAIT_FOREVER ? osWaitForever : timeout - elapsed);
+			else
+				osDelay(1);
+#endif
+		}
+	}
+
+
+	/**
+	 * Dispatches events unless a dispatcher thread does so, so that a caller can be sure events that have arrived
+	 * are seen.
+	 */
+	void service(void)
+	{
+#if USING_FREERTOS
+		if (dispatcher == nullptr)
+			dispatch();
+#else
+		dispatch();
+#endif
+	}
+
+
+	/**
+	 * Discards the latched events of a socket.
+	 * @param s The socket.
+	 */
+	void clear(SOCKET s)
+	{
+		latched[s] = 0;
+	}
+
+
+	/**
+	 * Sets an object to be called with the events of a socket.
+	 * @param s The socket.
+	 * @param handler The handler, or nullptr for none.
+	 */
+	void set_handler(SOCKET s, IHandler* handler)
+	{
+		handlers[s] = handler;
+	}
+
+
+#if USING_FREERTOS
+	/**
+	 * Sets a thread to be signalled by on_interrupt(). The thread should call run().
+	 * @param thread The thread that calls run().
+	 * @param flag The thread flag to set.
+	 */
+	void set_dispatcher_thread(osThreadId_t thread, uint32_t flag=0x01)
+	{
+		dispatcher = thread;
+		dispatcher_flag = flag;
+	}
+
+
+	/**
+	 * Dispatches events as interrupts arrive. Does not return.
+	 */
+	void run(void)
+	{
+		for (;;)
+		{
+			osThreadFlagsWait(dispatcher_flag, osFlagsWaitAny, osWaitForever);
+			dispatch();
+		}
+	}
+#endif
+
+
+	/**
+	 * Gets the event counts of a socket.
+	 * @param s The socket.
+	 * @returns Pointer to the counts.
+	 */
+	Counters* get_counters(SOCKET s)
+	{
+		return &counters[s];
+	}
+
+
+	/**
+	 * Gets the number of times INTn fell.
+	 * @returns The number of interrupts.
+	 */
+	uint32_t get_interrupts(void)
+	{
+		return interrupts;
+	}
+
+
+private:
+	void count(SOCKET s, uint8_t ir)
+	{
+		Counters* c = &counters[s];
+		if (ir & SnIR::CON)
+			c->connected++;
+		if (ir & SnIR::DISCON)
+			c->disconnected++;
+		if (ir & SnIR::RECV)
+			c->received++;
+		if (ir & SnIR::TIMEOUT)
+			c->timeouts++;
+		if (ir & SnIR::SEND_OK)
+			c->sent++;
+	}
+
+
+	Ethernet* w5500;
+	uint8_t mask = 0;
+	volatile bool pending = false;
+	volatile uint32_t interrupts = 0;
+	volatile uint8_t latched[MAX_SOCK_NUM] = {0};
+	IHandler* handlers[MAX_SOCK_NUM] = {nullptr};
+	Counters counters[MAX_SOCK_NUM] = {};
+#if USING_FREERTOS
+	osThreadId_t owners[MAX_SOCK_NUM] = {nullptr};
+	osThreadId_t dispatcher = nullptr;
+	uint32_t dispatcher_flag = 0x01;
+#endif
+};
+
+
+#endif /* INC_COMMS_ETHERNET_W5500_SOCKETEVENTS_H_ */
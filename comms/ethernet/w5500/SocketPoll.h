@@ -0,0 +1,237 @@
+/**
+ * \file       comms/ethernet/w5500/SocketPoll.h
+ * \class      SocketPoll
+ * \brief      Waits on several W5500 sockets at once and reports only those that are ready, like poll() in POSIX.
+ * \notes	   Works best with a SocketEvents, when it needs no SPI at all while nothing happens; without one it reads
+ *             SIR once per sweep.
+ */
+
+#ifndef INC_COMMS_ETHERNET_W5500_SOCKETPOLL_H_
+#define INC_COMMS_ETHERNET_W5500_SOCKETPOLL_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "Ethernet.h"
+#include "Socket.h"
+#include "SocketEvents.h"
+
+
+/**
+ * @brief	One socket to poll: the conditions of interest, and those found.
+ */
+typedef struct PollEntry
+{
+	Socket* socket;
+	uint8_t events;  /// The conditions of interest, as Sn_IR bits.
+	uint8_t ready;  /// Set by poll() to the conditions of interest that hold.
+} PollEntry;
+
+
+/**
+ * Lets one network task service the sockets of several protocols, looking only at those that something has happened
+ * to, and sleeping when nothing has.
+ *
+ * The conditions are named after the Sn_IR bits but, as with poll() in POSIX, they are levels rather than events, so
+ * a socket stays ready until the caller deals with it:
+ * - SnIR::RECV: data is waiting to be read.
+ * - SnIR::SEND_OK: a send will not have to wait for the previous one to complete.
+ * - SnIR::CON: the connection is established.
+ * - SnIR::DISCON: the peer has closed the connection, or the socket is closed.
+ * - SnIR::TIMEOUT: the socket is closed.
+ *
+ * Each sweep finds which sockets had interrupts: from the event counts of a SocketEvents, which costs no SPI, or
+ * else by reading SIR, one SPI frame for all of them. Only those sockets, and any reported ready last time (since the
+ * caller has probably changed them), are looked at again; Socket's register shadows make many of these looks free as
+ * well. Changes made by the caller's own commands to a socket that was not ready, such as closing it, are not
+ * reported. Without a SocketEvents, poll() clears the CON, DISCON, RECV and SEND_OK bits of Sn_IR that it sees, so
+ * that SIR reads zero again, and tells the Socket when its send has completed.
+ */
+class SocketPoll
+{
+public:
+	/**
+	 * Constructs an instance.
+	 * @param w5500 The chip.
+	 * @param events The event dispatcher that the sockets use, or nullptr if they poll.
+	 */
+	SocketPoll(Ethernet* w5500, SocketEvents* events=nullptr)
+	{
+		this->w5500 = w5500;
+		this->events = events;
+	}
+
+
+	/**
+	 * Waits until at least one socket is ready.
+	 * @param entries The sockets, each opened and with the conditions of interest set. poll() sets ready.
+	 * @param count The number of entries.
+	 * @param timeout The maximum time to wait in milliseconds, 0 to check once, or W5500_WAIT_FOREVER.
+	 * @returns The number of entries that are ready; 0 on timeout.
+	 */
+	uint8_t poll(PollEntry* entries, uint8_t count, uint32_t timeout=W5500_WAIT_FOREVER)
+	{
+		uint8_t sockets = 0;
+		for (uint8_t i=0; i < count; i++)
+			sockets |= 1 << entries[i].socket->get_socket();
+		if (events != nullptr)
+			events->watch(sockets);
+
+		uint32_t start = HAL_GetTick();
+		for (;;)
+		{
+			uint8_t changed = sweep(sockets);
+			uint8_t found = 0;
+			uint8_t ready_sockets = 0;
+			for (uint8_t i=0; i < count; i++)
+			{
+				PollEntry* entry = &entries[i];
+				SOCKET s = entry->socket->get_socket();
+				entry->ready = 0;
+				if (sent & (1 << s))
+					entry->socket->set_sent();
+				if (!((changed | was_ready | ~looked) & (1 << s)))
+					continue;
+				entry->ready = look(entry->socket, entry->events, (changed | ~looked) & (1 << s));
+				if (entry->ready)
+				{
+					found++;
+					ready_sockets |= 1 << s;
+				}
+			}
+			sent = 0;
+			looked |= sockets;
+			was_ready = ready_sockets;
+			hints_used(sockets);
+			if (found > 0)
+				return found;
+
+			uint32_t elapsed = HAL_GetTick() - start;
+			if (timeout != W5500_WAIT_FOREVER && elapsed >= timeout)
+				return 0;
+			if (events != nullptr)
+				events->sleep(timeout == W5500_WAIT_FOREVER ? W5500_WAIT_FOREVER : timeout - elapsed);
+#if USING_FREERTOS
+			else
+				osDelay(1);
+#endif
+		}
+	}
+
+
+	/**
+	 * Gets the number of sweeps made, for comparing with the SPI transactions they cost.
+	 */
+	uint32_t get_sweeps(void)
+	{
+		return sweeps;
+	}
+
+
+private:
+	/**
+	 * Finds which sockets have had interrupts since the last sweep.
+	 * @param sockets The sockets of interest.
+	 * @returns A bit for each socket that has.
+	 */
+	uint8_t sweep(uint8_t sockets)
+	{
+		sweeps++;
+		uint8_t changed = 0;
+		if (events != nullptr)
+		{
+			events->service();
+			for (SOCKET s=0; s < MAX_SOCK_NUM; s++)
+			{
+				if (!(sockets & (1 << s)))
+					continue;
+				SocketEvents::Counters* c = events->get_counters(s);
+				uint32_t total = c->connected + c->disconnected + c->received + c->timeouts + c->sent;
+				if (total != seen[s])
+					changed |= 1 << s;
+				pending_seen[s] = total;
+			}
+			return changed;
+		}
+
+		uint8_t sir = w5500->get_socket_interrupts() & sockets;
+		for (SOCKET s=0; s < MAX_SOCK_NUM; s++)
+		{
+			if (!(sir & (1 << s)))
+				continue;
+			uint8_t ir = w5500->readSnIR(s);
+			// SEND_OK is cleared too, or SIR would stay set and every sweep would read Sn_IR again; poll() hands it on
+			// to the Socket. TIMEOUT is left for Socket, which waits on it; the socket is closed anyway.
+			uint8_t edges = ir & (SnIR::CON | SnIR::DISCON | SnIR::RECV | SnIR::SEND_OK);
+			if (edges)
+				w5500->writeSnIR(s, edges);
+			if (edges & (SnIR::CON | SnIR::DISCON | SnIR::RECV))
+				w5500->forget_status(1 << s);
+			if (edges & SnIR::SEND_OK)
+				sent |= 1 << s;
+			changed |= 1 << s;
+		}
+		return changed;
+	}
+
+
+	/**
+	 * Records that the events counted by the last sweep have been looked at.
+	 */
+	void hints_used(uint8_t sockets)
+	{
+		if (events == nullptr)
+			return;
+		for (SOCKET s=0; s < MAX_SOCK_NUM; s++)
+			if (sockets & (1 << s))
+				seen[s] = pending_seen[s];
+	}
+
+
+	/**
+	 * Finds which conditions of interest hold for a socket.
+	 * @param socket The socket.
+	 * @param interest The conditions of interest.
+	 * @param changed True if the socket has had an interrupt since it was last looked at.
+	 */
+	uint8_t look(Socket* socket, uint8_t interest, bool changed)
+	{
+		SOCKET s = socket->get_socket();
+		uint8_t ready = 0;
+
+		// Data that arrives raises RECV, so without an interrupt what is known to be waiting is all there is.
+		if ((interest & SnIR::RECV) && w5500->get_rx_received(s, changed ? 1 : 0) > 0)
+			ready |= SnIR::RECV;
+
+		if (interest & SnIR::SEND_OK)
+		{
+			if (!socket->is_sending() || (events != nullptr && events->peek(s, SnIR::SEND_OK)))
+				ready |= SnIR::SEND_OK;
+		}
+
+		if (interest & (SnIR::CON | SnIR::DISCON | SnIR::TIMEOUT))
+		{
+			uint8_t status = w5500->get_status(s);
+			if ((interest & SnIR::CON) && status == SnSR::ESTABLISHED)
+				ready |= SnIR::CON;
+			if ((interest & SnIR::DISCON) && (status == SnSR::CLOSE_WAIT || status == SnSR::CLOSED))
+				ready |= SnIR::DISCON;
+			if ((interest & SnIR::TIMEOUT) && status == SnSR::CLOSED)
+				ready |= SnIR::TIMEOUT;
+		}
+		return ready;
+	}
+
+
+	Ethernet* w5500;
+	SocketEvents* events;
+	uint8_t looked = 0;  /// Sockets looked at at least once.
+	uint8_t was_ready = 0;  /// Sockets reported ready by the last sweep.
+	uint8_t sent = 0;  /// Sockets whose SEND_OK the last sweep cleared, without a SocketEvents.
+	uint32_t seen[MAX_SOCK_NUM] = {0};  /// Event totals already looked at, with a SocketEvents.
+	uint32_t pending_seen[MAX_SOCK_NUM] = {0};
+	uint32_t sweeps = 0;
+};
+
+
+#endif /* INC_COMMS_ETHERNET_W5500_SOCKETPOLL_H_ */
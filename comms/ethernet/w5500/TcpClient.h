@@ -41,8 +41,11 @@ public:
 		t.start();
 
 		while (status() != SnSR::ESTABLISHED)
+		{
 			if (t.is_elapsed() || status() == SnSR::CLOSED)
 				return false;
+			socket->wait(SnIR::CON | SnIR::DISCON | SnIR::TIMEOUT, timeout);
+		}
 
 		return true;
 	}
@@ -54,6 +57,17 @@ public:
 		return size;
 	}
 
+	/**
+	 * Writes several pieces of data as one packet, in one SPI burst. See Socket::sendv().
+	 * @param iov The pieces.
+	 * @param count The number of pieces.
+	 * @returns The number of bytes written, or 0 on failure.
+	 */
+	size_t writev(const IoVec* iov, uint8_t count)
+	{
+		return socket->sendv(iov, count);
+	}
+
 	size_t write(const char *buf)
 	{
 		return write((const uint8_t *)buf, strlen(buf));
@@ -100,6 +114,7 @@ public:
 				socket->close();
 				break;
 			}
+			socket->wait(SnIR::DISCON | SnIR::TIMEOUT, timeout);
 		}
 	}
 
@@ -110,6 +125,11 @@ public:
 				(s == SnSR::CLOSE_WAIT && !available()));
 	}
 
+	Socket* get_socket()
+	{
+		return socket;
+	}
+
 	virtual uint8_t status()
 	{
 		if (!socket->is_connected())
@@ -126,7 +146,6 @@ protected:
 		return port++;
 	}
 
-private:
 	Socket* socket;
 };
 
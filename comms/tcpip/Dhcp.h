@@ -1,19 +1,31 @@
-// DHCP Library v0.3 - April 25, 2009
-// Author: Jordan Terrell - blog.jordanterrell.com
+/**
+ * \file       comms/tcpip/Dhcp.h
+ * \class      DhcpClient
+ * \brief      Obtains and keeps an IPv4 lease for a W5500 by DHCP, advancing one step at a time from poll().
+ * \notes	   Based on the DHCP Library v0.3 by Jordan Terrell (blog.jordanterrell.com).
+ */
 
 #ifndef Dhcp_h
 #define Dhcp_h
 
-#include "EthernetUdp.h"
-#include "util.h"
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "comms/ethernet/w5500/Ethernet.h"
+#include "comms/ethernet/w5500/Socket.h"
+#include "comms/tcpip/IPv4Address.h"
 
-/* DHCP state machine. */
-#define STATE_DHCP_START 0
-#define	STATE_DHCP_DISCOVER	1
-#define	STATE_DHCP_REQUEST	2
-#define	STATE_DHCP_LEASED	3
-#define	STATE_DHCP_REREQUEST	4
-#define	STATE_DHCP_RELEASE	5
+#ifndef NETWORK_DHCP_RETRY_INTERVAL
+#define NETWORK_DHCP_RETRY_INTERVAL (1000)  // Milliseconds before the first retransmission; doubles on each.
+#endif
+
+#ifndef DHCP_MAX_RETRY_INTERVAL
+#define DHCP_MAX_RETRY_INTERVAL (64000)  // Milliseconds between retransmissions at most.
+#endif
+
+#ifndef DHCP_REQUEST_RETRIES
+#define DHCP_REQUEST_RETRIES (4)  // REQUESTs sent for an offer before starting again with DISCOVER.
+#endif
 
 #define DHCP_FLAGSBROADCAST	0x8000
 
@@ -43,16 +55,12 @@
 #define DHCP_SECS		0
 
 #define MAGIC_COOKIE		0x63825363
-#define MAX_DHCP_OPT	16
+#define DHCP_OPTIONS_OFFSET	240  // Fixed fields, sname, file and magic cookie.
+#define DHCP_MAX_MESSAGE	548  // Largest message a client must accept (576 bytes less the IP and UDP headers).
 
 #define HOST_NAME "WIZnet"
 #define DEFAULT_LEASE	(900) //default lease time in seconds
-
-#define DHCP_CHECK_NONE         (0)
-#define DHCP_CHECK_RENEW_FAIL   (1)
-#define DHCP_CHECK_RENEW_OK     (2)
-#define DHCP_CHECK_REBIND_FAIL  (3)
-#define DHCP_CHECK_REBIND_OK    (4)
+#define DHCP_MAX_LEASE	(2000000)  // Seconds; longer leases are treated as this, within the range of HAL_GetTick().
 
 enum
 {
@@ -60,540 +68,498 @@ enum
 	subnetMask		=	1,
 	timerOffset		=	2,
 	routersOnSubnet		=	3,
-	/* timeServer		=	4,
-	nameServer		=	5,*/
 	dns			=	6,
-	/*logServer		=	7,
-	cookieServer		=	8,
-	lprServer		=	9,
-	impressServer		=	10,
-	resourceLocationServer	=	11,*/
 	hostName		=	12,
-	/*bootFileSize		=	13,
-	meritDumpFile		=	14,*/
 	domainName		=	15,
-	/*swapServer		=	16,
-	rootPath		=	17,
-	extentionsPath		=	18,
-	IPforwarding		=	19,
-	nonLocalSourceRouting	=	20,
-	policyFilter		=	21,
-	maxDgramReasmSize	=	22,
-	defaultIPTTL		=	23,
-	pathMTUagingTimeout	=	24,
-	pathMTUplateauTable	=	25,
-	ifMTU			=	26,
-	allSubnetsLocal		=	27,
-	broadcastAddr		=	28,
-	performMaskDiscovery	=	29,
-	maskSupplier		=	30,
-	performRouterDiscovery	=	31,
-	routerSolicitationAddr	=	32,
-	staticRoute		=	33,
-	trailerEncapsulation	=	34,
-	arpCacheTimeout		=	35,
-	ethernetEncapsulation	=	36,
-	tcpDefaultTTL		=	37,
-	tcpKeepaliveInterval	=	38,
-	tcpKeepaliveGarbage	=	39,
-	nisDomainName		=	40,
-	nisServers		=	41,
-	ntpServers		=	42,
-	vendorSpecificInfo	=	43,
-	netBIOSnameServer	=	44,
-	netBIOSdgramDistServer	=	45,
-	netBIOSnodeType		=	46,
-	netBIOSscope		=	47,
-	xFontServer		=	48,
-	xDisplayManager		=	49,*/
 	dhcpRequestedIPaddr	=	50,
 	dhcpIPaddrLeaseTime	=	51,
-	/*dhcpOptionOverload	=	52,*/
 	dhcpMessageType		=	53,
 	dhcpServerIdentifier	=	54,
 	dhcpParamRequest	=	55,
-	/*dhcpMsg			=	56,
-	dhcpMaxMsgSize		=	57,*/
 	dhcpT1value		=	58,
 	dhcpT2value		=	59,
-	/*dhcpClassIdentifier	=	60,*/
 	dhcpClientIdentifier	=	61,
 	endOption		=	255
 };
 
-typedef struct _RIP_MSG_FIXED
-{
-	uint8_t  op; 
-	uint8_t  htype; 
-	uint8_t  hlen;
-	uint8_t  hops;
-	uint32_t xid;
-	uint16_t secs;
-	uint16_t flags;
-	uint8_t  ciaddr[4];
-	uint8_t  yiaddr[4];
-	uint8_t  siaddr[4];
-	uint8_t  giaddr[4];
-	uint8_t  chaddr[6];
-} RIP_MSG_FIXED;
-
-
-class DhcpClass
+
+/**
+ * A DHCP client (RFC 2131) that never blocks, so that boot goes on while the network comes up and renewals happen in
+ * the background.
+ *
+ * Call begin() once and poll() often. Each call does at most one step: it reads a waiting reply, all of it in one SPI
+ * burst, or sends or retransmits a message when its time has come. Retransmissions back off from
+ * NETWORK_DHCP_RETRY_INTERVAL to DHCP_MAX_RETRY_INTERVAL.
+ *
+ * - Init: sends DISCOVER, with the chip's address cleared.
+ * - Selecting: waits for an OFFER, then sends REQUEST for it.
+ * - Requesting: waits for ACK, which binds the lease and sets the chip's address, mask and gateway; or NAK, which
+ *   starts again.
+ * - Bound: nothing to do until T1; the socket is closed for others to use.
+ * - Renewing: from T1, asks the server that gave the lease to extend it.
+ * - Rebinding: from T2, asks any server. When the lease expires, the address is given up and the client starts again.
+ */
+class DhcpClient
 {
 public:
-	DhcpClass(EthernetUDP* udp)
-	{
-		this->udp = udp;
-	}
+	enum State : uint8_t { Stopped, Init, Selecting, Requesting, Bound, Renewing, Rebinding };
 
-	IPAddress getLocalIp() { return IPAddress(_dhcpLocalIp); }
-	IPAddress getSubnetMask() { return IPAddress(_dhcpSubnetMask); }
-	IPAddress getGatewayIp() { return IPAddress(_dhcpGatewayIp); }
-	IPAddress getDhcpServerIp() { return IPAddress(_dhcpDhcpServerIp); }
-	IPAddress getDnsServerIp() { return IPAddress(_dhcpDnsServerIp); }
+	/**
+	 * @brief	What a call to poll() brought about.
+	 */
+	enum Event : uint8_t
+	{
+		NoEvent,
+		Leased,  /// A lease was obtained, and the chip's address set.
+		Renewed,  /// The lease was extended.
+		Lost,  /// The lease expired or was refused, and the chip's address cleared.
+	};
 
 
-	int beginWithDHCP(uint8_t *mac, unsigned long timeout, unsigned long responseTimeout)
+	/**
+	 * Constructs an instance.
+	 * @param w5500 The chip, whose MAC address must already be set.
+	 * @param socket A socket to use while messages are exchanged; it is closed while bound.
+	 */
+	DhcpClient(Ethernet* w5500, Socket* socket)
 	{
-		_dhcpLeaseTime=0;
-		_dhcpT1=0;
-		_dhcpT2=0;
-		_timeout = timeout;
-		_responseTimeout = responseTimeout;
-
-		// zero out _dhcpMacAddr
-		memset(_dhcpMacAddr, 0, 6);
-		reset_DHCP_lease();
-
-		memcpy((uint8_t*)_dhcpMacAddr, (uint8_t*)mac, 6);
-		_dhcp_state = STATE_DHCP_START;
-		return request_DHCP_lease();
+		this->w5500 = w5500;
+		this->socket = socket;
 	}
 
 
-	/*
-	    returns:
-	    0/DHCP_CHECK_NONE: nothing happened
-	    1/DHCP_CHECK_RENEW_FAIL: renew failed
-	    2/DHCP_CHECK_RENEW_OK: renew success
-	    3/DHCP_CHECK_REBIND_FAIL: rebind fail
-	    4/DHCP_CHECK_REBIND_OK: rebind success
+	/**
+	 * Starts obtaining a lease. Returns at once; call poll().
 	 */
-	int checkLease()
+	void begin(void)
 	{
-		int rc = DHCP_CHECK_NONE;
+		w5500->get_mac_address(mac);
+		xid = HAL_GetTick() ^ ((uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | mac[4] << 8 | mac[5]);
+		clear_address();
+		enter(Init);
+	}
 
-		unsigned long now = millis();
-		unsigned long elapsed = now - _lastCheckLeaseMillis;
 
-		// if more then one sec passed, reduce the counters accordingly
-		if (elapsed >= 1000)
+	/**
+	 * Gives up the lease and stops. Does nothing if already stopped.
+	 */
+	void stop(void)
+	{
+		if (state == Stopped)
+			return;
+		if (state == Bound || state == Renewing || state == Rebinding)
 		{
-			// set the new timestamps
-			_lastCheckLeaseMillis = now - (elapsed % 1000);
-			elapsed = elapsed / 1000;
-
-			// decrease the counters by elapsed seconds
-			// we assume that the cycle time (elapsed) is fairly constant
-			// if the remainder is less than cycle time * 2
-			// do it early instead of late
-			if (_renewInSec < elapsed * 2)
-				_renewInSec = 0;
-			else
-				_renewInSec -= elapsed;
-
-			if (_rebindInSec < elapsed * 2)
-				_rebindInSec = 0;
-			else
-				_rebindInSec -= elapsed;
+			open();
+			send(DHCP_RELEASE, server_ip, false);
 		}
+		close();
+		clear_address();
+		state = Stopped;
+	}
 
-		// if we have a lease but should renew, do it
-		if (_renewInSec == 0 &&_dhcp_state == STATE_DHCP_LEASED)
+
+	/**
+	 * Advances the client. Call often; it does not block.
+	 * @returns What happened, if anything.
+	 */
+	Event poll(void)
+	{
+		uint32_t now = HAL_GetTick();
+		switch (state)
 		{
-			_dhcp_state = STATE_DHCP_REREQUEST;
-			rc = 1 + request_DHCP_lease();
+		case Stopped:
+			return NoEvent;
+
+		case Init:
+			open();
+			clear_address();
+			started = now;
+			xid++;
+			send(DHCP_DISCOVER, IPv4Address(255, 255, 255, 255), true);
+			enter(Selecting);
+			return NoEvent;
+
+		case Bound:
+			if (elapsed(now) < t1)
+				return NoEvent;
+			open();
+			started = now;
+			requested = now;
+			xid++;
+			send(DHCP_REQUEST, server_ip, false);
+			enter(Renewing);
+			return NoEvent;
+
+		default:
+			break;
 		}
 
-		// if we have a lease or is renewing but should bind, do it
-		if (_rebindInSec == 0 && (_dhcp_state == STATE_DHCP_LEASED || _dhcp_state == STATE_DHCP_START))
+		uint8_t type = receive();
+		if (type != 0)
+			return on_reply(type);
+
+		if ((state == Renewing || state == Rebinding) && elapsed(now) >= lease)
+		{
+			enter(Init);
+			clear_address();
+			return Lost;
+		}
+		if (state == Renewing && elapsed(now) >= t2)
 		{
-			// this should basically restart completely
-			_dhcp_state = STATE_DHCP_START;
-			reset_DHCP_lease();
-			rc = 3 + request_DHCP_lease();
+			// Broadcast to any server, but the client still has its address, so the reply need not be (RFC 2131 4.4.5).
+			xid++;
+			send(DHCP_REQUEST, IPv4Address(255, 255, 255, 255), false);
+			enter(Rebinding);
+			return NoEvent;
 		}
-		return rc;
+		if (now - sent < retry_interval)
+			return NoEvent;
+
+		// Nothing heard: try again, less often each time.
+		retry_interval = retry_interval * 2 > DHCP_MAX_RETRY_INTERVAL ? DHCP_MAX_RETRY_INTERVAL : retry_interval * 2;
+		retries++;
+		if (state == Selecting)
+			send(DHCP_DISCOVER, IPv4Address(255, 255, 255, 255), true);
+		else if (state == Requesting && retries >= DHCP_REQUEST_RETRIES)
+			enter(Init);
+		else if (state == Requesting)
+			send(DHCP_REQUEST, IPv4Address(255, 255, 255, 255), true);
+		else if (state == Rebinding)
+			send(DHCP_REQUEST, IPv4Address(255, 255, 255, 255), false);
+		else if (state == Renewing)
+			send(DHCP_REQUEST, server_ip, false);
+		return NoEvent;
 	}
 
 
+	State get_state(void) { return state; }
+	bool is_bound(void) { return state == Bound || state == Renewing || state == Rebinding; }
+	IPv4Address get_local_ip(void) { return local_ip; }
+	IPv4Address get_subnet_mask(void) { return subnet_mask; }
+	IPv4Address get_gateway_ip(void) { return gateway_ip; }
+	IPv4Address get_dhcp_server_ip(void) { return server_ip; }
+	IPv4Address get_dns_server_ip(void) { return dns_ip; }
+
+	/**
+	 * Gets the length of the lease in seconds, as granted by the server.
+	 */
+	uint32_t get_lease_time(void) { return lease / 1000; }
+
 private:
-	uint32_t _dhcpInitialTransactionId;
-	uint32_t _dhcpTransactionId;
-	uint8_t  _dhcpMacAddr[6];
-	uint8_t  _dhcpLocalIp[4];
-	uint8_t  _dhcpSubnetMask[4];
-	uint8_t  _dhcpGatewayIp[4];
-	uint8_t  _dhcpDhcpServerIp[4];
-	uint8_t  _dhcpDnsServerIp[4];
-	uint32_t _dhcpLeaseTime;
-	uint32_t _dhcpT1, _dhcpT2;
-	uint32_t _renewInSec;
-	uint32_t _rebindInSec;
-	uint32_t _timeout;
-	uint32_t _responseTimeout;
-	uint32_t _lastCheckLeaseMillis;
-	uint8_t _dhcp_state;
-	EthernetUDP* udp;
-
-
-	void reset_DHCP_lease()
+	/**
+	 * Moves to a state in which a message is awaited, resetting the retransmission timer.
+	 */
+	void enter(State next)
 	{
-		// zero out _dhcpSubnetMask, _dhcpGatewayIp, _dhcpLocalIp, _dhcpDhcpServerIp, _dhcpDnsServerIp
-		memset(_dhcpLocalIp, 0, 20);
+		state = next;
+		retry_interval = NETWORK_DHCP_RETRY_INTERVAL;
+		retries = 0;
 	}
 
-	//return:0 on error, 1 if request is sent and response is received
-	int request_DHCP_lease()
-	{
-		uint8_t messageType = 0;
-
-		// Pick an initial transaction ID
-		_dhcpTransactionId = (rand() % (2000UL - 1UL)) + 1UL;
-		_dhcpInitialTransactionId = _dhcpTransactionId;
 
-		udp->stop();
-		if (udp->begin(DHCP_CLIENT_PORT) == 0)
-			return 0;  // Couldn't get a socket
-
-		presend_DHCP();
-		int result = 0;
-		unsigned long startTime = millis();
+	/**
+	 * Opens the socket on the client port, unless this client has it open already. Once closed, the chip socket may
+	 * have gone to someone else, so its status says nothing about this client.
+	 */
+	void open(void)
+	{
+		if (!opened)
+			opened = socket->open(SnMR::UDP, DHCP_CLIENT_PORT, 0);
+	}
 
-		while(_dhcp_state != STATE_DHCP_LEASED)
-		{
-			if(_dhcp_state == STATE_DHCP_START)
-			{
-				_dhcpTransactionId++;
 
-				send_DHCP_MESSAGE(DHCP_DISCOVER, ((millis() - startTime) / 1000));
-				_dhcp_state = STATE_DHCP_DISCOVER;
-			}
-			else if(_dhcp_state == STATE_DHCP_REREQUEST)
-			{
-				_dhcpTransactionId++;
-				send_DHCP_MESSAGE(DHCP_REQUEST, ((millis() - startTime)/1000));
-				_dhcp_state = STATE_DHCP_REQUEST;
-			}
-			else if(_dhcp_state == STATE_DHCP_DISCOVER)
-			{
-				uint32_t respId;
-				messageType = parseDHCPResponse(_responseTimeout, respId);
-				if(messageType == DHCP_OFFER)
-				{
-					// We'll use the transaction ID that the offer came with,
-					// rather than the one we were up to
-					_dhcpTransactionId = respId;
-					send_DHCP_MESSAGE(DHCP_REQUEST, ((millis() - startTime) / 1000));
-					_dhcp_state = STATE_DHCP_REQUEST;
-				}
-			}
-			else if(_dhcp_state == STATE_DHCP_REQUEST)
-			{
-				uint32_t respId;
-				messageType = parseDHCPResponse(_responseTimeout, respId);
-				if(messageType == DHCP_ACK)
-				{
-					_dhcp_state = STATE_DHCP_LEASED;
-					result = 1;
-					//use default lease time if we didn't get it
-					if(_dhcpLeaseTime == 0){
-						_dhcpLeaseTime = DEFAULT_LEASE;
-					}
-					// Calculate T1 & T2 if we didn't get it
-					if(_dhcpT1 == 0){
-						// T1 should be 50% of _dhcpLeaseTime
-						_dhcpT1 = _dhcpLeaseTime >> 1;
-					}
-					if(_dhcpT2 == 0){
-						// T2 should be 87.5% (7/8ths) of _dhcpLeaseTime
-						_dhcpT2 = _dhcpLeaseTime - (_dhcpLeaseTime >> 3);
-					}
-					_renewInSec = _dhcpT1;
-					_rebindInSec = _dhcpT2;
-				}
-				else if(messageType == DHCP_NAK)
-					_dhcp_state = STATE_DHCP_START;
-			}
+	void close(void)
+	{
+		if (opened)
+			socket->close();
+		opened = false;
+	}
 
-			if(messageType == 255)
-			{
-				messageType = 0;
-				_dhcp_state = STATE_DHCP_START;
-			}
 
-			if(result != 1 && ((millis() - startTime) > _timeout))
-				break;
-		}
-
-		// We're done with the socket now
-		udp->stop();
-		_dhcpTransactionId++;
-		_lastCheckLeaseMillis = millis();
-		return result;
+	uint32_t elapsed(uint32_t now)
+	{
+		return now - bound_at;
 	}
 
-	void presend_DHCP()
+
+	void clear_address(void)
 	{
+		uint8_t zero[4] = {0};
+		w5500->tcpip_set_ip_address(zero);
+		local_ip = IPv4Address((uint32_t)0);
 	}
 
-	void send_DHCP_MESSAGE(uint8_t messageType, uint16_t secondsElapsed)
-	{
-		uint8_t buffer[32];
-		memset(buffer, 0, 32);
-		IPAddress dest_addr(255, 255, 255, 255); // Broadcast address
 
-		if (-1 == udp->beginPacket(dest_addr, DHCP_SERVER_PORT))
+	/**
+	 * Builds a message in the buffer and sends it in one write.
+	 * @param type DHCP_DISCOVER, DHCP_REQUEST or DHCP_RELEASE.
+	 * @param to The server, or the broadcast address.
+	 * @param broadcast True to ask for the reply to be broadcast, when the client has no address.
+	 */
+	void send(uint8_t type, IPv4Address to, bool broadcast)
+	{
+		uint8_t* p = packet;
+		memset(p, 0, DHCP_OPTIONS_OFFSET);
+		p[0] = DHCP_BOOTREQUEST;
+		p[1] = DHCP_HTYPE10MB;
+		p[2] = DHCP_HLENETHERNET;
+		p[3] = DHCP_HOPS;
+		put32(p + 4, xid);
+		uint16_t secs = (HAL_GetTick() - started) / 1000;
+		p[8] = secs >> 8;
+		p[9] = secs;
+		if (broadcast)
+			p[10] = DHCP_FLAGSBROADCAST >> 8;
+		// ciaddr is set only when the client has an address it may use.
+		bool has_address = type == DHCP_RELEASE || state == Bound || state == Renewing || state == Rebinding;
+		if (has_address)
+			memcpy(p + 12, local_ip.raw_address(), 4);
+		memcpy(p + 28, mac, 6);
+		put32(p + 236, MAGIC_COOKIE);
+		p += DHCP_OPTIONS_OFFSET;
+
+		*p++ = dhcpMessageType;
+		*p++ = 1;
+		*p++ = type;
+
+		*p++ = dhcpClientIdentifier;
+		*p++ = 7;
+		*p++ = 1;  // Ethernet
+		memcpy(p, mac, 6);
+		p += 6;
+
+		const uint8_t name_length = strlen(HOST_NAME);
+		*p++ = hostName;
+		*p++ = name_length + 6;  // Host name and the last 3 bytes of the MAC address in hexadecimal.
+		memcpy(p, HOST_NAME, name_length);
+		p += name_length;
+		for (uint8_t i=3; i < 6; i++)
 		{
-			// FIXME Need to return errors
-			return;
+			*p++ = "0123456789ABCDEF"[mac[i] >> 4];
+			*p++ = "0123456789ABCDEF"[mac[i] & 0x0f];
 		}
 
-		buffer[0] = DHCP_BOOTREQUEST;   // op
-		buffer[1] = DHCP_HTYPE10MB;     // htype
-		buffer[2] = DHCP_HLENETHERNET;  // hlen
-		buffer[3] = DHCP_HOPS;          // hops
-
-		// xid
-		unsigned long xid = htonl(_dhcpTransactionId);
-		memcpy(buffer + 4, &(xid), 4);
-
-		// 8, 9 - seconds elapsed
-		buffer[8] = ((secondsElapsed & 0xff00) >> 8);
-		buffer[9] = (secondsElapsed & 0x00ff);
-
-		// flags
-		unsigned short flags = htons(DHCP_FLAGSBROADCAST);
-		memcpy(buffer + 10, &(flags), 2);
-
-		// ciaddr: already zeroed
-		// yiaddr: already zeroed
-		// siaddr: already zeroed
-		// giaddr: already zeroed
-
-		//put data in W5100 transmit buffer
-		udp->write(buffer, 28);
-
-		memset(buffer, 0, 32); // clear local buffer
-		memcpy(buffer, _dhcpMacAddr, 6); // chaddr
-
-		//put data in W5100 transmit buffer
-		udp->write(buffer, 16);
-		memset(buffer, 0, 32); // clear local buffer
-
-		// leave zeroed out for sname && file
-		// put in W5100 transmit buffer x 6 (192 bytes)
-
-		for(int i = 0; i < 6; i++)
-			udp->write(buffer, 32);
-
-		// OPT - Magic Cookie
-		buffer[0] = (uint8_t)((MAGIC_COOKIE >> 24)& 0xFF);
-		buffer[1] = (uint8_t)((MAGIC_COOKIE >> 16)& 0xFF);
-		buffer[2] = (uint8_t)((MAGIC_COOKIE >> 8)& 0xFF);
-		buffer[3] = (uint8_t)(MAGIC_COOKIE& 0xFF);
+		// In SELECTING, name the offer taken; later the address is in ciaddr instead.
+		if (type == DHCP_REQUEST && !has_address)
+		{
+			*p++ = dhcpRequestedIPaddr;
+			*p++ = 4;
+			memcpy(p, local_ip.raw_address(), 4);
+			p += 4;
+		}
+		if ((type == DHCP_REQUEST && !has_address) || type == DHCP_RELEASE)
+		{
+			*p++ = dhcpServerIdentifier;
+			*p++ = 4;
+			memcpy(p, server_ip.raw_address(), 4);
+			p += 4;
+		}
 
-		// OPT - message type
-		buffer[4] = dhcpMessageType;
-		buffer[5] = 0x01;
-		buffer[6] = messageType; //DHCP_REQUEST;
+		if (type != DHCP_RELEASE)
+		{
+			*p++ = dhcpParamRequest;
+			*p++ = 6;
+			*p++ = subnetMask;
+			*p++ = routersOnSubnet;
+			*p++ = dns;
+			*p++ = domainName;
+			*p++ = dhcpT1value;
+			*p++ = dhcpT2value;
+		}
+		*p++ = endOption;
 
-		// OPT - client identifier
-		buffer[7] = dhcpClientIdentifier;
-		buffer[8] = 0x07;
-		buffer[9] = 0x01;
-		memcpy(buffer + 10, _dhcpMacAddr, 6);
+		socket->start_udp(to, DHCP_SERVER_PORT);
+		socket->bufferData(packet, p - packet);
+		socket->send_udp();
+		sent = HAL_GetTick();
+	}
 
-		// OPT - host name
-		buffer[16] = hostName;
-		buffer[17] = strlen(HOST_NAME) + 6; // length of hostname + last 3 bytes of mac address
-		strcpy((char*)&(buffer[18]), HOST_NAME);
 
-		printByte((char*)&(buffer[24]), _dhcpMacAddr[3]);
-		printByte((char*)&(buffer[26]), _dhcpMacAddr[4]);
-		printByte((char*)&(buffer[28]), _dhcpMacAddr[5]);
+	/**
+	 * Reads a waiting reply, if there is one, in one read, and takes what it offers if it is for this client.
+	 * @returns The DHCP message type, or 0 if there was none for this client.
+	 */
+	uint8_t receive(void)
+	{
+		uint8_t from[4];
+		uint16_t port;
+		uint16_t length = socket->recvfrom(packet, sizeof(packet), from, &port);
+		if (length < DHCP_OPTIONS_OFFSET || port != DHCP_SERVER_PORT || packet[0] != DHCP_BOOTREPLY ||
+				get32(packet + 4) != xid || memcmp(packet + 28, mac, 6) != 0 || get32(packet + 236) != MAGIC_COOKIE)
+			return 0;
+
+		Offer offer = {};
+		memcpy(offer.address, packet + 16, 4);  // yiaddr
+		for (uint16_t i = DHCP_OPTIONS_OFFSET; i < length; )
+		{
+			uint8_t option = packet[i++];
+			if (option == padOption)
+				continue;
+			if (option == endOption || i >= length)
+				break;
+			uint8_t size = packet[i++];
+			if (i + size > length)
+				break;
+			const uint8_t* value = packet + i;
+			i += size;
 
-		//put data in W5100 transmit buffer
-		udp->write(buffer, 30);
+			switch (option)
+			{
+			case dhcpMessageType:
+				if (size >= 1)
+					offer.type = value[0];
+				break;
+			case subnetMask:
+				if (size >= 4)
+					memcpy(offer.subnet_mask, value, 4);
+				break;
+			case routersOnSubnet:
+				if (size >= 4)
+					memcpy(offer.gateway, value, 4);
+				break;
+			case dns:
+				if (size >= 4)
+					memcpy(offer.dns, value, 4);
+				break;
+			case dhcpServerIdentifier:
+				if (size >= 4)
+					memcpy(offer.server, value, 4);
+				break;
+			case dhcpIPaddrLeaseTime:
+				if (size >= 4)
+					offer.lease = get32(value);
+				break;
+			case dhcpT1value:
+				if (size >= 4)
+					offer.t1 = get32(value);
+				break;
+			case dhcpT2value:
+				if (size >= 4)
+					offer.t2 = get32(value);
+				break;
+			default:
+				break;
+			}
+		}
 
-		if(messageType == DHCP_REQUEST)
+		if (offer.type == DHCP_OFFER && state == Selecting)
 		{
-			buffer[0] = dhcpRequestedIPaddr;
-			buffer[1] = 0x04;
-			buffer[2] = _dhcpLocalIp[0];
-			buffer[3] = _dhcpLocalIp[1];
-			buffer[4] = _dhcpLocalIp[2];
-			buffer[5] = _dhcpLocalIp[3];
-
-			buffer[6] = dhcpServerIdentifier;
-			buffer[7] = 0x04;
-			buffer[8] = _dhcpDhcpServerIp[0];
-			buffer[9] = _dhcpDhcpServerIp[1];
-			buffer[10] = _dhcpDhcpServerIp[2];
-			buffer[11] = _dhcpDhcpServerIp[3];
-
-			//put data in W5100 transmit buffer
-			udp->write(buffer, 12);
+			local_ip = offer.address;
+			server_ip = IPv4Address(offer.server).is_empty() ? IPv4Address(from) : IPv4Address(offer.server);
 		}
-
-		buffer[0] = dhcpParamRequest;
-		buffer[1] = 0x06;
-		buffer[2] = subnetMask;
-		buffer[3] = routersOnSubnet;
-		buffer[4] = dns;
-		buffer[5] = domainName;
-		buffer[6] = dhcpT1value;
-		buffer[7] = dhcpT2value;
-		buffer[8] = endOption;
-
-		//put data in W5100 transmit buffer
-		udp->write(buffer, 9);
-		udp->endPacket();
+		else if (offer.type == DHCP_ACK && state != Selecting)
+			take(&offer);
+		else if (offer.type != DHCP_NAK)
+			return 0;
+		return offer.type;
 	}
 
 
-	uint8_t parseDHCPResponse(unsigned long responseTimeout, uint32_t& transactionId)
+	/**
+	 * @brief	What a reply offers.
+	 */
+	typedef struct Offer
+	{
+		uint8_t type;
+		uint8_t address[4];
+		uint8_t subnet_mask[4];
+		uint8_t gateway[4];
+		uint8_t dns[4];
+		uint8_t server[4];
+		uint32_t lease;
+		uint32_t t1;
+		uint32_t t2;
+	} Offer;
+
+
+	/**
+	 * Binds the lease in an ACK.
+	 */
+	void take(Offer* offer)
 	{
-		uint8_t type = 0;
-		uint8_t opt_len = 0;
+		uint32_t seconds = offer->lease == 0 ? DEFAULT_LEASE : offer->lease > DHCP_MAX_LEASE ? DHCP_MAX_LEASE : offer->lease;
+		uint32_t renew = offer->t1 == 0 || offer->t1 >= seconds ? seconds / 2 : offer->t1;
+		uint32_t rebind = offer->t2 == 0 || offer->t2 >= seconds || offer->t2 <= renew ? seconds - seconds / 8 : offer->t2;
+		lease = seconds * 1000;
+		t1 = renew * 1000;
+		t2 = rebind * 1000;
+		bound_at = requested;  // The lease runs from when it was asked for.
+
+		local_ip = offer->address;
+		subnet_mask = offer->subnet_mask;
+		gateway_ip = offer->gateway;
+		dns_ip = offer->dns;
+		if (!IPv4Address(offer->server).is_empty())
+			server_ip = offer->server;
+		w5500->tcpip_set_ip_address(local_ip.raw_address());
+		w5500->tcpip_set_subnet_mask(subnet_mask.raw_address());
+		w5500->tcpip_set_gateway_ip(gateway_ip.raw_address());
+	}
 
-		unsigned long startTime = millis();
 
-		while(udp->parsePacket() <= 0)
+	/**
+	 * Moves on from a reply that receive() accepted.
+	 */
+	Event on_reply(uint8_t type)
+	{
+		if (type == DHCP_OFFER)
 		{
-			if((millis() - startTime) > responseTimeout)
-				return 255;
-			Timer t;
-			t.block(milliseconds(50));
+			requested = HAL_GetTick();
+			send(DHCP_REQUEST, IPv4Address(255, 255, 255, 255), true);
+			enter(Requesting);
+			return NoEvent;
 		}
 
-		// start reading in the packet
-		RIP_MSG_FIXED fixedMsg;
-		udp->read((uint8_t*)&fixedMsg, sizeof(RIP_MSG_FIXED));
-
-		if(fixedMsg.op == DHCP_BOOTREPLY && udp->remotePort() == DHCP_SERVER_PORT)
+		bool was_bound = state == Renewing || state == Rebinding;
+		if (type == DHCP_NAK)
 		{
-			transactionId = ntohl(fixedMsg.xid);
-			if(memcmp(fixedMsg.chaddr, _dhcpMacAddr, 6) != 0 || (transactionId < _dhcpInitialTransactionId) || (transactionId > _dhcpTransactionId))
-			{
-				// Need to read the rest of the packet here regardless
-				udp->flush();
-				return 0;
-			}
+			enter(Init);
+			clear_address();
+			return was_bound ? Lost : NoEvent;
+		}
 
-			memcpy(_dhcpLocalIp, fixedMsg.yiaddr, 4);
+		enter(Bound);
+		close();
+		return was_bound ? Renewed : Leased;
+	}
 
-			// Skip to the option part
-			// Doing this a byte at a time so we don't have to put a big buffer
-			// on the stack (as we don't have lots of memory lying around)
-			for (int i =0; i < (240 - (int)sizeof(RIP_MSG_FIXED)); i++)
-				udp->read(); // we don't care about the returned byte
 
-			while (udp->available() > 0)
-			{
-				switch (udp->read())
-				{
-				case endOption :
-					break;
-
-				case padOption :
-					break;
-
-				case dhcpMessageType :
-					opt_len = udp->read();
-					type = udp->read();
-					break;
-
-				case subnetMask :
-					opt_len = udp->read();
-					udp->read(_dhcpSubnetMask, 4);
-					break;
-
-				case routersOnSubnet :
-					opt_len = udp->read();
-					udp->read(_dhcpGatewayIp, 4);
-					for (int i = 0; i < opt_len-4; i++)
-					{
-						udp->read();
-					}
-					break;
-
-				case dns :
-					opt_len = udp->read();
-					udp->read(_dhcpDnsServerIp, 4);
-					for (int i = 0; i < opt_len-4; i++)
-						udp->read();
-					break;
-
-				case dhcpServerIdentifier :
-					opt_len = udp->read();
-					if( IPAddress(_dhcpDhcpServerIp) == IPAddress((uint32_t)0) || IPAddress(_dhcpDhcpServerIp) == udp->remoteIP())
-					{
-						udp->read(_dhcpDhcpServerIp, sizeof(_dhcpDhcpServerIp));
-					}
-					else
-					{
-						// Skip over the rest of this option
-						while (opt_len--)
-							udp->read();
-					}
-					break;
-
-				case dhcpT1value :
-					opt_len = udp->read();
-					udp->read((uint8_t*)&_dhcpT1, sizeof(_dhcpT1));
-					_dhcpT1 = ntohl(_dhcpT1);
-					break;
-
-				case dhcpT2value :
-					opt_len = udp->read();
-					udp->read((uint8_t*)&_dhcpT2, sizeof(_dhcpT2));
-					_dhcpT2 = ntohl(_dhcpT2);
-					break;
-
-				case dhcpIPaddrLeaseTime :
-					opt_len = udp->read();
-					udp->read((uint8_t*)&_dhcpLeaseTime, sizeof(_dhcpLeaseTime));
-					_dhcpLeaseTime = ntohl(_dhcpLeaseTime);
-					_renewInSec = _dhcpLeaseTime;
-					break;
-
-				default :
-					opt_len = udp->read();
-					// Skip over the rest of this option
-					while (opt_len--)
-						udp->read();
-					break;
-				}
-			}
-		}
-
-		// Need to skip to end of the packet regardless here
-		udp->flush();
-		return type;
+	static void put32(uint8_t* p, uint32_t value)
+	{
+		p[0] = value >> 24;
+		p[1] = value >> 16;
+		p[2] = value >> 8;
+		p[3] = value;
 	}
 
-	void printByte(char * buf, uint8_t n )
+
+	static uint32_t get32(const uint8_t* p)
 	{
-		char *str = &buf[1];
-		buf[0]='0';
-		do {
-			unsigned long m = n;
-			n /= 16;
-			char c = m - 16 * n;
-			*str-- = c < 10 ? c + '0' : c + 'A' - 10;
-		} while(n);
+		return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
 	}
+
+
+	Ethernet* w5500;
+	Socket* socket;
+	State state = Stopped;
+	bool opened = false;  /// The socket is open, from the first message of an exchange until bound or stopped.
+	uint8_t mac[6] = {0};
+	uint32_t xid = 0;
+	uint32_t started = 0;  /// When the current exchange began.
+	uint32_t sent = 0;  /// When the last message was sent.
+	uint32_t requested = 0;  /// When the first REQUEST of the current exchange was sent.
+	uint32_t retry_interval = NETWORK_DHCP_RETRY_INTERVAL;
+	uint8_t retries = 0;
+	uint32_t bound_at = 0;
+	uint32_t lease = 0;  /// Milliseconds from bound_at.
+	uint32_t t1 = 0;
+	uint32_t t2 = 0;
+	IPv4Address local_ip;
+	IPv4Address subnet_mask;
+	IPv4Address gateway_ip;
+	IPv4Address server_ip;
+	IPv4Address dns_ip;
+	uint8_t packet[DHCP_MAX_MESSAGE];
 };
 
 #endif
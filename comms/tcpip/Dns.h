@@ -39,7 +39,24 @@
 // Port number that DNS servers listen on
 #define DNS_PORT        53
 
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE (8)  // Hostnames whose answers are kept.
+#endif
+
+#ifndef DNS_TIMEOUT
+#define DNS_TIMEOUT (1000)  // Milliseconds to wait for the resolver to answer.
+#endif
+
+#ifndef DNS_NEGATIVE_TTL
+#define DNS_NEGATIVE_TTL (10)  // Seconds to remember that a hostname could not be resolved.
+#endif
+
+#ifndef DNS_MAX_TTL
+#define DNS_MAX_TTL (3600)  // Seconds that an answer is kept at most, whatever its TTL.
+#endif
+
 // Possible return codes from ProcessResponse
+#define DNS_PENDING      0  // From Resolve(): the query has not been answered yet.
 #define SUCCESS          1
 #define TIMED_OUT        -1
 #define INVALID_SERVER   -2
@@ -47,9 +64,31 @@
 #define INVALID_RESPONSE -4
 
 
+/**
+ * Resolves hostnames through one resolver, keeping the answers in a small cache.
+ *
+ * Answers are kept for their TTL, up to DNS_MAX_TTL. Failures (no such name, no address, or no answer within
+ * DNS_TIMEOUT) are kept for DNS_NEGATIVE_TTL, so that a reconnect loop does not query for a missing name every time.
+ * Entries are found by a hash of the hostname, without regard to case, and the least recently used is replaced.
+ *
+ * Get() blocks until an answer is known. Resolve() never blocks: it answers from the cache, or sends a query and returns
+ * DNS_PENDING, and is called again (or Poll() is) until the answer arrives. One query is outstanding at a time.
+ */
 class DnsClient
 {
 public:
+	/**
+	 * @brief	Counts of lookups.
+	 */
+	typedef struct Statistics
+	{
+		uint32_t hits;  /// Lookups answered with an address from the cache.
+		uint32_t negative_hits;  /// Lookups answered with a failure from the cache.
+		uint32_t queries;  /// Queries sent.
+		uint32_t timeouts;  /// Queries not answered in time.
+	} Statistics;
+
+
 	DnsClient(IUdp* udp, IPv4Address resolver)
 	{
 		this->udp = udp;
@@ -57,7 +96,7 @@ public:
 	}
 
 
-	/** Resolve the given hostname to an IP address.
+	/** Resolve the given hostname to an IP address, waiting for the answer if it is not cached.
         @param aHostname Name to be resolved
         @param aResult IPAddress structure to store the returned IP address
         @result 1 if aIPAddrString was successfully converted to an IP address,
@@ -65,18 +104,125 @@ public:
 	 */
 	int Get(const char* hostname, IPv4Address& ip)
 	{
-		// See if it is already a dotted-quad string.
-//		ImmutableString test = hostname;
-//		IPv4Address hostip(test);
+		int status;
+		while ((status = Resolve(hostname, ip)) == DNS_PENDING)
+			osDelay(10);
+		return status;
+	}
+
+
+	/**
+	 * Resolves a hostname without waiting.
+	 * @param hostname The name.
+	 * @param ip Receives the address on success.
+	 * @returns SUCCESS; DNS_PENDING if the answer is not known yet, so call again later; or the error code of a failure,
+	 *          which is remembered for DNS_NEGATIVE_TTL.
+	 */
+	int Resolve(const char* hostname, IPv4Address& ip)
+	{
+		Poll();
+
+		uint8_t length;
+		uint32_t hash = Hash(hostname, &length);
+		uint32_t now = HAL_GetTick();
+		Entry* entry = Find(hash, length);
+		if (entry != nullptr && entry->state == Querying)
+			return DNS_PENDING;
+		if (entry != nullptr && now - entry->stored < entry->ttl)
+		{
+			entry->used = now;
+			if (entry->state == Resolved)
+			{
+				statistics.hits++;
+				memcpy(ip.raw_address(), entry->address, 4);
+				return SUCCESS;
+			}
+			statistics.negative_hits++;
+			return entry->status;
+		}
+
+		// Not known, or expired: ask, unless another query is outstanding.
+		if (query != nullptr)
+			return DNS_PENDING;
+		if (entry == nullptr)
+			entry = Replace();
+		entry->hash = hash;
+		entry->length = length;
+		entry->state = Querying;
+		entry->used = now;
 
-		// Send DNS request
 		udp->begin(resolver, DNS_PORT);
 		udp->beginPacket();
 		BuildRequest(hostname);
 		udp->endPacket();
-		int status = ProcessResponse(1000, ip);
+		query = entry;
+		query_sent = now;
+		statistics.queries++;
+		return DNS_PENDING;
+	}
+
+
+	/**
+	 * Takes the answer to the outstanding query, if it has arrived or timed out. Resolve() calls this itself.
+	 */
+	void Poll(void)
+	{
+		if (query == nullptr)
+			return;
+
+		IPv4Address ip;
+		uint32_t ttl = 0;
+		int status;
+		if (udp->parsePacket() > 0)
+		{
+			status = ParseResponse(ip, &ttl);
+			if (status == INVALID_SERVER || status == INVALID_RESPONSE || status == TRUNCATED)
+			{
+				udp->flush();  // A stray or late packet: keep waiting.
+				return;
+			}
+		}
+		else if (HAL_GetTick() - query_sent >= DNS_TIMEOUT)
+		{
+			status = TIMED_OUT;
+			statistics.timeouts++;
+		}
+		else
+			return;
 		udp->stop();
-		return status;
+
+		query->stored = HAL_GetTick();
+		query->status = status;
+		if (status == SUCCESS)
+		{
+			memcpy(query->address, ip.raw_address(), 4);
+			query->state = Resolved;
+			// A TTL of 0 means do not cache; keep it for a second so that the caller can still collect it.
+			query->ttl = (ttl == 0 ? 1 : ttl > DNS_MAX_TTL ? DNS_MAX_TTL : ttl) * 1000;
+		}
+		else
+		{
+			query->state = Failed;
+			query->ttl = DNS_NEGATIVE_TTL * 1000;
+		}
+		query = nullptr;
+	}
+
+
+	/**
+	 * Forgets all cached answers.
+	 */
+	void ClearCache(void)
+	{
+		for (uint8_t i=0; i < DNS_CACHE_SIZE; i++)
+			if (&cache[i] != query)
+				cache[i].state = Free;
+	}
+
+
+	Statistics* GetStatistics(void)
+	{
+		return &statistics;
 	}
 
 protected:
@@ -171,7 +317,18 @@ protected:
 				return TIMED_OUT;
 			osDelay(50);
 		}
+		return ParseResponse(ip);
+	}
+
 
+	/**
+	 * Reads the response packet that parsePacket() found.
+	 * @param ip Receives the first address in the answer.
+	 * @param ttl Receives the time to live of the address in seconds, or nullptr.
+	 * @returns SUCCESS or an error code.
+	 */
+	int ParseResponse(IPv4Address& ip, uint32_t* ttl=nullptr)
+	{
 		// We've had a reply!
 		// Read the UDP header
 		uint8_t header[DNS_HEADER_SIZE]; // Enough space to reuse for the DNS header
@@ -278,9 +435,8 @@ protected:
 			udp->read((uint8_t*)&answerType, sizeof(answerType));
 			udp->read((uint8_t*)&answerClass, sizeof(answerClass));
 
-			// Ignore the Time-To-Live as we don't do any caching
-			for (int i =0; i < TTL_SIZE; i++)
-				udp->read(); // we don't care about the returned byte
+			uint8_t answerTtl[TTL_SIZE];
+			udp->read(answerTtl, TTL_SIZE);
 
 			// And read out the length of this answer
 			// Don't need header_flags anymore, so we can reuse it here
@@ -296,6 +452,8 @@ protected:
 					return -9;//INVALID_RESPONSE;
 				}
 				udp->read(ip.raw_address(), 4);
+				if (ttl != nullptr)
+					*ttl = (uint32_t)answerTtl[0] << 24 | (uint32_t)answerTtl[1] << 16 | answerTtl[2] << 8 | answerTtl[3];
 				return SUCCESS;
 			}
 			else
@@ -314,9 +472,72 @@ protected:
 	}
 
 private:
+	enum State : uint8_t { Free, Querying, Resolved, Failed };
+
+	/**
+	 * @brief	What is known about one hostname.
+	 */
+	typedef struct Entry
+	{
+		uint32_t hash;  /// Of the hostname, without regard to case.
+		uint8_t length;  /// Of the hostname; guards against most collisions of the hash.
+		State state;
+		int8_t status;  /// SUCCESS or the error code.
+		uint8_t address[4];
+		uint32_t stored;  /// When the answer arrived.
+		uint32_t ttl;  /// Milliseconds that the answer is kept.
+		uint32_t used;  /// When last looked up.
+	} Entry;
+
+
+	static uint32_t Hash(const char* hostname, uint8_t* length)
+	{
+		uint32_t hash = 2166136261u;  // FNV-1a
+		const char* p = hostname;
+		for (; *p; p++)
+		{
+			char c = *p >= 'A' && *p <= 'Z' ? *p + ('a' - 'A') : *p;
+			hash = (hash ^ (uint8_t)c) * 16777619u;
+		}
+		*length = p - hostname;
+		return hash;
+	}
+
+
+	Entry* Find(uint32_t hash, uint8_t length)
+	{
+		for (uint8_t i=0; i < DNS_CACHE_SIZE; i++)
+			if (cache[i].state != Free && cache[i].hash == hash && cache[i].length == length)
+				return &cache[i];
+		return nullptr;
+	}
+
+
+	/**
+	 * Chooses the entry to hold a new hostname: a free one, or else the least recently used.
+	 */
+	Entry* Replace(void)
+	{
+		Entry* oldest = nullptr;
+		for (uint8_t i=0; i < DNS_CACHE_SIZE; i++)
+		{
+			Entry* entry = &cache[i];
+			if (entry->state == Free)
+				return entry;
+			if (entry != query && (oldest == nullptr || (int32_t)(entry->used - oldest->used) < 0))
+				oldest = entry;
+		}
+		return oldest;
+	}
+
+
 	IPv4Address resolver;
 	uint16_t iRequestId = 0;
 	IUdp* udp;
+	Entry cache[DNS_CACHE_SIZE] = {};
+	Entry* query = nullptr;  /// The entry whose query is outstanding.
+	uint32_t query_sent = 0;
+	Statistics statistics = {};
 };
 
 #endif
@@ -10,8 +10,57 @@
 
 #include <comms/ethernet/w5500/TcpClient.h>
 #include <comms/tcpip/IPv4Address.h>
+#include <comms/tcpip/MqttTopicTrie.h>
 #include <string.h>
 
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT (4)  // QoS 1 messages that may await PUBACK at once.
+#endif
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE (256)  // Largest QoS 1 packet kept for resending, and largest packet received.
+#endif
+
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+#define MQTT_MAX_SUBSCRIPTIONS (8)  // Topic filters that may be subscribed to at once.
+#endif
+
+#ifndef MQTT_ACK_TIMEOUT
+#define MQTT_ACK_TIMEOUT (5000)  // Milliseconds to wait for TCP, CONNACK, PUBACK or PINGRESP before reconnecting.
+#endif
+
+#ifndef MQTT_RECONNECT_MIN
+#define MQTT_RECONNECT_MIN (500)  // Milliseconds before the first attempt to reconnect.
+#endif
+
+#ifndef MQTT_RECONNECT_MAX
+#define MQTT_RECONNECT_MAX (30000)  // Longest wait between attempts to reconnect; the wait doubles up to this.
+#endif
+
+#ifndef MQTT_SESSION_EXPIRY
+#define MQTT_SESSION_EXPIRY (32)  // Seconds that the broker keeps the session after the connection is lost.
+#endif
+
+
+/**
+ * An MQTT 5 client that keeps one session open.
+ *
+ * Call poll() often, from the task that publishes. Nothing blocks: connect() only starts connecting, and poll() then
+ * waits for the TCP connection and for CONNACK, each for up to MQTT_ACK_TIMEOUT, without stopping the task. poll()
+ * also reads what the broker sends, sends PINGREQ to honour keep_alive, and reconnects after the connection is lost,
+ * waiting from MQTT_RECONNECT_MIN to MQTT_RECONNECT_MAX between attempts.
+ *
+ * QoS 1 messages are kept until acknowledged, up to a window of MQTT_MAX_INFLIGHT (or the broker's Receive Maximum),
+ * and are sent again with the DUP flag when the session is resumed. MQTT 5 allows resending only then, so a PUBACK
+ * that does not arrive within MQTT_ACK_TIMEOUT is taken to mean that the connection is lost. The broker keeps the
+ * session for MQTT_SESSION_EXPIRY seconds; if it did not, the messages are discarded, as MQTT 5 requires, and
+ * counted in Statistics::expired.
+ *
+ * Messages on subscribed topics are passed to the IHandler of each matching filter from poll(), straight from the
+ * receive buffer. Filters are routed through an MqttTopicTrie, so the cost of a message depends on the depth of its
+ * topic rather than the number of subscriptions. The broker is told not to send packets larger than
+ * MQTT_MAX_PACKET_SIZE; any that arrive anyway are discarded.
+ */
 class MqttClient : public TcpClient
 {
 protected:
@@ -47,6 +96,10 @@ protected:
 	static const constexpr uint8_t FlagsDisconnect  = 0b0000;
 	static const constexpr uint8_t FlagsAuthenticate = 0b0000;
 
+	static const constexpr uint8_t PublishFlagDuplicate = 0b1000;
+	static const constexpr uint8_t PublishFlagQoS1 = 0b0010;
+	static const constexpr uint8_t PublishFlagRetain = 0b0001;
+
 	static const constexpr uint8_t ConnectFlagUsername = 0x80;
 	static const constexpr uint8_t ConnectFlagPassword = 0x40;
 	static const constexpr uint8_t ConnectFlagWillRetain = 0x20;
@@ -58,8 +111,60 @@ protected:
 	static const constexpr uint8_t PropertySessionExpiryInterval = 0x11;
 	static const constexpr uint8_t PropertyPayloadFormatIndicator = 0x01;
 	static const constexpr uint8_t PropertyMessageExpiryInterval = 0x01;
+	static const constexpr uint8_t PropertyServerKeepAlive = 0x13;
+	static const constexpr uint8_t PropertyReceiveMaximum = 0x21;
+	static const constexpr uint8_t PropertyTopicAliasMaximum = 0x22;
+	static const constexpr uint8_t PropertyMaximumPacketSize = 0x27;
 
 public:
+	/**
+	 * Receives the messages on a subscribed topic. Called from poll().
+	 */
+	class IHandler
+	{
+	public:
+		/**
+		 * Called when a message arrives on a topic that matches the filter.
+		 * @param topic The topic name, which is not terminated.
+		 * @param topic_length The length of the topic name.
+		 * @param payload The payload, in the client's receive buffer: valid only during the call.
+		 * @param length The length of the payload.
+		 */
+		virtual void on_message(const char* topic, uint16_t topic_length, const uint8_t* payload, uint32_t length) = 0;
+	};
+
+	/**
+	 * @brief	Counts of what the session has done.
+	 */
+	typedef struct Statistics
+	{
+		uint32_t published;  /// Messages accepted by publish().
+		uint32_t acknowledged;  /// QoS 1 messages acknowledged by the broker.
+		uint32_t rejected;  /// QoS 1 messages acknowledged with a failure reason code.
+		uint32_t resent;  /// QoS 1 messages sent again after reconnecting.
+		uint32_t pings;  /// PINGREQs sent.
+		uint32_t connects;  /// Sessions established.
+		uint32_t disconnects;  /// Connections lost.
+		uint32_t received;  /// Messages received on subscribed topics.
+		uint32_t unmatched;  /// Messages received that matched no filter.
+		uint32_t refused;  /// Subscriptions refused by the broker.
+		uint32_t discarded;  /// Packets from the broker too large to receive.
+		uint32_t expired;  /// QoS 1 messages discarded unacknowledged because the broker did not keep the session.
+	} Statistics;
+
+
+	/**
+	 * @brief	Where the client is in connecting to the broker.
+	 */
+	enum State : uint8_t
+	{
+		Idle,  /// Not connected: poll() connects again once the wait after the last attempt has passed.
+		Connecting,  /// Waiting for the TCP connection.
+		Handshaking,  /// CONNECT sent; waiting for CONNACK.
+		Connected  /// The session is open.
+	};
+
+
 	MqttClient(Socket* socket, IPv4Address broker, const char* client_id, uint16_t keep_alive=60, uint16_t port=1883) : TcpClient(socket)
 	{
 		this->broker = broker;
@@ -69,54 +174,107 @@ public:
 	}
 
 
+	/**
+	 * Starts connecting to the broker; poll() carries on until the broker accepts the session, or the attempt fails
+	 * and poll() tries again later. The first connection starts a clean session; later ones resume it and resend
+	 * unacknowledged QoS 1 messages.
+	 * @returns True if connecting has started; false if the socket could not be opened.
+	 */
 	bool connect(void)
 	{
-		bool ret = TcpClient::connect(broker, port);
-		if (!ret)
+		attempted = true;
+		if (state != Idle)
+			drop();
+		last_attempt = HAL_GetTick();
+		if (!socket->open(SnMR::TCP, assign_local_port(), 0))
+		{
+			back_off();
 			return false;
+		}
+		socket->connect(broker.raw_address(), port);
+		state = Connecting;
+		return true;
+	}
 
-		const uint8_t properties_length = 5;
-		const uint8_t client_id_length = strlen(client_id);
-		uint16_t protocol_name_length = 4;
-		uint8_t control_header = Connect | FlagsConnect;
-		uint8_t packet_length = 1 + 1 + 2 + protocol_name_length + 1 + 1 + 2 + properties_length + 1 + client_id_length;
-		const char* protocol_name = "MQTT";
-		const uint8_t protocol_version = 5;
-		const uint8_t connect_flags = ConnectFlagCleanStart;
-		const uint8_t property = PropertySessionExpiryInterval;
-		const uint32_t property_value = 0x00000020;
-
-		// Flush read buffer.
-		flush_read();
-
-		// Fixed header
-		write(control_header);
-		write(packet_length);
-		write16(protocol_name_length);
-		write(protocol_name, protocol_name_length);
-		write(protocol_version);
-
-		// Variable header
-		write(connect_flags);
-		write16(keep_alive);
-		write(properties_length);
-		write(property);
-		write32(property_value);
-		write16(client_id_length);
-		write(client_id, client_id_length);
-		flush_write();
-
-		// Get ACK response.
-		osDelay(100);
-		control_header = read();
-		packet_length = read();
-		while (available())
-			read();
-
-		connected = control_header == ConnectAck;
-		return connected;
+
+	/**
+	 * Ends the session cleanly. Unacknowledged QoS 1 messages are discarded.
+	 */
+	void disconnect(void)
+	{
+		if (state == Connected)
+		{
+			uint8_t packet[] = { Disconnect | FlagsDisconnect, 0 };
+			write(packet, sizeof(packet));
+			stop();
+		}
+		else if (state != Idle)
+			socket->close();
+		state = Idle;
+		session_started = false;
+		attempted = false;
+		inflight_head = inflight_count = 0;
+	}
+
+
+	/**
+	 * Subscribes to a topic filter, now if connected and otherwise on connecting.
+	 * @param filter The topic filter, which may contain `+` and `#` wildcards. It is kept by pointer, to subscribe
+	 *        again on reconnecting, so it must stay valid until unsubscribe(); after that it may be freed or reused.
+	 * @param handler Receives the messages.
+	 * @param qos The maximum QoS of the messages: 0 or 1.
+	 * @returns True if subscribed, or to be on connecting; false if the filter is invalid, there is no room, or the
+	 *          connection was lost.
+	 */
+	bool subscribe(const char* filter, IHandler* handler, uint8_t qos=0)
+	{
+		uint8_t index = find_subscription(filter);
+		if (index == MqttTopicTrie::None)
+			index = find_subscription(nullptr);
+		if (index == MqttTopicTrie::None || !topics.insert(filter, index))
+			return false;
+
+		Subscription* subscription = &subscriptions[index];
+		subscription->filter = filter;
+		subscription->handler = handler;
+		subscription->qos = qos > 0 ? 1 : 0;
+		subscription->packet_id = 0;
+		return state != Connected || send_subscribe(subscription);
+	}
+
+
+	/**
+	 * Unsubscribes from a topic filter.
+	 * @param filter The topic filter, as given to subscribe().
+	 * @returns True if unsubscribed; false if not subscribed or the connection was lost.
+	 */
+	bool unsubscribe(const char* filter)
+	{
+		uint8_t index = topics.remove(filter);
+		if (index == MqttTopicTrie::None)
+			return false;
+		subscriptions[index].filter = nullptr;
+		if (state != Connected)
+			return true;
+
+		const uint16_t filter_length = strlen(filter);
+		const uint16_t id = next_packet_id();
+		const uint8_t variable_header[] = {
+			(uint8_t)(id >> 8), (uint8_t)id,
+			0,  // Properties length
+			(uint8_t)(filter_length >> 8), (uint8_t)filter_length
+		};
+		uint8_t fixed_header[5];
+		IoVec packet[] = {
+			{ fixed_header, encode_fixed_header(fixed_header, Unsubscribe | FlagsUnsubscribe,
+					sizeof(variable_header) + filter_length) },
+			{ variable_header, sizeof(variable_header) },
+			{ filter, filter_length }
+		};
+		return send(packet, 3);
 	}
 
+
 	void write16(uint16_t value)
 	{
 		write(value >> 8);
@@ -131,44 +289,752 @@ public:
 		write(value & 0xff);
 	}
 
-	bool publish(const char* topic, uint8_t* data, uint16_t length)
+
+	/**
+	 * Publishes a message. Starts connecting if connect() has not been called.
+	 * @param topic The topic name.
+	 * @param data The payload.
+	 * @param length The length of the payload.
+	 * @param qos 0 to send at most once; 1 to send at least once.
+	 * @param retain True if the broker should keep the message for future subscribers.
+	 * @returns True if the message was sent, or for QoS 1 queued in the session; false if not connected, or the QoS 1
+	 *          window is full, or the packet is larger than MQTT_MAX_PACKET_SIZE.
+	 */
+	bool publish(const char* topic, const void* data, uint16_t length, uint8_t qos=0, bool retain=false)
 	{
-		bool ret = TcpClient::connect(broker, port);
-		if (!ret)
+		if (state != Connected)
+		{
+			if (!attempted)
+				connect();
 			return false;
+		}
 
-		flush_read();
 		const uint16_t topic_length = strlen(topic);
+		const uint8_t flags = (qos > 0 ? PublishFlagQoS1 : 0) | (retain ? PublishFlagRetain : 0);
+		const uint32_t remaining = 2 + topic_length + (qos > 0 ? 2 : 0) + 1 + length;
+		const uint8_t properties_length = 0;
 
-		// Fixed header
-		write(Publish | FlagsPublish);  // Control header
-		write(2 + topic_length + 1 + length);  // Remaining packet length
+		if (qos == 0)
+		{
+			const uint8_t variable_header[] = { (uint8_t)(topic_length >> 8), (uint8_t)topic_length };
+			uint8_t fixed_header[5];
+			IoVec packet[] = {
+				{ fixed_header, encode_fixed_header(fixed_header, Publish | FlagsPublish | flags, remaining) },
+				{ variable_header, sizeof(variable_header) },  // Length of topic name.
+				{ topic, topic_length },  // Topic name.
+				{ &properties_length, 1 },
+				{ data, length }
+			};
+			if (!send(packet, 5))
+				return false;
+			statistics.published++;
+			return true;
+		}
 
-		// Variable header
-		write16(topic_length);  // Length of topic name.
-		write(topic, topic_length);  // Topic name.
-		write((uint8_t)0); // Properties length.
+		if (remaining + 5 > MQTT_MAX_PACKET_SIZE)
+			return false;
+		if (inflight_count >= window)
+			receive();  // Perhaps a PUBACK is waiting.
+		if (inflight_count >= window || state != Connected)
+			return false;
 
-		// Data
-		write(data, length);
-		flush_write();
-		osDelay(100);
+		// Build the packet where it is kept until acknowledged.
+		Inflight* message = &inflight[(inflight_head + inflight_count) % MQTT_MAX_INFLIGHT];
+		uint16_t id = next_packet_id();
+		uint8_t* p = message->packet;
+		p += encode_fixed_header(p, Publish | FlagsPublish | flags, remaining);
+		*p++ = topic_length >> 8;
+		*p++ = topic_length;
+		memcpy(p, topic, topic_length);
+		p += topic_length;
+		*p++ = id >> 8;
+		*p++ = id;
+		*p++ = properties_length;
+		memcpy(p, data, length);
+		p += length;
+		message->packet_id = id;
+		message->length = p - message->packet;
+		message->acknowledged = false;
+		inflight_count++;
+		statistics.published++;
 
-		flush_read();
+		IoVec packet = { message->packet, message->length };
+		message->sent_at = HAL_GetTick();
+		send(&packet, 1);  // If the connection is lost, it is sent again on reconnecting.
 		return true;
 	}
 
+
+	/**
+	 * Reads and handles what the broker has sent, keeps the connection alive, and connects or reconnects as needed.
+	 * Call often.
+	 */
+	void poll(void)
+	{
+		uint32_t now = HAL_GetTick();
+		switch (state)
+		{
+		case Idle:
+			if (attempted && now - last_attempt >= backoff)
+				connect();
+			return;
+
+		case Connecting:
+		{
+			uint8_t status = socket->status();
+			if (status == SnSR::ESTABLISHED)
+				send_connect();
+			else if (status == SnSR::CLOSED || now - last_attempt >= MQTT_ACK_TIMEOUT)
+				drop();
+			return;
+		}
+
+		case Handshaking:
+			if (receive() && !accepted && now - last_sent >= MQTT_ACK_TIMEOUT)
+				drop();
+			if (accepted && state == Handshaking)
+				establish();
+			return;
+
+		case Connected:
+			break;
+		}
+		if (!receive())
+			return;
+
+		now = HAL_GetTick();
+		if (inflight_count > 0 && now - inflight[inflight_head].sent_at >= MQTT_ACK_TIMEOUT)
+		{
+			drop();  // No PUBACK: resend after reconnecting.
+			return;
+		}
+		if (ping_sent != 0)
+		{
+			if (now - ping_sent >= MQTT_ACK_TIMEOUT)
+				drop();
+			return;
+		}
+		if (server_keep_alive > 0 && now - last_sent >= server_keep_alive * 1000u / 2)
+		{
+			uint8_t packet[] = { PingRequest | FlagsPingRequest, 0 };
+			IoVec iov = { packet, sizeof(packet) };
+			if (send(&iov, 1))
+			{
+				ping_sent = now ? now : 1;
+				statistics.pings++;
+			}
+		}
+	}
+
+
 	bool is_connected(void)
 	{
-		return connected;
+		return state == Connected;
+	}
+
+
+	State get_state(void)
+	{
+		return state;
+	}
+
+
+	/**
+	 * Gets the number of QoS 1 messages awaiting PUBACK.
+	 */
+	uint8_t get_inflight(void)
+	{
+		return inflight_count;
+	}
+
+
+	/**
+	 * Limits the number of QoS 1 messages that may await PUBACK at once.
+	 * @param size 1 to MQTT_MAX_INFLIGHT. The broker's Receive Maximum, if lower, applies on connecting.
+	 */
+	void set_window(uint8_t size)
+	{
+		window = size < 1 ? 1 : size > MQTT_MAX_INFLIGHT ? MQTT_MAX_INFLIGHT : size;
+		window_limit = window;
+	}
+
+
+	/**
+	 * Sends packets that the caller has encoded, such as a batch of QoS 0 PUBLISH packets, in one write. Starts
+	 * connecting if connect() has not been called.
+	 * @param iov The pieces of the packets.
+	 * @param count The number of pieces.
+	 * @returns True if sent; false if not connected, or the connection was lost.
+	 */
+	bool send_encoded(const IoVec* iov, uint8_t count)
+	{
+		if (state != Connected)
+		{
+			if (!attempted)
+				connect();
+			return false;
+		}
+		return send(iov, count);
+	}
+
+
+	/**
+	 * Gets the highest topic alias that the broker accepts in this session; 0 if none.
+	 */
+	uint16_t get_topic_alias_maximum(void)
+	{
+		return state == Connected ? topic_alias_maximum : 0;
+	}
+
+
+	Statistics* get_statistics(void)
+	{
+		return &statistics;
+	}
+
+protected:
+	/**
+	 * Encodes the fixed header of a packet: the control byte and the remaining length as a variable byte integer.
+	 * @param buf Receives the header (up to 5 bytes).
+	 * @param control The packet type and flags.
+	 * @param remaining The length of the rest of the packet.
+	 * @returns The length of the header.
+	 */
+	static uint8_t encode_fixed_header(uint8_t* buf, uint8_t control, uint32_t remaining)
+	{
+		uint8_t n = 0;
+		buf[n++] = control;
+		do
+		{
+			uint8_t digit = remaining % 128;
+			remaining /= 128;
+			buf[n++] = remaining ? digit | 0x80 : digit;
+		} while (remaining && n < 5);
+		return n;
+	}
+
+
+	/**
+	 * Decodes a variable byte integer.
+	 * @param buf The encoded value.
+	 * @param length The bytes available.
+	 * @param value Receives the value.
+	 * @returns The number of bytes used, or 0 if more are needed.
+	 */
+	static uint8_t decode_variable(const uint8_t* buf, uint32_t length, uint32_t* value)
+	{
+		*value = 0;
+		for (uint8_t n=0; n < 4 && n < length; n++)
+		{
+			*value |= (uint32_t)(buf[n] & 0x7f) << (7 * n);
+			if (!(buf[n] & 0x80))
+				return n + 1;
+		}
+		return 0;
+	}
+
+
+	/**
+	 * Handles one packet from the broker.
+	 * @param control The first byte: the packet type and flags.
+	 * @param body The rest of the packet, after the remaining length.
+	 * @param length The length of the body.
+	 */
+	virtual void on_packet(uint8_t control, const uint8_t* body, uint32_t length)
+	{
+		switch (control & 0xf0)
+		{
+		case ConnectAck:
+			// Flags, reason code, properties.
+			if (length < 2 || body[1] != 0)
+			{
+				drop();
+				break;
+			}
+			if (length > 2)
+				read_connect_properties(body + 2, length - 2);
+			session_present = body[0] & 0x01;
+			accepted = true;
+			break;
+
+		case PublishAck:
+			if (length >= 2)
+				acknowledge((body[0] << 8) | body[1], length > 2 ? body[2] : 0);
+			break;
+
+		case Publish:
+			deliver(control, body, length);
+			break;
+
+		case SubscribeAck:
+			// Packet identifier, properties, then a reason code for the one filter.
+			if (length >= 3)
+				refuse((body[0] << 8) | body[1], body + 2, length - 2);
+			break;
+
+		case PingResponse:
+			ping_sent = 0;
+			break;
+
+		case Disconnect:
+			drop();
+			break;
+
+		default:
+			break;  // UNSUBACK needs no action; nothing else is expected at QoS 0 and 1.
+		}
+	}
+
+
+	/**
+	 * Sends a packet and notes the time for keep-alive.
+	 * @returns True if sent; false if the connection was lost.
+	 */
+	bool send(const IoVec* iov, uint8_t count)
+	{
+		if (!writev(iov, count))
+		{
+			drop();
+			return false;
+		}
+		last_sent = HAL_GetTick();
+		return true;
+	}
+
+
+	/**
+	 * Closes the connection after it has failed, or gives up an attempt to connect. poll() reconnects later, waiting
+	 * longer after each failed attempt.
+	 */
+	void drop(void)
+	{
+		if (state == Idle)
+			return;
+		if (state == Connected)
+			statistics.disconnects++;
+		else
+			back_off();
+		state = Idle;
+		socket->close();
+		last_attempt = HAL_GetTick();
 	}
 
 private:
+	/**
+	 * @brief	A topic filter subscribed to.
+	 */
+	typedef struct Subscription
+	{
+		const char* filter;  /// The filter, or nullptr if the slot is free.
+		IHandler* handler;
+		uint8_t qos;
+		uint16_t packet_id;  /// Of the last SUBSCRIBE sent, or 0 if not sent in this session.
+	} Subscription;
+
+
+	/**
+	 * @brief	A QoS 1 message awaiting PUBACK.
+	 */
+	typedef struct Inflight
+	{
+		uint16_t packet_id;
+		uint16_t length;
+		uint32_t sent_at;
+		bool acknowledged;
+		uint8_t packet[MQTT_MAX_PACKET_SIZE];
+	} Inflight;
+
+
+	/**
+	 * Sends CONNECT once the TCP connection is established.
+	 */
+	void send_connect(void)
+	{
+		const uint8_t client_id_length = strlen(client_id);
+		const uint8_t protocol_version = 5;
+		const uint8_t connect_flags = session_started ? 0 : ConnectFlagCleanStart;
+		const uint32_t session_expiry = MQTT_SESSION_EXPIRY;
+		const uint8_t variable_header[] = {
+			0, 4, 'M', 'Q', 'T', 'T',  // Protocol name
+			protocol_version,
+			connect_flags,
+			(uint8_t)(keep_alive >> 8), (uint8_t)keep_alive,
+			10,  // Properties length
+			PropertySessionExpiryInterval,
+			(uint8_t)(session_expiry >> 24), (uint8_t)(session_expiry >> 16), (uint8_t)(session_expiry >> 8),
+			(uint8_t)session_expiry,
+			PropertyMaximumPacketSize,
+			0, 0, (uint8_t)(MQTT_MAX_PACKET_SIZE >> 8), (uint8_t)MQTT_MAX_PACKET_SIZE,
+			0, client_id_length  // Payload: client ID
+		};
+
+		rx_length = 0;
+		rx_skip = 0;
+		ping_sent = 0;
+		accepted = false;
+		session_present = false;
+		window = window_limit;
+		server_keep_alive = keep_alive;
+		topic_alias_maximum = 0;
+
+		uint8_t fixed_header[5];
+		IoVec packet[] = {
+			{ fixed_header, encode_fixed_header(fixed_header, Connect | FlagsConnect,
+					sizeof(variable_header) + client_id_length) },
+			{ variable_header, sizeof(variable_header) },
+			{ client_id, client_id_length }
+		};
+		state = Handshaking;
+		send(packet, 3);
+	}
+
+
+	/**
+	 * Opens the session once the broker has accepted it. Unacknowledged QoS 1 messages are sent again if the broker
+	 * kept the session, and discarded if it did not.
+	 */
+	void establish(void)
+	{
+		state = Connected;
+		session_started = true;
+		backoff = MQTT_RECONNECT_MIN;
+		statistics.connects++;
+		if (!session_present)
+		{
+			statistics.expired += inflight_count;
+			inflight_head = inflight_count = 0;
+		}
+		resend();
+		resubscribe();
+	}
+
+
+	/**
+	 * Reads what has arrived and handles each complete packet.
+	 * @returns False if the connection was lost.
+	 */
+	bool receive(void)
+	{
+		if (receiving)
+			return is_open();  // Called by a handler: the packets are already being read.
+		receiving = true;
+		while (is_open())
+		{
+			int16_t n = socket->recv(rx + rx_length, sizeof(rx) - rx_length);
+			if (n == 0)
+				drop();
+			if (n <= 0)
+				break;
+
+			rx_length += n;
+			uint16_t used = 0;
+			while (used < rx_length && is_open())
+			{
+				if (rx_skip > 0)
+				{
+					uint32_t skip = rx_skip < (uint32_t)(rx_length - used) ? rx_skip : rx_length - used;
+					rx_skip -= skip;
+					used += skip;
+					continue;
+				}
+
+				uint32_t remaining;
+				uint8_t header = rx_length - used < 2 ? 0 :
+						decode_variable(rx + used + 1, rx_length - used - 1, &remaining);
+				if (header == 0)
+					break;  // The header is incomplete.
+				uint32_t total = 1 + header + remaining;
+				if (total > sizeof(rx))
+				{
+					rx_skip = total;  // Too large to hold: discard it.
+					statistics.discarded++;
+					continue;
+				}
+				if (total > (uint32_t)(rx_length - used))
+					break;  // The packet is incomplete.
+				on_packet(rx[used], rx + used + 1 + header, remaining);
+				used += total;
+			}
+			memmove(rx, rx + used, rx_length - used);
+			rx_length -= used;
+		}
+		receiving = false;
+		return is_open();
+	}
+
+
+	/**
+	 * Determines whether MQTT packets can be exchanged: CONNECT has been sent on an established connection.
+	 */
+	bool is_open(void)
+	{
+		return state == Handshaking || state == Connected;
+	}
+
+
+	/**
+	 * Passes a PUBLISH from the broker to the handlers of the filters that match its topic, and acknowledges it.
+	 */
+	void deliver(uint8_t control, const uint8_t* body, uint32_t length)
+	{
+		uint8_t qos = (control >> 1) & 0x03;
+		if (length < 2)
+			return;
+		uint16_t topic_length = (body[0] << 8) | body[1];
+		uint32_t p = 2 + topic_length;
+		uint16_t id = 0;
+		if (qos > 0)
+		{
+			if (length < p + 2)
+				return;
+			id = (body[p] << 8) | body[p + 1];
+			p += 2;
+		}
+		uint32_t properties;
+		uint8_t n = p < length ? decode_variable(body + p, length - p, &properties) : 0;
+		if (n == 0 || length < p + n + properties)
+			return;
+		p += n + properties;
+
+		const char* topic = (const char*)body + 2;
+		statistics.received++;
+		uint8_t matched = topics.match(topic, topic_length, [&](uint8_t index) {
+			subscriptions[index].handler->on_message(topic, topic_length, body + p, length - p);
+		});
+		if (matched == 0)
+			statistics.unmatched++;
+
+		if (qos == 1 && state == Connected)
+		{
+			uint8_t packet[] = { PublishAck | FlagsPublishAck, 2, (uint8_t)(id >> 8), (uint8_t)id };
+			IoVec iov = { packet, sizeof(packet) };
+			send(&iov, 1);
+		}
+	}
+
+
+	/**
+	 * Counts a SUBACK that refuses a subscription.
+	 */
+	void refuse(uint16_t id, const uint8_t* buf, uint32_t length)
+	{
+		uint32_t properties;
+		uint8_t n = decode_variable(buf, length, &properties);
+		if (n == 0 || length <= n + properties)
+			return;
+		if (buf[n + properties] >= 0x80)
+		{
+			statistics.refused++;
+			for (uint8_t i=0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+				if (subscriptions[i].filter != nullptr && subscriptions[i].packet_id == id)
+					subscriptions[i].packet_id = 0;
+		}
+	}
+
+
+	/**
+	 * Finds the slot of a filter.
+	 * @param filter The filter, or nullptr for a free slot.
+	 * @returns The slot, or MqttTopicTrie::None.
+	 */
+	uint8_t find_subscription(const char* filter)
+	{
+		for (uint8_t i=0; i < MQTT_MAX_SUBSCRIPTIONS; i++)
+		{
+			const char* f = subscriptions[i].filter;
+			if (filter == nullptr ? f == nullptr : f != nullptr && strcmp(f, filter) == 0)
+				return i;
+		}
+		return MqttTopicTrie::None;
+	}
+
+
+	bool send_subscribe(Subscription* subscription)
+	{
+		const uint16_t filter_length = strlen(subscription->filter);
+		const uint16_t id = next_packet_id();
+		const uint8_t variable_header[] = {
+			(uint8_t)(id >> 8), (uint8_t)id,
+			0,  // Properties length
+			(uint8_t)(filter_length >> 8), (uint8_t)filter_length
+		};
+		const uint8_t options = subscription->qos;
+		uint8_t fixed_header[5];
+		IoVec packet[] = {
+			{ fixed_header, encode_fixed_header(fixed_header, Subscribe | FlagsSubscribe,
+					sizeof(variable_header) + filter_length + 1) },
+			{ variable_header, sizeof(variable_header) },
+			{ subscription->filter, filter_length },
+			{ &options, 1 }
+		};
+		if (!send(packet, 4))
+			return false;
+		subscription->packet_id = id;
+		return true;
+	}
+
+
+	/**
+	 * Sends SUBSCRIBE for the filters the broker does not have: all of them unless it kept the session.
+	 */
+	void resubscribe(void)
+	{
+		for (uint8_t i=0; i < MQTT_MAX_SUBSCRIPTIONS && state == Connected; i++)
+		{
+			Subscription* subscription = &subscriptions[i];
+			if (subscription->filter == nullptr || (session_present && subscription->packet_id != 0))
+				continue;
+			send_subscribe(subscription);
+		}
+	}
+
+
+	void back_off(void)
+	{
+		backoff = backoff * 2 > MQTT_RECONNECT_MAX ? MQTT_RECONNECT_MAX : backoff * 2;
+	}
+
+
+	/**
+	 * Sends the unacknowledged QoS 1 messages of a resumed session again, in order, with the DUP flag.
+	 */
+	void resend(void)
+	{
+		for (uint8_t i=0; i < inflight_count && state == Connected; i++)
+		{
+			Inflight* message = &inflight[(inflight_head + i) % MQTT_MAX_INFLIGHT];
+			if (message->acknowledged)
+				continue;
+			message->packet[0] |= PublishFlagDuplicate;
+			message->sent_at = HAL_GetTick();
+			IoVec packet = { message->packet, message->length };
+			if (send(&packet, 1))
+				statistics.resent++;
+		}
+	}
+
+
+	/**
+	 * Releases the QoS 1 message with a packet identifier.
+	 */
+	void acknowledge(uint16_t id, uint8_t reason)
+	{
+		for (uint8_t i=0; i < inflight_count; i++)
+		{
+			Inflight* message = &inflight[(inflight_head + i) % MQTT_MAX_INFLIGHT];
+			if (message->packet_id != id || message->acknowledged)
+				continue;
+			message->acknowledged = true;
+			statistics.acknowledged++;
+			if (reason >= 0x80)
+				statistics.rejected++;
+			break;
+		}
+		// PUBACKs normally arrive in order; release from the oldest.
+		while (inflight_count > 0 && inflight[inflight_head].acknowledged)
+		{
+			inflight_head = (inflight_head + 1) % MQTT_MAX_INFLIGHT;
+			inflight_count--;
+		}
+	}
+
+
+	uint16_t next_packet_id(void)
+	{
+		for (;;)
+		{
+			if (++packet_id == 0)
+				packet_id = 1;
+			bool used = false;
+			for (uint8_t i=0; i < inflight_count; i++)
+				used |= inflight[(inflight_head + i) % MQTT_MAX_INFLIGHT].packet_id == packet_id;
+			if (!used)
+				return packet_id;
+		}
+	}
+
+
+	/**
+	 * Reads the CONNACK properties that matter here: the broker's Receive Maximum and Server Keep Alive.
+	 */
+	void read_connect_properties(const uint8_t* buf, uint32_t length)
+	{
+		uint32_t properties;
+		uint8_t n = decode_variable(buf, length, &properties);
+		if (n == 0)
+			return;
+		const uint8_t* p = buf + n;
+		const uint8_t* end = p + (properties < length - n ? properties : length - n);
+		while (p < end)
+		{
+			uint8_t id = *p++;
+			uint32_t size;
+			switch (id)
+			{
+			case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2a:
+				size = 1;
+				break;
+			case 0x13: case 0x21: case 0x22: case 0x23:
+				size = 2;
+				break;
+			case 0x02: case 0x11: case 0x18: case 0x27:
+				size = 4;
+				break;
+			case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1a: case 0x1c: case 0x1f:
+				size = end - p < 2 ? 0 : 2 + ((p[0] << 8) | p[1]);
+				break;
+			case 0x26:  // User property: a pair of strings.
+				size = end - p < 2 ? 0 : 2 + ((p[0] << 8) | p[1]);
+				if ((uint32_t)(end - p) >= size + 2)
+					size += 2 + ((p[size] << 8) | p[size + 1]);
+				break;
+			default:
+				return;  // Unknown: the rest cannot be parsed.
+			}
+			if (size == 0 || (uint32_t)(end - p) < size)
+				return;
+			if (id == PropertyReceiveMaximum)
+			{
+				uint16_t maximum = (p[0] << 8) | p[1];
+				window = maximum < window_limit ? maximum : window_limit;
+			}
+			else if (id == PropertyServerKeepAlive)
+				server_keep_alive = (p[0] << 8) | p[1];
+			else if (id == PropertyTopicAliasMaximum)
+				topic_alias_maximum = (p[0] << 8) | p[1];
+			p += size;
+		}
+	}
+
+
 	IPv4Address broker;
 	uint16_t port;
 	const char* client_id;
 	uint16_t keep_alive;
-	bool connected;
+	uint16_t server_keep_alive = 0;  /// keep_alive, unless the broker set another.
+	uint16_t topic_alias_maximum = 0;
+	State state = Idle;
+	bool accepted = false;  /// CONNACK received.
+	bool attempted = false;  /// connect() has been called, so reconnecting is wanted.
+	bool session_started = false;
+	bool session_present = false;  /// The broker resumed the session.
+	uint32_t last_attempt = 0;
+	uint32_t backoff = MQTT_RECONNECT_MIN;
+	uint32_t last_sent = 0;
+	uint32_t ping_sent = 0;  /// When an unanswered PINGREQ was sent, or 0.
+	uint16_t packet_id = 0;
+	uint8_t window = MQTT_MAX_INFLIGHT;
+	uint8_t window_limit = MQTT_MAX_INFLIGHT;
+	Inflight inflight[MQTT_MAX_INFLIGHT];
+	uint8_t inflight_head = 0;
+	uint8_t inflight_count = 0;
+	uint8_t rx[MQTT_MAX_PACKET_SIZE];
+	uint16_t rx_length = 0;
+	uint32_t rx_skip = 0;  /// Bytes still to discard of a packet too large to hold.
+	bool receiving = false;  /// receive() is running, perhaps in a handler.
+	MqttTopicTrie topics;
+	Subscription subscriptions[MQTT_MAX_SUBSCRIPTIONS] = {};
+	Statistics statistics = {};
 };
 
 #endif /* LIB_STM32_TOOLBOX_COMMS_ETHERNET_MQTTCLIENT_H_ */
@@ -0,0 +1,253 @@
+/**
+ * \file       comms/tcpip/MqttTelemetry.h
+ * \class      MqttTelemetry
+ * \brief      Publishes frequent small readings through an MqttClient in batches, one socket write per interval.
+ * \notes	   Messages are sent at QoS 0. Call poll() often, as well as MqttClient::poll().
+ */
+
+#ifndef INC_COMMS_TCPIP_MQTTTELEMETRY_H_
+#define INC_COMMS_TCPIP_MQTTTELEMETRY_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "MqttClient.h"
+
+#ifndef MQTT_TELEMETRY_TOPICS
+#define MQTT_TELEMETRY_TOPICS (16)  // Topics that may be registered.
+#endif
+
+#ifndef MQTT_TELEMETRY_BUFFER
+#define MQTT_TELEMETRY_BUFFER (512)  // Bytes of PUBLISH packets collected before a write; at most the socket's TX buffer.
+#endif
+
+#ifndef MQTT_TELEMETRY_INTERVAL
+#define MQTT_TELEMETRY_INTERVAL (100)  // Milliseconds that a message may wait for others to join it.
+#endif
+
+
+/**
+ * Collects PUBLISH packets for registered topics and sends them together, so that a device publishing dozens of
+ * readings a second makes one socket write, and a few SPI transactions, per interval instead of per reading.
+ *
+ * The length and bytes of each topic name are prepared once, when the topic is registered. If the broker accepts
+ * topic aliases, each topic is given one: the first message of a session carries the name, later ones only the alias.
+ * The alias counts as known to the broker only once the batch that names it has been sent, so a batch that is dropped
+ * leaves the next message to name the topic again.
+ * A batch is sent when the interval since its first message has passed or when the next message does not fit.
+ */
+class MqttTelemetry
+{
+public:
+	static constexpr uint8_t None = 0xff;
+
+	/**
+	 * @brief	Counts of what has been sent, and what batching saved.
+	 */
+	typedef struct Statistics
+	{
+		uint32_t messages;  /// Messages published.
+		uint32_t batches;  /// Batches sent, each in one write.
+		uint32_t bytes;  /// Bytes of packets sent.
+		uint32_t bytes_saved;  /// Bytes of topic names replaced by topic aliases.
+		uint32_t transactions;  /// SPI transactions spent sending batches.
+		uint32_t transactions_saved;  /// SPI transactions that one write per message would have spent in addition.
+		uint32_t dropped;  /// Messages lost because their batch could not be sent.
+	} Statistics;
+
+
+	/**
+	 * Constructs an instance.
+	 * @param client The client that sends the batches.
+	 * @param interval The longest time in milliseconds that a message waits to be sent.
+	 */
+	MqttTelemetry(MqttClient* client, uint32_t interval=MQTT_TELEMETRY_INTERVAL)
+	{
+		this->client = client;
+		this->interval = interval;
+	}
+
+
+	/**
+	 * Registers a topic.
+	 * @param name The topic name. It is kept by pointer.
+	 * @param retain True if the broker should keep the last message for future subscribers.
+	 * @returns The handle to publish with, or None if there is no room.
+	 */
+	uint8_t add_topic(const char* name, bool retain=false)
+	{
+		if (topic_count == MQTT_TELEMETRY_TOPICS)
+			return None;
+		Topic* topic = &topics[topic_count];
+		topic->name = name;
+		topic->length = strlen(name);
+		topic->control = 0x30 | (retain ? 0x01 : 0);  // PUBLISH, QoS 0.
+		topic->session = 0;
+		topic->pending = false;
+		return topic_count++;
+	}
+
+
+	/**
+	 * Adds a message to the batch, sending the batch first if the message does not fit.
+	 * @param topic The handle from add_topic().
+	 * @param data The payload.
+	 * @param length The length of the payload.
+	 * @returns True if added; false if the handle is invalid, the message is larger than MQTT_TELEMETRY_BUFFER, or the
+	 *          batch could not be sent to make room.
+	 */
+	bool publish(uint8_t topic, const void* data, uint16_t length)
+	{
+		if (topic >= topic_count)
+			return false;
+		Topic* t = &topics[topic];
+
+		// A batch holds the messages of one session, since its aliases mean nothing in another.
+		uint32_t session = client->get_statistics()->connects;
+		if (batch_count > 0 && batch_session != session)
+			flush();
+
+		// Alias numbers start at 1.
+		bool alias = topic < client->get_topic_alias_maximum();
+		bool named = !alias || (t->session != session && !t->pending);
+		uint32_t remaining = 2 + (named ? t->length : 0) + (alias ? 4 : 1) + length;
+		uint32_t size = 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2 : 3) + remaining;
+		if (size > MQTT_TELEMETRY_BUFFER)
+			return false;
+		if (batch_length + size > MQTT_TELEMETRY_BUFFER && !flush())
+			return false;
+
+		if (batch_length == 0)
+		{
+			started = HAL_GetTick();
+			batch_session = session;
+		}
+		uint8_t* p = batch + batch_length;
+		*p++ = t->control;
+		do
+		{
+			uint8_t digit = remaining % 128;
+			remaining /= 128;
+			*p++ = remaining ? digit | 0x80 : digit;
+		} while (remaining);
+		if (named)
+		{
+			*p++ = t->length >> 8;
+			*p++ = t->length;
+			memcpy(p, t->name, t->length);
+			p += t->length;
+		}
+		else
+		{
+			*p++ = 0;
+			*p++ = 0;
+			statistics.bytes_saved += t->length;
+		}
+		if (alias)
+		{
+			*p++ = 3;  // Properties length
+			*p++ = 0x23;  // Topic alias
+			*p++ = 0;
+			*p++ = topic + 1;
+			t->pending |= named;
+			batch_aliased |= !named;
+		}
+		else
+			*p++ = 0;  // Properties length
+		memcpy(p, data, length);
+		p += length;
+
+		batch_length = p - batch;
+		batch_count++;
+		statistics.messages++;
+		return true;
+	}
+
+
+	/**
+	 * Sends the batch if its first message has waited for the interval. Call often.
+	 */
+	void poll(void)
+	{
+		if (batch_count > 0 && HAL_GetTick() - started >= interval)
+			flush();
+	}
+
+
+	/**
+	 * Sends the batch now.
+	 * @returns True if sent or empty; false if it could not be sent, and was dropped.
+	 */
+	bool flush(void)
+	{
+		if (batch_count == 0)
+			return true;
+
+		// A reconnect since the batch began forgets the aliases that it relies on.
+		bool sent = false;
+		uint32_t session = client->get_statistics()->connects;
+		if (!batch_aliased || session == batch_session)
+		{
+			Socket::OpCount* counts = &client->get_socket()->get_counters()->send;
+			uint32_t before = counts->transactions;
+			IoVec iov = { batch, batch_length };
+			sent = client->send_encoded(&iov, 1);
+			if (sent)
+			{
+				// One write per message would have cost about the same each, as the size matters little.
+				uint32_t spent = counts->transactions - before;
+				statistics.batches++;
+				statistics.bytes += batch_length;
+				statistics.transactions += spent;
+				statistics.transactions_saved += spent * (batch_count - 1);
+			}
+		}
+		if (!sent)
+			statistics.dropped += batch_count;
+		for (uint8_t i=0; i < topic_count; i++)
+		{
+			if (sent && topics[i].pending)
+				topics[i].session = session;
+			topics[i].pending = false;
+		}
+
+		batch_length = 0;
+		batch_count = 0;
+		batch_aliased = false;
+		return sent;
+	}
+
+
+	Statistics* get_statistics(void)
+	{
+		return &statistics;
+	}
+
+private:
+	/**
+	 * @brief	A registered topic.
+	 */
+	typedef struct Topic
+	{
+		const char* name;
+		uint16_t length;
+		uint8_t control;  /// The first byte of its PUBLISH packets.
+		uint32_t session;  /// The session in which its alias was last sent with its name, or 0.
+		bool pending;  /// The batch gives its name with its alias, which the broker knows once the batch is sent.
+	} Topic;
+
+
+	MqttClient* client;
+	uint32_t interval;
+	Topic topics[MQTT_TELEMETRY_TOPICS];
+	uint8_t topic_count = 0;
+	uint8_t batch[MQTT_TELEMETRY_BUFFER];
+	uint16_t batch_length = 0;
+	uint16_t batch_count = 0;
+	bool batch_aliased = false;  /// The batch has messages that give only an alias.
+	uint32_t batch_session = 0;
+	uint32_t started = 0;
+	Statistics statistics = {};
+};
+
+
+#endif /* INC_COMMS_TCPIP_MQTTTELEMETRY_H_ */
@@ -0,0 +1,291 @@
+/**
+ * \file       comms/tcpip/MqttTopicTrie.h
+ * \class      MqttTopicTrie
+ * \brief      Matches MQTT topic names against a set of topic filters with `+` and `#` wildcards.
+ * \notes	   The names of the levels are copied, so a filter need not outlive the call that inserts or removes it.
+ */
+
+#ifndef INC_COMMS_TCPIP_MQTTTOPICTRIE_H_
+#define INC_COMMS_TCPIP_MQTTTOPICTRIE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MQTT_MAX_TOPIC_NODES
+#define MQTT_MAX_TOPIC_NODES (32)  // Topic levels, across all filters, that MqttTopicTrie can hold; at most 254.
+#endif
+
+#ifndef MQTT_MAX_TOPIC_NAMES
+#define MQTT_MAX_TOPIC_NAMES (MQTT_MAX_TOPIC_NODES * 8)  // Bytes for the names of those levels, which are copied.
+#endif
+
+
+/**
+ * Holds topic filters as a tree of their levels, each level a node below the level before it in some filter. A node
+ * keeps its `+` and `#` children itself, and its other children are found through one hash table keyed on the parent
+ * and the name. Matching a topic name walks down the tree one level at a time, following the child with the same name
+ * and the `+` child, and taking the `#` child as a match of the rest. So the work grows with the depth of the topic,
+ * not with the number of filters.
+ *
+ * As MQTT requires, a topic beginning with `$` is not matched by a filter beginning with a wildcard.
+ */
+class MqttTopicTrie
+{
+public:
+	static constexpr uint8_t None = 0xff;
+
+
+	MqttTopicTrie(void)
+	{
+		clear();
+	}
+
+
+	/**
+	 * Removes all filters.
+	 */
+	void clear(void)
+	{
+		nodes[0] = { 0, 0, None, None, None, None };  // The root, above the first level.
+		used = 1;
+		names_used = 0;
+		memset(table, None, sizeof(table));
+	}
+
+
+	/**
+	 * Adds a filter, or changes the value of one already added.
+	 * @param filter The topic filter.
+	 * @param value The value that match() reports for topics that match the filter; not None.
+	 * @returns True if added; false if the filter is invalid or there is no room.
+	 */
+	bool insert(const char* filter, uint8_t value)
+	{
+		uint8_t node = find(filter, true);
+		if (node == None)
+			return false;
+		nodes[node].value = value;
+		return true;
+	}
+
+
+	/**
+	 * Removes a filter. Its nodes are left in place for reuse by a filter with the same levels.
+	 * @param filter The topic filter.
+	 * @returns The value of the filter, or None if it was not found.
+	 */
+	uint8_t remove(const char* filter)
+	{
+		uint8_t node = find(filter, false);
+		if (node == None)
+			return None;
+		uint8_t value = nodes[node].value;
+		nodes[node].value = None;
+		return value;
+	}
+
+
+	/**
+	 * Finds the filters that match a topic name.
+	 * @param topic The topic name, which need not be terminated.
+	 * @param length The length of the topic name.
+	 * @param visit Called with the value of each filter that matches.
+	 * @returns The number of filters that match.
+	 */
+	template <typename Visitor>
+	uint8_t match(const char* topic, uint16_t length, Visitor visit)
+	{
+		if (length == 0)
+			return 0;
+		return match(0, topic, topic + length, topic[0] != '$', visit);
+	}
+
+
+	/**
+	 * Determines whether a topic filter is valid: `#` only as the last level, and wildcards only as whole levels.
+	 * @param filter The topic filter.
+	 * @returns True if valid; otherwise false.
+	 */
+	static bool is_valid(const char* filter)
+	{
+		if (*filter == '\0')
+			return false;
+		for (const char* p = filter; *p; p++)
+		{
+			bool alone = (p == filter || p[-1] == '/') && (p[1] == '\0' || p[1] == '/');
+			if (*p == '+' && !alone)
+				return false;
+			if (*p == '#' && !(alone && p[1] == '\0'))
+				return false;
+		}
+		return true;
+	}
+
+
+	/**
+	 * Gets the number of nodes in use, out of MQTT_MAX_TOPIC_NODES.
+	 */
+	uint8_t get_used(void)
+	{
+		return used;
+	}
+
+
+	/**
+	 * Gets the number of bytes of level names in use, out of MQTT_MAX_TOPIC_NAMES.
+	 */
+	uint16_t get_names_used(void)
+	{
+		return names_used;
+	}
+
+private:
+	static constexpr uint16_t TableSize = MQTT_MAX_TOPIC_NODES * 2;  // Keeps probe sequences short.
+
+	/**
+	 * @brief	One level of one or more filters.
+	 */
+	typedef struct Node
+	{
+		uint16_t level;  /// Where the name of the level starts in names.
+		uint8_t length;  /// The length of the name.
+		uint8_t parent;  /// The node of the level above.
+		uint8_t plus;  /// The `+` child, or None.
+		uint8_t hash;  /// The `#` child, or None.
+		uint8_t value;  /// The value of the filter that ends here, or None.
+	} Node;
+
+
+	/**
+	 * Finds the node where a filter ends.
+	 * @param filter The topic filter.
+	 * @param add True to add the nodes that are missing.
+	 * @returns The node, or None if not found or there is no room.
+	 */
+	uint8_t find(const char* filter, bool add)
+	{
+		if (!is_valid(filter))
+			return None;
+		uint8_t node = 0;
+		for (const char* level = filter; ; )
+		{
+			const char* end = strchr(level, '/');
+			uint8_t length = end != nullptr ? end - level : strlen(level);
+			uint8_t child = find_child(node, level, length, add);
+			if (child == None)
+				return None;
+			node = child;
+			if (end == nullptr)
+				return node;
+			level = end + 1;
+		}
+	}
+
+
+	/**
+	 * Finds the child of a node with a name.
+	 * @param node The parent.
+	 * @param level The name.
+	 * @param length The length of the name.
+	 * @param add True to add the child if it is missing.
+	 * @returns The child, or None if not found or there is no room.
+	 */
+	uint8_t find_child(uint8_t node, const char* level, uint8_t length, bool add)
+	{
+		uint8_t* slot;
+		if (length == 1 && level[0] == '+')
+			slot = &nodes[node].plus;
+		else if (length == 1 && level[0] == '#')
+			slot = &nodes[node].hash;
+		else
+		{
+			uint16_t i = lookup(node, level, length);
+			if (table[i] != None)
+				return table[i];
+			slot = &table[i];
+		}
+		if (*slot != None || !add || used == MQTT_MAX_TOPIC_NODES || names_used + length > MQTT_MAX_TOPIC_NAMES)
+			return *slot;
+		memcpy(names + names_used, level, length);
+		nodes[used] = { names_used, length, node, None, None, None };
+		names_used += length;
+		*slot = used++;
+		return *slot;
+	}
+
+
+	/**
+	 * Finds the slot in the hash table of a named child of a node.
+	 * @returns The slot that holds the child, or the empty slot where it would go.
+	 */
+	uint16_t lookup(uint8_t parent, const char* level, uint8_t length)
+	{
+		uint32_t h = 2166136261u ^ parent;  // FNV-1a
+		for (uint8_t i=0; i < length; i++)
+			h = (h ^ (uint8_t)level[i]) * 16777619u;
+		for (uint16_t i = h % TableSize; ; i = (i + 1) % TableSize)
+		{
+			uint8_t n = table[i];
+			if (n == None || (nodes[n].parent == parent && nodes[n].length == length &&
+					memcmp(names + nodes[n].level, level, length) == 0))
+				return i;
+		}
+	}
+
+
+	/**
+	 * Matches the rest of a topic name below a node.
+	 * @param node The node of the levels matched so far.
+	 * @param level The start of the next level of the topic name.
+	 * @param end The end of the topic name.
+	 * @param wild True if wildcards may match this level; false for the first level of a topic beginning with `$`.
+	 * @param visit Called with the value of each filter that matches.
+	 * @returns The number of filters that match.
+	 */
+	template <typename Visitor>
+	uint8_t match(uint8_t node, const char* level, const char* end, bool wild, Visitor& visit)
+	{
+		const char* level_end = (const char*)memchr(level, '/', end - level);
+		if (level_end == nullptr)
+			level_end = end;
+		uint8_t found = 0;
+
+		uint8_t named = level_end - level > 0xff ? None : table[lookup(node, level, level_end - level)];
+		uint8_t children[2] = { named, wild ? nodes[node].plus : None };
+		if (wild)
+			found += report(nodes[node].hash, visit);
+		for (uint8_t child : children)
+		{
+			if (child == None)
+				continue;
+			if (level_end == end)
+			{
+				found += report(child, visit);
+				found += report(nodes[child].hash, visit);  // "a/#" also matches "a".
+			}
+			else
+				found += match(child, level_end + 1, end, true, visit);
+		}
+		return found;
+	}
+
+
+	template <typename Visitor>
+	uint8_t report(uint8_t node, Visitor& visit)
+	{
+		if (node == None || nodes[node].value == None)
+			return 0;
+		visit(nodes[node].value);
+		return 1;
+	}
+
+
+	Node nodes[MQTT_MAX_TOPIC_NODES];
+	uint8_t table[TableSize];  /// Named children, by parent and name.
+	uint8_t used;
+	char names[MQTT_MAX_TOPIC_NAMES];  /// The names of the levels, one after another.
+	uint16_t names_used;
+};
+
+
+#endif /* INC_COMMS_TCPIP_MQTTTOPICTRIE_H_ */
@@ -15,7 +15,30 @@
 #include "comms/tcpip/IPv4Address.h"
 #include "utility/Timer.h"
 
+#ifndef TFTP_MAX_BLOCK_SIZE
+#define TFTP_MAX_BLOCK_SIZE (1024)  // Largest block agreed by blksize; a multiple of 512. The W5500 does not fragment, so at most 1024.
+#endif
 
+#ifndef TFTP_MAX_WINDOW_SIZE
+#define TFTP_MAX_WINDOW_SIZE (16)  // Most blocks per acknowledgement agreed by windowsize.
+#endif
+
+#ifndef TFTP_RETRANSMIT_INTERVAL
+#define TFTP_RETRANSMIT_INTERVAL (1000)  // Milliseconds without progress before a window or acknowledgement is sent again.
+#endif
+
+
+/**
+ * Serves one transfer at a time, in either direction. A client may ask for larger blocks (RFC 2348, `blksize`) and
+ * for several blocks per acknowledgement (RFC 7440, `windowsize`), which together cut the round trips for a 1 MB
+ * image from 2048 to 64 or fewer.
+ *
+ * The callbacks still see the file in 512-byte pieces numbered from 1, whatever block size is agreed, and a piece
+ * shorter than 512 bytes still marks the end. So the agreed block size is a multiple of 512.
+ *
+ * When receiving, the window is also limited to what the socket's receive buffer can hold, so a socket given a larger
+ * buffer with Ethernet::set_buffer_sizes() takes larger windows.
+ */
 class TftpServer
 {
 public:
@@ -25,6 +48,7 @@ public:
 	static constexpr uint16_t OpcodeData = 0x03;
 	static constexpr uint16_t OpcodeAcknowledge = 0x04;
 	static constexpr uint16_t OpcodeError = 0x05;
+	static constexpr uint16_t OpcodeOptionAcknowledge = 0x06;
 
 	static constexpr uint16_t ErrorUndefined = 0x00;
 	static constexpr uint16_t ErrorFileNotFound = 0x01;
@@ -35,6 +59,8 @@ public:
 	static constexpr uint16_t ErrorFileExists = 0x06;
 	static constexpr uint16_t ErrorNoSuchUser = 0x07;
 
+	static constexpr uint16_t SegmentSize = 512;  /// The size of the pieces that the callbacks see.
+
 
 	/**
 	 * @brief	Constructs a TftpServer instance.
@@ -59,7 +85,9 @@ public:
 
 	/**
 	 * @brief	Sets the data callback function.
-	 * @param	data_callback	Pointer to the callback function.
+	 * @param	data_callback	Pointer to the callback function. It is passed the filename, the block number (from
+	 * 			1), and up to 512 bytes of data. It is first called with block 0 and no data when a write begins, and
+	 * 			fewer than 512 bytes ends the transfer. Each block is passed once, in order.
 	 */
 	void set_data_callback(void (*data_callback)(char*, uint16_t, uint8_t*, uint16_t))
 	{
@@ -67,6 +95,18 @@ public:
 	}
 
 
+	/**
+	 * @brief	Sets the read callback function, which supplies the data for read requests.
+	 * @param	read_callback	Pointer to the callback function. It is passed the filename, the block number (from
+	 * 			1), and a buffer of the given length to fill, and returns the number of bytes supplied. Fewer than
+	 * 			512 bytes ends the transfer. The same block may be requested more than once.
+	 */
+	void set_read_callback(uint16_t (*read_callback)(char*, uint16_t, uint8_t*, uint16_t))
+	{
+		this->read_callback = read_callback;
+	}
+
+
 	/**
 	 * @brief Checks for incoming TFTP packets and handles them. The data callback may be called as required.
 	 */
@@ -74,43 +114,129 @@ public:
     {
     	uint8_t addr[4];
     	uint16_t port;
-    	uint16_t length = socket->recvfrom(buffer, 512, addr, &port);
 
-    	if (length == 0)
+    	// Take up to a window of packets, so that a window is not spread over many calls.
+    	for (uint16_t i=0; i < TFTP_MAX_WINDOW_SIZE; i++)
     	{
-    		if (timeout.is_elapsed())
-    		{
-				timeout.reset();
-				error(addr, port, ErrorUndefined, "Timeout exceeded");
-				socket->disconnect();
-				socket->close();
-				state = Closed;
-				begin();
-    		}
-    		return;
+			uint16_t length = socket->recvfrom(buffer, sizeof(buffer), addr, &port);
+			if (length == 0)
+				break;
+			handle(addr, port, length);
     	}
 
+		if (timeout.is_elapsed())
+		{
+			timeout.reset();
+			retransmit.reset();
+			error(client_ip, client_port, ErrorUndefined, "Timeout exceeded");
+			socket->disconnect();
+			socket->close();
+			state = Closed;
+			begin();
+		}
+		else if (retransmit.is_elapsed())
+		{
+			// Nothing has moved the transfer on: say again what was said last.
+			retransmit.restart();
+			if (options_pending)
+				send_options();
+			else if (state == Open)
+				ack(expected - 1);
+			else if (state == Reading)
+				send_window();
+		}
+    }
+
+
+private:
+	/**
+	 * @brief Handles one packet in the receive buffer.
+	 * @param addr	The sender's IP address.
+	 * @param port	The sender's UDP port.
+	 * @param length	The length of the packet.
+	 */
+	void handle(uint8_t* addr, uint16_t port, uint16_t length)
+	{
+		if (length < 4)
+		{
+			error(addr, port, ErrorIllegalOperation, "Packet too short.");
+			return;
+		}
 		uint16_t opcode = swap(*(uint16_t*)buffer);
 		memcpy(client_ip, addr, 4);
 		client_port = port;
 		if (opcode == OpcodeWriteRequest) // WRQ / Write request
 		{
 			state = Open;
-			// Copy filename.
-			for (uint16_t i=0; i < 80; i++)
-			{
-				filename[i] = buffer[i+2];
-				filename[i+1] = 0;
-				if (filename[i] == 0x00)
-					break;
-			}
+			copy_filename();
+			negotiate(length);
+			expected = 1;
+			unacknowledged = 0;
+			nacked = false;
 
-			// Respond with acknowledgement.
-			ack(0);
+			// Respond with acknowledgement, or with the options agreed.
+			if (options_pending)
+				send_options();
+			else
+				ack(0);
 			timeout.start(timeout_duration);
+			retransmit.start(retransmit_duration);
 			data_callback(filename, 0, nullptr, 0);
 		}
 
+		else if (opcode == OpcodeReadRequest) // RRQ / Read request
+		{
+			if (read_callback == nullptr)
+			{
+				error(addr, port, ErrorAccessViolation, "Reading is not supported.");
+				return;
+			}
+			state = Reading;
+			copy_filename();
+			negotiate(length);
+			base = 1;
+			sent = 0;
+			final = false;
+			timeout.start(timeout_duration);
+			retransmit.start(retransmit_duration);
+
+			// With options, the client acknowledges them as block 0 before data is sent.
+			if (options_pending)
+				send_options();
+			else
+				send_window();
+		}
+
+		else if (opcode == OpcodeAcknowledge && state == Reading)
+		{
+			uint16_t block_id = swap(*(uint16_t*)(buffer+2));
+			uint16_t acknowledged = block_id - (uint16_t)(base - 1);  // Blocks of the window received.
+			if (acknowledged > sent)
+				return;  // Stale acknowledgement.
+			timeout.restart();
+			// An acknowledgement that moves nothing on is a duplicate, or a client that lost the first block. Answering
+			// each with a window would double the traffic with every delayed copy (the Sorcerer's Apprentice bug), so
+			// the window is left for the retransmit timer to send again. Only the acknowledgement of the options starts
+			// the data.
+			if (acknowledged == 0 && !options_pending)
+				return;
+			retransmit.restart();
+			options_pending = false;
+
+			// If the last block of the window was short, it was the last block.
+			if (final && acknowledged == sent)
+			{
+				state = Closed;
+				timeout.reset();
+				retransmit.reset();
+				return;
+			}
+
+			// Carry on from the first block not received, which resends any lost.
+			base += acknowledged;
+			send_window();
+		}
+
 //			// If the client IP doesn't match, another host is connecting, which isn't allowed.
 //    		if (memcmp(client_ip, addr, 4))
 //    		{
@@ -124,32 +250,212 @@ public:
 			socket->disconnect();
 			socket->close();
 			timeout.reset();
+			retransmit.reset();
+			begin();
 			return;
 		}
 
-		else if (opcode == OpcodeData)
+		else if (opcode == OpcodeData && state == Open)
 		{
 			uint16_t block_id = swap(*(uint16_t*)(buffer+2));
-			data_callback(filename, block_id, buffer+4, length-4);
 			timeout.restart();
+			if (block_id != expected)
+			{
+				// A block was lost, or a window was sent again: say once where to resume.
+				if (!nacked)
+				{
+					ack(expected - 1);
+					nacked = true;
+					unacknowledged = 0;
+					retransmit.restart();
+				}
+				return;
+			}
+			options_pending = false;
+			nacked = false;
+			retransmit.restart();
+			deliver(block_id, buffer+4, length-4);
+			expected++;
 
-			// If less than 512B of data, it is the last block.
-			if (length-4 < 512)
+			// Acknowledge each window, and the last block, which is shorter than a whole block.
+			bool last = length-4 < block_size;
+			if (last || ++unacknowledged == window)
+			{
+				ack(block_id);
+				unacknowledged = 0;
+			}
+			if (last)
 			{
 				state = Closed;
 				timeout.reset();
+				retransmit.reset();
 			}
-			ack(block_id);
+		}
+
+		else if (opcode == OpcodeData && state == Closed)
+		{
+			// The last acknowledgement was lost.
+			uint16_t block_id = swap(*(uint16_t*)(buffer+2));
+			if (block_id == (uint16_t)(expected - 1))
+				ack(block_id);
 		}
 
 		else
 		{
 			error(addr, port, ErrorUndefined, "Intention not understood.");
 		}
+	}
+
+
+    /**
+     * @brief Copies the filename from a request in the receive buffer.
+     */
+    void copy_filename(void)
+    {
+		for (uint16_t i=0; i < 80; i++)
+		{
+			filename[i] = buffer[i+2];
+			filename[i+1] = 0;
+			if (filename[i] == 0x00)
+				break;
+		}
+    }
+
+
+    /**
+     * @brief Reads the options of a request in the receive buffer, and decides the block and window sizes.
+     * @param length	The length of the request.
+     */
+    void negotiate(uint16_t length)
+    {
+    	block_size = SegmentSize;
+    	window = 1;
+    	has_block_size = false;
+    	has_window = false;
+
+    	// Skip the filename and mode; options are pairs of strings after them.
+    	const char* end = (const char*)buffer + length;
+    	const char* p = next_string((const char*)buffer + 2, end);
+    	p = next_string(p, end);
+    	while (p < end)
+    	{
+    		const char* name = p;
+    		const char* value = next_string(name, end);
+    		p = next_string(value, end);
+    		if (p > end)
+    			break;  // Not terminated.
+    		uint32_t number = to_number(value);
+
+    		// Smaller blocks than 512 are refused by leaving the option out, so the client falls back to 512.
+    		if (is_option(name, "blksize") && number >= SegmentSize)
+    		{
+    			number = number > TFTP_MAX_BLOCK_SIZE ? TFTP_MAX_BLOCK_SIZE : number;
+    			block_size = number - number % SegmentSize;
+    			has_block_size = true;
+    		}
+    		else if (is_option(name, "windowsize") && number >= 1 && number <= 65535)
+    		{
+    			window = number > TFTP_MAX_WINDOW_SIZE ? TFTP_MAX_WINDOW_SIZE : number;
+    			has_window = true;
+    		}
+    	}
+
+    	// Received blocks wait in the chip until read, each with an 8-byte header.
+    	if (state == Open)
+    	{
+    		uint16_t fits = socket->get_rx_buffer_size() / (block_size + 4 + 8);
+    		if (window > fits)
+    			window = fits > 0 ? fits : 1;
+    	}
+    	options_pending = has_block_size || has_window;
+    }
+
+
+    /**
+     * @brief Sends an option acknowledgement (RFC 2347) with the options agreed.
+     */
+    void send_options(void)
+    {
+    	uint8_t out[32];
+    	uint8_t* p = out;
+    	*(uint16_t*)p = swap(OpcodeOptionAcknowledge);
+    	p += 2;
+    	if (has_block_size)
+    		p = put_option(p, "blksize", block_size);
+    	if (has_window)
+    		p = put_option(p, "windowsize", window);
+    	socket->start_udp(client_ip, client_port);
+    	socket->bufferData(out, p - out);
+    	socket->send_udp();
+    }
+
+
+    /**
+     * @brief Sends a window of blocks from the first not acknowledged, stopping after the last block of the file.
+     */
+    void send_window(void)
+    {
+    	sent = 0;
+    	final = false;
+    	while (sent < window && !final)
+    	{
+    		final = send_block(base + sent) < block_size;
+    		sent++;
+    	}
+    }
+
+
+    /**
+     * @brief Sends a block of data, supplied by the read callback, to the client.
+     * @param block_id	The block to send.
+     * @returns	The number of bytes of data in the block.
+     */
+    uint16_t send_block(uint16_t block_id)
+    {
+    	uint16_t segments = block_size / SegmentSize;
+    	uint16_t segment = (block_id - 1) * segments + 1;
+    	uint16_t length = 0;
+    	for (uint16_t i=0; i < segments; i++)
+    	{
+    		uint16_t supplied = read_callback(filename, segment + i, buffer+4 + length, SegmentSize);
+    		length += supplied;
+    		if (supplied < SegmentSize)
+    			break;
+    	}
+    	*(uint16_t*)buffer = swap(OpcodeData);
+    	*(uint16_t*)(buffer+2) = swap(block_id);
+    	socket->start_udp(client_ip, client_port);
+    	socket->bufferData(buffer, 4 + length);
+    	socket->send_udp();
+    	return length;
+    }
+
+
+    /**
+     * @brief Passes a received block to the data callback in 512-byte pieces.
+     * @param block_id	The block.
+     * @param data	The data of the block.
+     * @param length	The number of bytes of data.
+     */
+    void deliver(uint16_t block_id, uint8_t* data, uint16_t length)
+    {
+    	uint16_t segment = (block_id - 1) * (block_size / SegmentSize) + 1;
+    	uint16_t offset = 0;
+    	do
+    	{
+    		uint16_t size = length - offset > SegmentSize ? SegmentSize : length - offset;
+    		data_callback(filename, segment++, data + offset, size);
+    		offset += size;
+    		if (size < SegmentSize)
+    			return;
+    	} while (offset < length);
+
+    	// A last block that ends with a whole piece needs an empty piece after it to end the transfer.
+    	if (length < block_size)
+    		data_callback(filename, segment, data + offset, 0);
     }
 
 
-private:
     /**
      * @brief Swaps the bytes of a 16-bit word.
      * @param word	The word to manipulate.
@@ -161,6 +467,57 @@ private:
     }
 
 
+    /**
+     * @brief Finds the string after one in a request.
+     * @returns	The start of the next string, or a pointer past end if the string is not terminated.
+     */
+    static const char* next_string(const char* p, const char* end)
+    {
+    	while (p < end && *p != '\0')
+    		p++;
+    	return p + 1;
+    }
+
+
+    /**
+     * @brief Compares an option name, which is not case-sensitive, with one in lower case.
+     */
+    static bool is_option(const char* name, const char* option)
+    {
+    	for (; *option; name++, option++)
+    		if ((*name | 0x20) != *option)
+    			return false;
+    	return *name == '\0';
+    }
+
+
+    static uint32_t to_number(const char* p)
+    {
+    	uint32_t number = 0;
+    	for (; *p >= '0' && *p <= '9'; p++)
+    		number = number < 100000 ? number * 10 + (*p - '0') : number;
+    	return *p == '\0' ? number : 0;
+    }
+
+
+    static uint8_t* put_option(uint8_t* p, const char* name, uint16_t value)
+    {
+    	strcpy((char*)p, name);
+    	p += strlen(name) + 1;
+    	char digits[6];
+    	uint8_t count = 0;
+    	do
+    	{
+    		digits[count++] = '0' + value % 10;
+    		value /= 10;
+    	} while (value);
+    	while (count)
+    		*p++ = digits[--count];
+    	*p++ = '\0';
+    	return p;
+    }
+
+
     /**
      * @brief Acknowledges a block to the client.
      * @param block_id	The block to acknowledge.
@@ -207,14 +564,27 @@ private:
 	uint16_t port;
 	uint8_t client_ip[4];
 	uint16_t client_port;
-	uint16_t last_block;
+	uint16_t block_size = SegmentSize;  /// The agreed block size.
+	uint16_t window = 1;  /// The agreed number of blocks per acknowledgement.
+	bool has_block_size = false;  /// The client asked for a block size that was agreed.
+	bool has_window = false;  /// The client asked for a window size.
+	bool options_pending = false;  /// An option acknowledgement has been sent and no block since.
+	uint16_t expected = 1;  /// When receiving, the next block wanted.
+	uint16_t unacknowledged = 0;  /// When receiving, the blocks received since the last acknowledgement.
+	bool nacked = false;  /// When receiving, an out-of-order block has been answered with the last in order.
+	uint16_t base = 1;  /// When sending, the first block not acknowledged.
+	uint16_t sent = 0;  /// When sending, the blocks of the window sent.
+	bool final = false;  /// When sending, the window holds the last block.
 	Socket* socket;
-	uint8_t buffer[516];
+	uint8_t buffer[4 + TFTP_MAX_BLOCK_SIZE];
 	char filename[81];
-	enum { Closed, Open } state = Closed;
+	enum { Closed, Open, Reading } state = Closed;
 	void (*data_callback)(char* filename, uint16_t block_id, uint8_t* data, uint16_t length);
+	uint16_t (*read_callback)(char* filename, uint16_t block_id, uint8_t* data, uint16_t length) = nullptr;
 	Timer timeout;
+	Timer retransmit;
 	const uint32_t timeout_duration = milliseconds(Constants::TftpTimeout);
+	const uint32_t retransmit_duration = milliseconds(TFTP_RETRANSMIT_INTERVAL);
 };
 
 #endif /* LIB_STM32_TOOLBOX_COMMS_ETHERNET_NTPCLIENT_H_ */
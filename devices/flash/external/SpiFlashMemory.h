@@ -274,14 +274,9 @@ public:
 		if (length > 0x100)
 			return ErrorLargerThanPage;
 
-		while (!is_idle());  // Wait for any pending operations.
-		write_enable();
-		cs_select();
-		write_byte(PageProgram);
-		write_address(address);
-		for (uint32_t i=0; i < length; i++)
-			write_byte(((uint8_t*)data)[i]);
-		cs_deselect();
+		error programmed = page_program_raw(address, data, length);
+		if (programmed != ErrorNone)
+			return programmed;
 
 		while (!is_idle());  // Wait for write.
 		uint8_t verify[0x100];
@@ -298,6 +293,31 @@ public:
 	}
 
 
+	/**
+	 * @brief	Programs data without waiting for completion or verifying the result.
+	 * @param	address The address to start writing.
+	 * @param	data Pointer to the data to write.
+	 * @param	length The number of bytes to write.
+	 * @returns	ErrorLargerThanPage if the length is greater than one page.
+	 * @note	The page must already be erased. The whole page is clocked out in a single SPI transfer, which makes
+	 *          this suitable for time-critical paths such as fault handlers.
+	 */
+	error page_program_raw(uint32_t address, void* data, uint32_t length=0x100)
+	{
+		if (length > 0x100)
+			return ErrorLargerThanPage;
+
+		while (!is_idle());  // Wait for any pending operations.
+		write_enable();
+		cs_select();
+		write_byte(PageProgram);
+		write_address(address);
+		write_bytes((uint8_t*)data, length);
+		cs_deselect();
+		return ErrorNone;
+	}
+
+
 	/**
 	 * @brief	Programs data.
 	 * @param	address The address to start writing.
@@ -338,8 +358,7 @@ public:
 		cs_select();
 		write_byte(ReadDataBytes);
 		write_address(address);
-		for (uint32_t i=0; i < length; i++)
-			((uint8_t*)data)[i] = read_byte();
+		read_burst(data, length);
 		cs_deselect();
 	}
 
@@ -358,13 +377,24 @@ public:
 		write_byte(ReadDataBytesHighSpeed);
 		write_address(address);
 		write_byte(0x00);
-		for (uint32_t i=0; i < length; i++)
-			((uint8_t*)data)[i] = read_byte();
+		read_burst(data, length);
 		cs_deselect();
 	}
 
 
 private:
+	/**
+	 * @brief	Clocks in data in as few SPI transfers as the HAL length field allows.
+	 * @param	data Pointer to the data buffer.
+	 * @param	length The number of bytes to read.
+	 */
+	void read_burst(void* data, uint32_t length)
+	{
+		for (uint32_t i=0; i < length; i += 0x8000)
+			read_bytes(((uint8_t*)data)+i, length-i < 0x8000 ? length-i : 0x8000);
+	}
+
+
 	/**
 	 * @brief	Writes a 24-bit address.
 	 * @param	address The address to write.
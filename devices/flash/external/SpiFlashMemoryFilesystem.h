@@ -92,14 +92,21 @@ public:
 
 	/**
 	 * @brief	Checks if the filesystem is initialized, and initializes it if it isn't.
+	 * @param	reserved The number of bytes at the top of the chip to exclude from the filesystem. Rounded up to
+	 *          a whole number of sectors. See get_reserved_address().
 	 * @returns	True if successful; otherwise false.
 	 */
-	bool initialize(void)
+	bool initialize(uint32_t reserved=0)
 	{
 		RDID rdid = read_identification();
 		if (!rdid.is_valid())
 			return false;
 		capacity = pow(2, rdid.capacity);
+		reserved = (reserved + SectorSize - 1) / SectorSize * SectorSize;
+		if (reserved >= capacity)
+			return false;
+		capacity -= reserved;
+		this->reserved = reserved;
 
 		// Allocate index.
 		uint32_t index_size = capacity / SectorSize / 8;
@@ -110,6 +117,8 @@ public:
 		for (uint32_t address=0; address<capacity; address += SectorSize)
 		{
 			DirectoryEntry* entry = read_directory(address);
+			if (entry->is_valid() && entry->id > last_id)
+				last_id = entry->id;
 			if (entry->is_valid() && !entry->is_deleted())
 			{
 				used += SectorSize;
@@ -125,9 +134,21 @@ public:
 	 */
 	void wipe(void)
 	{
-		chip_erase();
+		if (reserved == 0)
+			chip_erase();
+		else
+		{
+			// Leave the reserved region intact.
+			for (uint32_t address=0; address<capacity; address += SectorSize)
+			{
+				if (loop_callback != nullptr)
+					loop_callback();
+				sector_erase(address);
+			}
+		}
 		reset_index();
 		used = 0;
+		last_id = 0;
 	}
 
 
@@ -184,24 +205,26 @@ public:
 	 * @param filename The name of the file.
 	 * @param data Pointer to the data to write.
 	 * @param length Length of the file.
+	 * @param replace If true, an existing file with the same name is removed first. Pass false when the name is
+	 *                known to be new, to skip searching the directory.
 	 * @returns The error code, if any.
 	 */
-	error write_file(const char* filename, void* data, uint32_t length)
+	error write_file(const char* filename, void* data, uint32_t length, bool replace=true)
 	{
 		// Overwrite the file if it exists.
-		uint32_t id = get_fileid(filename);
+		uint32_t id = replace ? get_fileid(filename) : 0;
 		if (id != 0)
 			remove(id);
 
 		// Determine requirements and create template for directory entry.
-		uint32_t sectors = length / UsableSectorSize + 1;
+		uint32_t sectors = length ? (length + UsableSectorSize - 1) / UsableSectorSize : 1;
 		uint32_t free_sector = get_free_sector();
 		if (free_sector == ErrorDirectoryFull)
 			return ErrorFull;
 
 		DirectoryEntry entry = {
 			.magic_number = DirectoryEntry::MAGIC_NUMBER,
-			.id = get_last_id() + 1,
+			.id = ++last_id,
 			.sectors = sectors,
 			.index = 0,
 			.address = free_sector,
@@ -231,12 +254,14 @@ public:
 				return e;
 
 			entry.index++;
-			entry.address = get_free_sector();
-			if (entry.address == ErrorDirectoryFull)
-				return ErrorFull;
 			written += size;
 			remaining -= size;
 			used += SectorSize;
+			if (remaining == 0)
+				break;
+			entry.address = get_free_sector(entry.address);
+			if (entry.address == ErrorDirectoryFull)
+				return ErrorFull;
 		}
 		return ErrorNone;
 	}
@@ -269,6 +294,8 @@ public:
 	{
 		for (uint32_t sector=start; sector < capacity; sector += SectorSize)
 		{
+			if (read_index(sector))
+				continue;  // In use; no need to read the directory.
 			if (loop_callback != nullptr)
 				loop_callback();
 
@@ -288,7 +315,7 @@ public:
 	fileid get_fileid(const char* filename)
 	{
 		DirectoryEntry* entry = search(filename);
-		return entry->id;
+		return entry != nullptr ? entry->id : 0;
 	}
 
 
@@ -346,7 +373,12 @@ public:
 			if (entry->id == id)
 			{
 				uint8_t* target = ((uint8_t*)data) + entry->index * UsableSectorSize;
-				uint32_t size = entry->index == entry->sectors-1 ? length % UsableSectorSize : UsableSectorSize;
+				// The last sector holds what is left, which is a whole sector when the length is an exact multiple.
+				uint32_t size = UsableSectorSize;
+				if (entry->index == entry->sectors-1)
+					size = length - entry->index * UsableSectorSize;
+				if (size > remaining)
+					return ErrorFileCorrupt;
 				read(entry->address + sizeof(DirectoryEntry), target, size);
 				if (entry->index == 0)
 					memcpy(md5, entry->md5, 16);
@@ -356,9 +388,11 @@ public:
 				break;
 			entry = iterate_directory();
 		}
+		if (entry == nullptr)
+			return ErrorFileCorrupt;  // A sector is missing.
 
 		tiny_md5((uint8_t*) data, length, hash);  // Recalculate hash and see if it matches expected.
-		if (memcmp(hash, entry->md5, 16))
+		if (memcmp(hash, md5, 16))
 			return ErrorFileCorrupt;
 
 		return ErrorNone;
@@ -468,19 +502,11 @@ public:
 	/**
 	 * @brief	Gets the last file ID number.
 	 * @returns The ID number.
+	 * @note	The number is found when the filesystem is initialized and kept up to date by write_file(), so writing
+	 *          a file does not need to scan the directory.
 	 */
 	uint32_t get_last_id(void)
 	{
-		uint32_t last_id = 0;
-		for (uint32_t i=0; i < capacity; i += SectorSize)
-		{
-			if (loop_callback != nullptr)
-				loop_callback();
-
-			DirectoryEntry* entry = read_directory(i);
-			if (entry->is_valid() && entry->id > last_id)
-				last_id = entry->id;
-		}
 		return last_id;
 	}
 
@@ -526,6 +552,16 @@ public:
 	}
 
 
+	/**
+	 * @brief	Gets the address of the region reserved by initialize().
+	 * @returns	The first address after the filesystem; the reserved region extends to the end of the chip.
+	 */
+	uint32_t get_reserved_address(void)
+	{
+		return capacity;
+	}
+
+
 	/**
 	 * @brief	Sets a function to be called during long loops.
 	 */
@@ -536,7 +572,9 @@ public:
 
 private:
 	uint32_t capacity = 0;
+	uint32_t reserved = 0;
 	uint32_t used = 0;
+	fileid last_id = 0;
 	uint8_t buffer[PageSize];
 	void (*loop_callback)(void);
 	uint8_t* index;
@@ -8,7 +8,30 @@
 #define INC_COMMS_ZLAC8015_H_
 
 #include "stm32-toolbox/comms/CanOpen.h"
+#include "stm32-toolbox/comms/CanOpenPdo.h"
+#include "stm32-toolbox/generics/Queue.h"
 
+#ifndef ZLAC8015_QUEUE_LENGTH
+#define ZLAC8015_QUEUE_LENGTH (32)
+#endif
+
+#ifndef ZLAC8015_SDO_TIMEOUT
+#define ZLAC8015_SDO_TIMEOUT (20)
+#endif
+
+
+/**
+ * Drives a ZLAC8015 motor controller.
+ *
+ * Configuration is queued: each SDO request is sent as soon as the drive answers the one before it, rather than after
+ * a fixed delay, and the queues of several drives run side by side. Nothing waits for the bus; call poll() regularly
+ * to retry requests that could not be sent and to give up on ones that were not answered within ZLAC8015_SDO_TIMEOUT
+ * milliseconds. Register the instance with CanOpen::set_node_callback() so it sees the drive's replies and PDOs.
+ *
+ * After configure_pdos(), the drive sends its status word, velocity, position and fault code in TPDOs, which are
+ * decoded into a cache, so the getters cost no bus traffic, and velocity() is a single RPDO frame. This is what
+ * allows control loops at 1 kHz across several drives; without the PDOs, refresh() reads the same objects over SDO.
+ */
 class Zlac8015 : public CanOpen::ICanOpenCallback
 {
 public:
@@ -74,6 +97,21 @@ public:
 	static constexpr uint16_t Fault_Hall = 0x0200;
 
 
+	// Objects carried by the PDOs that configure_pdos() maps.
+	typedef CanOpenObject<CanOpen::Index_StatusWord, 0, uint16_t> StatusWord;
+	typedef CanOpenObject<CanOpen::Index_ActualSpeed, 0, int16_t> ActualSpeed;
+	typedef CanOpenObject<CanOpen::Index_ActualPosition, 0, int32_t> ActualPosition;
+	typedef CanOpenObject<CanOpen::Index_LastFaultCode, 0, uint16_t> LastFaultCode;
+	typedef CanOpenObject<CanOpen::Index_ActualTorque, 0, uint16_t> ActualTorque;
+	typedef CanOpenObject<Index_MotorTemperature, 0, int16_t> MotorTemperature;
+	typedef CanOpenObject<CanOpen::Index_TargetSpeed, 0, int32_t> TargetSpeed;
+
+	typedef CanOpenPdo<StatusWord, ActualSpeed, ActualPosition> StatusPdo;  // TPDO1 at 0x180+id.
+	typedef CanOpenPdo<LastFaultCode, ActualTorque, MotorTemperature> FaultPdo;  // TPDO2 at 0x280+id.
+	typedef CanOpenPdo<TargetSpeed> VelocityPdo;  // RPDO1 at 0x200+id.
+
+	static constexpr uint16_t StatusWord_Fault = 0x0008;
+
 	typedef struct
 	{
 		int16_t target_linear_velocity;
@@ -105,6 +143,7 @@ public:
 		this->id = id;
 		this->wheel_circumference = wheel_circumference;
 		this->reverse = reverse;
+		requests.set_buffer(request_buffer, ZLAC8015_QUEUE_LENGTH);
 	}
 
 
@@ -117,6 +156,7 @@ public:
 	{
 		this->acc_time = acceleration_time;
 		this->dec_time = deceleration_time;
+		rpdo_ready = false;  // Resetting communications restores the saved PDO parameters.
 		can->nmt(CanOpen::NMT_ResetCommunications, id);
 		can->nmt(CanOpen::NMT_Operational, id);
 		osDelay(2000);
@@ -147,8 +187,7 @@ public:
 	 */
 	void control_word(uint16_t value)
 	{
-		can->sdo(id, CanOpen::Index_ControlWord, 0x00, value, sizeof(uint16_t));
-
+		write(CanOpen::Index_ControlWord, 0x00, value, sizeof(uint16_t));
 	}
 
 
@@ -170,7 +209,14 @@ public:
 			state.target_linear_velocity = (value * wheel_circumference) / 60;
 
 		}
-		can->sdo(id, CanOpen::Index_TargetSpeed, 0x00, state.target_angular_velocity, sizeof(uint32_t));
+		if (rpdo_ready)
+		{
+			uint8_t data[VelocityPdo::length];
+			VelocityPdo::pack(data, state.target_angular_velocity);
+			can->send(0x200 + id, data, VelocityPdo::length);
+		}
+		else
+			write(CanOpen::Index_TargetSpeed, 0x00, state.target_angular_velocity, sizeof(uint32_t));
 	}
 
 
@@ -180,7 +226,7 @@ public:
 	 */
 	void acceleration_time(uint32_t value)
 	{
-		can->sdo(id, CanOpen::Index_AccelerationTime, 0x00, value, sizeof(uint32_t));
+		write(CanOpen::Index_AccelerationTime, 0x00, value, sizeof(uint32_t));
 	}
 
 
@@ -190,7 +236,7 @@ public:
 	 */
 	void deceleration_time(uint32_t value)
 	{
-		can->sdo(id, CanOpen::Index_DecelerationTime, 0x00, value, sizeof(uint32_t));
+		write(CanOpen::Index_DecelerationTime, 0x00, value, sizeof(uint32_t));
 	}
 
 
@@ -200,22 +246,51 @@ public:
 	 */
 	void maximum_velocity(uint32_t value)
 	{
-		can->sdo(id, CanOpen::Index_MaximumSpeed, 0x00, value, sizeof(uint32_t));
+		write(CanOpen::Index_MaximumSpeed, 0x00, value, sizeof(uint32_t));
+	}
+
+
+	/**
+	 * Maps the drive's PDOs so that its state is sent without being asked for, and velocity commands need no reply.
+	 * The drive is taken to pre-operational while its PDOs are remapped, and back to operational afterwards; the
+	 * requests are queued, so this returns at once. Call again after setup(), which restores the saved mapping.
+	 * @param transmission_type When the drive sends its TPDOs: 1-240 for every nth SYNC (so that several drives report
+	 *                          the same instant), or 0xff to send on change and on the event timer. With SYNC, which
+	 *                          is the default, the cache is only refreshed if a node on the bus produces SYNC, such
+	 *                          as this one calling CanOpen::sync() from a timer at the control rate.
+	 * @param event_timer With transmission type 0xff, the longest interval between TPDOs, in milliseconds.
+	 * @returns True if queued; false if the queue has no room.
+	 */
+	bool configure_pdos(uint8_t transmission_type=1, uint16_t event_timer=0)
+	{
+		// Two NMT commands, and six requests per PDO plus one per mapped object.
+		constexpr uint32_t needed = 2 + 3 * 6 + StatusPdo::count + FaultPdo::count + VelocityPdo::count;
+		if (ZLAC8015_QUEUE_LENGTH - requests.get_length() < needed)
+			return false;
+		rpdo_ready = false;
+		nmt(CanOpen::NMT_Preoperational);
+		map<StatusPdo>(CanOpen::Index_Tpdo0Communications, CanOpen::Index_Tpdo0Mapping, 0x180 + id,
+				transmission_type, event_timer);
+		map<FaultPdo>(CanOpen::Index_Tpdo1Communications, CanOpen::Index_Tpdo1Mapping, 0x280 + id,
+				transmission_type, event_timer);
+		map<VelocityPdo>(CanOpen::Index_Rpdo0Communications, CanOpen::Index_Rpdo0Mapping, 0x200 + id, 0xff, 0);
+		nmt(CanOpen::NMT_Operational);
+		return true;
 	}
 
 
 	/**
-	 * Refreshes state information.
+	 * Refreshes state information over SDO. Not needed for the objects in the PDOs once configure_pdos() is done.
 	 */
 	void refresh(void)
 	{
-		can->sdo(id, CanOpen::Index_ActualPosition, 0x00);
-		can->sdo(id, CanOpen::Index_ActualSpeed, 0x00);
-		can->sdo(id, CanOpen::Index_LastFaultCode, 0x00);
-		can->sdo(id, Index_MotorTemperature, 0x00);
-		can->sdo(id, CanOpen::Index_RealtimeTargetTorque, 0x00);
-		can->sdo(id, CanOpen::Index_ActualTorque, 0x00);
-		can->sdo(id, Index_BusVoltage, 0x00);
+		read(CanOpen::Index_ActualPosition, 0x00);
+		read(CanOpen::Index_ActualSpeed, 0x00);
+		read(CanOpen::Index_LastFaultCode, 0x00);
+		read(Index_MotorTemperature, 0x00);
+		read(CanOpen::Index_RealtimeTargetTorque, 0x00);
+		read(CanOpen::Index_ActualTorque, 0x00);
+		read(Index_BusVoltage, 0x00);
 	}
 
 
@@ -225,7 +300,7 @@ public:
 	 */
 	void operating_mode(OperatingModes mode)
 	{
-		can->sdo(id, CanOpen::Index_OperatingMode, 0x00, (uint8_t)mode, sizeof(uint8_t));
+		write(CanOpen::Index_OperatingMode, 0x00, (uint8_t)mode, sizeof(uint8_t));
 	}
 
 
@@ -240,62 +315,204 @@ public:
 
 
 	/**
-	 * Stops
+	 * Stops, discarding any configuration still queued.
 	 */
 	void quick_stop(void)
 	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		requests.clear();
+		__set_PRIMASK(primask);
 		control_word(Stop);
 	}
 
 
 	/**
-	 * Stops
+	 * Reads the status word over SDO. Not needed once configure_pdos() is done.
 	 */
 	void status(void)
 	{
-		can->sdo(id, CanOpen::Index_StatusWord, 0x00);
+		read(CanOpen::Index_StatusWord, 0x00);
+	}
+
+
+	/**
+	 * Queues an SDO write.
+	 * @param index The index.
+	 * @param subindex The subindex.
+	 * @param value The value.
+	 * @param size The size of the value in bytes (1, 2 or 4).
+	 * @returns True if queued; false if the queue is full.
+	 */
+	bool write(uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+	{
+		Request request = { index, subindex, size, value };
+		return enqueue(request);
+	}
+
+
+	/**
+	 * Queues an SDO read. The value is decoded by on_sdo_reply() when it arrives.
+	 * @param index The index.
+	 * @param subindex The subindex.
+	 * @returns True if queued; false if the queue is full.
+	 */
+	bool read(uint16_t index, uint8_t subindex)
+	{
+		Request request = { index, subindex, 0, 0 };
+		return enqueue(request);
+	}
+
+
+	/**
+	 * Sends queued requests that could not be sent before, and gives up on a request that has not been answered in
+	 * ZLAC8015_SDO_TIMEOUT milliseconds. Call regularly.
+	 */
+	void poll(void)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (pending == Waiting && HAL_GetTick() - sent_at >= ZLAC8015_SDO_TIMEOUT)
+		{
+			timeouts++;
+			pending = Idle;
+		}
+		kick();
+		__set_PRIMASK(primask);
+	}
+
+
+	/**
+	 * Determines whether requests are queued or awaiting a reply.
+	 * @returns True if busy; otherwise false.
+	 */
+	bool is_busy(void)
+	{
+		return pending != Idle || !requests.is_empty();
+	}
+
+
+	/**
+	 * Gets the number of requests that were not answered in time.
+	 * @returns The number of requests.
+	 */
+	uint32_t get_timeouts(void)
+	{
+		return timeouts;
+	}
+
+
+	/**
+	 * Gets the number of requests that the drive refused with an SDO abort.
+	 * @returns The number of requests.
+	 */
+	uint32_t get_aborts(void)
+	{
+		return aborts;
+	}
+
+
+	/**
+	 * Determines whether velocity() is sent as an RPDO, which is once the drive has acknowledged enabling it.
+	 * @returns True if the RPDO is enabled; false if velocity() writes over SDO.
+	 */
+	bool is_rpdo_ready(void)
+	{
+		return rpdo_ready;
+	}
+
+
+	/**
+	 * Called when a PDO is received. Decodes the drive's TPDOs into the cache.
+	 * @param cob The COB-ID.
+	 * @param data The data.
+	 */
+	void on_pdo(uint16_t cob, uint8_t* data) override
+	{
+		if (cob == 0x180 + id)
+		{
+			uint16_t status;
+			int16_t speed;
+			int32_t position;
+			StatusPdo::unpack(data, status, speed, position);
+			state.status = status;
+			state.actual_angular_velocity = speed;
+			state.actual_linear_velocity = (speed * wheel_circumference) / 60.0;
+			state.angular_position = position;
+			state.linear_position = position / counts * wheel_circumference;
+			updated_at = HAL_GetTick();
+		}
+		else if (cob == 0x280 + id)
+		{
+			uint16_t fault, torque;
+			int16_t temperature;
+			FaultPdo::unpack(data, fault, torque, temperature);
+			last_fault = fault;
+			state.actual_torque = torque * 100;
+			state.temperature = temperature / 10.0;
+		}
 	}
 
 
 	/**
 	 * Called when an sdo message is received
 	 * @param address The address ID of the receiver.
+	 * @param command The SDO command specifier.
 	 * @param index The SDO index.
 	 * @param subindex The SDO subindex.
-	 * @param data The data (1-4 bytes).
+	 * @param data The data (1-4 bytes), or the abort code.
 	 */
-	void on_sdo(uint16_t address, uint16_t index, uint8_t subindex, uint8_t* data) override
+	void on_sdo_reply(uint16_t address, uint8_t command, uint16_t index, uint8_t subindex, uint8_t* data) override
 	{
 		if (address != id)
 			return;
 
+		// A reply to the request in flight releases the next one, whether it was accepted or refused.
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (pending == Waiting && index == request.index && subindex == request.subindex)
+		{
+			if (command == CanOpen::SDO_Abort)
+				aborts++;
+			else if (command == CanOpen::SDO_DownloadResponse && request.size
+					&& index == CanOpen::Index_Rpdo0Communications && subindex == CanOpen::Subindex_Rpdo0CobId)
+				rpdo_ready = !(request.value & 0x80000000);
+			pending = Idle;
+			kick();
+		}
+		__set_PRIMASK(primask);
+
+		// Only an upload response carries a value; an abort carries its code.
+		if ((command & 0xe0) != CanOpen::SDO_UploadResponse)
+			return;
+
 		switch (index)
 		{
 		case CanOpen::Index_ActualSpeed:
-			state.actual_angular_velocity = CanOpen::lsb_int16_to_float(data, 1);
+			state.actual_angular_velocity = Conversion::lsb_int16_to_float(data, 1);
 			state.actual_linear_velocity = (state.actual_angular_velocity * wheel_circumference) / 60.0;
 			break;
 		case CanOpen::Index_ActualPosition:
-			state.angular_position = CanOpen::lsb_int32_to_int32(data);
+			state.angular_position = Conversion::lsb_int32_to_int32(data);
 			state.linear_position = state.angular_position / counts * wheel_circumference;
 			break;
 		case CanOpen::Index_LastFaultCode:
-			last_fault = CanOpen::lsb_uint16_to_uint16(data);
+			last_fault = Conversion::lsb_uint16_to_uint16(data);
 			break;
 		case Index_MotorTemperature:
-			state.temperature = CanOpen::lsb_int16_to_float(data, 10);
+			state.temperature = Conversion::lsb_int16_to_float(data, 10);
 			break;
 		case CanOpen::Index_RealtimeTargetTorque:
-			state.target_torque = CanOpen::lsb_uint16_to_uint16(data);
+			state.target_torque = Conversion::lsb_uint16_to_uint16(data);
 			break;
 		case CanOpen::Index_ActualTorque:
-			state.actual_torque = CanOpen::lsb_uint16_to_uint16(data) * 100;
+			state.actual_torque = Conversion::lsb_uint16_to_uint16(data) * 100;
 			break;
 		case Index_BusVoltage:
 //			state.bus_voltage = CanOpen::data_to_float(data, 100);
 			break;
 		case CanOpen::Index_StatusWord:
-			state.status = CanOpen::lsb_uint16_to_uint16(data);
+			state.status = Conversion::lsb_uint16_to_uint16(data);
 			break;
 		}
 	}
@@ -307,7 +524,61 @@ public:
 	 */
 	MotorData get_state(void)
 	{
-		return state;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		MotorData copy = state;
+		__set_PRIMASK(primask);
+		return copy;
+	}
+
+
+	/**
+	 * Gets the cached status word.
+	 * @returns The status word.
+	 */
+	uint16_t get_status_word(void)
+	{
+		return state.status;
+	}
+
+
+	/**
+	 * Gets the cached velocity.
+	 * @returns The velocity in rpm.
+	 */
+	int16_t get_velocity(void)
+	{
+		return state.actual_angular_velocity;
+	}
+
+
+	/**
+	 * Gets the cached position.
+	 * @returns The position in encoder counts.
+	 */
+	int32_t get_position(void)
+	{
+		return state.angular_position;
+	}
+
+
+	/**
+	 * Determines whether the status word reports a fault.
+	 * @returns True if faulted; otherwise false.
+	 */
+	bool is_faulted(void)
+	{
+		return state.status & StatusWord_Fault;
+	}
+
+
+	/**
+	 * Gets the time since the status PDO was last received, to detect a drive that has stopped reporting.
+	 * @returns The time in milliseconds.
+	 */
+	uint32_t get_age(void)
+	{
+		return HAL_GetTick() - updated_at;
 	}
 
 
@@ -321,6 +592,88 @@ public:
 	}
 
 private:
+	/**
+	 * A queued SDO request.
+	 */
+	typedef struct Request
+	{
+		uint16_t index;  /// The index, or 0 for an NMT command to the drive.
+		uint8_t subindex;
+		uint8_t size;  /// The size of the value to write, or 0 to read.
+		uint32_t value;
+	} Request;
+
+	enum Pending { Idle, Ready, Waiting };
+
+
+	bool enqueue(const Request& request)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		bool queued = requests.enqueue(request);
+		kick();
+		__set_PRIMASK(primask);
+		return queued;
+	}
+
+
+	void nmt(uint8_t state)
+	{
+		Request request = { 0, 0, 0, state };
+		enqueue(request);
+	}
+
+
+	/**
+	 * Sends the next request if the drive is not busy with one. Call with interrupts disabled.
+	 */
+	void kick(void)
+	{
+		while (pending != Waiting)
+		{
+			if (pending == Idle)
+			{
+				if (requests.is_empty())
+					return;
+				request = requests.dequeue();
+				pending = Ready;
+			}
+
+			if (request.index == 0)
+			{
+				// NMT is not answered, so carry on with the next request.
+				if (can->nmt(request.value, id) != 0)
+					return;
+				pending = Idle;
+				continue;
+			}
+
+			if (can->send_sdo(id, request.index, request.subindex, request.value, request.size) != 0)
+				return;  // Retried by poll().
+			pending = Waiting;
+			sent_at = HAL_GetTick();
+		}
+	}
+
+
+	/**
+	 * Queues the requests that remap a PDO: disable it, clear the mapping, map each object, set the number of
+	 * objects and the transmission type, then enable it.
+	 */
+	template <typename Pdo> void map(uint16_t communication, uint16_t mapping, uint16_t cob, uint8_t transmission_type,
+			uint16_t event_timer)
+	{
+		write(communication, CanOpen::Subindex_Rpdo0CobId, 0x80000000 | cob, 4);
+		write(mapping, CanOpen::Subindex_NumberOfEntries, 0, 1);
+		for (uint8_t i=0; i < Pdo::count; i++)
+			write(mapping, i + 1, Pdo::get_mapping(i), 4);
+		write(mapping, CanOpen::Subindex_NumberOfEntries, Pdo::count, 1);
+		write(communication, CanOpen::Subindex_TransmissionTime, transmission_type, 1);
+		write(communication, CanOpen::Subindex_EventTimer, event_timer, 2);
+		write(communication, CanOpen::Subindex_Rpdo0CobId, cob, 4);
+	}
+
+
 	uint8_t id;
 	MotorData state = {0};
 	CanOpen* can;
@@ -329,6 +682,15 @@ private:
 	bool reverse;
 	uint32_t acc_time, dec_time;
 	uint16_t last_fault;
+	Queue<Request> requests;
+	Request request_buffer[ZLAC8015_QUEUE_LENGTH];
+	Request request;  // The request in flight.
+	volatile Pending pending = Idle;
+	uint32_t sent_at = 0;
+	uint32_t timeouts = 0;
+	uint32_t aborts = 0;
+	volatile bool rpdo_ready = false;
+	volatile uint32_t updated_at = 0;
 };
 
 #endif /* INC_COMMS_ZLAC8015_H_ */
@@ -0,0 +1,395 @@
+///	@file       diagnostics/CrashDump.h
+///	@class      CrashDump
+///	@brief      Captures a post-mortem record of a hard fault to external SPI FLASH.
+///
+/// @note       This code is part of the `stm32-toolbox` project that provides easy-to-use building blocks to create
+///             firmware for STM32 microcontrollers. _See https://github.com/TwoRedCells/stm32-toolbox/_
+/// @copyright  See https://github.com/TwoRedCells/stm32-toolbox/blob/main/LICENSE
+
+
+#ifndef INC_DIAGNOSTICS_CRASHDUMP_H_
+#define INC_DIAGNOSTICS_CRASHDUMP_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "toolbox.h"
+#include "devices/flash/external/SpiFlashMemory.h"
+#include "utility/Crc.h"
+#if LOG_TAIL_SIZE
+#include "diagnostics/Log.h"
+#endif
+
+extern "C" uint32_t _estack;  // Top of the main stack, from the linker script.
+
+
+/// <summary>
+/// Captures a post-mortem record of a hard fault to external SPI FLASH.
+/// </summary>
+/// <remarks>
+/// The record holds the exception frame stacked by the core, the fault status registers, a window of the stack above
+/// the frame, and (if LOG_TAIL_SIZE is set) the tail of the in-RAM log. It is written with raw page programs to a
+/// region of FLASH that is kept erased, so capture needs neither the RTOS nor interrupts and takes a few
+/// milliseconds. The header page is programmed last, so an interrupted capture is never mistaken for a valid one.
+///
+/// Reserve the region at the top of the chip by passing CRASHDUMP_REGION_SIZE to
+/// <see cref="SpiFlashMemoryFilesystem::initialize">SpiFlashMemoryFilesystem::initialize()</see>, then call
+/// begin() with <see cref="SpiFlashMemoryFilesystem::get_reserved_address">get_reserved_address()</see>. If begin()
+/// returns true, a dump from the previous run is available: it can be copied into the filesystem with export_to(), or
+/// served over TFTP by calling read() from the TFTP read callback. Call clear() to erase it and arm the next capture.
+///
+/// The fault handler is installed with a macro in one translation unit:
+/// <code>
+/// CrashDump crash_dump;
+/// CRASHDUMP_DEFINE_HARDFAULT_HANDLER(crash_dump)
+/// </code>
+/// </remarks>
+class CrashDump
+{
+public:
+	static constexpr uint32_t MAGIC_NUMBER = 0x504d5544;  // "DUMP"
+
+	/**
+	 * @brief	The first page of the record.
+	 */
+	typedef struct Header
+	{
+		uint32_t magic_number;  /// Indicates that a complete record is present.
+		uint32_t length;  /// Number of bytes that follow the header page.
+		uint32_t crc;  /// CRC32 of the bytes that follow the header page.
+		uint32_t stack_length;  /// Number of stack bytes, starting at the exception frame.
+		uint32_t log_length;  /// Number of log bytes, following the stack.
+		uint32_t r0, r1, r2, r3, r12, lr, pc, xpsr;  /// Exception frame.
+		uint32_t cfsr, hfsr, mmfar, bfar, afsr;  /// Fault status registers.
+		uint32_t sp;  /// Stack pointer at the time of the fault.
+		uint32_t exc_return;  /// EXC_RETURN value, which identifies the stack in use.
+		uint32_t uptime;  /// HAL tick count at the time of the fault.
+
+		/**
+		 * @brief	Synactic sugar for evaluating record validity.
+		 * @returns	True is the record is valid; otherwise false.
+		 */
+		bool is_valid(void)
+		{
+			return magic_number == MAGIC_NUMBER && length <= CRASHDUMP_REGION_SIZE - SpiFlashMemory::PageSize;
+		}
+	} Header;
+
+
+	/**
+	 * @brief	Prepares to capture, and checks for a record left by the previous run.
+	 * The region is erased only if it holds something other than a valid record, such as a capture cut short, so a
+	 * normal boot only reads it.
+	 * @param	flash The FLASH device to write to.
+	 * @param	address The first address of the reserved region. Must be sector aligned.
+	 * @param	log Optional log whose in-RAM tail is captured.
+	 * @returns	True if a valid record from the previous run is present; otherwise false.
+	 */
+#if LOG_TAIL_SIZE
+	bool begin(SpiFlashMemory* flash, uint32_t address, Log* log=nullptr)
+#else
+	bool begin(SpiFlashMemory* flash, uint32_t address)
+#endif
+	{
+		this->flash = flash;
+		this->address = address;
+#if LOG_TAIL_SIZE
+		this->log = log;
+#endif
+		instance = this;
+
+		flash->read(address, &header, sizeof(Header));
+		present = header.is_valid() && verify();
+		if (!present && !is_blank())
+			clear();
+		return present;
+	}
+
+
+	/**
+	 * @brief	Determines whether a record from the previous run is present.
+	 * @returns	True if present; otherwise false.
+	 */
+	bool is_present(void)
+	{
+		return present;
+	}
+
+
+	/**
+	 * @brief	Gets the header of the record from the previous run.
+	 * @returns	Pointer to the header, valid only if is_present() is true.
+	 */
+	Header* get_header(void)
+	{
+		return &header;
+	}
+
+
+	/**
+	 * @brief	Gets the length of the whole record, as it would appear in a file.
+	 * @returns	The length in bytes, or zero if there is no record.
+	 */
+	uint32_t get_length(void)
+	{
+		return present ? SpiFlashMemory::PageSize + header.length : 0;
+	}
+
+
+	/**
+	 * @brief	Reads part of the record, as it would appear in a file.
+	 * @param	offset The offset from the start of the record.
+	 * @param	data Pointer to the destination.
+	 * @param	length The maximum number of bytes to read.
+	 * @returns	The number of bytes read.
+	 */
+	uint32_t read(uint32_t offset, void* data, uint32_t length)
+	{
+		uint32_t total = get_length();
+		if (offset >= total)
+			return 0;
+		if (length > total - offset)
+			length = total - offset;
+		flash->read(address + offset, data, length);
+		return length;
+	}
+
+
+	/**
+	 * @brief	Copies the record into a file.
+	 * @tparam	FS The filesystem type, typically SpiFlashMemoryFilesystem.
+	 * @param	fs The filesystem to write to.
+	 * @param	filename The name of the file.
+	 * @param	buffer A buffer of at least get_length() bytes to stage the record in.
+	 * @param	size The size of the buffer.
+	 * @returns	The error code, if any.
+	 */
+	template <class FS>
+	SpiFlashMemory::error export_to(FS* fs, const char* filename, uint8_t* buffer, uint32_t size)
+	{
+		if (!present)
+			return FS::ErrorFileNotFound;
+		if (size < get_length())
+			return FS::ErrorFull;
+		uint32_t length = read(0, buffer, size);
+		return fs->write_file(filename, buffer, length);
+	}
+
+
+	/**
+	 * @brief	Erases the reserved region, discarding any record and arming the next capture.
+	 */
+	void clear(void)
+	{
+		for (uint32_t offset=0; offset < CRASHDUMP_REGION_SIZE; offset += SpiFlashMemory::SectorSize)
+			flash->sector_erase(address + offset);
+		while (!flash->is_idle());
+		present = false;
+	}
+
+
+	/**
+	 * @brief	Writes the record and resets the MCU. Called from the hard fault handler.
+	 * @param	frame Pointer to the exception frame on the active stack.
+	 * @param	exc_return The EXC_RETURN value from LR on entry to the handler.
+	 */
+	void capture(uint32_t* frame, uint32_t exc_return)
+	{
+		// Not started. Returning would re-enter the fault, so reset without a record.
+		if (flash == nullptr)
+			NVIC_SystemReset();
+
+		Header* h = &header;  // The previous record's header is no longer needed.
+		h->r0 = frame[0];
+		h->r1 = frame[1];
+		h->r2 = frame[2];
+		h->r3 = frame[3];
+		h->r12 = frame[4];
+		h->lr = frame[5];
+		h->pc = frame[6];
+		h->xpsr = frame[7];
+#if defined(SCB_CFSR_MEMFAULTSR_Pos)
+		h->cfsr = SCB->CFSR;
+		h->hfsr = SCB->HFSR;
+		h->mmfar = SCB->MMFAR;
+		h->bfar = SCB->BFAR;
+		h->afsr = SCB->AFSR;
+#else
+		// Cortex-M0/M0+ have no fault status registers.
+		h->cfsr = h->hfsr = h->mmfar = h->bfar = h->afsr = 0;
+#endif
+		h->sp = (uint32_t) frame;
+		h->exc_return = exc_return;
+		h->uptime = HAL_GetTick();
+
+		flash->abort();
+		cursor = address + SpiFlashMemory::PageSize;
+		fill = 0;
+		crc = 0;
+
+		// Stack window, clamped to the top of RAM.
+		uint32_t top = (uint32_t) &_estack;
+		uint32_t stack_length = CRASHDUMP_STACK_WINDOW;
+		if ((uint32_t) frame + stack_length > top)
+			stack_length = top > (uint32_t) frame ? top - (uint32_t) frame : 0;
+		if (stack_length > CRASHDUMP_REGION_SIZE - SpiFlashMemory::PageSize)
+			stack_length = CRASHDUMP_REGION_SIZE - SpiFlashMemory::PageSize;
+		append((uint8_t*) frame, stack_length);
+		h->stack_length = stack_length;
+
+		h->log_length = 0;
+#if LOG_TAIL_SIZE
+		if (log != nullptr)
+		{
+			uint8_t* data;
+			uint32_t room = CRASHDUMP_REGION_SIZE - SpiFlashMemory::PageSize - stack_length;
+			Log::Tail* tail = log->get_tail();
+			uint32_t skip = tail->get_length() > room ? tail->get_length() - room : 0;
+			uint32_t n = tail->get_first(&data);
+			uint32_t s = skip < n ? skip : n;
+			append(data + s, n - s);
+			h->log_length += n - s;
+			skip -= s;
+			n = tail->get_second(&data);
+			append(data + skip, n - skip);
+			h->log_length += n - skip;
+		}
+#endif
+		if (fill)
+			program();
+
+		// Header last, so a partial record is never valid.
+		h->magic_number = MAGIC_NUMBER;
+		h->length = h->stack_length + h->log_length;
+		h->crc = crc;
+		memset(page, 0xff, sizeof(page));
+		memcpy(page, h, sizeof(Header));
+		flash->page_program_raw(address, page, SpiFlashMemory::PageSize);
+		while (!flash->is_idle());
+
+		NVIC_SystemReset();
+	}
+
+
+	/**
+	 * @brief	Gets the instance registered by begin(), for use by the fault handler.
+	 * @returns	The instance, or nullptr if begin() was never called.
+	 */
+	static CrashDump* get_instance(void)
+	{
+		return instance;
+	}
+
+
+private:
+	/**
+	 * @brief	Recalculates the CRC of the stored record and compares it to the header.
+	 * @returns	True if they match; otherwise false.
+	 */
+	bool verify(void)
+	{
+		uint32_t c = 0;
+		for (uint32_t offset=0; offset < header.length; offset += sizeof(page))
+		{
+			uint32_t n = header.length - offset < sizeof(page) ? header.length - offset : sizeof(page);
+			flash->read(address + SpiFlashMemory::PageSize + offset, page, n);
+			c = Crc::crc32_ethernet(page, n, c);
+		}
+		return c == header.crc;
+	}
+
+
+	/**
+	 * @brief	Determines whether the whole region reads as erased.
+	 * @returns	True if every byte is 0xff; otherwise false.
+	 */
+	bool is_blank(void)
+	{
+		for (uint32_t offset=0; offset < CRASHDUMP_REGION_SIZE; offset += sizeof(page))
+		{
+			flash->read(address + offset, page, sizeof(page));
+			for (uint32_t i=0; i < sizeof(page); i++)
+				if (page[i] != 0xff)
+					return false;
+		}
+		return true;
+	}
+
+
+	/**
+	 * @brief	Streams bytes into the staging page, programming each page as it fills.
+	 * @param	data Pointer to the bytes.
+	 * @param	length The number of bytes.
+	 */
+	void append(uint8_t* data, uint32_t length)
+	{
+		crc = Crc::crc32_ethernet(data, length, crc);
+		while (length)
+		{
+			uint32_t n = SpiFlashMemory::PageSize - fill;
+			if (n > length)
+				n = length;
+			memcpy(page + fill, data, n);
+			fill += n;
+			data += n;
+			length -= n;
+			if (fill == SpiFlashMemory::PageSize)
+				program();
+		}
+	}
+
+
+	/**
+	 * @brief	Programs the staging page at the cursor.
+	 */
+	void program(void)
+	{
+		flash->page_program_raw(cursor, page, fill);
+		cursor += SpiFlashMemory::PageSize;
+		fill = 0;
+	}
+
+
+	SpiFlashMemory* flash = nullptr;
+	uint32_t address = 0;
+#if LOG_TAIL_SIZE
+	Log* log = nullptr;
+#endif
+	Header header;
+	bool present = false;
+	uint8_t page[SpiFlashMemory::PageSize];  // Static storage, since the stack may be what failed.
+	uint32_t cursor = 0;
+	uint32_t fill = 0;
+	uint32_t crc = 0;
+	static inline CrashDump* instance = nullptr;
+};
+
+
+/**
+ * @brief	Defines HardFault_Handler so that it captures to the specified CrashDump instance.
+ * @note	Use once, at global scope, in a single translation unit. Remove the HardFault_Handler generated by CubeMX.
+ *			The handler uses only Thumb-1 instructions, so it also builds for Cortex-M0/M0+ parts.
+ */
+#define CRASHDUMP_DEFINE_HARDFAULT_HANDLER(dump) \
+	extern "C" void crashdump_capture(uint32_t* frame, uint32_t exc_return) \
+	{ \
+		(dump).capture(frame, exc_return); \
+	} \
+	extern "C" __attribute__((naked)) void HardFault_Handler(void) \
+	{ \
+		__asm volatile( \
+			"movs r0, #4\n" \
+			"mov r1, lr\n" \
+			"tst r0, r1\n" \
+			"bne 1f\n" \
+			"mrs r0, msp\n" \
+			"b 2f\n" \
+			"1:\n" \
+			"mrs r0, psp\n" \
+			"2:\n" \
+			"ldr r2, 3f\n" \
+			"bx r2\n" \
+			".align 2\n" \
+			"3: .word crashdump_capture\n"); \
+	}
+
+#endif /* INC_DIAGNOSTICS_CRASHDUMP_H_ */
@@ -75,10 +75,80 @@ public:
         serial->printf("# %s: ", level_names[level]);
         serial->printf(format, args...);
         serial->printf("\r\n");
+#if LOG_TAIL_SIZE
+        tail.printf("# %s: ", level_names[level]);
+        tail.printf(format, args...);
+        tail.printf("\r\n");
+#endif
         last_level = level;
         release_mutex();
     }
 
+#if LOG_TAIL_SIZE
+    /**
+     * Keeps the most recent LOG_TAIL_SIZE bytes of log output in RAM, so they survive to a fault handler.
+     */
+    class Tail : public PrintLite
+    {
+    public:
+        size_t write(uint8_t c) override
+        {
+            buffer[head] = c;
+            head = (head + 1) % LOG_TAIL_SIZE;
+            if (length < LOG_TAIL_SIZE)
+                length++;
+            return 1;
+        }
+
+        /**
+         * Gets the number of bytes held.
+         * @returns The number of bytes.
+         */
+        uint32_t get_length(void)
+        {
+            return length;
+        }
+
+        /**
+         * Gets the oldest held bytes, up to the point where the ring wraps.
+         * @param data Set to point at the first byte.
+         * @returns The number of contiguous bytes at data.
+         */
+        uint32_t get_first(uint8_t** data)
+        {
+            uint32_t start = (head + LOG_TAIL_SIZE - length) % LOG_TAIL_SIZE;
+            *data = buffer + start;
+            return start + length > LOG_TAIL_SIZE ? LOG_TAIL_SIZE - start : length;
+        }
+
+        /**
+         * Gets the remaining bytes after the ring wraps.
+         * @param data Set to point at the first byte.
+         * @returns The number of contiguous bytes at data.
+         */
+        uint32_t get_second(uint8_t** data)
+        {
+            uint8_t* first;
+            *data = buffer;
+            return length - get_first(&first);
+        }
+
+    private:
+        uint8_t buffer[LOG_TAIL_SIZE];
+        uint32_t head = 0;
+        uint32_t length = 0;
+    };
+
+    /**
+     * Gets the in-RAM tail of the log.
+     * @returns The tail.
+     */
+    Tail* get_tail(void)
+    {
+        return &tail;
+    }
+#endif
+
 
     void get_mutex(void)
     {
@@ -99,6 +169,9 @@ public:
 private:
     LogLevels last_level;
     LogLevels minimum_level;
+#if LOG_TAIL_SIZE
+    Tail tail;
+#endif
 
 #if USING_FREERTOS
     osMutexId_t mutex;
@@ -0,0 +1,253 @@
+///	@file       diagnostics/MemoryUsage.h
+///	@class      MemoryUsage
+///	@brief      Measures stack and heap high-water marks.
+///
+/// @note       This code is part of the `stm32-toolbox` project that provides easy-to-use building blocks to create
+///             firmware for STM32 microcontrollers. _See https://github.com/TwoRedCells/stm32-toolbox/_
+/// @copyright  See https://github.com/TwoRedCells/stm32-toolbox/blob/main/LICENSE
+
+
+#ifndef INC_DIAGNOSTICS_MEMORYUSAGE_H_
+#define INC_DIAGNOSTICS_MEMORYUSAGE_H_
+
+#include <stdint.h>
+#include <malloc.h>
+#include "toolbox.h"
+#include "diagnostics/Fault.h"
+#include "diagnostics/Log.h"
+#include "utility/Timer.h"
+#if GENERICS_ALLOW_NEW
+#include "generics/Allocator.h"
+#endif
+
+extern "C" uint32_t _estack;  // Top of the main stack, from the linker script.
+extern "C" uint32_t _Min_Stack_Size;  // Size reserved for the main stack, from the linker script.
+
+
+/// <summary>
+/// Measures stack and heap high-water marks.
+/// </summary>
+/// <remarks>
+/// The main stack is painted with a known pattern as early as possible after reset; the watermark is found later by
+/// scanning up from the bottom of the stack for the first overwritten word. RTOS task stacks are painted by FreeRTOS
+/// itself, so their watermarks come from the kernel. Heap usage is reported for allocations made by the generics
+/// (when GENERICS_ALLOW_NEW is set) and for the C library heap as a whole.
+///
+/// Call poll() from a low-priority loop. Every MEMORYUSAGE_REPORT_INTERVAL milliseconds it takes a snapshot, logs it,
+/// and raises <see cref="Fault::StackOverflow">StackOverflow</see> or
+/// <see cref="Fault::MemoryAllocation">MemoryAllocation</see> when a stack comes within MEMORYUSAGE_STACK_MARGIN bytes
+/// of its end or a generics allocation has failed.
+/// </remarks>
+class MemoryUsage
+{
+public:
+	static constexpr uint32_t PaintPattern = 0xa5a5a5a5;  // The same pattern FreeRTOS uses for task stacks.
+
+	/**
+	 * @brief	Usage of one RTOS task stack.
+	 */
+	typedef struct TaskStack
+	{
+		const char* name;  /// The task name.
+		uint32_t free;  /// The fewest bytes that have remained free.
+	} TaskStack;
+
+	/**
+	 * @brief	A point-in-time view of memory usage.
+	 */
+	typedef struct Snapshot
+	{
+		uint32_t main_stack_size;  /// Bytes reserved for the main stack.
+		uint32_t main_stack_peak;  /// Most bytes of the main stack ever used.
+		uint32_t heap_arena;  /// Bytes obtained from the system by the C library heap; its high-water mark.
+		uint32_t heap_used;  /// Bytes currently allocated from the C library heap.
+		uint32_t generics_current;  /// Bytes currently allocated by the generics.
+		uint32_t generics_peak;  /// Most bytes allocated by the generics at once.
+		uint32_t generics_failures;  /// Failed allocations by the generics.
+		uint32_t task_count;  /// Number of entries in tasks.
+		TaskStack tasks[MEMORYUSAGE_MAX_TASKS];
+	} Snapshot;
+
+
+	/**
+	 * @brief	Paints the unused part of the main stack.
+	 * @note	Call at the start of main(). Everything below the current stack pointer, less a small margin for this
+	 *          function's own frame, is overwritten.
+	 */
+	static void paint_main_stack(void)
+	{
+		paint(get_main_stack_bottom(), (uint32_t*) (uintptr_t) __get_MSP() - 16);
+	}
+
+
+	/**
+	 * @brief	Paints a region of a stack.
+	 * @param	bottom The lowest word of the region.
+	 * @param	end One past the highest word of the region.
+	 */
+	static void paint(uint32_t* bottom, uint32_t* end)
+	{
+		for (uint32_t* p=bottom; p < end; p++)
+			*p = PaintPattern;
+	}
+
+
+	/**
+	 * @brief	Gets the size of the main stack.
+	 * @returns	The size in bytes.
+	 */
+	static uint32_t get_main_stack_size(void)
+	{
+		return (uint32_t) (uintptr_t) &_Min_Stack_Size;
+	}
+
+
+	/**
+	 * @brief	Gets the most the main stack has been used since it was painted.
+	 * @returns	The number of bytes.
+	 */
+	static uint32_t get_main_stack_peak(void)
+	{
+		return get_stack_peak(get_main_stack_bottom(), &_estack);
+	}
+
+
+	/**
+	 * @brief	Gets the most a descending stack has been used since it was painted.
+	 * @param	bottom The lowest word of the stack.
+	 * @param	top One past the highest word of the stack.
+	 * @returns	The number of bytes from the lowest overwritten word to the top.
+	 */
+	static uint32_t get_stack_peak(uint32_t* bottom, uint32_t* top)
+	{
+		uint32_t* p = bottom;
+		while (p < top && *p == PaintPattern)
+			p++;
+		return (top - p) * sizeof(uint32_t);
+	}
+
+
+	/**
+	 * @brief	Takes a snapshot of memory usage.
+	 * @param	snapshot The snapshot to fill.
+	 */
+	static void snapshot(Snapshot* snapshot)
+	{
+		snapshot->main_stack_size = get_main_stack_size();
+		snapshot->main_stack_peak = get_main_stack_peak();
+
+		struct mallinfo mi = mallinfo();
+		snapshot->heap_arena = mi.arena;
+		snapshot->heap_used = mi.uordblks;
+
+#if GENERICS_ALLOW_NEW
+		snapshot->generics_current = Allocator::get_current();
+		snapshot->generics_peak = Allocator::get_peak();
+		snapshot->generics_failures = Allocator::get_failures();
+#else
+		snapshot->generics_current = 0;
+		snapshot->generics_peak = 0;
+		snapshot->generics_failures = 0;
+#endif
+
+		snapshot->task_count = 0;
+#if USING_FREERTOS
+		osThreadId_t threads[MEMORYUSAGE_MAX_TASKS];
+		uint32_t count = osThreadEnumerate(threads, MEMORYUSAGE_MAX_TASKS);
+		for (uint32_t i=0; i < count; i++)
+		{
+			snapshot->tasks[i].name = osThreadGetName(threads[i]);
+			snapshot->tasks[i].free = osThreadGetStackSpace(threads[i]);
+		}
+		snapshot->task_count = count;
+#endif
+	}
+
+
+	/**
+	 * @brief	Constructs an instance that reports periodically.
+	 * @param	log The log to report to, or nullptr.
+	 * @param	fault The fault instance to raise faults on, or nullptr.
+	 */
+	MemoryUsage(Log* log=nullptr, Fault* fault=nullptr)
+	{
+		this->log = log;
+		this->fault = fault;
+	}
+
+
+	/**
+	 * @brief	Takes, reports and checks a snapshot if the reporting interval has elapsed.
+	 * @returns	True if a snapshot was taken; otherwise false.
+	 */
+	bool poll(void)
+	{
+		if (timer.is_started() && !timer.is_elapsed())
+			return false;
+		timer.start(milliseconds(MEMORYUSAGE_REPORT_INTERVAL));
+
+		snapshot(&last);
+		if (log != nullptr)
+			report(log, &last);
+		if (fault != nullptr)
+			check(fault, &last);
+		return true;
+	}
+
+
+	/**
+	 * @brief	Gets the snapshot taken by the last call to poll().
+	 * @returns	Pointer to the snapshot.
+	 */
+	Snapshot* get_last(void)
+	{
+		return &last;
+	}
+
+
+	/**
+	 * @brief	Logs a snapshot.
+	 * @param	log The log to write to.
+	 * @param	snapshot The snapshot.
+	 */
+	static void report(Log* log, Snapshot* snapshot)
+	{
+		log->log(LOGLEVEL_INFO, "Main stack %d/%d, heap %d (arena %d), generics %d (peak %d, failed %d)",
+				snapshot->main_stack_peak, snapshot->main_stack_size, snapshot->heap_used, snapshot->heap_arena,
+				snapshot->generics_current, snapshot->generics_peak, snapshot->generics_failures);
+		for (uint32_t i=0; i < snapshot->task_count; i++)
+			log->log(LOGLEVEL_INFO, "Task %s stack free %d", snapshot->tasks[i].name, snapshot->tasks[i].free);
+	}
+
+
+	/**
+	 * @brief	Raises faults for stacks that are nearly exhausted and for failed allocations.
+	 * @param	fault The fault instance.
+	 * @param	snapshot The snapshot.
+	 */
+	static void check(Fault* fault, Snapshot* snapshot)
+	{
+		bool overflow = snapshot->main_stack_size - snapshot->main_stack_peak < MEMORYUSAGE_STACK_MARGIN;
+		for (uint32_t i=0; i < snapshot->task_count; i++)
+			if (snapshot->tasks[i].free < MEMORYUSAGE_STACK_MARGIN)
+				overflow = true;
+		if (overflow)
+			fault->raise(Fault::StackOverflow);
+		if (snapshot->generics_failures)
+			fault->raise(Fault::MemoryAllocation);
+	}
+
+
+private:
+	static uint32_t* get_main_stack_bottom(void)
+	{
+		return (uint32_t*) ((uintptr_t) &_estack - (uintptr_t) &_Min_Stack_Size);
+	}
+
+	Log* log;
+	Fault* fault;
+	Timer timer;
+	Snapshot last = {};
+};
+
+#endif /* INC_DIAGNOSTICS_MEMORYUSAGE_H_ */
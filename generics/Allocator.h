@@ -0,0 +1,123 @@
+///	@file       generics/Allocator.h
+///	@class      Allocator
+///	@brief      Heap allocation used by the generics, with usage accounting.
+///
+/// @note       This code is part of the `stm32-toolbox` project that provides easy-to-use building blocks to create
+///             firmware for STM32 microcontrollers. _See https://github.com/TwoRedCells/stm32-toolbox/_
+/// @copyright  See https://github.com/TwoRedCells/stm32-toolbox/blob/main/LICENSE
+
+
+#ifndef LIB_STM32_TOOLBOX_GENERICS_ALLOCATOR_H_
+#define LIB_STM32_TOOLBOX_GENERICS_ALLOCATOR_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/**
+ * Wraps malloc, realloc and free for the generics, keeping track of current and peak usage so that RAM reservations
+ * can be sized from measurements. See MemoryUsage.
+ */
+class Allocator
+{
+public:
+	/**
+	 * Allocates memory.
+	 * @param bytes The number of bytes.
+	 * @returns Pointer to the memory, or nullptr on failure.
+	 */
+	static void* allocate(uint32_t bytes)
+	{
+		void* p = malloc(bytes);
+		account(p != nullptr, 0, bytes);
+		return p;
+	}
+
+
+	/**
+	 * Resizes memory.
+	 * @param p Pointer to the memory, or nullptr.
+	 * @param old_bytes The size of the existing allocation.
+	 * @param bytes The new size.
+	 * @returns Pointer to the memory, or nullptr on failure (in which case p is still valid).
+	 */
+	static void* reallocate(void* p, uint32_t old_bytes, uint32_t bytes)
+	{
+		void* q = realloc(p, bytes);
+		account(q != nullptr, old_bytes, bytes);
+		return q;
+	}
+
+
+	/**
+	 * Frees memory.
+	 * @param p Pointer to the memory.
+	 * @param bytes The size of the allocation.
+	 */
+	static void release(void* p, uint32_t bytes)
+	{
+		if (p == nullptr)
+			return;
+		free(p);
+		current -= bytes;
+	}
+
+
+	/**
+	 * Gets the number of bytes currently allocated.
+	 * @returns The number of bytes.
+	 */
+	static uint32_t get_current(void)
+	{
+		return current;
+	}
+
+
+	/**
+	 * Gets the largest number of bytes that have been allocated at once.
+	 * @returns The number of bytes.
+	 */
+	static uint32_t get_peak(void)
+	{
+		return peak;
+	}
+
+
+	/**
+	 * Gets the number of allocations that failed.
+	 * @returns The number of failures.
+	 */
+	static uint32_t get_failures(void)
+	{
+		return failures;
+	}
+
+
+	/**
+	 * Restarts peak tracking from the current usage.
+	 */
+	static void reset_peak(void)
+	{
+		peak = current;
+	}
+
+
+private:
+	static void account(bool success, uint32_t old_bytes, uint32_t bytes)
+	{
+		if (!success)
+		{
+			failures++;
+			return;
+		}
+		current = current - old_bytes + bytes;
+		if (current > peak)
+			peak = current;
+	}
+
+	static inline volatile uint32_t current = 0;
+	static inline volatile uint32_t peak = 0;
+	static inline volatile uint32_t failures = 0;
+};
+
+#endif /* LIB_STM32_TOOLBOX_GENERICS_ALLOCATOR_H_ */
@@ -10,6 +10,13 @@
 #ifndef GENERIC_DICTIONARY_H
 #define GENERIC_DICTIONARY_H
 
+#include "toolbox.h"
+#if GENERICS_ALLOW_NEW
+#include "Allocator.h"
+#else
+#include <stdlib.h>
+#endif
+
 
 /**
  * A dictionary.
@@ -38,8 +45,13 @@ public:
 	Dictionary(uint32_t length)
     {
     	dynamic = true;
+#if GENERICS_ALLOW_NEW
+    	T* keys = (T*) Allocator::allocate(length*sizeof(T));
+    	U* values = (U*) Allocator::allocate(length*sizeof(U));
+#else
     	T* keys = (T*) malloc(length*sizeof(T));
-    	U* values = (U*) malloc(length*sizeof(T));
+    	U* values = (U*) malloc(length*sizeof(U));
+#endif
     	set_buffers(keys, values, length);
     	this->length = 0;
     }
@@ -49,8 +61,13 @@ public:
     {
     	if (dynamic)
     	{
+#if GENERICS_ALLOW_NEW
+    		Allocator::release(keys, buffer_length*sizeof(T));
+    		Allocator::release(values, buffer_length*sizeof(U));
+#else
     		free(keys);
     		free(values);
+#endif
     	}
     }
 
@@ -14,7 +14,7 @@
 
 
 #if GENERICS_ALLOW_NEW
-#include <malloc.h>
+#include "Allocator.h"
 #endif
 
 template <class T>
@@ -53,8 +53,8 @@ public:
 #if GENERICS_ALLOW_NEW
 	~ICollection()
 	{
-		if (buffer != nullptr)
-			free(buffer);
+		if (dynamic)
+			Allocator::release(buffer, buffer_length * sizeof(T));
 	}
 
 	/**
@@ -63,14 +63,16 @@ public:
 	 */
 	bool allocate(uint32_t objects)
 	{
-		buffer_length = objects * sizeof(T);
-		if (buffer == nullptr)
-			buffer = (T*) malloc(objects);
+		T* p;
+		if (dynamic)
+			p = (T*) Allocator::reallocate(buffer, buffer_length * sizeof(T), objects * sizeof(T));
 		else
-			buffer = (T*) realloc(buffer, objects);
-		if (buffer == nullptr)
+			p = (T*) Allocator::allocate(objects * sizeof(T));
+		if (p == nullptr)
 			return false;
+		buffer = p;
 		buffer_length = objects;
+		dynamic = true;
 		return true;
 	}
 
@@ -128,6 +130,9 @@ protected:
     uint32_t buffer_length = 0;  // Length of the buffer.
     T _default;
     uint32_t length = 0;
+#if GENERICS_ALLOW_NEW
+    bool dynamic = false;  // True if the buffer was allocated at runtime.
+#endif
 };
 
 #endif /* LIB_STM32_TOOLBOX_GENERICS_ICOLLECTION_H_ */
@@ -0,0 +1,151 @@
+///	@file       generics/LockFreeQueue.h
+///	@class      LockFreeQueue
+///	@brief      A single-producer, single-consumer FIFO queue that is safe between an interrupt and a task.
+///
+/// @note       This code is part of the `stm32-toolbox` project that provides easy-to-use building blocks to create
+///             firmware for STM32 microcontrollers. _See https://github.com/TwoRedCells/stm32-toolbox/_
+/// @copyright  See https://github.com/TwoRedCells/stm32-toolbox/blob/main/LICENSE
+
+
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include <stdint.h>
+
+
+/**
+ * A single-producer, single-consumer FIFO queue with external buffer.
+ * Unlike Queue, the producer only writes the head index and the consumer only writes the tail index, so one side
+ * may run in an interrupt without either side disabling interrupts or taking a lock.
+ * @tparam T The underlying type of the queue.
+ */
+template <class T> class LockFreeQueue
+{
+public:
+    /**
+     * Default constructor.
+     * set_buffer() must be called before the queue can be used.
+     */
+    LockFreeQueue()
+    {
+    }
+
+
+    /**
+     * Constructs a queue using the specified buffer.
+     * @param buffer Pointer to the buffer.
+     * @param length The length of the buffer in objects. Must be a power of two.
+     */
+    LockFreeQueue(T* buffer, uint32_t length)
+    {
+    	set_buffer(buffer, length);
+    }
+
+
+    /**
+     * Sets the internal buffer to the specified pointer, emptying the queue.
+     * @param buffer Pointer to the buffer.
+     * @param length The length of the buffer in objects. Must be a power of two.
+     */
+    void set_buffer(T* buffer, uint32_t length)
+    {
+        this->buffer = buffer;
+        this->mask = length - 1;
+        head = 0;
+        tail = 0;
+    }
+
+
+    /**
+     * Adds an item to the end of the queue. Call only from the producer.
+     * @param value The value to add.
+     * @return true if successful; false if the queue is full.
+     */
+    bool enqueue(const T& value)
+    {
+        uint32_t h = head;
+        if (buffer == nullptr || h - tail > mask)
+            return false;
+
+        buffer[h & mask] = value;
+        __sync_synchronize();  // Publish the item before the index.
+        head = h + 1;
+        return true;
+    }
+
+
+    /**
+     * Removes an item from the front of the queue. Call only from the consumer.
+     * @param value Set to the item.
+     * @return true if an item was removed; false if the queue is empty.
+     */
+    bool dequeue(T& value)
+    {
+        uint32_t t = tail;
+        if (t == head)
+            return false;
+
+        value = buffer[t & mask];
+        __sync_synchronize();  // Finish reading before releasing the slot.
+        tail = t + 1;
+        return true;
+    }
+
+
+    /**
+     * Gets a pointer to the item at the front of the queue without removing it. Call only from the consumer.
+     * @return Pointer to the item, or nullptr if the queue is empty.
+     */
+    T* peek(void)
+    {
+        if (tail == head)
+            return nullptr;
+        return &buffer[tail & mask];
+    }
+
+
+    /**
+     * Returns the number of items in the queue.
+     * @return The length of the queue.
+     */
+    uint32_t get_length(void)
+    {
+        return head - tail;
+    }
+
+
+    /**
+     * Returns the number of items the queue can hold.
+     * @return The capacity of the queue.
+     */
+    uint32_t get_capacity(void)
+    {
+        return mask + 1;
+    }
+
+
+    /**
+     * Returns the state of the queue.
+     * @return true if the queue is empty; otherwise false.
+     */
+    bool is_empty()
+    {
+        return head == tail;
+    }
+
+
+    /**
+     * Discards all items. Call only from the consumer.
+     */
+    void clear(void)
+    {
+        tail = head;
+    }
+
+private:
+    T* buffer = nullptr;  // Pointer to the buffer.
+    uint32_t mask = 0;  // Length of the buffer, less one.
+    volatile uint32_t head = 0;  // Free-running count of items added; written only by the producer.
+    volatile uint32_t tail = 0;  // Free-running count of items removed; written only by the consumer.
+};
+#endif
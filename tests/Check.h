@@ -0,0 +1,44 @@
+/**
+ * \file       tests/Check.h
+ * \brief      The few assertions that the host tests use.
+ * \notes      CHECK() reports a failed condition and carries on, so one run shows every failure. A test's main()
+ *             returns check_result(), which is non-zero if any check failed.
+ */
+
+#ifndef TESTS_CHECK_H_
+#define TESTS_CHECK_H_
+
+#include <stdio.h>
+
+inline int check_failures = 0;
+
+
+/**
+ * Records the outcome of a check.
+ * @returns The outcome, so that a test can stop early.
+ */
+inline bool check(bool passed, const char* condition, const char* file, int line)
+{
+	if (!passed)
+	{
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+		check_failures++;
+	}
+	return passed;
+}
+
+
+/**
+ * Reports the outcome of a test program.
+ * @param name The name of the test.
+ * @returns The exit status: 0 if every check passed; otherwise 1.
+ */
+inline int check_result(const char* name)
+{
+	printf("%s: %s\n", name, check_failures ? "FAILED" : "passed");
+	return check_failures ? 1 : 0;
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+#endif /* TESTS_CHECK_H_ */
@@ -0,0 +1,183 @@
+/**
+ * \file       tests/can/CanFilterTest.cpp
+ * \brief      Packs sets of COB-IDs into bxCAN filter banks and checks every ID against the banks, as the hardware
+ *             would: how many banks, which wanted IDs pass, and how many unwanted ones do.
+ */
+
+#include <stdlib.h>
+#include "toolbox.h"
+#include "comms/CanFilter.h"
+#include "Check.h"
+
+
+/**
+ * Whether a 16-bit scale bank passes a standard data frame, as bxCAN decides.
+ */
+static bool bank_accepts(const CanFilter::Bank& bank, uint16_t id)
+{
+	uint16_t value = id << 5;
+	if (bank.list)
+		return value == bank.id_low || value == bank.mask_low || value == bank.id_high || value == bank.mask_high;
+	return !((value ^ bank.id_low) & bank.mask_low) || !((value ^ bank.id_high) & bank.mask_high);
+}
+
+
+/**
+ * Solves a filter and checks the banks against the IDs it was given.
+ * @param wanted Set to true for each wanted ID by the caller.
+ * @param used Set to the number of banks used.
+ * @returns The number of unwanted IDs that pass.
+ */
+static uint32_t check_banks(CanFilter& filter, const bool wanted[0x800], uint32_t available, uint32_t* used)
+{
+	CanFilter::Bank banks[CAN_FILTER_BANKS];
+	*used = filter.solve(banks, available);
+	CHECK(*used >= 1 && *used <= available);
+
+	uint32_t unwanted = 0, missed = 0, listed = 0;
+	for (uint16_t id=0; id <= CanFilter::AllIds; id++)
+	{
+		bool passes = false;
+		for (uint32_t b=0; b < *used; b++)
+			if (bank_accepts(banks[b], id))
+			{
+				passes = true;
+				if (banks[b].list && !wanted[id])
+					listed++;
+			}
+		if (wanted[id] && !passes)
+			missed++;
+		if (!wanted[id] && passes)
+			unwanted++;
+	}
+	CHECK(missed == 0);
+	CHECK(listed == 0);  // A list bank holds exact IDs, so it never passes one that was not asked for.
+	return unwanted;
+}
+
+
+/**
+ * A master's usual set fits without merging: fourteen exact IDs and the LSS pair take five banks and pass nothing
+ * else. With fewer banks, entries merge, and every wanted ID still passes.
+ */
+static void test_master_set(void)
+{
+	CanFilter filter;
+	bool wanted[0x800] = {};
+	const uint16_t bases[] = { 0x180, 0x580, 0x700 };
+	for (uint16_t base : bases)
+		for (uint16_t node=1; node <= 4; node++)
+		{
+			CHECK(filter.add(base + node));
+			wanted[base + node] = true;
+		}
+	CHECK(filter.add(0x000) && filter.add(0x080));
+	wanted[0x000] = wanted[0x080] = true;
+	CHECK(filter.add_range(0x7e4, 0x7e5));
+	wanted[0x7e4] = wanted[0x7e5] = true;
+	CHECK(filter.get_count() == 15);
+
+	uint32_t used;
+	CHECK(check_banks(filter, wanted, CAN_FILTER_BANKS, &used) == 0);
+	CHECK(used == 5);
+	printf("  16 IDs:");
+	for (uint32_t available=5; available >= 1; available--)
+	{
+		uint32_t unwanted = check_banks(filter, wanted, available, &used);
+		printf(" %u bank%s, %u unwanted;", used, used == 1 ? "" : "s", unwanted);
+		CHECK(used <= available);
+		if (available == 5)
+			CHECK(unwanted == 0);
+	}
+	printf("\n");
+}
+
+
+/**
+ * Ranges split into aligned masks, and stop at the last standard ID.
+ */
+static void test_ranges(void)
+{
+	CanFilter filter;
+	bool wanted[0x800] = {};
+	CHECK(filter.add_range(0x181, 0x1ff));  // TPDO1 of every node.
+	for (uint16_t id=0x181; id <= 0x1ff; id++)
+		wanted[id] = true;
+	CHECK(filter.get_count() == 7);  // 0x181, 0x182/2, 0x184/4 ... 0x1c0/64.
+	uint32_t used;
+	CHECK(check_banks(filter, wanted, CAN_FILTER_BANKS, &used) == 0);
+	CHECK(used == 4);
+
+	CanFilter top;
+	bool top_wanted[0x800] = {};
+	CHECK(top.add_range(0x7f0, 0xffff));
+	for (uint16_t id=0x7f0; id <= 0x7ff; id++)
+		top_wanted[id] = true;
+	CHECK(top.get_count() == 1);
+	CHECK(check_banks(top, top_wanted, 1, &used) == 0);
+}
+
+
+/**
+ * merge() takes the smallest entry that covers both, and merge_cost() counts only the IDs that neither covered.
+ */
+static void test_merge(void)
+{
+	CanFilter::Entry a = { 0x181, CanFilter::AllIds }, b = { 0x182, CanFilter::AllIds };
+	CanFilter::Entry m = CanFilter::merge(a, b);
+	CHECK(m.id == 0x180 && m.mask == 0x7fc);
+	CHECK(CanFilter::size(m) == 4);
+	CHECK(CanFilter::merge_cost(a, b) == 2);
+
+	CanFilter::Entry block = { 0x180, 0x7f0 };
+	CHECK(CanFilter::merge_cost(block, a) == 0);  // a is inside the block.
+	CanFilter::Entry other = { 0x190, 0x7f0 };
+	CHECK(CanFilter::merge_cost(block, other) == 0);  // Two halves of 0x180-0x19f.
+	CHECK(CanFilter::merge_cost(block, { 0x1b0, 0x7f0 }) == 32);  // 0x180-0x1bf, less the two blocks.
+}
+
+
+/**
+ * Random sets of exact IDs and masks, packed into every bank budget from 1 to 14, never lose a wanted ID.
+ */
+static void test_random(void)
+{
+	srand(29);
+	uint32_t worst = 0;
+	for (uint32_t round=0; round < 50; round++)
+	{
+		CanFilter filter;
+		bool wanted[0x800] = {};
+		uint32_t entries = 1 + rand() % CAN_FILTER_MAX_ENTRIES;
+		for (uint32_t i=0; i < entries; i++)
+		{
+			uint16_t mask = rand() % 4 ? CanFilter::AllIds : CanFilter::AllIds & ~((1u << (rand() % 6)) - 1);
+			uint16_t id = rand() & mask & CanFilter::AllIds;
+			CHECK(filter.add(id, mask));
+			for (uint16_t x=0; x <= CanFilter::AllIds; x++)
+				if ((x & mask) == id)
+					wanted[x] = true;
+		}
+		if (entries == CAN_FILTER_MAX_ENTRIES)
+			CHECK(!filter.add(0x123));  // The table is full.
+		for (uint32_t available=1; available <= CAN_FILTER_BANKS; available++)
+		{
+			uint32_t used;
+			uint32_t unwanted = check_banks(filter, wanted, available, &used);
+			if (available == 7 && unwanted > worst)
+				worst = unwanted;
+		}
+	}
+	printf("  50 random sets of up to %u entries: at most %u unwanted IDs with 7 banks\n", CAN_FILTER_MAX_ENTRIES,
+			worst);
+}
+
+
+int main(void)
+{
+	test_master_set();
+	test_ranges();
+	test_merge();
+	test_random();
+	return check_result("CanFilterTest");
+}
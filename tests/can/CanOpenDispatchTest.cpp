@@ -0,0 +1,176 @@
+/**
+ * \file       tests/can/CanOpenDispatchTest.cpp
+ * \brief      Checks which ICanOpenCallback method CanOpen calls for each range of COB-IDs, and what a frame costs to
+ *             classify.
+ */
+
+#include <chrono>
+#include "toolbox.h"
+#include "comms/CanOpen.h"
+#include "Check.h"
+
+
+/**
+ * Notes the last method called, and for which node.
+ */
+class Recorder : public CanOpen::ICanOpenCallback
+{
+public:
+	void on_sdo(uint16_t node, uint16_t index, uint8_t subindex, uint8_t* data) override
+	{
+		(void) index, (void) subindex, (void) data;
+		record('S', node);
+	}
+
+
+	void on_pdo(uint16_t cob, uint8_t* data) override
+	{
+		(void) data;
+		record('P', cob & 0x7f);
+	}
+
+
+	void on_heartbeat(uint8_t node) override
+	{
+		record('H', node);
+	}
+
+
+	void on_nmt(uint8_t data) override
+	{
+		(void) data;
+		record('N', 0);
+	}
+
+
+	void on_lss(uint16_t cob, uint8_t* data) override
+	{
+		(void) cob, (void) data;
+		record('L', 0);
+	}
+
+
+	void on_other_message(uint16_t cob, uint8_t* data) override
+	{
+		(void) cob, (void) data;
+		record('O', 0);
+	}
+
+
+	void record(char kind, uint16_t node)
+	{
+		last = kind;
+		last_node = node;
+		calls++;
+	}
+
+
+	char last = 0;
+	uint16_t last_node = 0;
+	uint32_t calls = 0;
+};
+
+
+static VirtualCanBus bus(1000000);
+static CAN_HandleTypeDef hcan(&bus);
+
+
+/**
+ * Passes one frame to on_frame().
+ * @returns The method that was called, or 0 if none was.
+ */
+static char classify(CanOpen& can, Recorder& recorder, uint16_t cob)
+{
+	uint8_t data[8] = { 0x43, 0x00, 0x10, 0, 0, 0, 0, 0 };
+	recorder.last = 0;
+	can.on_frame(cob, data);
+	return recorder.last;
+}
+
+
+/**
+ * Each function code of the CiA 301 predefined connection set goes to its own method, including those that overlapping
+ * masks used to take for something else.
+ */
+static void test_function_codes(void)
+{
+	Recorder recorder;
+	CanOpen master(&hcan);
+	master.set_callback(&recorder);
+
+	CHECK(classify(master, recorder, 0x000) == 'N');
+	CHECK(classify(master, recorder, 0x080) == 'O');  // SYNC
+	CHECK(classify(master, recorder, 0x085) == 'O');  // EMCY
+	CHECK(classify(master, recorder, 0x100) == 'O');  // TIME
+	for (uint16_t base=0x180; base <= 0x500; base += 0x80)
+		CHECK(classify(master, recorder, base + 5) == 'P' && recorder.last_node == 5);
+	CHECK(classify(master, recorder, 0x3ff) == 'P');
+	CHECK(classify(master, recorder, 0x585) == 'S' && recorder.last_node == 5);
+	CHECK(classify(master, recorder, 0x605) == 'O');  // An SDO request is not for a master.
+	CHECK(classify(master, recorder, 0x685) == 'O');  // Unused, though it has the bits of 0x480.
+	CHECK(classify(master, recorder, 0x705) == 'H' && recorder.last_node == 5);
+	CHECK(classify(master, recorder, 0x77f) == 'H' && recorder.last_node == 127);
+	CHECK(classify(master, recorder, 0x7e4) == 'L');
+	CHECK(classify(master, recorder, 0x7e5) == 'L');
+	CHECK(classify(master, recorder, 0x7e6) == 'O');  // In the LSS range, not a heartbeat.
+
+	CanOpen slave(&hcan, CanOpen::Slave);
+	slave.set_callback(&recorder);
+	CHECK(classify(slave, recorder, 0x605) == 'S' && recorder.last_node == 5);
+}
+
+
+/**
+ * A node's own callback takes its PDO, SDO and heartbeat frames, and the other nodes' go to the default one.
+ */
+static void test_node_callbacks(void)
+{
+	Recorder fallback, drive;
+	CanOpen master(&hcan);
+	master.set_callback(&fallback);
+	master.set_node_callback(5, &drive);
+
+	CHECK(classify(master, drive, 0x185) == 'P');
+	CHECK(classify(master, drive, 0x585) == 'S');
+	CHECK(classify(master, drive, 0x705) == 'H');
+	CHECK(fallback.calls == 0);
+	CHECK(classify(master, fallback, 0x186) == 'P' && fallback.last_node == 6);
+	CHECK(classify(master, fallback, 0x000) == 'N');  // Broadcasts go to the default callback.
+	CHECK(drive.calls == 3);
+
+	master.set_node_callback(5, nullptr);
+	CHECK(classify(master, fallback, 0x185) == 'P');
+}
+
+
+/**
+ * Classifying costs about the same for every COB-ID. Host time, so only printed.
+ */
+static void test_cost(void)
+{
+	Recorder recorder;
+	CanOpen master(&hcan);
+	master.set_callback(&recorder);
+	uint8_t data[8] = {0};
+	const uint16_t cobs[] = { 0x000, 0x185, 0x505, 0x585, 0x705, 0x7e6 };
+	printf("  on_frame() on the host:");
+	for (uint16_t cob : cobs)
+	{
+		const uint32_t n = 1000000;
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i=0; i < n; i++)
+			master.on_frame(cob, data);
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		printf(" 0x%03x %.1f ns%s", cob, (double) ns.count() / n, cob == 0x7e6 ? "\n" : ",");
+	}
+	CHECK(recorder.calls == 6 * 1000000);
+}
+
+
+int main(void)
+{
+	test_function_codes();
+	test_node_callbacks();
+	test_cost();
+	return check_result("CanOpenDispatchTest");
+}
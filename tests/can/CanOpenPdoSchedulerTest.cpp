@@ -0,0 +1,255 @@
+/**
+ * \file       tests/can/CanOpenPdoSchedulerTest.cpp
+ * \brief      Runs a CanOpenPdoScheduler on a VirtualCanBus at 1 Mbit/s and checks when each kind of TPDO goes out:
+ *             every nth SYNC, on change, held back by an inhibit time, and on an event timer.
+ */
+
+#include "toolbox.h"
+#include "comms/CanOpenPdoScheduler.h"
+#include "Check.h"
+
+
+/**
+ * Records the frames it receives, and when.
+ */
+class Listener : public VirtualCanBus::Node
+{
+public:
+	void on_rx_pending(void) override
+	{
+		VirtualCanBus::Frame frame;
+		while (receive(frame))
+			if (count < 256)
+			{
+				frames[count] = frame;
+				times[count++] = VirtualHal::get_time();
+			}
+	}
+
+
+	/**
+	 * Counts the frames with a COB-ID.
+	 */
+	uint32_t count_of(uint16_t cob)
+	{
+		uint32_t n = 0;
+		for (uint32_t i=0; i < count; i++)
+			n += frames[i].cob == cob;
+		return n;
+	}
+
+
+	/**
+	 * Gets the longest and shortest times between frames with a COB-ID, in microseconds.
+	 */
+	void intervals(uint16_t cob, uint64_t* shortest, uint64_t* longest)
+	{
+		*shortest = ~0ull;
+		*longest = 0;
+		uint64_t last = 0;
+		bool first = true;
+		for (uint32_t i=0; i < count; i++)
+		{
+			if (frames[i].cob != cob)
+				continue;
+			uint64_t t = times[i] / 1000;
+			if (!first)
+			{
+				*shortest = t - last < *shortest ? t - last : *shortest;
+				*longest = t - last > *longest ? t - last : *longest;
+			}
+			last = t;
+			first = false;
+		}
+	}
+
+
+	VirtualCanBus::Frame frames[256];
+	uint64_t times[256];
+	uint32_t count = 0;
+};
+
+
+/**
+ * A master that sends SYNC, with a scheduler and a transmit queue, and a node that listens.
+ */
+class Rig
+{
+public:
+	Rig() : hcan(&bus), master(&hcan), scheduler(&master)
+	{
+		rig = this;
+		VirtualHal::set_bus(&bus);
+		master.set_tx_queue(queue, 32);
+		master.setup();
+		bus.attach(&listener);
+	}
+
+
+	~Rig()
+	{
+		rig = nullptr;
+	}
+
+
+	/**
+	 * Sends SYNC, then runs the bus for the rest of the period.
+	 */
+	void sync(uint32_t period_us=1000)
+	{
+		master.sync();
+		bus.advance((uint64_t) period_us * 1000);
+	}
+
+
+	/**
+	 * Runs the bus, polling the scheduler every 100 us.
+	 */
+	void run(uint32_t us)
+	{
+		for (uint32_t t=0; t < us; t += 100)
+		{
+			scheduler.poll();
+			bus.advance(100000);
+		}
+	}
+
+
+	inline static Rig* rig = nullptr;
+
+	VirtualCanBus bus { 1000000 };
+	CAN_HandleTypeDef hcan;
+	CanOpen master;
+	CanOpenPdoScheduler scheduler;
+	Listener listener;
+	CanTxQueue::Entry queue[32];
+};
+
+
+static void rig_tx_complete(uint32_t mailbox)
+{
+	if (Rig::rig != nullptr)
+		Rig::rig->master.on_tx_complete(mailbox);
+}
+
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; rig_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; rig_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; rig_tx_complete(CAN_TX_MAILBOX2); }
+
+
+/**
+ * Cyclic PDOs go out at every nth SYNC, right behind it and in registration order.
+ */
+static void test_every(void)
+{
+	Rig rig;
+	uint8_t a[2] = { 1, 2 }, b[4] = { 3, 4, 5, 6 };
+	CHECK(rig.scheduler.add_sync(0x181, a, sizeof(a), 1));
+	CHECK(rig.scheduler.add_sync(0x182, b, sizeof(b), 3));
+	for (uint32_t i=0; i < 12; i++)
+		rig.sync();
+	CHECK(rig.listener.count_of(0x080) == 12);
+	CHECK(rig.listener.count_of(0x181) == 12);
+	CHECK(rig.listener.count_of(0x182) == 4);
+	CHECK(rig.scheduler.get_sent() == 16);
+
+	// SYNC 3: the SYNC, then both PDOs.
+	uint32_t third = 0;
+	for (uint32_t i=0, syncs=0; i < rig.listener.count; i++)
+		if (rig.listener.frames[i].cob == 0x080 && ++syncs == 3)
+			third = i;
+	CHECK(rig.listener.frames[third + 1].cob == 0x181);
+	CHECK(rig.listener.frames[third + 2].cob == 0x182 && rig.listener.frames[third + 2].length == 4);
+	CHECK(rig.listener.times[third + 2] - rig.listener.times[third] < 250000);
+}
+
+
+/**
+ * An acyclic PDO goes out at the first SYNC, and then at the first SYNC after each change.
+ */
+static void test_on_change(void)
+{
+	Rig rig;
+	uint8_t value[2] = { 0, 0 };
+	CHECK(rig.scheduler.add_sync(0x281, value, sizeof(value), 0));
+	rig.sync();
+	rig.sync();
+	CHECK(rig.listener.count_of(0x281) == 1);
+	value[1] = 7;
+	rig.sync();
+	rig.sync();
+	CHECK(rig.listener.count_of(0x281) == 2);
+	CHECK(rig.listener.frames[rig.listener.count - 2].data[1] == 7);  // The SYNC after the change, then the PDO.
+}
+
+
+/**
+ * A cyclic PDO held back by its inhibit time stays due, and goes out at the next SYNC that the inhibit time allows,
+ * instead of waiting for another n SYNCs.
+ */
+static void test_inhibit(void)
+{
+	Rig rig;
+	uint8_t value[2] = { 0, 0 };
+	CHECK(rig.scheduler.add_sync(0x381, value, sizeof(value), 2, 25));  // Every 2nd SYNC, at most every 2.5 ms.
+	for (uint32_t i=0; i < 12; i++)
+		rig.sync();
+	uint64_t shortest, longest;
+	rig.listener.intervals(0x381, &shortest, &longest);
+	printf("  every 2nd 1 ms SYNC, 2.5 ms inhibit: %u sent, %u held back, %llu-%llu us apart\n",
+			rig.listener.count_of(0x381), rig.scheduler.get_inhibited(), (unsigned long long) shortest,
+			(unsigned long long) longest);
+	CHECK(rig.listener.count_of(0x381) == 4);  // SYNCs 2, 5, 8 and 11.
+	CHECK(rig.scheduler.get_inhibited() == 3);
+	CHECK(shortest >= 2500 && longest <= 3100);
+}
+
+
+/**
+ * An event-driven PDO goes out when it changes, and when its event timer expires without a change. A change inside
+ * the inhibit time waits for it to pass, and only the latest value is sent.
+ */
+static void test_event(void)
+{
+	Rig rig;
+	uint8_t value[2] = { 0, 0 };
+	CHECK(rig.scheduler.add_event(0x481, value, sizeof(value), 10));  // 10 ms event timer.
+	rig.run(35000);
+	CHECK(rig.listener.count_of(0x481) == 4);  // At 0, 10, 20 and 30 ms.
+	uint64_t shortest, longest;
+	rig.listener.intervals(0x481, &shortest, &longest);
+	CHECK(shortest >= 10000 && longest < 10300);
+
+	value[0] = 1;
+	rig.run(1000);
+	CHECK(rig.listener.count_of(0x481) == 5);
+	CHECK(rig.listener.frames[rig.listener.count - 1].data[0] == 1);
+
+	Rig inhibited;
+	uint8_t counter[2] = { 0, 0 };
+	CHECK(inhibited.scheduler.add_event(0x482, counter, sizeof(counter), 0, 50));  // At most every 5 ms.
+	for (uint32_t ms=0; ms < 20; ms++)
+	{
+		counter[0]++;
+		inhibited.run(1000);
+	}
+	inhibited.run(10000);
+	inhibited.listener.intervals(0x482, &shortest, &longest);
+	uint32_t n = inhibited.listener.count_of(0x482);
+	printf("  20 changes 1 ms apart, 5 ms inhibit: %u sent, %llu-%llu us apart\n", n, (unsigned long long) shortest,
+			(unsigned long long) longest);
+	CHECK(n == 5);  // At 0, 5, 10, 15 and 20 ms.
+	CHECK(shortest >= 4900);  // Measured on arrival, so within a frame's time of 5 ms.
+	CHECK(inhibited.listener.frames[inhibited.listener.count - 1].data[0] == 20);
+}
+
+
+int main(void)
+{
+	test_every();
+	test_on_change();
+	test_inhibit();
+	test_event();
+	return check_result("CanOpenPdoSchedulerTest");
+}
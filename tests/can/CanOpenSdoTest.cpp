@@ -0,0 +1,340 @@
+/**
+ * \file       tests/can/CanOpenSdoTest.cpp
+ * \brief      Runs segmented and block SDO transfers between two CanOpen nodes on a VirtualCanBus at 500 kbit/s and
+ *             1 Mbit/s, and the ways a transfer fails: a timeout, an abort, a CRC mismatch and a transfer refused.
+ * \notes      Every segment of a transfer has the same COB-ID, so a transfer only completes, and only at the speed of
+ *             the wire, if CanBus puts frames with equal IDs on the bus in the order they were sent.
+ */
+
+#include <initializer_list>
+#include "toolbox.h"
+#include "comms/CanOpen.h"
+#include "comms/CanOpenSdo.h"
+#include "Check.h"
+#include <stdlib.h>
+
+static constexpr uint8_t ServerNode = 5;
+static constexpr uint16_t Index = 0x2000;
+
+static uint8_t object[5000];
+
+
+/**
+ * Serves one object, for reading and writing.
+ */
+class Server : public CanOpenSdo::ISdoServer
+{
+public:
+	uint32_t on_read(uint16_t index, uint8_t subindex, uint8_t** data, uint32_t* length) override
+	{
+		(void) subindex;
+		if (index != Index)
+			return CanOpenSdo::AbortNoObject;
+		*data = object;
+		*length = read_length;
+		return 0;
+	}
+
+
+	uint32_t on_write(uint16_t index, uint8_t subindex, uint8_t** buffer, uint32_t* size) override
+	{
+		(void) subindex;
+		if (index != Index)
+			return CanOpenSdo::AbortNoObject;
+		*buffer = written;
+		*size = sizeof(written);
+		return 0;
+	}
+
+
+	uint32_t on_written(uint16_t index, uint8_t subindex, uint32_t length) override
+	{
+		(void) index;
+		(void) subindex;
+		written_length = length;
+		return 0;
+	}
+
+
+	uint32_t read_length = 0;
+	uint8_t written[sizeof(object)];
+	uint32_t written_length = 0;
+};
+
+
+/**
+ * A client and a server on one bus, with or without transmit queues.
+ */
+class Rig
+{
+public:
+	Rig(bool queued, uint32_t bitrate=1000000) : bus(bitrate), hcan1(&bus), hcan2(&bus), client(&hcan1),
+			server(&hcan2, CanOpen::Slave), client_sdo(&client), server_sdo(&server)
+	{
+		rig = this;
+		VirtualHal::set_bus(&bus);
+		if (queued)
+		{
+			client.set_tx_queue(client_queue, 32);
+			server.set_tx_queue(server_queue, 32);
+		}
+		client.setup();
+		server.setup();
+		server_sdo.set_server(ServerNode, &objects);
+		client_sdo.set_callback(MakeDelegate(this, &Rig::on_complete));
+	}
+
+
+	~Rig()
+	{
+		rig = nullptr;
+	}
+
+
+	/**
+	 * Runs the bus and both engines until the client's transfer completes.
+	 * @returns True if it completed within the time limit.
+	 */
+	bool run(uint64_t limit=2000000000ull)
+	{
+		uint64_t start = bus.get_time();
+		uint32_t frames = bus.get_frames();
+		while (!done && bus.get_time() - start < limit)
+		{
+			bus.advance(10000);
+			client_sdo.poll();
+			server_sdo.poll();
+		}
+		elapsed = bus.get_time() - start;
+		frames_used = bus.get_frames() - frames;
+		return done;
+	}
+
+
+	/**
+	 * Runs the bus and both engines for a time, so that frames sent at completion, such as an abort, arrive.
+	 */
+	void settle(uint64_t ns=1000000)
+	{
+		for (uint64_t end=bus.get_time() + ns; bus.get_time() < end; )
+		{
+			bus.advance(10000);
+			client_sdo.poll();
+			server_sdo.poll();
+		}
+	}
+
+
+	CanOpen& node(CAN_HandleTypeDef* hcan)
+	{
+		return hcan == &hcan1 ? client : server;
+	}
+
+
+	void on_complete(uint8_t node, uint32_t abort_code, uint32_t length)
+	{
+		(void) node;
+		done = true;
+		this->abort_code = abort_code;
+		this->length = length;
+	}
+
+
+	inline static Rig* rig = nullptr;
+
+	VirtualCanBus bus;
+	CAN_HandleTypeDef hcan1, hcan2;
+	CanOpen client, server;
+	CanOpenSdo client_sdo, server_sdo;
+	Server objects;
+	CanTxQueue::Entry client_queue[32], server_queue[32];
+	bool done = false;
+	uint32_t abort_code = 0;
+	uint32_t length = 0;
+	uint64_t elapsed = 0;
+	uint32_t frames_used = 0;
+};
+
+
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_message(); }
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX2); }
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX2); }
+
+
+/**
+ * Reads the object and checks that every byte arrived, within the time the wire needs.
+ */
+static void test_upload(uint32_t bitrate, bool queued, bool block, uint32_t length, uint64_t limit_us)
+{
+	Rig rig(queued, bitrate);
+	static uint8_t buffer[sizeof(object) + 8];
+	memset(buffer, 0, sizeof(buffer));
+	rig.objects.read_length = length;
+	CHECK(rig.client_sdo.upload(ServerNode, Index, 1, buffer, sizeof(buffer), block));
+	CHECK(rig.run());
+	CHECK(rig.abort_code == 0);
+	CHECK(rig.length == length);
+	CHECK(memcmp(buffer, object, length) == 0);
+	CHECK(rig.elapsed / 1000 < limit_us);
+	printf("  %4u kbit/s %-6s %-9s upload   %4u B: %6.2f ms, %6.1f kB/s, %4u frames\n", bitrate / 1000,
+			queued ? "queued" : "direct", block ? "block" : "segmented", length, rig.elapsed / 1e6,
+			length * 1e6 / rig.elapsed, rig.frames_used);
+}
+
+
+/**
+ * Writes the object and checks that every byte arrived, within the time the wire needs.
+ */
+static void test_download(uint32_t bitrate, bool queued, bool block, uint32_t length, uint64_t limit_us)
+{
+	Rig rig(queued, bitrate);
+	CHECK(rig.client_sdo.download(ServerNode, Index, 1, object, length, block));
+	CHECK(rig.run());
+	CHECK(rig.abort_code == 0);
+	CHECK(rig.objects.written_length == length);
+	CHECK(memcmp(rig.objects.written, object, length) == 0);
+	CHECK(rig.elapsed / 1000 < limit_us);
+	printf("  %4u kbit/s %-6s %-9s download %4u B: %6.2f ms, %6.1f kB/s, %4u frames\n", bitrate / 1000,
+			queued ? "queued" : "direct", block ? "block" : "segmented", length, rig.elapsed / 1e6,
+			length * 1e6 / rig.elapsed, rig.frames_used);
+}
+
+
+static void test_transfers(uint32_t bitrate, bool queued)
+{
+	// A 7-byte segment takes about 120 us at 1 Mbit/s; the limits allow for the acknowledgements and polling, and
+	// scale with the bit time.
+	uint64_t scale = 1000000 / bitrate;
+	test_upload(bitrate, queued, true, 7, 2000 * scale);
+	test_upload(bitrate, queued, true, 500, 12000 * scale);
+	test_upload(bitrate, queued, true, 889, 20000 * scale);  // Exactly one block of 127 segments.
+	test_upload(bitrate, queued, true, 4999, 100000 * scale);
+	test_upload(bitrate, queued, false, 4999, 200000 * scale);
+	test_download(bitrate, queued, true, 4999, 100000 * scale);
+	test_download(bitrate, queued, false, 4999, 200000 * scale);
+	test_download(bitrate, queued, false, 4, 2000 * scale);
+}
+
+
+/**
+ * A node that never answers times the transfer out after CANOPEN_SDO_TIMEOUT, and frees its slot.
+ */
+static void test_timeout(void)
+{
+	Rig rig(false);
+	uint8_t buffer[8];
+	CHECK(rig.client_sdo.upload(ServerNode + 1, Index, 1, buffer, sizeof(buffer)));
+	CHECK(rig.run());
+	CHECK(rig.abort_code == CanOpenSdo::AbortTimeout);
+	CHECK(rig.elapsed / 1000000 >= CANOPEN_SDO_TIMEOUT && rig.elapsed / 1000000 < CANOPEN_SDO_TIMEOUT + 20);
+	CHECK(rig.client_sdo.get_timeouts() == 1);
+	CHECK(rig.client_sdo.get_aborts() == 0);
+	CHECK(!rig.client_sdo.is_busy(ServerNode + 1));
+	printf("  no answer: AbortTimeout after %.0f ms\n", rig.elapsed / 1e6);
+}
+
+
+/**
+ * An object that the server does not have ends the transfer with the server's abort code, by either protocol.
+ */
+static void test_abort(void)
+{
+	for (bool block : { false, true })
+	{
+		Rig rig(false);
+		uint8_t buffer[64];
+		CHECK(rig.client_sdo.upload(ServerNode, Index + 1, 0, buffer, sizeof(buffer), block));
+		CHECK(rig.run());
+		rig.settle();
+		CHECK(rig.abort_code == CanOpenSdo::AbortNoObject);
+		CHECK(rig.client_sdo.get_aborts() == 1);
+		CHECK(rig.server_sdo.get_aborts() == 1);
+
+		rig.done = false;
+		CHECK(rig.client_sdo.download(ServerNode, Index + 1, 0, object, 100, block));
+		CHECK(rig.run());
+		CHECK(rig.abort_code == CanOpenSdo::AbortNoObject);
+		CHECK(!rig.client_sdo.is_busy(ServerNode));
+	}
+}
+
+
+/**
+ * Data that changes at the sender after its segments have gone out fails the CRC at the receiver, which aborts the
+ * block transfer with AbortCrc. That is the client for an upload and the server for a download.
+ */
+static void test_crc(void)
+{
+	for (bool upload : { true, false })
+	{
+		Rig rig(false);
+		static uint8_t value[sizeof(object)];
+		static uint8_t buffer[sizeof(object) + 8];
+		memcpy(value, object, sizeof(object));
+		rig.objects.read_length = 4999;
+		if (upload)
+			CHECK(rig.client_sdo.upload(ServerNode, Index, 1, buffer, sizeof(buffer), true));
+		else
+			CHECK(rig.client_sdo.download(ServerNode, Index, 1, value, 4999, true));
+		CHECK(!rig.run(5000000));  // Part of the first block.
+		uint8_t* sender = upload ? object : value;
+		uint8_t saved = sender[0];
+		sender[0] ^= 0xff;
+		CHECK(rig.run());
+		rig.settle();
+		sender[0] = saved;
+		CHECK(rig.abort_code == CanOpenSdo::AbortCrc);
+		CHECK(rig.client_sdo.get_aborts() == 1 && rig.server_sdo.get_aborts() == 1);
+	}
+}
+
+
+/**
+ * Only one transfer runs with each node, and only CANOPEN_SDO_MAX_TRANSFERS at once; a refused transfer leaves the
+ * running ones alone.
+ */
+static void test_refused(void)
+{
+	Rig rig(false);
+	static uint8_t buffer[sizeof(object) + 8];
+	rig.objects.read_length = 889;
+	CHECK(rig.client_sdo.upload(ServerNode, Index, 1, buffer, sizeof(buffer), true));
+	CHECK(rig.client_sdo.is_busy(ServerNode));
+	CHECK(!rig.client_sdo.upload(ServerNode, Index, 1, buffer, sizeof(buffer)));
+	CHECK(!rig.client_sdo.download(ServerNode, Index, 1, object, 4));
+
+	// The other slots, with nodes that will not answer.
+	uint8_t others[8];
+	for (uint8_t n=1; n < CANOPEN_SDO_MAX_TRANSFERS; n++)
+		CHECK(rig.client_sdo.upload(ServerNode + n, Index, 1, others, sizeof(others)));
+	CHECK(!rig.client_sdo.upload(ServerNode + CANOPEN_SDO_MAX_TRANSFERS, Index, 1, others, sizeof(others)));
+
+	CHECK(rig.run());
+	CHECK(rig.abort_code == 0 && rig.length == 889);
+	CHECK(memcmp(buffer, object, 889) == 0);
+	CHECK(!rig.client_sdo.is_busy(ServerNode));
+	CHECK(rig.client_sdo.upload(ServerNode, Index, 1, buffer, sizeof(buffer)));
+}
+
+
+int main(void)
+{
+	srand(1);
+	for (uint32_t i=0; i < sizeof(object); i++)
+		object[i] = rand();
+
+	for (uint32_t bitrate : { 500000u, 1000000u })
+	{
+		test_transfers(bitrate, false);
+		test_transfers(bitrate, true);
+	}
+	test_timeout();
+	test_abort();
+	test_crc();
+	test_refused();
+	return check_result("CanOpenSdoTest");
+}
@@ -0,0 +1,184 @@
+/**
+ * \file       tests/can/CanRxQueueTest.cpp
+ * \brief      Floods a CanBus at 1 Mbit/s while its handler is slow, with frames handled in the receive interrupt and
+ *             with them queued for a task, and counts what is lost.
+ */
+
+#include "toolbox.h"
+#include "comms/CanBus.h"
+#include "Check.h"
+
+static constexpr uint32_t Frames = 200;
+static constexpr uint64_t HandlerTime = 500000;  // Nanoseconds that the handler takes for each frame, as an SDO might.
+
+
+/**
+ * Sends a numbered burst of frames back to back, keeping all its mailboxes full.
+ */
+class Sender : public VirtualCanBus::Node
+{
+public:
+	void start(void)
+	{
+		set_fifo_priority(true);  // Send in the order queued, not by mailbox.
+		for (uint32_t i=0; i < VirtualCanBus::Mailboxes; i++)
+			send_next();
+	}
+
+
+	void on_tx_complete(uint32_t mailbox) override
+	{
+		(void) mailbox;
+		send_next();
+	}
+
+private:
+	void send_next(void)
+	{
+		if (sent == Frames)
+			return;
+		uint8_t data[8] = { (uint8_t) sent, (uint8_t) (sent >> 8), 0, 0, 0, 0, 0, 0 };
+		if (transmit(0x181, data, 8))
+			sent++;
+	}
+
+
+	uint32_t sent = 0;
+};
+
+
+/**
+ * A CanBus whose handler takes HandlerTime for each frame, in the interrupt or in the task that calls dispatch().
+ * While the interrupt routine is busy, another receive interrupt waits, as it does on the target.
+ */
+class Rig
+{
+public:
+	Rig(bool deferred) : hcan(&bus), can(&hcan), deferred(deferred)
+	{
+		rig = this;
+		VirtualHal::set_bus(&bus);
+		bus.attach(&sender);
+		can.set_message_callback(MakeDelegate(this, &Rig::on_frame));
+		if (deferred)
+			can.set_rx_queue(queue, 256);
+		can.setup();
+	}
+
+
+	~Rig()
+	{
+		rig = nullptr;
+	}
+
+
+	void on_interrupt(void)
+	{
+		if (VirtualHal::get_time() < isr_busy_until)
+			return;  // Taken when the routine returns; see run().
+		can.on_message();
+	}
+
+
+	/**
+	 * Runs the burst in 5 us steps, taking a pending interrupt whenever the routine is free, and letting the task
+	 * dispatch one frame whenever it is.
+	 */
+	void run(void)
+	{
+		sender.start();
+		for (uint32_t step=0; step < 400000; step++)
+		{
+			bus.advance(5000);
+			uint64_t now = VirtualHal::get_time();
+			bool pending = HAL_CAN_GetRxFifoFillLevel(&hcan, CAN_RX_FIFO0) > 0;
+			if (now >= isr_busy_until && pending)
+				can.on_message();
+			bool queued = deferred && now >= task_busy_until && can.dispatch(1) == 1;
+			if (queued)
+				task_busy_until = now + HandlerTime;
+			if (bus.get_frames() == Frames && !pending && !queued && now >= isr_busy_until && now >= task_busy_until)
+				break;  // Everything has been sent, and what arrived has been handled.
+		}
+	}
+
+
+	inline static Rig* rig = nullptr;
+
+	VirtualCanBus bus { 1000000 };
+	CAN_HandleTypeDef hcan;
+	CanBus can;
+	Sender sender;
+	bool deferred;
+	CanBus::Frame queue[256];
+	uint64_t isr_busy_until = 0;
+	uint64_t task_busy_until = 0;
+	uint32_t handled = 0;
+	uint32_t in_order = 0;
+
+private:
+	void on_frame(uint16_t cob, uint8_t* data)
+	{
+		(void) cob;
+		if ((uint32_t) (data[0] | data[1] << 8) == in_order)
+			in_order++;
+		handled++;
+		if (!deferred)
+			isr_busy_until = VirtualHal::get_time() + HandlerTime;
+	}
+};
+
+
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan) { (void) hcan; Rig::rig->on_interrupt(); }
+
+
+/**
+ * Handled in the interrupt, a 500 us handler lets the three-deep hardware FIFO overrun.
+ */
+static void test_inline(void)
+{
+	Rig rig(false);
+	rig.run();
+	printf("  1 Mbit/s, %u frames, 500 us handler in the interrupt: %u handled\n", Frames, rig.handled);
+	CHECK(rig.bus.get_frames() == Frames);
+	CHECK(rig.handled < Frames);
+}
+
+
+/**
+ * Queued for a task, every frame is handled, in order, and no overrun or overflow is counted.
+ */
+static void test_deferred(void)
+{
+	Rig rig(true);
+	rig.run();
+	printf("  1 Mbit/s, %u frames, 500 us handler in a task: %u handled, %u overruns, %u overflows\n", Frames,
+			rig.handled, rig.can.get_hardware_overruns(), rig.can.get_rx_overflows());
+	CHECK(rig.handled == Frames);
+	CHECK(rig.in_order == Frames);
+	CHECK(rig.can.get_hardware_overruns() == 0);
+	CHECK(rig.can.get_rx_overflows() == 0);
+}
+
+
+/**
+ * A queue shorter than the burst counts what it drops.
+ */
+static void test_overflow(void)
+{
+	Rig rig(true);
+	rig.can.set_rx_queue(rig.queue, 64);
+	rig.run();
+	printf("  the same with a queue of 64: %u handled, %u overflows\n", rig.handled, rig.can.get_rx_overflows());
+	CHECK(rig.can.get_rx_overflows() > 0);
+	CHECK(rig.handled + rig.can.get_rx_overflows() == Frames);
+}
+
+
+int main(void)
+{
+	test_inline();
+	test_deferred();
+	test_overflow();
+	return check_result("CanRxQueueTest");
+}
@@ -0,0 +1,171 @@
+/**
+ * \file       tests/can/CanStatisticsTest.cpp
+ * \brief      Checks what CanStatistics counts for a CanBus on a VirtualCanBus, and how its load compares with the wire.
+ */
+
+#include "toolbox.h"
+#include "comms/CanBus.h"
+#include "comms/CanStatistics.h"
+#include "Check.h"
+
+
+/**
+ * A sender, a receiver and an observer that accepts every frame, on one bus, each with statistics.
+ */
+class Rig
+{
+public:
+	Rig(bool queued) : hcan1(&bus), hcan2(&bus), hcan3(&bus), sender(&hcan1), receiver(&hcan2), observer(&hcan3)
+	{
+		rig = this;
+		VirtualHal::set_bus(&bus);
+		if (queued)
+			sender.set_tx_queue(queue, 16);
+		sender.set_statistics(&sender_statistics);
+		receiver.set_statistics(&receiver_statistics);
+		observer.set_statistics(&observer_statistics);
+	}
+
+
+	~Rig()
+	{
+		rig = nullptr;
+	}
+
+
+	void setup(void)
+	{
+		sender.setup();
+		receiver.setup();
+		observer.setup();
+	}
+
+
+	/**
+	 * Runs the bus for a second, then closes the statistics windows.
+	 */
+	void run_window(void)
+	{
+		bus.advance(1000000000ull - bus.get_time() % 1000000000ull);
+		sender.update_statistics();
+		receiver.update_statistics();
+		observer.update_statistics();
+	}
+
+
+	CanBus& node(CAN_HandleTypeDef* hcan)
+	{
+		return hcan == &hcan1 ? sender : hcan == &hcan2 ? receiver : observer;
+	}
+
+
+	inline static Rig* rig = nullptr;
+
+	VirtualCanBus bus { 500000 };
+	CAN_HandleTypeDef hcan1, hcan2, hcan3;
+	CanBus sender, receiver, observer;
+	CanStatistics sender_statistics { 500000 }, receiver_statistics { 500000 }, observer_statistics { 500000 };
+	CanTxQueue::Entry queue[16];
+};
+
+
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_message(); }
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_complete(CAN_TX_MAILBOX2); }
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_tx_abort(CAN_TX_MAILBOX2); }
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef* hcan) { Rig::rig->node(hcan).on_error(); }
+
+
+/**
+ * A frame is counted once, when it has been sent, including one that was preempted and sent later.
+ */
+static void test_tx_counted_once(bool queued)
+{
+	Rig rig(queued);
+	rig.setup();
+	uint8_t data[8] = { 0 };
+	uint32_t sent = 0;
+	const uint16_t cobs[] = { 0x400, 0x401, 0x402, 0x050 };  // The last preempts 0x402 when queued.
+	for (uint16_t cob : cobs)
+		if (rig.sender.send(cob, data, 8) == 0)
+			sent++;
+	CHECK(sent == (queued ? 4u : 3u));
+	CHECK(rig.sender.get_tx_preemptions() == (queued ? 1u : 0u));
+	CHECK(rig.bus.run_until_idle());
+	rig.run_window();
+	CHECK(rig.sender_statistics.get_snapshot()->tx_frames == sent);
+	CHECK(rig.receiver_statistics.get_snapshot()->rx_frames == sent);
+}
+
+
+/**
+ * The worst-case bit count makes the load an upper bound while every frame is accepted, and a lower bound for the
+ * bus once the filters leave frames out.
+ */
+static void test_load_bound(void)
+{
+	Rig rig(true);
+	rig.receiver.add_filter(0x181);
+	rig.setup();
+
+	uint8_t data[8] = { 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff };
+	for (uint32_t i=0; i < 200; i++)
+	{
+		rig.sender.send(i % 2 ? 0x181 : 0x281, data, 8);
+		rig.bus.advance(2000000);
+	}
+	uint64_t busy = rig.bus.get_busy_time();
+	rig.run_window();
+	uint32_t wire = busy * 1000 / 1000000000ull;  // Tenths of a percent over the one-second window.
+	uint32_t observed = rig.observer_statistics.get_snapshot()->load;
+	uint32_t filtered = rig.receiver_statistics.get_snapshot()->load;
+	printf("  load on the wire %u.%u%%, seen by a node accepting all %u.%u%%, by a filtered node %u.%u%%\n",
+			wire / 10, wire % 10, observed / 10, observed % 10, filtered / 10, filtered % 10);
+	CHECK(observed >= wire);
+	CHECK(filtered < wire);
+}
+
+
+/**
+ * A bus-off is counted once, whether the error interrupt reports it, the error status register shows it, or both, and
+ * a second one after the node restarts is counted again.
+ */
+static void test_bus_off(bool interrupt)
+{
+	Rig rig(false);
+	rig.setup();
+	if (interrupt)
+		HAL_CAN_ActivateNotification(&rig.hcan1, CAN_IT_BUSOFF);
+	rig.hcan1.set_auto_recovery(false);
+
+	uint8_t data[8] = { 0 };
+	for (uint32_t round=1; round <= 2; round++)
+	{
+		rig.bus.inject_errors(32);  // Eight each, so the transmit error counter passes 255.
+		rig.sender.send(0x181, data, 8);
+		rig.run_window();
+		CHECK(rig.hcan1.get_state() == VirtualCanBus::BusOff);
+		CHECK(rig.sender_statistics.get_snapshot()->bus_off == round);
+		rig.run_window();
+		CHECK(rig.sender_statistics.get_snapshot()->bus_off == round);
+
+		rig.hcan1.restart();
+		HAL_CAN_ResetError(&rig.hcan1);
+		rig.run_window();
+		CHECK(rig.sender_statistics.get_snapshot()->bus_off == round);
+	}
+}
+
+
+int main(void)
+{
+	test_tx_counted_once(false);
+	test_tx_counted_once(true);
+	test_load_bound();
+	test_bus_off(false);
+	test_bus_off(true);
+	return check_result("CanStatisticsTest");
+}
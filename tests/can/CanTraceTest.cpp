@@ -0,0 +1,249 @@
+/**
+ * \file       tests/can/CanTraceTest.cpp
+ * \brief      Checks what a CanBus hands its tap, what CanTrace records to a SpiFlashMemoryFilesystem on a
+ *             VirtualSpiFlash, and the candump text and file names of CanTraceExporter.
+ * \notes      Where the timing of the tap matters, the recorder is stood in for by a tap that notes the frames and the
+ *             virtual time.
+ */
+
+#include "toolbox.h"
+#include "comms/CanBus.h"
+#include "comms/CanTrace.h"
+#include "comms/CanTraceExporter.h"
+#include "Check.h"
+
+
+/**
+ * A tap that records the frames it is given and when.
+ */
+class Tap : public CanBus::ITap
+{
+public:
+	void on_tap(uint16_t cob, const uint8_t* data, uint8_t length, bool tx) override
+	{
+		(void) data;
+		(void) length;
+		if (count < 16)
+		{
+			frames[count].cob = cob;
+			frames[count].tx = tx;
+			frames[count].time = bus->get_time();
+			count++;
+		}
+	}
+
+
+	VirtualCanBus* bus = nullptr;
+	struct
+	{
+		uint16_t cob;
+		bool tx;
+		uint64_t time;
+	} frames[16];
+	uint32_t count = 0;
+};
+
+
+/**
+ * A node that notes when each frame is received.
+ */
+class Listener : public VirtualCanBus::Node
+{
+public:
+	void on_rx_pending(void) override
+	{
+		VirtualCanBus::Frame frame;
+		while (receive(frame))
+			if (count < 16)
+			{
+				cobs[count] = frame.cob;
+				times[count] = bus->get_time();
+				count++;
+			}
+	}
+
+
+	VirtualCanBus* bus = nullptr;
+	uint16_t cobs[16];
+	uint64_t times[16];
+	uint32_t count = 0;
+};
+
+
+static CanBus* can = nullptr;
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX2); }
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX2); }
+
+
+/**
+ * A sent frame is tapped once, when it has left the wire, in bus order, including one that was preempted and sent
+ * later.
+ */
+static void test_tap_on_completion(bool queued)
+{
+	VirtualCanBus bus(500000);
+	CAN_HandleTypeDef hcan(&bus);
+	VirtualHal::set_bus(&bus);
+	Listener listener;
+	listener.bus = &bus;
+	bus.attach(&listener);
+	CanBus sender(&hcan);
+	CanTxQueue::Entry queue[16];
+	if (queued)
+		sender.set_tx_queue(queue, 16);
+	sender.setup();
+	can = &sender;
+	Tap tap;
+	tap.bus = &bus;
+	sender.set_tap(&tap);
+
+	uint8_t data[8] = { 0 };
+	const uint16_t cobs[] = { 0x400, 0x401, 0x402, 0x050 };  // The last preempts 0x402 when queued.
+	for (uint16_t cob : cobs)
+		sender.send(cob, data, 8);
+	CHECK(tap.count == 0);
+	CHECK(bus.run_until_idle());
+
+	CHECK(sender.get_tx_preemptions() == (queued ? 1u : 0u));
+	CHECK(tap.count == listener.count);
+	for (uint32_t i=0; i < tap.count && i < listener.count; i++)
+	{
+		CHECK(tap.frames[i].tx);
+		CHECK(tap.frames[i].cob == listener.cobs[i]);
+		CHECK(tap.frames[i].time == listener.times[i]);
+	}
+}
+
+
+/**
+ * A session of exactly two blocks' worth of frames is written as two full files of one sector's payload each, and
+ * reads back from the flash frame for frame, in order.
+ */
+static void test_record(void)
+{
+	VirtualCanBus bus(500000);
+	CAN_HandleTypeDef hcan(&bus);
+	VirtualHal::set_bus(&bus);
+	Listener listener;
+	listener.bus = &bus;
+	bus.attach(&listener);
+	CanBus sender(&hcan);
+	sender.setup();
+	can = &sender;
+
+	VirtualSpiFlash chip;
+	SpiFlashMemoryFilesystem fs(&chip.hspi, &chip.cs_port, 0);
+	CHECK(fs.initialize());
+	static CanTrace::Record ring[512];
+	CanTrace trace(&fs, ring, 512);
+	sender.set_tap(&trace);
+	CHECK(trace.start() == 0);
+
+	uint8_t data[8] = { 0 };
+	const uint32_t frames = 2 * CanTrace::RecordsPerBlock;
+	for (uint32_t i=0; i < frames; i++)
+	{
+		data[0] = (uint8_t) i;
+		data[1] = (uint8_t) (i >> 8);
+		sender.send(0x181, data, 8);
+		CHECK(bus.run_until_idle());
+		if (i % 64 == 63)
+			CHECK(trace.poll() == 0);
+	}
+	CHECK(trace.stop() == 0);
+	CHECK(trace.get_captured() == frames && trace.get_dropped() == 0);
+	CHECK(trace.get_blocks() == 2);
+
+	static CanTrace::Record records[2 * CanTrace::RecordsPerBlock];
+	char name[24];
+	uint32_t previous = 0, in_order = 0;
+	for (uint32_t block=0; block < 3; block++)
+	{
+		trace.get_filename(name, 0, block);
+		SpiFlashMemoryFilesystem::fileid id = fs.get_fileid(name);
+		CHECK((id != 0) == (block < 2));
+		if (id == 0)
+			continue;
+		SpiFlashMemoryFilesystem::DirectoryEntry* entry = fs.iterate_files(true);
+		while (entry != nullptr && entry->id != id)
+			entry = fs.iterate_files();
+		CHECK(entry != nullptr && entry->length == CanTrace::BlockSize && entry->sectors == 1);
+		CanTrace::Record* target = records + block * CanTrace::RecordsPerBlock;
+		CHECK(fs.read_file(id, target, CanTrace::BlockSize) == SpiFlashMemoryFilesystem::ErrorNone);
+	}
+	for (uint32_t i=0; i < frames; i++)
+	{
+		CanTrace::Record& r = records[i];
+		if (r.cob == 0x181 && r.flags == CanTrace::FlagTx && (uint32_t) (r.data[0] | r.data[1] << 8) == i
+				&& (i == 0 || r.timestamp > previous))
+			in_order++;
+		previous = r.timestamp;
+	}
+	printf("  %u frames in %u blocks of %u bytes, %u read back in order\n", frames, trace.get_blocks(),
+			CanTrace::BlockSize, in_order);
+	CHECK(in_order == frames);
+}
+
+
+static uint32_t format(CanTraceExporter& exporter, uint32_t timestamp, uint16_t cob, uint8_t length, uint8_t flags,
+		char* line)
+{
+	CanTraceExporter::Record record = { timestamp, cob, length, flags,
+			{ 0x01, 0x02, 0x03, 0x04, 0xa5, 0x5a, 0xff, 0x00 } };
+	return exporter.format(record, line);
+}
+
+
+/**
+ * Records become candump lines, and timestamps carry on past 2^32 microseconds.
+ */
+static void test_format(void)
+{
+	CanTraceExporter exporter("vcan1");
+	char line[64];
+	CHECK(format(exporter, 12345678, 0x181, 8, 0, line) == strlen(line));
+	CHECK(strcmp(line, "(12.345678) vcan1 181#01020304A55AFF00\n") == 0);
+	CHECK(format(exporter, 12345679, 0x00a, 0, CanTraceExporter::FlagTx, line) == strlen(line));
+	CHECK(strcmp(line, "(12.345679) vcan1 00A#\n") == 0);
+	CHECK(format(exporter, 0x80000000u, 0, 0, CanTraceExporter::FlagTime, line) == 0);
+	CHECK(format(exporter, 5, 0x7ff, 2, 0, line) > 0);
+	CHECK(strcmp(line, "(4294.967301) vcan1 7FF#0102\n") == 0);
+}
+
+
+/**
+ * Only the whole <prefix><session>.<block> pattern names a block, and names round-trip.
+ */
+static void test_filenames(void)
+{
+	uint32_t session, block;
+	char name[24];
+	CanTraceExporter::get_filename(name, "can", 2, 17);
+	CHECK(strcmp(name, "can002.0017") == 0);
+	CHECK(CanTraceExporter::parse_filename(name, "can", &session, &block));
+	CHECK(session == 2 && block == 17);
+	CanTraceExporter::get_filename(name, "can", 1234, 56789);
+	CHECK(CanTraceExporter::parse_filename(name, "can", &session, &block));
+	CHECK(session == 1234 && block == 56789);
+
+	const char* others[] = { "canopen.cfg", "can", "can002", "can002.", "can.0001", "can002.0017x", "can002x0017",
+			"cam002.0017", "can1234567890.0001" };
+	for (const char* other : others)
+		CHECK(!CanTraceExporter::parse_filename(other, "can", &session, &block));
+}
+
+
+int main(void)
+{
+	test_tap_on_completion(false);
+	test_tap_on_completion(true);
+	test_record();
+	test_format();
+	test_filenames();
+	return check_result("CanTraceTest");
+}
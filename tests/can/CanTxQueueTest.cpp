@@ -0,0 +1,189 @@
+/**
+ * \file       tests/can/CanTxQueueTest.cpp
+ * \brief      Checks the order in which CanBus releases frames from its transmit queue onto a VirtualCanBus.
+ */
+
+#include "toolbox.h"
+#include "comms/CanBus.h"
+#include "Check.h"
+
+
+/**
+ * A node that records the frames it receives.
+ */
+class Listener : public VirtualCanBus::Node
+{
+public:
+	void on_rx_pending(void) override
+	{
+		VirtualCanBus::Frame frame;
+		while (receive(frame))
+			if (count < 64)
+				received[count++] = frame;
+	}
+
+
+	/**
+	 * Determines whether the frames with a COB-ID arrived with their first data bytes counting up from zero.
+	 */
+	bool is_in_order(uint16_t cob, uint32_t expected)
+	{
+		uint32_t next = 0;
+		for (uint32_t i=0; i < count; i++)
+			if (received[i].cob == cob && received[i].data[0] != next++)
+				return false;
+		return next == expected;
+	}
+
+
+	VirtualCanBus::Frame received[64];
+	uint32_t count = 0;
+};
+
+
+static CanBus* can = nullptr;
+
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_complete(CAN_TX_MAILBOX2); }
+void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef* hcan) { (void) hcan; can->on_tx_abort(CAN_TX_MAILBOX2); }
+
+
+/**
+ * A CanBus with a transmit queue, and a listener, on one bus.
+ */
+class Rig
+{
+public:
+	Rig(uint32_t length=16) : hcan(&bus), bus_can(&hcan)
+	{
+		VirtualHal::set_bus(&bus);
+		bus.attach(&listener);
+		bus_can.set_tx_queue(queue, length);
+		bus_can.setup();
+		can = &bus_can;
+	}
+
+
+	void send(uint16_t cob, uint8_t first)
+	{
+		uint8_t data[2] = { first, 0 };
+		bus_can.send(cob, data, 2);
+	}
+
+
+	VirtualCanBus bus { 500000 };
+	CAN_HandleTypeDef hcan;
+	CanBus bus_can;
+	Listener listener;
+	CanTxQueue::Entry queue[16];
+};
+
+
+/**
+ * Frames with one COB-ID keep their order when more are sent than there are mailboxes, even though the hardware
+ * sends equal IDs lowest mailbox first.
+ */
+static void test_same_cob_order(void)
+{
+	Rig rig;
+	for (uint8_t i=0; i < 12; i++)
+		rig.send(0x581, i);
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.listener.count == 12);
+	CHECK(rig.listener.is_in_order(0x581, 12));
+	CHECK(rig.bus_can.get_tx_dropped() == 0);
+}
+
+
+/**
+ * Frames are released lowest COB-ID first, while each COB-ID keeps its own order.
+ */
+static void test_priority(void)
+{
+	Rig rig;
+	for (uint8_t i=0; i < 5; i++)
+	{
+		rig.send(0x300, i);
+		rig.send(0x200, i);
+	}
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.listener.count == 10);
+	CHECK(rig.listener.is_in_order(0x200, 5));
+	CHECK(rig.listener.is_in_order(0x300, 5));
+	// The first 0x300 took a mailbox before any 0x200 was queued, so it may go first; all others follow priority.
+	uint32_t last_200 = 0, first_300_after = 10;
+	for (uint32_t i=0; i < rig.listener.count; i++)
+	{
+		if (rig.listener.received[i].cob == 0x200)
+			last_200 = i;
+		else if (rig.listener.received[i].data[0] > 0 && i < first_300_after)
+			first_300_after = i;
+	}
+	CHECK(last_200 < first_300_after);
+}
+
+
+/**
+ * A frame that outranks every mailbox preempts the lowest-priority one, which is sent later, exactly once.
+ */
+static void test_preemption(void)
+{
+	Rig rig;
+	rig.send(0x400, 0);
+	rig.send(0x401, 0);
+	rig.send(0x402, 0);
+	rig.send(0x050, 0);
+	CHECK(rig.bus_can.get_tx_preemptions() == 1);
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.listener.count == 4);
+	CHECK(rig.listener.received[0].cob == 0x050);
+	CHECK(rig.listener.received[1].cob == 0x400);
+	CHECK(rig.listener.received[2].cob == 0x401);
+	CHECK(rig.listener.received[3].cob == 0x402);
+}
+
+
+/**
+ * A frame with the same COB-ID as one in a mailbox waits for it, rather than preempting another mailbox.
+ */
+static void test_no_preemption_behind_same_cob(void)
+{
+	Rig rig;
+	rig.send(0x080, 0);
+	rig.send(0x401, 0);
+	rig.send(0x402, 0);
+	rig.send(0x080, 1);
+	CHECK(rig.bus_can.get_tx_preemptions() == 0);
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.listener.count == 4);
+	CHECK(rig.listener.is_in_order(0x080, 2));
+}
+
+
+/**
+ * With no timeout, a full queue drops its oldest frame.
+ */
+static void test_drop_oldest(void)
+{
+	Rig rig(4);
+	for (uint8_t i=0; i < 9; i++)
+		rig.send(0x300 + i, 0);  // Three go to the mailboxes, four are queued, and two are dropped.
+	CHECK(rig.bus_can.get_tx_dropped() == 2);
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.listener.count == 7);
+	CHECK(rig.listener.received[3].cob == 0x305);
+}
+
+
+int main(void)
+{
+	test_same_cob_order();
+	test_priority();
+	test_preemption();
+	test_no_preemption_behind_same_cob();
+	test_drop_oldest();
+	return check_result("CanTxQueueTest");
+}
@@ -0,0 +1,112 @@
+/**
+ * \file       tests/can/MemoryUsageTest.cpp
+ * \brief      Checks the Allocator's usage accounting, and the stack watermark that MemoryUsage finds by painting and
+ *             scanning, on a stack made of an array.
+ */
+
+#include "toolbox.h"
+#include "diagnostics/MemoryUsage.h"
+#include "generics/Allocator.h"
+#include "Check.h"
+
+
+/**
+ * Current and peak usage follow allocate(), reallocate() and release(), and reset_peak() starts the peak again from
+ * what is allocated now.
+ */
+static void test_allocator(void)
+{
+	uint32_t base = Allocator::get_current();
+	void* a = Allocator::allocate(100);
+	void* b = Allocator::allocate(300);
+	CHECK(a != nullptr && b != nullptr);
+	CHECK(Allocator::get_current() == base + 400);
+	CHECK(Allocator::get_peak() >= base + 400);
+
+	b = Allocator::reallocate(b, 300, 1000);
+	CHECK(b != nullptr);
+	CHECK(Allocator::get_current() == base + 1100);
+	uint32_t peak = Allocator::get_peak();
+	CHECK(peak == base + 1100);
+
+	b = Allocator::reallocate(b, 1000, 50);
+	Allocator::release(a, 100);
+	CHECK(Allocator::get_current() == base + 50);
+	CHECK(Allocator::get_peak() == peak);
+
+	Allocator::reset_peak();
+	CHECK(Allocator::get_peak() == base + 50);
+	Allocator::release(b, 50);
+	Allocator::release(nullptr, 50);  // Ignored, as free() would.
+	CHECK(Allocator::get_current() == base);
+	CHECK(Allocator::get_peak() == base + 50);
+	CHECK(Allocator::get_failures() == 0);
+}
+
+
+/**
+ * After painting, the peak is the distance from the top of the stack to the lowest word written, whatever was written
+ * above it.
+ */
+static void test_watermark(void)
+{
+	static uint32_t stack[256];
+	uint32_t* top = stack + 256;
+	memset(stack, 0, sizeof(stack));
+	MemoryUsage::paint(stack, top);
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == 0);
+
+	// A frame of 40 words, then a deeper call that leaves a gap of painted words in its own frame.
+	for (uint32_t i=216; i < 256; i++)
+		stack[i] = i;
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == 40 * 4);
+	stack[150] = 0;
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == 106 * 4);
+
+	// Returning does not lower the mark; painting again does.
+	for (uint32_t i=150; i < 216; i++)
+		stack[i] = MemoryUsage::PaintPattern;
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == 40 * 4);
+	stack[150] = 0;
+	MemoryUsage::paint(stack, stack + 216);
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == 40 * 4);
+
+	stack[0] = 0;
+	CHECK(MemoryUsage::get_stack_peak(stack, top) == sizeof(stack));
+}
+
+
+/**
+ * check() raises StackOverflow once fewer than MEMORYUSAGE_STACK_MARGIN bytes have stayed free, and MemoryAllocation
+ * once an allocation has failed.
+ */
+static void test_check(void)
+{
+	MemoryUsage::Snapshot snapshot = {};
+	snapshot.main_stack_size = 1024;
+	snapshot.main_stack_peak = 1024 - MEMORYUSAGE_STACK_MARGIN;
+	Fault fault;
+	MemoryUsage::check(&fault, &snapshot);
+	CHECK(!fault.is_present(Fault::StackOverflow) && !fault.is_present(Fault::MemoryAllocation));
+
+	snapshot.main_stack_peak += 4;
+	MemoryUsage::check(&fault, &snapshot);
+	CHECK(fault.is_present(Fault::StackOverflow));
+
+	Fault task_fault;
+	snapshot.main_stack_peak = 0;
+	snapshot.task_count = 1;
+	snapshot.tasks[0] = { "can", MEMORYUSAGE_STACK_MARGIN - 1 };
+	snapshot.generics_failures = 1;
+	MemoryUsage::check(&task_fault, &snapshot);
+	CHECK(task_fault.is_present(Fault::StackOverflow) && task_fault.is_present(Fault::MemoryAllocation));
+}
+
+
+int main(void)
+{
+	test_allocator();
+	test_watermark();
+	test_check();
+	return check_result("MemoryUsageTest");
+}
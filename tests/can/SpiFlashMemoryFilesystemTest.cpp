@@ -0,0 +1,99 @@
+/**
+ * \file       tests/can/SpiFlashMemoryFilesystemTest.cpp
+ * \brief      Writes files of every awkward length to a SpiFlashMemoryFilesystem on a VirtualSpiFlash and reads them
+ *             back, including lengths that fill their last sector exactly, and files with a damaged or missing sector.
+ */
+
+#include "toolbox.h"
+#include "devices/flash/external/SpiFlashMemoryFilesystem.h"
+#include "Check.h"
+
+static constexpr uint32_t Usable = SpiFlashMemoryFilesystem::UsableSectorSize;
+static uint8_t written[4 * Usable];
+static uint8_t read_back[4 * Usable];
+
+
+/**
+ * Fills the data to write with a pattern that differs from sector to sector.
+ */
+static void fill(uint32_t length, uint32_t seed)
+{
+	for (uint32_t i=0; i < length; i++)
+		written[i] = (uint8_t) (i * 7 + i / 251 + seed);
+}
+
+
+/**
+ * Every length reads back as written, including those that are an exact multiple of the usable sector size, such as
+ * a CanTrace block, and each file takes as many sectors as its length needs.
+ */
+static void test_round_trip(void)
+{
+	VirtualSpiFlash chip;
+	SpiFlashMemoryFilesystem fs(&chip.hspi, &chip.cs_port, 0);
+	CHECK(fs.initialize());
+	CHECK(fs.get_capacity() == 0x40000);
+
+	const uint32_t lengths[] = { 1, 255, Usable - 1, Usable, Usable + 1, 2 * Usable, 3 * Usable + 100 };
+	printf("  usable sector %u bytes; read back:", Usable);
+	for (uint32_t i=0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		uint32_t length = lengths[i];
+		char name[16];
+		snprintf(name, sizeof(name), "file%u", i);
+		fill(length, i);
+		uint32_t used = fs.get_used();
+		CHECK(fs.write_file(name, written, length) == SpiFlashMemoryFilesystem::ErrorNone);
+		CHECK(fs.get_used() - used == (length + Usable - 1) / Usable * SpiFlashMemory::SectorSize);
+
+		memset(read_back, 0, sizeof(read_back));
+		SpiFlashMemoryFilesystem::error e = fs.read_file(name, read_back, length);
+		CHECK(e == SpiFlashMemoryFilesystem::ErrorNone);
+		CHECK(memcmp(read_back, written, length) == 0);
+		printf(" %u %s;", length, e == SpiFlashMemoryFilesystem::ErrorNone ? "ok" : "failed");
+	}
+	printf("\n");
+
+	// A second mount finds the same files.
+	SpiFlashMemoryFilesystem again(&chip.hspi, &chip.cs_port, 0);
+	CHECK(again.initialize());
+	CHECK(again.get_used() == fs.get_used());
+	fill(2 * Usable, 5);
+	CHECK(again.read_file("file5", read_back, 2 * Usable) == SpiFlashMemoryFilesystem::ErrorNone);
+	CHECK(memcmp(read_back, written, 2 * Usable) == 0);
+}
+
+
+/**
+ * A changed byte fails the digest, and a file whose last sector has gone is reported corrupt rather than read past.
+ */
+static void test_damage(void)
+{
+	VirtualSpiFlash chip;
+	SpiFlashMemoryFilesystem fs(&chip.hspi, &chip.cs_port, 0);
+	CHECK(fs.initialize());
+	fill(2 * Usable, 1);
+	CHECK(fs.write_file("damaged", written, 2 * Usable) == SpiFlashMemoryFilesystem::ErrorNone);
+	CHECK(fs.write_file("missing", written, 2 * Usable) == SpiFlashMemoryFilesystem::ErrorNone);
+
+	SpiFlashMemoryFilesystem::fileid id = fs.get_fileid("damaged");
+	int32_t sector = fs.get_file_sector(id, 1);
+	CHECK(sector >= 0);
+	chip.get_memory()[sector + sizeof(SpiFlashMemoryFilesystem::DirectoryEntry) + 10] ^= 0x01;
+	CHECK(fs.read_file(id, read_back, 2 * Usable) == SpiFlashMemoryFilesystem::ErrorFileCorrupt);
+
+	id = fs.get_fileid("missing");
+	sector = fs.get_file_sector(id, 1);
+	CHECK(sector >= 0);
+	chip.erase_sector(sector);
+	CHECK(fs.read_file(id, read_back, 2 * Usable) == SpiFlashMemoryFilesystem::ErrorFileCorrupt);
+	CHECK(fs.read_file("absent", read_back, 1) == SpiFlashMemoryFilesystem::ErrorFileNotFound);
+}
+
+
+int main(void)
+{
+	test_round_trip();
+	test_damage();
+	return check_result("SpiFlashMemoryFilesystemTest");
+}
@@ -0,0 +1,216 @@
+/**
+ * \file       tests/can/VirtualCanBusTest.cpp
+ * \brief      Checks the arbitration, timing and error rules of VirtualCanBus, and the filters of VirtualCanHal.h.
+ */
+
+#include "toolbox.h"
+#include "comms/CanBus.h"
+#include "Check.h"
+
+
+/**
+ * A node that records the COB-IDs it receives, and can queue a frame when one of its own is sent.
+ */
+class Recorder : public VirtualCanBus::Node
+{
+public:
+	void on_rx_pending(void) override
+	{
+		VirtualCanBus::Frame frame;
+		if (!draining)
+			return;
+		while (receive(frame))
+			if (count < 32)
+				received[count++] = frame;
+	}
+
+
+	void on_tx_complete(uint32_t mailbox) override
+	{
+		completed++;
+		if (follow_up)
+		{
+			follow_up = false;
+			uint8_t data[1] = { 0xdd };
+			transmit(0x300, data, 1, &follow_up_mailbox);
+		}
+		(void) mailbox;
+	}
+
+
+	VirtualCanBus::Frame received[32];
+	uint32_t count = 0;
+	uint32_t completed = 0;
+	bool draining = true;
+	bool follow_up = false;
+	uint32_t follow_up_mailbox = 0;
+};
+
+
+/**
+ * The lowest COB-ID offered by any node wins.
+ */
+static void test_arbitration(void)
+{
+	VirtualCanBus bus(500000);
+	Recorder a, b, listener;
+	bus.attach(&a);
+	bus.attach(&b);
+	bus.attach(&listener);
+
+	uint8_t data[1] = { 0 };
+	a.transmit(0x200, data, 1);
+	b.transmit(0x100, data, 1);
+	a.transmit(0x080, data, 1);
+	CHECK(bus.run_until_idle());
+	CHECK(listener.count == 3);
+	CHECK(listener.received[0].cob == 0x080);
+	CHECK(listener.received[1].cob == 0x100);
+	CHECK(listener.received[2].cob == 0x200);
+}
+
+
+/**
+ * Frames with equal COB-IDs go out lowest mailbox first, as on bxCAN with TXFP clear, so a frame added to a mailbox
+ * that has just emptied overtakes older ones. With FIFO priority they go out in the order of the requests.
+ */
+static void test_mailbox_order(bool fifo)
+{
+	VirtualCanBus bus(500000);
+	Recorder sender, listener;
+	bus.attach(&sender);
+	bus.attach(&listener);
+	sender.set_fifo_priority(fifo);
+
+	for (uint8_t i=0; i < 3; i++)
+		sender.transmit(0x300, &i, 1);
+	sender.follow_up = true;  // Adds 0xdd to mailbox 0 as soon as its frame is sent.
+	CHECK(bus.run_until_idle());
+	CHECK(sender.follow_up_mailbox == 0);
+	CHECK(listener.count == 4);
+
+	const uint8_t expected_fifo[] = { 0, 1, 2, 0xdd };
+	const uint8_t expected_id[] = { 0, 0xdd, 1, 2 };
+	const uint8_t* expected = fifo ? expected_fifo : expected_id;
+	for (uint32_t i=0; i < 4; i++)
+		CHECK(listener.received[i].data[0] == expected[i]);
+}
+
+
+/**
+ * A frame occupies the bus for its stuffed length at the bitrate.
+ */
+static void test_timing(void)
+{
+	VirtualCanBus bus(500000);
+	Recorder a, listener;
+	bus.attach(&a);
+	bus.attach(&listener);
+
+	uint8_t data[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	uint32_t bits = VirtualCanBus::frame_bits(0x000, data, 8);
+	CHECK(bits > 111 && bits <= 135);  // 111 bits unstuffed, including the interframe space.
+	a.transmit(0x000, data, 8);
+	CHECK(bus.run_until_idle());
+	CHECK(bus.get_time() == bits * 2000ull);
+	CHECK(bus.get_busy_time() == bus.get_time());
+
+	// Alternating bits need no stuffing.
+	uint8_t alternating[1] = { 0x55 };
+	CHECK(VirtualCanBus::frame_bits(0x2aa, alternating, 1) >= 1 + 11 + 3 + 4 + 8 + 15 + 13);
+}
+
+
+/**
+ * Unacknowledged frames make the sender error-passive, where ACK errors stop counting; corrupted frames raise the
+ * counter to bus-off, from which the node recovers after 128 occurrences of 11 recessive bits.
+ */
+static void test_errors(void)
+{
+	VirtualCanBus bus(500000);
+	Recorder a, b;
+	bus.attach(&a);
+	bus.attach(&b);
+	b.set_online(false);
+
+	uint8_t data[1] = { 0 };
+	a.transmit(0x100, data, 1);
+	bus.advance(10000000);
+	CHECK(a.get_state() == VirtualCanBus::ErrorPassive);
+	CHECK(a.get_tec() == 128);
+	CHECK(a.completed == 0);
+
+	b.set_online(true);
+	CHECK(bus.run_until_idle());
+	CHECK(a.completed == 1);
+	CHECK(a.get_tec() == 127);
+	CHECK(a.get_state() == VirtualCanBus::ErrorActive);
+
+	bus.inject_errors(17);  // 127 + 17 * 8 > 255.
+	a.transmit(0x100, data, 1);
+	bus.advance(2000000);  // 17 error frames take about 1.5 ms; recovery takes 2.8 ms more.
+	CHECK(a.get_state() == VirtualCanBus::BusOff);
+	CHECK(!a.is_online());
+	CHECK(bus.run_until_idle());
+	CHECK(a.get_state() == VirtualCanBus::ErrorActive);
+	CHECK(a.completed == 2);
+}
+
+
+/**
+ * A receiver that does not read its FIFO overruns on the fourth frame.
+ */
+static void test_overrun(void)
+{
+	VirtualCanBus bus(500000);
+	Recorder a, b;
+	bus.attach(&a);
+	bus.attach(&b);
+	b.draining = false;
+
+	uint8_t data[1] = { 0 };
+	for (uint32_t i=0; i < 4; i++)
+	{
+		a.transmit(0x100 + i, data, 1);
+		CHECK(bus.run_until_idle());
+	}
+	CHECK(b.get_fifo_level() == 3);
+	CHECK(b.is_overrun());
+}
+
+
+/**
+ * CanBus programs its filters into the banks of a virtual peripheral, which then receives only those frames.
+ */
+static void test_filters(void)
+{
+	VirtualCanBus bus(500000);
+	CAN_HandleTypeDef hcan(&bus);
+	Recorder sender;
+	bus.attach(&sender);
+	CanBus can(&hcan);
+	can.add_filter(0x181);
+	can.add_filter_range(0x700, 0x7ff);
+	CHECK(can.setup() == HAL_OK);
+
+	uint8_t data[1] = { 0 };
+	const uint16_t cobs[] = { 0x181, 0x182, 0x705, 0x6ff };
+	for (uint16_t cob : cobs)
+		sender.transmit(cob, data, 1);
+	CHECK(bus.run_until_idle());
+	CHECK(hcan.get_fifo_level() == 2);
+	CHECK(!hcan.is_overrun());
+}
+
+
+int main(void)
+{
+	test_arbitration();
+	test_mailbox_order(false);
+	test_mailbox_order(true);
+	test_timing();
+	test_errors();
+	test_overrun();
+	test_filters();
+	return check_result("VirtualCanBusTest");
+}
@@ -0,0 +1,259 @@
+/**
+ * \file       tests/can/VirtualSpiFlash.h
+ * \class      VirtualSpiFlash
+ * \brief      Models a serial NOR flash at the command level, for host builds of SpiFlashMemory and its filesystem.
+ * \notes      The host builds reach this through spi.h and gpio.h, the CubeMX headers that SPI.h includes. It provides
+ *             the subset of the HAL that SPI uses: a SPI handle and a chip-select port, both owned by the chip, so
+ *             that a driver is built on them as on the target.
+ *
+ * <code>
+ * VirtualSpiFlash chip(18);  // 256 KB.
+ * SpiFlashMemoryFilesystem fs(&chip.hspi, &chip.cs_port, 0);
+ * </code>
+ */
+
+#ifndef TESTS_CAN_VIRTUALSPIFLASH_H_
+#define TESTS_CAN_VIRTUALSPIFLASH_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+class VirtualSpiFlash;
+
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+typedef struct { VirtualSpiFlash* chip; } GPIO_TypeDef;
+typedef struct { VirtualSpiFlash* chip; } SPI_HandleTypeDef;
+
+
+/**
+ * A flash chip of 4 KB sectors and 256-byte pages, as the W25Q and GD25Q parts are.
+ *
+ * A command starts when the chip select falls. Reads, the identification and the status registers answer at once,
+ * and a page program or erase takes effect when the chip select rises, as on the part, and only after a write enable.
+ * Programming clears bits and never sets them, and a page program wraps within its page. Every operation completes
+ * at once, so the busy bit always reads zero.
+ */
+class VirtualSpiFlash
+{
+public:
+	static constexpr uint32_t PageSize = 0x100;
+	static constexpr uint32_t SectorSize = 0x1000;
+
+	/**
+	 * Creates an erased chip.
+	 * @param capacity The size as a power of two, which the identification reports; 18 for 256 KB.
+	 */
+	VirtualSpiFlash(uint8_t capacity=18)
+	{
+		this->capacity = capacity;
+		size = 1u << capacity;
+		memory = (uint8_t*) malloc(size);
+		memset(memory, 0xff, size);
+		hspi.chip = this;
+		cs_port.chip = this;
+	}
+
+
+	~VirtualSpiFlash()
+	{
+		free(memory);
+	}
+
+
+	/**
+	 * Drives the chip select.
+	 */
+	void select(bool selected)
+	{
+		if (selected)
+		{
+			command = 0;
+			received = 0;
+			address = 0;
+			page_count = 0;
+		}
+		else if (this->selected)
+			complete();
+		this->selected = selected;
+	}
+
+
+	/**
+	 * Clocks bytes in.
+	 */
+	void transmit(const uint8_t* data, uint32_t length)
+	{
+		for (uint32_t i=0; i < length && selected; i++, received++)
+		{
+			uint8_t byte = data[i];
+			if (received == 0)
+				command = byte;
+			else if (received <= 3)
+				address = (address << 8 | byte) & (size - 1);
+			else if (command == 0x02)
+				page[page_count++ % PageSize] = byte;  // More than a page wraps, as on the part.
+		}
+	}
+
+
+	/**
+	 * Clocks bytes out.
+	 */
+	void receive(uint8_t* data, uint32_t length)
+	{
+		for (uint32_t i=0; i < length; i++, received++)
+		{
+			switch (selected ? command : 0)
+			{
+			case 0x9f:
+				data[i] = received == 1 ? 0xef : received == 2 ? 0x40 : received == 3 ? capacity : 0xff;
+				break;
+			case 0x05:
+				data[i] = write_enabled ? 0x02 : 0x00;
+				break;
+			case 0x35:
+				data[i] = 0x00;
+				break;
+			case 0x03:
+				data[i] = memory[address];
+				address = (address + 1) & (size - 1);
+				reads++;
+				break;
+			default:
+				data[i] = 0xff;
+			}
+		}
+	}
+
+
+	/**
+	 * Erases a sector behind the driver's back, as a failing part or an interrupted write would leave it.
+	 */
+	void erase_sector(uint32_t address)
+	{
+		memset(memory + (address & (size - 1) & ~(SectorSize - 1)), 0xff, SectorSize);
+	}
+
+
+	uint8_t* get_memory(void)
+	{
+		return memory;
+	}
+
+
+	uint32_t get_erases(void)
+	{
+		return erases;
+	}
+
+
+	uint32_t get_programs(void)
+	{
+		return programs;
+	}
+
+
+	/**
+	 * Gets the number of bytes read from the array.
+	 */
+	uint32_t get_reads(void)
+	{
+		return reads;
+	}
+
+
+	SPI_HandleTypeDef hspi;
+	GPIO_TypeDef cs_port;
+
+private:
+	/**
+	 * Applies the command when the chip select rises.
+	 */
+	void complete(void)
+	{
+		switch (command)
+		{
+		case 0x06:
+			write_enabled = true;
+			return;
+		case 0x04:
+			write_enabled = false;
+			return;
+		case 0x02:
+			if (!write_enabled || received < 4)
+				break;
+			for (uint32_t i=0; i < page_count && i < PageSize; i++)
+			{
+				uint32_t at = (address & ~(PageSize - 1)) | ((address + i) & (PageSize - 1));
+				memory[at] &= page[i];
+			}
+			programs++;
+			break;
+		case 0x20:
+			if (!write_enabled || received < 4)
+				break;
+			erase_sector(address);
+			erases++;
+			break;
+		case 0x60:
+		case 0xc7:
+			if (!write_enabled)
+				break;
+			memset(memory, 0xff, size);
+			erases++;
+			break;
+		default:
+			return;
+		}
+		write_enabled = false;
+	}
+
+
+	uint8_t capacity;
+	uint32_t size;
+	uint8_t* memory;
+	bool selected = false;
+	bool write_enabled = false;
+	uint8_t command = 0;
+	uint32_t received = 0;
+	uint32_t address = 0;
+	uint8_t page[PageSize];
+	uint32_t page_count = 0;
+	uint32_t erases = 0;
+	uint32_t programs = 0;
+	uint32_t reads = 0;
+};
+
+
+inline void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state)
+{
+	(void) pin;
+	if (port != nullptr && port->chip != nullptr)
+		port->chip->select(state == GPIO_PIN_RESET);
+}
+
+
+inline HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout)
+{
+	(void) timeout;
+	hspi->chip->transmit(data, size);
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout)
+{
+	(void) timeout;
+	hspi->chip->receive(data, size);
+	return HAL_OK;
+}
+
+
+inline HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef* hspi)
+{
+	(void) hspi;
+	return HAL_OK;
+}
+
+#endif /* TESTS_CAN_VIRTUALSPIFLASH_H_ */
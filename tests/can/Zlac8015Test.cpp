@@ -0,0 +1,174 @@
+/**
+ * \file       tests/can/Zlac8015Test.cpp
+ * \brief      Runs a Zlac8015 against a simulated drive on a VirtualCanBus, which accepts or refuses its SDO requests.
+ */
+
+#include "toolbox.h"
+#include "comms/CanOpen.h"
+#include "devices/motors/Zlac8015.h"
+#include "Check.h"
+
+static constexpr uint8_t DriveNode = 3;
+
+
+/**
+ * Answers SDO requests like a ZLAC8015, either accepting every one or aborting every one, and notes the RPDOs and
+ * SDO writes of the target speed it receives.
+ */
+class Drive : public VirtualCanBus::Node
+{
+public:
+	void on_rx_pending(void) override
+	{
+		VirtualCanBus::Frame frame;
+		while (receive(frame))
+		{
+			if (frame.cob == 0x200 + DriveNode)
+				rpdos++;
+			if (frame.cob != 0x600 + DriveNode)
+				continue;
+
+			uint16_t index = frame.data[1] | frame.data[2] << 8;
+			uint8_t reply[8] = { 0, frame.data[1], frame.data[2], frame.data[3], 0, 0, 0, 0 };
+			if (refuse)
+			{
+				reply[0] = CanOpen::SDO_Abort;
+				memcpy(reply + 4, &AbortNoObject, 4);
+			}
+			else if (frame.data[0] == 0x40)
+			{
+				reply[0] = 0x43;  // Expedited upload of four bytes.
+				memcpy(reply + 4, &value, 4);
+			}
+			else
+			{
+				reply[0] = CanOpen::SDO_DownloadResponse;
+				if (index == CanOpen::Index_TargetSpeed)
+					speed_writes++;
+			}
+			transmit(0x580 + DriveNode, reply, 8);
+		}
+	}
+
+
+	static constexpr uint32_t AbortNoObject = 0x06020000;
+	bool refuse = false;
+	int32_t value = 1234;
+	uint32_t rpdos = 0;
+	uint32_t speed_writes = 0;
+};
+
+
+/**
+ * A master with a Zlac8015, and a drive, on one bus.
+ */
+class Rig
+{
+public:
+	Rig(bool refuse) : hcan(&bus), master(&hcan), zlac(&master, DriveNode, 500)
+	{
+		rig = this;
+		VirtualHal::set_bus(&bus);
+		bus.attach(&drive);
+		drive.refuse = refuse;
+		master.set_node_callback(DriveNode, &zlac);
+		master.setup();
+	}
+
+
+	~Rig()
+	{
+		rig = nullptr;
+	}
+
+
+	/**
+	 * Runs the bus until the Zlac8015 has worked through its queue.
+	 * @returns True if it did within a second.
+	 */
+	bool run(void)
+	{
+		for (uint32_t ms=0; ms < 1000 && zlac.is_busy(); ms++)
+		{
+			bus.advance(1000000);
+			zlac.poll();
+		}
+		return !zlac.is_busy();
+	}
+
+
+	inline static Rig* rig = nullptr;
+
+	VirtualCanBus bus { 1000000 };
+	CAN_HandleTypeDef hcan;
+	CanOpen master;
+	Zlac8015 zlac;
+	Drive drive;
+};
+
+
+void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef* hcan) { (void) hcan; Rig::rig->master.on_message(); }
+void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; Rig::rig->master.on_tx_complete(CAN_TX_MAILBOX0); }
+void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; Rig::rig->master.on_tx_complete(CAN_TX_MAILBOX1); }
+void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef* hcan) { (void) hcan; Rig::rig->master.on_tx_complete(CAN_TX_MAILBOX2); }
+
+
+/**
+ * Once the drive acknowledges enabling the RPDO, velocity commands go out as RPDOs.
+ */
+static void test_rpdo_accepted(void)
+{
+	Rig rig(false);
+	CHECK(rig.zlac.configure_pdos());
+	CHECK(rig.run());
+	CHECK(rig.zlac.is_rpdo_ready());
+	CHECK(rig.zlac.get_aborts() == 0);
+	rig.zlac.velocity(100, Zlac8015::Rpm);
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.drive.rpdos == 1);
+	CHECK(rig.drive.speed_writes == 0);
+}
+
+
+/**
+ * A drive that refuses the mapping leaves velocity commands on SDO, instead of sending RPDOs it will ignore.
+ */
+static void test_rpdo_refused(void)
+{
+	Rig rig(true);
+	CHECK(rig.zlac.configure_pdos());
+	CHECK(rig.run());
+	CHECK(!rig.zlac.is_rpdo_ready());
+	CHECK(rig.zlac.get_aborts() == 3 * 6 + 3 + 3 + 1);
+	CHECK(rig.zlac.get_timeouts() == 0);
+	rig.zlac.velocity(100, Zlac8015::Rpm);
+	CHECK(rig.run());
+	CHECK(rig.bus.run_until_idle());
+	CHECK(rig.drive.rpdos == 0);
+}
+
+
+/**
+ * Values read over SDO reach the cache; abort codes do not.
+ */
+static void test_read(void)
+{
+	const bool refusals[] = { false, true };
+	for (bool refuse : refusals)
+	{
+		Rig rig(refuse);
+		rig.zlac.read(CanOpen::Index_ActualPosition, 0);
+		CHECK(rig.run());
+		CHECK(rig.zlac.get_aborts() == (refuse ? 1u : 0u));
+		CHECK(rig.zlac.get_position() == (refuse ? 0 : 1234));
+	}
+}
+
+
+int main(void)
+{
+	test_rpdo_accepted();
+	test_rpdo_refused();
+	test_read();
+	return check_result("Zlac8015Test");
+}
@@ -0,0 +1,10 @@
+///	@file       tests/can/gpio.h
+///	@brief      Stands in for the CubeMX GPIO header that comms/SPI.h includes, with the flash chip select on the port.
+
+#ifndef TESTS_CAN_GPIO_H_
+#define TESTS_CAN_GPIO_H_
+
+#include "toolbox.h"
+#include "VirtualSpiFlash.h"
+
+#endif
@@ -0,0 +1,10 @@
+///	@file       tests/can/spi.h
+///	@brief      Stands in for the CubeMX SPI header that comms/SPI.h includes, with the flash model behind the port.
+
+#ifndef TESTS_CAN_SPI_H_
+#define TESTS_CAN_SPI_H_
+
+#include "toolbox.h"
+#include "VirtualSpiFlash.h"
+
+#endif
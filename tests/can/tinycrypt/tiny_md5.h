@@ -0,0 +1,21 @@
+///	@file       tests/can/tinycrypt/tiny_md5.h
+///	@brief      Stands in for tinycrypt's MD5 in the host builds. The filesystem only compares the digest it stored
+///	            with the one it computes on reading, so any 16-byte digest that changes with the data serves: this one
+///	            is four FNV-1a lanes over interleaved bytes, and is not MD5.
+
+#ifndef TESTS_CAN_TINYCRYPT_TINY_MD5_H_
+#define TESTS_CAN_TINYCRYPT_TINY_MD5_H_
+
+#include <stdint.h>
+#include <string.h>
+
+inline void tiny_md5(uint8_t* data, uint32_t length, uint8_t digest[16])
+{
+	uint32_t lanes[4] = { 0x811c9dc5, 0x811c9dc5 ^ 1, 0x811c9dc5 ^ 2, 0x811c9dc5 ^ 3 };
+	for (uint32_t i=0; i < length; i++)
+		lanes[i % 4] = (lanes[i % 4] ^ data[i]) * 16777619u;
+	lanes[0] ^= length;
+	memcpy(digest, lanes, 16);
+}
+
+#endif
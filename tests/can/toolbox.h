@@ -0,0 +1,42 @@
+///	@file       tests/can/toolbox.h
+///	@brief      Configuration for the CAN host tests, which run CanBus and CanOpen over VirtualCanHal.h.
+
+#ifndef INC_TOOLBOX_H_
+#define INC_TOOLBOX_H_
+
+#include <stdint.h>
+#include "comms/VirtualCanHal.h"
+
+// CAN
+#define CAN_DEFAULT_BITRATE (125000)
+#define CAN_FILTER_BANKS (14)
+#define CAN_FILTER_MAX_ENTRIES (32)
+#define CAN_STATISTICS_WATCH_MAX (4)
+#define CAN_STATISTICS_JITTER_BINS (16)
+#define CAN_STATISTICS_HISTORY (60)
+#define CAN_TRACE_FILTERS (8)
+#define CANOPEN_SDO_MAX_TRANSFERS (4)
+#define CANOPEN_SDO_TIMEOUT (500)
+#define CANOPEN_SDO_BLOCK_SIZE (127)
+#define CANOPEN_PDO_SCHEDULER_MAX_PDOS (8)
+#define VIRTUAL_CAN_MAX_NODES (16)
+
+// Flash
+#define EXTERNAL_FLASH_FILENAME_LENGTH (80)
+
+// Motors
+#define ZLAC8015_QUEUE_LENGTH (32)
+#define ZLAC8015_SDO_TIMEOUT (20)
+
+// Timer
+#define TIMER_OVERFLOW_INTERVAL (0xffffffff/2)
+
+// Generics
+#define GENERICS_ALLOW_NEW (0)
+
+// Diagnostics
+#define MEMORYUSAGE_MAX_TASKS (8)
+#define MEMORYUSAGE_REPORT_INTERVAL (60000)
+#define MEMORYUSAGE_STACK_MARGIN (64)
+
+#endif
@@ -0,0 +1,168 @@
+/**
+ * \file       tests/w5500/BufferSizesTest.cpp
+ * \brief      Divides the W5500's buffer memory unevenly: which layouts are taken, which socket open() picks, and what
+ *             a larger transmit buffer does for TCP over a slow round trip.
+ */
+
+#include "toolbox.h"
+#include "comms/ethernet/w5500/TcpClient.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const uint8_t PeerIp[4] = { 10, 0, 0, 2 };
+static const uint8_t Even[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+
+
+/**
+ * Counts what it receives.
+ */
+class Sink : public VirtualW5500::ITcpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		(void) data;
+		received += length;
+	}
+
+
+	uint32_t received = 0;
+};
+
+
+static bool chip_has(const uint8_t tx_kb[8], const uint8_t rx_kb[8])
+{
+	for (SOCKET s=0; s < 8; s++)
+		if (w5500.readSnTXBUF_SIZE(s) != tx_kb[s] || w5500.readSnRXBUF_SIZE(s) != rx_kb[s]
+				|| w5500.get_tx_buffer_size(s) != tx_kb[s] * 1024 || w5500.get_rx_buffer_size(s) != rx_kb[s] * 1024)
+			return false;
+	return true;
+}
+
+
+/**
+ * Sizes that the chip does not have, and totals over 16 KB in either direction, are refused and change nothing.
+ */
+static void test_validation(void)
+{
+	const uint8_t odd[8] = { 3, 2, 2, 2, 2, 2, 2, 1 };
+	const uint8_t over[8] = { 16, 1, 0, 0, 0, 0, 0, 0 };
+	const uint8_t uneven[8] = { 8, 4, 2, 1, 1, 0, 0, 0 };
+	CHECK(chip_has(Even, Even));
+	CHECK(!w5500.set_buffer_sizes(odd, Even));
+	CHECK(!w5500.set_buffer_sizes(Even, over));
+	CHECK(!w5500.set_buffer_sizes(over, Even));
+	CHECK(chip_has(Even, Even));
+
+	CHECK(w5500.set_buffer_sizes(uneven, Even));
+	CHECK(chip_has(uneven, Even));
+	CHECK(!w5500.set_buffer_size(5, 4, 2));  // 20 KB with the others.
+	CHECK(!w5500.set_buffer_size(5, 0, 32));
+	CHECK(chip_has(uneven, Even));
+	CHECK(w5500.set_buffer_size(5, 0, 0));
+	CHECK(w5500.set_buffer_size(6, 0, 4));
+	CHECK(w5500.get_rx_buffer_size(6) == 4096 && w5500.get_rx_buffer_size(5) == 0);
+	CHECK(w5500.set_buffer_sizes(Even, Even));
+}
+
+
+/**
+ * open() takes the free socket with the smallest buffers that meet set_buffer_needs(), and never one without buffers.
+ */
+static void test_socket_choice(void)
+{
+	const uint8_t tx[8] = { 8, 4, 1, 2, 1, 0, 0, 0 };
+	const uint8_t rx[8] = { 8, 4, 1, 2, 1, 0, 0, 0 };
+	CHECK(w5500.set_buffer_sizes(tx, rx));
+
+	Socket large(&w5500), medium(&w5500), small(&w5500), other(&w5500);
+	medium.set_buffer_needs(4096, 4096);
+	CHECK(medium.open(SnMR::UDP, 5000, 0));
+	CHECK(medium.get_socket() == 1);
+	large.set_buffer_needs(4096, 4096);
+	CHECK(large.open(SnMR::UDP, 5001, 0));
+	CHECK(large.get_socket() == 0);
+
+	CHECK(small.open(SnMR::UDP, 5002, 0));
+	CHECK(small.get_socket() == 2);
+	CHECK(other.open(SnMR::UDP, 5003, 0));
+	CHECK(other.get_socket() == 4);
+	small.close();
+	other.close();
+
+	// With 1 KB sockets free, a socket that needs 2 KB still gets one big enough.
+	other.set_buffer_needs(2048, 1024);
+	CHECK(other.open(SnMR::UDP, 5004, 0));
+	CHECK(other.get_socket() == 3);
+
+	other.close();
+	large.close();
+	medium.close();
+	CHECK(w5500.set_buffer_sizes(Even, Even));
+}
+
+
+/**
+ * Sends over TCP from socket 0 with the given transmit buffer, and returns the rate in kB/s.
+ */
+static uint32_t send_rate(uint8_t tx_kb, uint32_t total)
+{
+	uint8_t tx[8] = { tx_kb, 0, 0, 0, 0, 0, 0, 0 };
+	uint8_t left = Ethernet::BUFFER_BUDGET_KB - tx_kb;
+	for (SOCKET s=1; s < 8 && left >= 2; s++, left -= 2)
+		tx[s] = 2;  // The rest go to the other sockets.
+	CHECK(w5500.set_buffer_sizes(tx, Even));
+
+	Sink sink;
+	chip.add_tcp_peer(PeerIp, 1883, &sink);
+	Socket socket(&w5500);
+	socket.set_buffer_needs(tx_kb * 1024, 2048);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 1883));
+	CHECK(socket.get_socket() == 0);
+
+	uint8_t buffer[1460] = {0};
+	uint64_t start = VirtualW5500::get_time();
+	for (uint32_t sent=0; sent < total; sent += sizeof(buffer))
+		socket.send(buffer, sizeof(buffer));
+	while (sink.received < total)
+		osDelay(1);
+	uint64_t ns = VirtualW5500::get_time() - start;
+	socket.close();
+	CHECK(w5500.set_buffer_sizes(Even, Even));
+	return (uint32_t) ((uint64_t) sink.received * 1000000ull / ns);
+}
+
+
+/**
+ * Over a 5 ms round trip, a transmit buffer of 16 KB keeps more data in flight than the default 2 KB, and moves it
+ * several times as fast.
+ */
+static void test_throughput(void)
+{
+	chip.latency = 2500000;
+	const uint8_t sizes[] = { 2, 4, 8, 16 };
+	uint32_t rates[4];
+	for (uint8_t i=0; i < 4; i++)
+		rates[i] = send_rate(sizes[i], 1460 * 200);
+	printf("  TCP send over a 5 ms round trip: %u, %u, %u and %u kB/s with 2, 4, 8 and 16 KB\n", rates[0], rates[1],
+			rates[2], rates[3]);
+	chip.latency = 100000;
+	CHECK(rates[1] > rates[0] && rates[2] > rates[1] && rates[3] > rates[2]);
+	CHECK(rates[3] > 3 * rates[0]);
+}
+
+
+int main(void)
+{
+	test_validation();
+	test_socket_choice();
+	test_throughput();
+	return check_result("BufferSizesTest");
+}
@@ -0,0 +1,262 @@
+/**
+ * \file       tests/w5500/BurstTransferTest.cpp
+ * \brief      Counts the SPI calls and frames that Socket spends moving 1 MB each way over TCP, and checks the data.
+ * \notes      The network is made instant, so that only the driver's own transfers are counted, not its waits for
+ *             the peer.
+ */
+
+#include "toolbox.h"
+#include "comms/ethernet/w5500/TcpClient.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static constexpr uint32_t Total = 1 << 20;
+static constexpr uint16_t Chunk = 1460;
+static const uint8_t PeerIp[4] = { 10, 0, 0, 2 };
+
+
+static uint8_t pattern(uint32_t i)
+{
+	return (uint8_t) (i * 7 + (i >> 8));
+}
+
+
+/**
+ * Keeps what it receives and checks it against the pattern; sends the pattern when asked.
+ */
+class Peer : public VirtualW5500::ITcpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		for (uint16_t i=0; i < length; i++)
+			if (data[i] != pattern(received + i))
+				errors++;
+		received += length;
+	}
+
+
+	void on_connect(uint8_t s) override
+	{
+		if (!source)
+			return;
+		uint8_t buffer[Chunk];
+		for (uint32_t sent=0; sent < Total; sent += Chunk)
+		{
+			uint16_t n = Total - sent < Chunk ? Total - sent : Chunk;
+			for (uint16_t i=0; i < n; i++)
+				buffer[i] = pattern(sent + i);
+			chip.send_tcp(s, buffer, n);
+		}
+	}
+
+
+	bool source = false;
+	uint32_t received = 0;
+	uint32_t errors = 0;
+};
+
+
+static void report(const char* what, uint32_t calls, uint32_t frames, uint64_t bytes)
+{
+	// The time at 20 MHz and 2.5 us per blocking call, which is what the SPI costs on the target.
+	uint64_t ns = calls * chip.spi_call_time + bytes * chip.spi_byte_time;
+	printf("  %s 1 MB in %u-byte chunks: %u HAL calls, %u frames, %u SPI bytes, %llu kB/s\n", what, Chunk, calls,
+			frames, (uint32_t) bytes, (unsigned long long) (Total * 1000000ull / ns));
+}
+
+
+/**
+ * Each chunk sent costs a few frames of a couple of calls each, not a call per byte.
+ */
+static void test_send(void)
+{
+	Peer peer;
+	chip.add_tcp_peer(PeerIp, 1883, &peer);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 1883));
+
+	uint32_t calls = chip.calls, frames = chip.frames;
+	uint64_t bytes = chip.bytes;
+	uint8_t buffer[Chunk];
+	for (uint32_t sent=0; sent < Total; sent += Chunk)
+	{
+		uint16_t n = Total - sent < Chunk ? Total - sent : Chunk;
+		for (uint16_t i=0; i < n; i++)
+			buffer[i] = pattern(sent + i);
+		CHECK(socket.send(buffer, n) == n);
+	}
+	calls = chip.calls - calls;
+	frames = chip.frames - frames;
+	bytes = chip.bytes - bytes;
+	osDelay(1);
+	report("send", calls, frames, bytes);
+
+	uint32_t chunks = (Total + Chunk - 1) / Chunk;
+	CHECK(peer.received == Total);
+	CHECK(peer.errors == 0);
+	CHECK(calls <= 2 * frames);
+	CHECK(calls < Total / 100);
+	CHECK(bytes <= Total + 64 * chunks);
+	socket.close();
+}
+
+
+/**
+ * Each chunk received costs a few frames of a couple of calls each, not a call per byte.
+ */
+static void test_recv(void)
+{
+	Peer peer;
+	peer.source = true;
+	chip.add_tcp_peer(PeerIp, 1884, &peer);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 1884));
+	osDelay(1);
+
+	uint32_t calls = chip.calls, frames = chip.frames;
+	uint64_t bytes = chip.bytes;
+	uint8_t buffer[Chunk];
+	uint32_t received = 0, errors = 0, chunks = 0;
+	while (received < Total && chunks < 2 * Total / Chunk)
+	{
+		int16_t n = socket.recv(buffer, Chunk);
+		chunks++;
+		for (int16_t i=0; i < n; i++)
+			if (buffer[i] != pattern(received + i))
+				errors++;
+		if (n > 0)
+			received += n;
+	}
+	calls = chip.calls - calls;
+	frames = chip.frames - frames;
+	bytes = chip.bytes - bytes;
+	report("recv", calls, frames, bytes);
+
+	CHECK(received == Total);
+	CHECK(errors == 0);
+	CHECK(calls <= 2 * frames);
+	CHECK(calls < Total / 100);
+	CHECK(bytes <= Total + 64 * chunks);
+	socket.close();
+}
+
+
+/**
+ * Keeps what it receives.
+ */
+class Recorder : public VirtualW5500::ITcpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		for (uint16_t i=0; i < length && received < sizeof(bytes); i++)
+			bytes[received++] = data[i];
+	}
+
+
+	uint8_t bytes[4096];
+	uint32_t received = 0;
+};
+
+
+/**
+ * A packet built with a reserved length field filled in last goes out as one segment, in order. Reserving, appending
+ * or filling past what begin_packet() allowed fails and leaves the packet as it was, and end_packet() sends nothing
+ * unless a packet is open.
+ */
+static void test_packet(void)
+{
+	Recorder peer;
+	chip.add_tcp_peer(PeerIp, 1885, &peer);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 1885));
+
+	CHECK(socket.end_packet() == 0);  // Nothing open.
+	CHECK(socket.reserve(2) == -1);
+	CHECK(!socket.append("x", 1));
+	osDelay(1);
+	CHECK(peer.received == 0);
+
+	CHECK(socket.begin_packet(16));
+	CHECK(socket.reserve(2) == 0);
+	IoVec pieces[3] = { { "topic", 5 }, { "", 0 }, { "/data", 5 } };
+	CHECK(socket.append(pieces, 3));
+	CHECK(socket.reserve(5) == -1);  // 12 + 5 > 16.
+	CHECK(!socket.append("12345", 5));
+	CHECK(socket.get_packet_length() == 12);
+	CHECK(!socket.fill(11, "ab", 2));  // Past the bytes so far.
+	uint8_t length[2] = { 0, 10 };
+	CHECK(socket.fill(0, length, 2));
+	CHECK(socket.reserve(4) == 12);
+	CHECK(socket.fill(12, "!!!!", 4));
+	CHECK(socket.end_packet() == 16);
+	CHECK(socket.end_packet() == 0);  // Already sent.
+	CHECK(!socket.fill(0, length, 2));
+	osDelay(1);
+	CHECK(peer.received == 16);
+	CHECK(memcmp(peer.bytes, "\x00\x0atopic/data!!!!", 16) == 0);
+
+	CHECK(!socket.begin_packet(w5500.get_tx_buffer_size(socket.get_socket()) + 1));
+	CHECK(socket.end_packet() == 0);
+	socket.close();
+}
+
+
+/**
+ * sendv() writes its pieces, empty ones included, in one burst and sends them as one segment, and refuses more than
+ * the transmit buffer holds.
+ */
+static void test_sendv(void)
+{
+	Recorder peer;
+	chip.add_tcp_peer(PeerIp, 1886, &peer);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 1886));
+
+	static uint8_t payload[1000];
+	for (uint32_t i=0; i < sizeof(payload); i++)
+		payload[i] = pattern(i);
+	const uint8_t header[4] = { 0x30, 0xe8, 0x07, 0x00 };
+	IoVec pieces[4] = { { header, 4 }, { nullptr, 0 }, { payload, sizeof(payload) }, { "end", 3 } };
+	uint32_t frames = chip.frames;
+	CHECK(socket.sendv(pieces, 4) == 4 + sizeof(payload) + 3);
+	frames = chip.frames - frames;
+	osDelay(1);
+	printf("  sendv of 4 pieces, %u bytes: %u SPI frames\n", peer.received, frames);
+	CHECK(peer.received == 4 + sizeof(payload) + 3);
+	CHECK(memcmp(peer.bytes, header, 4) == 0);
+	CHECK(memcmp(peer.bytes + 4, payload, sizeof(payload)) == 0);
+	CHECK(memcmp(peer.bytes + 4 + sizeof(payload), "end", 3) == 0);
+
+	uint16_t size = w5500.get_tx_buffer_size(socket.get_socket());
+	IoVec too_big[2] = { { payload, sizeof(payload) }, { nullptr, (uint16_t) (size - sizeof(payload) + 1) } };
+	CHECK(socket.sendv(too_big, 2) == 0);
+	socket.close();
+}
+
+
+int main(void)
+{
+	chip.latency = 0;
+	chip.wire_rate = 1000000000000ull;
+	test_send();
+	test_recv();
+	test_packet();
+	test_sendv();
+	return check_result("BurstTransferTest");
+}
@@ -0,0 +1,293 @@
+/**
+ * \file       tests/w5500/DhcpClientTest.cpp
+ * \brief      Runs a DhcpClient against DHCP servers on the W5500 stand-in: with another user of the chip's sockets,
+ *             a server that refuses with NAK, rebinding to another server after T2, and a server that goes away.
+ */
+
+#include "toolbox.h"
+#include "comms/tcpip/Dhcp.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const uint8_t ServerIp[4] = { 10, 0, 0, 1 };
+static const uint8_t LeasedIp[4] = { 10, 0, 0, 50 };
+static const uint8_t OtherServerIp[4] = { 10, 0, 0, 3 };
+static constexpr uint32_t Lease = 100;  // Seconds; T1 is at 50 and T2 at 88.
+
+
+/**
+ * Gets the time in milliseconds of virtual time.
+ */
+static uint32_t now(void)
+{
+	return VirtualW5500::get_time() / 1000000;
+}
+
+
+/**
+ * Offers and acknowledges one address to whoever asks, or refuses REQUESTs with NAK, or stays silent, and notes each
+ * message that it hears.
+ */
+class Server : public VirtualW5500::IUdpPeer
+{
+public:
+	/**
+	 * @brief	A message heard.
+	 */
+	typedef struct Request
+	{
+		uint8_t type;
+		bool broadcast;  /// The BROADCAST flag was set.
+		uint8_t ciaddr[4];
+		uint32_t time;  /// When it arrived, in milliseconds of virtual time.
+	} Request;
+
+
+	Server(const uint8_t ip[4]=ServerIp)
+	{
+		memcpy(this->ip, ip, 4);
+		chip.add_udp_peer(ip, DHCP_SERVER_PORT, this);
+	}
+
+
+	void on_datagram(const VirtualW5500::Endpoint& from, const uint8_t* data, uint16_t length) override
+	{
+		ports.push_back(from.port);
+		if (length < DHCP_OPTIONS_OFFSET + 3 || data[DHCP_OPTIONS_OFFSET] != dhcpMessageType)
+			return;
+		uint8_t type = data[DHCP_OPTIONS_OFFSET + 2];
+		Request request = { type, (data[10] & 0x80) != 0, { data[12], data[13], data[14], data[15] }, now() };
+		heard.push_back(request);
+		if (type == DHCP_REQUEST)
+			requests++;
+		if ((type != DHCP_DISCOVER && type != DHCP_REQUEST) || !answering)
+			return;
+
+		uint8_t reply[DHCP_OPTIONS_OFFSET + 32] = {0};
+		reply[0] = DHCP_BOOTREPLY;
+		memcpy(reply + 4, data + 4, 4);  // xid
+		memcpy(reply + 16, LeasedIp, 4);  // yiaddr
+		memcpy(reply + 28, data + 28, 6);  // chaddr
+		reply[236] = 0x63, reply[237] = 0x82, reply[238] = 0x53, reply[239] = 0x63;
+		uint8_t* p = reply + DHCP_OPTIONS_OFFSET;
+		*p++ = dhcpMessageType, *p++ = 1;
+		*p++ = type == DHCP_DISCOVER ? DHCP_OFFER : refusing ? DHCP_NAK : DHCP_ACK;
+		*p++ = dhcpServerIdentifier, *p++ = 4;
+		memcpy(p, ip, 4);
+		p += 4;
+		*p++ = dhcpIPaddrLeaseTime, *p++ = 4, *p++ = 0, *p++ = 0, *p++ = 0, *p++ = Lease;
+		*p++ = subnetMask, *p++ = 4, *p++ = 255, *p++ = 255, *p++ = 255, *p++ = 0;
+		*p++ = endOption;
+
+		VirtualW5500::Endpoint self = { { ip[0], ip[1], ip[2], ip[3] }, DHCP_SERVER_PORT };
+		chip.send_datagram(self, DHCP_CLIENT_PORT, reply, p - reply);
+	}
+
+
+	/**
+	 * Counts the messages of a type heard since a time.
+	 */
+	uint32_t count(uint8_t type, uint32_t since=0)
+	{
+		uint32_t n = 0;
+		for (Request& request : heard)
+			n += request.type == type && request.time >= since;
+		return n;
+	}
+
+
+	bool answering = true;  /// Answer at all.
+	bool refusing = false;  /// Answer REQUEST with NAK.
+	uint8_t ip[4];
+	std::vector<uint16_t> ports;
+	std::vector<Request> heard;
+	uint32_t requests = 0;
+};
+
+
+/**
+ * Polls the client every 10 ms until an event.
+ */
+static DhcpClient::Event run(DhcpClient& client, uint32_t ms)
+{
+	for (uint32_t i=0; i < ms / 10; i++)
+	{
+		DhcpClient::Event event = client.poll();
+		if (event != DhcpClient::NoEvent)
+			return event;
+		osDelay(10);
+	}
+	return DhcpClient::NoEvent;
+}
+
+
+/**
+ * Once bound, the client's chip socket goes to another user. Renewing opens a socket of its own again, rather than
+ * taking the other user's for its own because it is open for UDP; and stop() leaves the other user's alone.
+ */
+static void test_socket_given_up(void)
+{
+	Server server;
+	Socket socket(&w5500);
+	DhcpClient client(&w5500, &socket);
+	client.begin();
+	CHECK(run(client, 1000) == DhcpClient::Leased);
+	CHECK(client.get_state() == DhcpClient::Bound);
+	SOCKET dhcp_socket = socket.get_socket();
+
+	Socket other(&w5500);
+	CHECK(other.open(SnMR::UDP, 5000, 0));
+	SOCKET taken = other.get_socket();
+	CHECK(taken == dhcp_socket);
+
+	uint32_t requests = server.requests;
+	CHECK(run(client, Lease * 1000) == DhcpClient::Renewed);
+	CHECK(server.requests == requests + 1);
+	CHECK(server.ports.back() == DHCP_CLIENT_PORT);
+	CHECK(socket.get_socket() != taken);
+	CHECK(chip.get_status(taken) == SnSR::UDP);
+
+	client.stop();
+	CHECK(client.get_state() == DhcpClient::Stopped);
+	CHECK(chip.get_status(taken) == SnSR::UDP);
+	client.stop();
+	CHECK(chip.get_status(taken) == SnSR::UDP);
+
+	// A client that never started has nothing to close.
+	Socket unused(&w5500);
+	DhcpClient idle(&w5500, &unused);
+	idle.stop();
+	CHECK(chip.get_status(taken) == SnSR::UDP);
+	other.close();
+}
+
+
+/**
+ * A NAK to the first REQUEST starts again with DISCOVER rather than binding, and one to a renewal gives up the
+ * address at once with Lost. Either way the client binds again once the server stops refusing.
+ */
+static void test_nak(void)
+{
+	Server server;
+	Socket socket(&w5500);
+	DhcpClient client(&w5500, &socket);
+	server.refusing = true;
+	client.begin();
+	CHECK(run(client, 3000) == DhcpClient::NoEvent);
+	CHECK(!client.is_bound());
+	CHECK(server.count(DHCP_DISCOVER) >= 2 && server.count(DHCP_REQUEST) >= 2);
+	server.refusing = false;
+	CHECK(run(client, 1000) == DhcpClient::Leased);
+	CHECK(client.get_local_ip() == IPv4Address(LeasedIp));
+
+	server.refusing = true;
+	uint32_t bound = now();
+	CHECK(run(client, Lease * 1000) == DhcpClient::Lost);
+	uint32_t lost = now() - bound;
+	CHECK(client.get_state() == DhcpClient::Init);
+	CHECK(client.get_local_ip().is_empty());
+	CHECK(lost >= Lease * 500 && lost < Lease * 500 + 100);  // At T1, on the first renewal.
+	server.refusing = false;
+	CHECK(run(client, 1000) == DhcpClient::Leased);
+	printf("  NAK: refused renewal lost the lease %u ms after binding\n", lost);
+	client.stop();
+}
+
+
+/**
+ * When the server that gave the lease does not answer a renewal, the client asks any server from T2, without the
+ * BROADCAST flag since it still has its address, and takes the lease from the one that answers.
+ */
+static void test_rebind(void)
+{
+	Server server;
+	Server other(OtherServerIp);
+	Socket socket(&w5500);
+	DhcpClient client(&w5500, &socket);
+	other.answering = false;
+	client.begin();
+	CHECK(run(client, 1000) == DhcpClient::Leased);
+	CHECK(server.heard.back().type == DHCP_REQUEST && server.heard.back().broadcast);
+
+	uint32_t bound = now();
+	server.answering = false;
+	other.answering = true;
+	CHECK(run(client, Lease * 1000) == DhcpClient::Renewed);
+	uint32_t renewed = now() - bound;
+	CHECK(client.get_dhcp_server_ip() == IPv4Address(OtherServerIp));
+	CHECK(renewed >= Lease * 875 && renewed < Lease * 875 + 1000);
+
+	// The renewals went to the first server alone; the REQUEST from T2 went to both.
+	CHECK(other.count(DHCP_REQUEST, bound + 1) == 1);
+	CHECK(server.count(DHCP_REQUEST, bound + 1) >= 2);
+	Server::Request& rebind = other.heard.back();
+	CHECK(rebind.type == DHCP_REQUEST && !rebind.broadcast);
+	CHECK(memcmp(rebind.ciaddr, LeasedIp, 4) == 0);
+	for (Server::Request& request : server.heard)
+		if (request.time > bound)
+			CHECK(!request.broadcast && memcmp(request.ciaddr, LeasedIp, 4) == 0);
+	printf("  rebind: %u renewals unanswered, rebound after %u ms\n", server.count(DHCP_REQUEST, bound + 1) - 1,
+			renewed);
+	client.stop();
+}
+
+
+/**
+ * With no server answering, the lease expires on time with Lost and the address is cleared. DISCOVER is then sent
+ * less and less often, up to DHCP_MAX_RETRY_INTERVAL apart, and the client binds again soon after the server returns.
+ */
+static void test_server_down(void)
+{
+	Server server;
+	Socket socket(&w5500);
+	DhcpClient client(&w5500, &socket);
+	client.begin();
+	CHECK(run(client, 1000) == DhcpClient::Leased);
+	uint32_t bound = now();
+	server.answering = false;
+	CHECK(run(client, Lease * 1000 + 1000) == DhcpClient::Lost);
+	uint32_t lost = now() - bound;
+	CHECK(lost + 10 >= Lease * 1000 && lost < Lease * 1000 + 100);  // The lease runs from the REQUEST, just before.
+	CHECK(client.get_state() == DhcpClient::Init);
+	CHECK(client.get_local_ip().is_empty());
+
+	uint32_t down = now();
+	CHECK(run(client, 300000) == DhcpClient::NoEvent);
+	std::vector<uint32_t> times;
+	for (Server::Request& request : server.heard)
+		if (request.type == DHCP_DISCOVER && request.time >= down)
+			times.push_back(request.time);
+	CHECK(times.size() >= 8 && times.size() <= 12);
+	uint32_t longest = 0;
+	for (uint32_t i=1; i < times.size(); i++)
+	{
+		uint32_t gap = times[i] - times[i - 1];
+		CHECK(gap >= longest || gap >= DHCP_MAX_RETRY_INTERVAL);
+		CHECK(gap <= DHCP_MAX_RETRY_INTERVAL + 100);
+		longest = gap > longest ? gap : longest;
+	}
+	CHECK(longest >= DHCP_MAX_RETRY_INTERVAL);
+
+	server.answering = true;
+	uint32_t up = now();
+	CHECK(run(client, DHCP_MAX_RETRY_INTERVAL + 1000) == DhcpClient::Leased);
+	uint32_t recovered = now() - up;
+	CHECK(client.get_local_ip() == IPv4Address(LeasedIp));
+	printf("  server down: lease lost after %u ms, %u DISCOVERs in 300 s, %u ms at most apart; bound again %u ms "
+			"after the server returned\n", lost, (uint32_t) times.size(), longest, recovered);
+	client.stop();
+}
+
+
+int main(void)
+{
+	test_socket_given_up();
+	test_nak();
+	test_rebind();
+	test_server_down();
+	return check_result("DhcpClientTest");
+}
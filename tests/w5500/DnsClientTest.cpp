@@ -0,0 +1,251 @@
+/**
+ * \file       tests/w5500/DnsClientTest.cpp
+ * \brief      Runs a DnsClient against a resolver on the W5500 stand-in: what it caches, for how long, and which it
+ *             replaces.
+ */
+
+#include <map>
+#include <string>
+#include "toolbox.h"
+#include "comms/tcpip/Dns.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const uint8_t ResolverIp[4] = { 10, 0, 0, 1 };
+
+
+/**
+ * Answers A queries from a table of names, 3 ms after each arrives, and counts them.
+ */
+class Resolver : public VirtualW5500::IUdpPeer
+{
+public:
+	/**
+	 * @brief	The answer for one name.
+	 */
+	typedef struct Record
+	{
+		uint8_t address[4];
+		uint32_t ttl;  /// Seconds.
+	} Record;
+
+
+	Resolver()
+	{
+		chip.add_udp_peer(ResolverIp, DNS_PORT, this);
+	}
+
+
+	void on_datagram(const VirtualW5500::Endpoint& from, const uint8_t* data, uint16_t length) override
+	{
+		queries++;
+		if (!answering || length < DNS_HEADER_SIZE + 5)
+			return;
+
+		// The name, in lower case, from the labels of the question.
+		std::string name;
+		uint16_t p = DNS_HEADER_SIZE;
+		while (p < length && data[p] != 0)
+		{
+			if (!name.empty())
+				name += '.';
+			for (uint8_t i=1; i <= data[p]; i++)
+				name += (char) tolower(data[p + i]);
+			p += data[p] + 1;
+		}
+		uint16_t question_end = p + 5;
+
+		std::map<std::string, Record>::iterator record = records.find(name);
+		std::vector<uint8_t> reply(data, data + question_end);
+		reply[2] = 0x81;  // A response, recursion desired
+		reply[3] = 0x80 | (record == records.end() ? RESP_NAME_ERROR : RESP_NO_ERROR);
+		if (record != records.end())
+		{
+			const Record& r = record->second;
+			reply[7] = 1;
+			reply.insert(reply.end(), { 0xc0, DNS_HEADER_SIZE, 0, TYPE_A, 0, CLASS_IN, (uint8_t) (r.ttl >> 24),
+					(uint8_t) (r.ttl >> 16), (uint8_t) (r.ttl >> 8), (uint8_t) r.ttl, 0, 4 });
+			reply.insert(reply.end(), r.address, r.address + 4);
+		}
+
+		VirtualW5500::Endpoint self = { { ResolverIp[0], ResolverIp[1], ResolverIp[2], ResolverIp[3] }, DNS_PORT };
+		uint16_t port = from.port;
+		chip.schedule(3000000, [self, port, reply]() { chip.send_datagram(self, port, reply.data(), reply.size()); });
+	}
+
+
+	std::map<std::string, Record> records;
+	bool answering = true;
+	uint32_t queries = 0;
+};
+
+
+/**
+ * Lookups of one name, repeated as a reconnect loop would, send one query while its answer lasts, whatever the case
+ * of the name.
+ */
+static void test_cached(void)
+{
+	Resolver resolver;
+	resolver.records["broker.example.com"] = { { 10, 0, 0, 2 }, 3600 };
+	Socket socket(&w5500);
+	Udp udp(&socket);
+	DnsClient dns(&udp, IPv4Address(ResolverIp));
+
+	uint64_t start = VirtualW5500::get_time();
+	for (uint32_t i=0; i < 100; i++)
+	{
+		IPv4Address ip;
+		CHECK(dns.Get(i % 2 ? "BROKER.Example.com" : "broker.example.com", ip) == SUCCESS);
+		CHECK(ip == IPv4Address(10, 0, 0, 2));
+		osDelay(1000);
+	}
+	printf("  100 lookups over %llu s: %u queries\n",
+			(unsigned long long) ((VirtualW5500::get_time() - start) / 1000000000), resolver.queries);
+	CHECK(resolver.queries == 1);
+	CHECK(dns.GetStatistics()->queries == 1);
+	CHECK(dns.GetStatistics()->hits == 100);  // The first is answered from the cache too, once the answer is in.
+}
+
+
+/**
+ * A name that does not exist, and a resolver that does not answer, are each asked about once until DNS_NEGATIVE_TTL
+ * has passed.
+ */
+static void test_negative(void)
+{
+	Resolver resolver;
+	Socket socket(&w5500);
+	Udp udp(&socket);
+	DnsClient dns(&udp, IPv4Address(ResolverIp));
+	IPv4Address ip;
+
+	int missing = dns.Get("missing.example.com", ip);
+	CHECK(missing != SUCCESS);
+	CHECK(resolver.queries == 1);
+	osDelay(DNS_NEGATIVE_TTL * 1000 - 100);
+	uint32_t negative_hits = dns.GetStatistics()->negative_hits;
+	CHECK(dns.Get("missing.example.com", ip) == missing);
+	CHECK(resolver.queries == 1);
+	CHECK(dns.GetStatistics()->negative_hits == negative_hits + 1);
+	osDelay(200);
+	CHECK(dns.Get("missing.example.com", ip) == missing);
+	CHECK(resolver.queries == 2);
+
+	resolver.answering = false;
+	uint64_t start = VirtualW5500::get_time();
+	CHECK(dns.Get("silent.example.com", ip) == TIMED_OUT);
+	uint64_t took = (VirtualW5500::get_time() - start) / 1000000;
+	CHECK(took >= DNS_TIMEOUT && took < DNS_TIMEOUT + 100);
+	CHECK(dns.GetStatistics()->timeouts == 1);
+	CHECK(dns.Get("silent.example.com", ip) == TIMED_OUT);
+	CHECK(resolver.queries == 3);
+}
+
+
+/**
+ * An answer is kept for its TTL and no longer.
+ */
+static void test_ttl(void)
+{
+	Resolver resolver;
+	resolver.records["short.example.com"] = { { 10, 0, 0, 3 }, 5 };
+	Socket socket(&w5500);
+	Udp udp(&socket);
+	DnsClient dns(&udp, IPv4Address(ResolverIp));
+	IPv4Address ip;
+
+	CHECK(dns.Get("short.example.com", ip) == SUCCESS);
+	osDelay(4900);
+	CHECK(dns.Get("short.example.com", ip) == SUCCESS);
+	CHECK(resolver.queries == 1);
+	osDelay(200);
+	CHECK(dns.Get("short.example.com", ip) == SUCCESS);
+	CHECK(resolver.queries == 2);
+}
+
+
+/**
+ * Resolve() returns at once, and two names asked for together are both answered, one query after the other.
+ */
+static void test_resolve(void)
+{
+	Resolver resolver;
+	resolver.records["a.example.com"] = { { 10, 0, 0, 4 }, 60 };
+	resolver.records["b.example.com"] = { { 10, 0, 0, 5 }, 60 };
+	Socket socket(&w5500);
+	Udp udp(&socket);
+	DnsClient dns(&udp, IPv4Address(ResolverIp));
+
+	IPv4Address a, b;
+	int status_a = DNS_PENDING, status_b = DNS_PENDING;
+	uint32_t ms = 0;
+	uint64_t longest = 0;
+	for (; ms < 100 && (status_a == DNS_PENDING || status_b == DNS_PENDING); ms++)
+	{
+		uint64_t start = VirtualW5500::get_time();
+		if (status_a == DNS_PENDING)
+			status_a = dns.Resolve("a.example.com", a);
+		if (status_b == DNS_PENDING)
+			status_b = dns.Resolve("b.example.com", b);
+		uint64_t took = VirtualW5500::get_time() - start;
+		longest = took > longest ? took : longest;
+		osDelay(1);
+	}
+	printf("  two names resolved together in %u ms, the longest Resolve() %llu us\n", ms,
+			(unsigned long long) (longest / 1000));
+	CHECK(status_a == SUCCESS && a == IPv4Address(10, 0, 0, 4));
+	CHECK(status_b == SUCCESS && b == IPv4Address(10, 0, 0, 5));
+	CHECK(resolver.queries == 2);
+	CHECK(longest < 1000000);
+}
+
+
+/**
+ * With the cache full, a new name replaces the one looked up least recently.
+ */
+static void test_replacement(void)
+{
+	Resolver resolver;
+	char names[DNS_CACHE_SIZE + 1][16];
+	for (uint8_t i=0; i <= DNS_CACHE_SIZE; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "host%u.example", i);
+		resolver.records[names[i]] = { { 10, 0, 1, i }, 3600 };
+	}
+	Socket socket(&w5500);
+	Udp udp(&socket);
+	DnsClient dns(&udp, IPv4Address(ResolverIp));
+	IPv4Address ip;
+
+	for (uint8_t i=0; i < DNS_CACHE_SIZE; i++)
+	{
+		CHECK(dns.Get(names[i], ip) == SUCCESS);
+		osDelay(10);
+	}
+	CHECK(dns.Get(names[0], ip) == SUCCESS);  // Now host1 is the least recently used.
+	CHECK(dns.Get(names[DNS_CACHE_SIZE], ip) == SUCCESS);
+	CHECK(resolver.queries == DNS_CACHE_SIZE + 1);
+
+	CHECK(dns.Get(names[0], ip) == SUCCESS);
+	CHECK(dns.Get(names[2], ip) == SUCCESS);
+	CHECK(resolver.queries == DNS_CACHE_SIZE + 1);
+	CHECK(dns.Get(names[1], ip) == SUCCESS);
+	CHECK(ip == IPv4Address(10, 0, 1, 1));
+	CHECK(resolver.queries == DNS_CACHE_SIZE + 2);
+}
+
+
+int main(void)
+{
+	test_cached();
+	test_negative();
+	test_ttl();
+	test_resolve();
+	test_replacement();
+	return check_result("DnsClientTest");
+}
@@ -0,0 +1,266 @@
+/**
+ * \file       tests/w5500/MqttBroker.h
+ * \class      MqttBroker
+ * \brief      A host that speaks just enough MQTT 5 to test MqttClient and MqttTelemetry against, over VirtualW5500.
+ * \notes      It keeps what it receives for the test to look at, and answers as the test sets it to.
+ */
+
+#ifndef TESTS_W5500_MQTTBROKER_H_
+#define TESTS_W5500_MQTTBROKER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "VirtualW5500.h"
+
+
+class MqttBroker : public VirtualW5500::ITcpPeer
+{
+public:
+	/**
+	 * @brief	A PUBLISH received.
+	 */
+	typedef struct Message
+	{
+		uint8_t flags;  /// The low nibble of the fixed header: DUP, QoS and RETAIN.
+		std::string topic;  /// The topic, after any alias is resolved.
+		uint16_t id;  /// The packet identifier, for QoS 1.
+		uint16_t alias;  /// The topic alias, or 0.
+		std::vector<uint8_t> payload;
+		uint64_t time;  /// When it arrived, in nanoseconds of virtual time.
+	} Message;
+
+
+	MqttBroker(VirtualW5500* chip, uint16_t port=1883)
+	{
+		static const uint8_t ip[4] = { 10, 0, 0, 2 };
+		this->chip = chip;
+		chip->add_tcp_peer(ip, port, this);
+	}
+
+
+	bool accepts(void) override
+	{
+		return accepting;
+	}
+
+
+	void on_connect(uint8_t s) override
+	{
+		connections[s] = Connection();
+	}
+
+
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		Connection& c = connections[s];
+		c.rx.insert(c.rx.end(), data, data + length);
+		for (;;)
+		{
+			uint32_t remaining = 0;
+			uint8_t n = 1;
+			for (; n < 5 && n < c.rx.size(); n++)
+			{
+				remaining |= (c.rx[n] & 0x7f) << (7 * (n - 1));
+				if (!(c.rx[n] & 0x80))
+					break;
+			}
+			if (n >= c.rx.size() || c.rx.size() < 1 + n + remaining)
+				return;
+			std::vector<uint8_t> body(c.rx.begin() + 1 + n, c.rx.begin() + 1 + n + remaining);
+			uint8_t control = c.rx[0];
+			c.rx.erase(c.rx.begin(), c.rx.begin() + 1 + n + remaining);
+			on_packet(s, c, control, body);
+			if (!connections.count(s))
+				return;  // Closed for a protocol error.
+		}
+	}
+
+
+	void on_close(uint8_t s) override
+	{
+		connections.erase(s);
+	}
+
+
+	/**
+	 * Sends a PUBLISH to the client.
+	 * @param id The packet identifier, for QoS 1; 0 for QoS 0.
+	 */
+	void publish(uint8_t s, const char* topic, const char* payload, uint16_t id=0)
+	{
+		uint16_t topic_length = strlen(topic);
+		std::vector<uint8_t> packet = { (uint8_t) (id != 0 ? 0x32 : 0x30), 0, (uint8_t) (topic_length >> 8),
+				(uint8_t) topic_length };
+		packet.insert(packet.end(), topic, topic + topic_length);
+		if (id != 0)
+			packet.insert(packet.end(), { (uint8_t) (id >> 8), (uint8_t) id });
+		packet.push_back(0);  // Properties length
+		packet.insert(packet.end(), payload, payload + strlen(payload));
+		packet[1] = packet.size() - 2;  // Short enough for one byte of remaining length.
+		chip->send_tcp(s, packet.data(), packet.size());
+	}
+
+
+	/**
+	 * Closes a connection from the broker's side.
+	 */
+	void close(uint8_t s)
+	{
+		connections.erase(s);
+		chip->close_tcp(s);
+	}
+
+
+	// How to answer.
+	bool accepting = true;  /// Accept TCP connections.
+	bool answering = true;  /// Answer CONNECT.
+	bool session_present = false;  /// Claim to have kept the session.
+	bool acknowledging = true;  /// Send PUBACK.
+	uint16_t topic_alias_maximum = 0;  /// Sent in CONNACK if not 0.
+	bool granting = true;  /// Grant SUBSCRIBE, rather than refuse it with reason code 0x87.
+
+	// What was received.
+	uint32_t connects = 0;
+	uint32_t clean_starts = 0;
+	uint32_t session_expiry = 0;  /// From the last CONNECT.
+	uint32_t pings = 0;
+	uint32_t errors = 0;  /// Protocol errors, after each of which the connection was closed.
+	std::vector<Message> messages;
+	std::vector<std::string> subscribed;  /// The filters of each SUBSCRIBE, in order.
+	std::vector<std::string> unsubscribed;  /// The filters of each UNSUBSCRIBE, in order.
+	std::vector<uint16_t> acknowledged;  /// The packet identifiers of each PUBACK from the client.
+	uint8_t last_socket = 0;
+
+private:
+	typedef struct Connection
+	{
+		std::vector<uint8_t> rx;
+		std::map<uint16_t, std::string> aliases;
+	} Connection;
+
+
+	void on_packet(uint8_t s, Connection& c, uint8_t control, const std::vector<uint8_t>& body)
+	{
+		last_socket = s;
+		switch (control >> 4)
+		{
+		case 1:  // CONNECT
+			connects++;
+			if (body[7] & 0x02)
+				clean_starts++;
+			for (uint32_t p=11; p + 4 < body.size() && p < 11u + body[10]; )
+			{
+				if (body[p] == 0x11)
+					session_expiry = body[p + 1] << 24 | body[p + 2] << 16 | body[p + 3] << 8 | body[p + 4];
+				p += body[p] == 0x11 || body[p] == 0x27 ? 5 : 3;
+			}
+			if (answering)
+			{
+				std::vector<uint8_t> ack = { 0x20, 0, (uint8_t) (session_present ? 1 : 0), 0, 0 };
+				if (topic_alias_maximum != 0)
+				{
+					ack.insert(ack.end(), { 0x22, (uint8_t) (topic_alias_maximum >> 8), (uint8_t) topic_alias_maximum });
+					ack[4] = 3;
+				}
+				ack[1] = ack.size() - 2;
+				chip->send_tcp(s, ack.data(), ack.size());
+			}
+			break;
+
+		case 3:  // PUBLISH
+		{
+			Message message = {};
+			message.flags = control & 0x0f;
+			message.time = VirtualW5500::get_time();
+			uint16_t topic_length = body[0] << 8 | body[1];
+			message.topic.assign((const char*) body.data() + 2, topic_length);
+			uint32_t p = 2 + topic_length;
+			if (message.flags & 0x06)
+			{
+				message.id = body[p] << 8 | body[p + 1];
+				p += 2;
+			}
+			uint32_t end = p + 1 + body[p];
+			for (p++; p < end; )
+			{
+				if (body[p] == 0x23)
+					message.alias = body[p + 1] << 8 | body[p + 2];
+				p += body[p] == 0x23 ? 3 : 2;
+			}
+			message.payload.assign(body.begin() + end, body.end());
+
+			if (message.alias != 0 && message.topic.empty())
+			{
+				if (!c.aliases.count(message.alias))
+				{
+					errors++;  // An alias that this connection has not set: the broker must close it.
+					close(s);
+					return;
+				}
+				message.topic = c.aliases[message.alias];
+			}
+			else if (message.alias != 0)
+				c.aliases[message.alias] = message.topic;
+			messages.push_back(message);
+
+			if ((message.flags & 0x06) && acknowledging)
+			{
+				uint8_t ack[] = { 0x40, 2, (uint8_t) (message.id >> 8), (uint8_t) message.id };
+				chip->send_tcp(s, ack, sizeof(ack));
+			}
+			break;
+		}
+
+		case 4:  // PUBACK
+			acknowledged.push_back(body[0] << 8 | body[1]);
+			break;
+
+		case 8:  // SUBSCRIBE
+		{
+			subscribed.push_back(filter(body));
+			uint8_t ack[] = { 0x90, 4, body[0], body[1], 0, (uint8_t) (granting ? body.back() : 0x87) };
+			chip->send_tcp(s, ack, sizeof(ack));
+			break;
+		}
+
+		case 10:  // UNSUBSCRIBE
+		{
+			unsubscribed.push_back(filter(body));
+			uint8_t ack[] = { 0xb0, 4, body[0], body[1], 0, 0 };
+			chip->send_tcp(s, ack, sizeof(ack));
+			break;
+		}
+
+		case 12:  // PINGREQ
+		{
+			pings++;
+			uint8_t response[] = { 0xd0, 0 };
+			chip->send_tcp(s, response, sizeof(response));
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+
+	/**
+	 * Gets the one topic filter of a SUBSCRIBE or UNSUBSCRIBE, after its packet identifier and properties.
+	 */
+	static std::string filter(const std::vector<uint8_t>& body)
+	{
+		uint32_t p = 3 + body[2];
+		return std::string((const char*) body.data() + p + 2, body[p] << 8 | body[p + 1]);
+	}
+
+
+	VirtualW5500* chip;
+	std::map<uint8_t, Connection> connections;
+};
+
+
+#endif /* TESTS_W5500_MQTTBROKER_H_ */
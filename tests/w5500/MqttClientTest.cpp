@@ -0,0 +1,368 @@
+/**
+ * \file       tests/w5500/MqttClientTest.cpp
+ * \brief      Runs an MqttClient against an MqttBroker: connecting without blocking, what happens to unacknowledged
+ *             QoS 1 messages when the session is or is not resumed or a PUBACK does not come, and the throughput and
+ *             acknowledgement latency of QoS 0 and of QoS 1 with a window of 1 and of 4, and subscriptions.
+ */
+
+#include "toolbox.h"
+#include "comms/tcpip/MqttClient.h"
+#include "MqttBroker.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const IPv4Address BrokerIp(10, 0, 0, 2);
+
+
+/**
+ * Polls a client for a while, every millisecond.
+ * @returns The longest that one call to poll() took, in nanoseconds.
+ */
+static uint64_t run(MqttClient& client, uint32_t ms, bool until_connected=true)
+{
+	uint64_t longest = 0;
+	for (uint32_t i=0; i < ms && !(until_connected && client.is_connected()); i++)
+	{
+		uint64_t start = VirtualW5500::get_time();
+		client.poll();
+		uint64_t took = VirtualW5500::get_time() - start;
+		longest = took > longest ? took : longest;
+		osDelay(1);
+	}
+	return longest;
+}
+
+
+/**
+ * Neither connect() nor poll() waits for the broker, whether it answers, is slow to, or is not there at all.
+ */
+static void test_connect_does_not_block(void)
+{
+	MqttBroker broker(&chip);
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+
+	chip.latency = 2000000;  // A slow network: 4 ms for each round trip.
+	uint64_t start = VirtualW5500::get_time();
+	CHECK(client.connect());
+	uint64_t took = VirtualW5500::get_time() - start;
+	CHECK(!client.is_connected());
+	uint64_t longest = run(client, 100);
+	printf("  connect() took %llu us, the longest poll() %llu us\n", (unsigned long long) (took / 1000),
+			(unsigned long long) (longest / 1000));
+	CHECK(client.is_connected());
+	CHECK(took < 100000);
+	CHECK(longest < 1000000);
+	chip.latency = 100000;
+
+	// A broker that accepts the connection but never answers CONNECT: poll() gives up after MQTT_ACK_TIMEOUT.
+	client.disconnect();
+	broker.answering = false;
+	CHECK(client.connect());
+	longest = run(client, MQTT_ACK_TIMEOUT + 100);
+	CHECK(!client.is_connected());
+	CHECK(client.get_state() == MqttClient::Idle || client.get_state() == MqttClient::Connecting);
+	CHECK(longest < 1000000);
+	CHECK(broker.connects >= 2);
+
+	// No broker at all: the chip times the connection out.
+	client.disconnect();
+	broker.accepting = false;
+	CHECK(client.connect());
+	longest = run(client, 3000);
+	CHECK(!client.is_connected());
+	CHECK(longest < 1000000);
+	client.disconnect();
+}
+
+
+/**
+ * CONNECT asks the broker to keep the session for MQTT_SESSION_EXPIRY seconds.
+ */
+static void test_session_expiry(void)
+{
+	MqttBroker broker(&chip);
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	client.connect();
+	run(client, 100);
+	CHECK(client.is_connected());
+	CHECK(broker.session_expiry == MQTT_SESSION_EXPIRY);
+	client.disconnect();
+}
+
+
+/**
+ * Unacknowledged QoS 1 messages are sent again with DUP if the broker kept the session, and discarded if it did not.
+ */
+static void test_session_resumed(void)
+{
+	const bool kept[] = { true, false };
+	for (bool present : kept)
+	{
+		MqttBroker broker(&chip);
+		Socket socket(&w5500);
+		MqttClient client(&socket, BrokerIp, "test");
+		client.connect();
+		run(client, 100);
+		CHECK(client.is_connected());
+		CHECK(broker.clean_starts == 1);
+
+		broker.acknowledging = false;
+		uint8_t data[4] = { 1, 2, 3, 4 };
+		for (uint8_t i=0; i < 3; i++)
+			CHECK(client.publish("a/b", data, sizeof(data), 1));
+		osDelay(1);
+		CHECK(broker.messages.size() == 3);
+		CHECK(client.get_inflight() == 3);
+
+		broker.acknowledging = true;
+		broker.session_present = present;
+		broker.close(broker.last_socket);
+		run(client, 100, false);
+		run(client, MQTT_RECONNECT_MAX);
+		CHECK(client.is_connected());
+		CHECK(broker.connects == 2);
+		CHECK(broker.clean_starts == 1);
+		run(client, 10, false);
+
+		MqttClient::Statistics* statistics = client.get_statistics();
+		CHECK(client.get_inflight() == 0);
+		if (present)
+		{
+			CHECK(broker.messages.size() == 6);
+			CHECK(broker.messages.back().flags & 0x08);
+			CHECK(statistics->resent == 3);
+			CHECK(statistics->expired == 0);
+		}
+		else
+		{
+			CHECK(broker.messages.size() == 3);
+			CHECK(statistics->resent == 0);
+			CHECK(statistics->expired == 3);
+		}
+		client.disconnect();
+	}
+}
+
+
+/**
+ * Publishes a stream of messages as fast as the client accepts them over a network with a 1 ms round trip, polling
+ * every 10 us. QoS 0 waits only for the chip; QoS 1 is limited by the window, as each message waits a round trip for
+ * its PUBACK, so a window of 4 moves about four times as much as a window of 1.
+ * @returns The throughput in kB/s.
+ */
+static uint32_t test_throughput(uint8_t qos, uint8_t window)
+{
+	MqttBroker broker(&chip);
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	client.set_window(window);
+	client.connect();
+	run(client, 100);
+	CHECK(client.is_connected());
+
+	chip.latency = 500000;
+	const uint32_t count = 200;
+	uint8_t payload[64];
+	static uint64_t published_at[count];
+	MqttClient::Statistics* statistics = client.get_statistics();
+	uint32_t published = 0, acknowledged = statistics->acknowledged, done = 0;
+	uint64_t latency = 0, worst = 0;
+	uint64_t start = VirtualW5500::get_time();
+	while (done < count && VirtualW5500::get_time() - start < 10000000000ull)
+	{
+		memset(payload, (uint8_t) published, sizeof(payload));
+		if (published < count && client.publish("sensors/1", payload, sizeof(payload), qos))
+			published_at[published++] = VirtualW5500::get_time();
+		client.poll();
+		VirtualW5500::advance(10000);
+		if (qos == 0)
+			done = broker.messages.size();
+		for (; qos == 1 && statistics->acknowledged > acknowledged; acknowledged++, done++)
+		{
+			uint64_t took = VirtualW5500::get_time() - published_at[done];
+			latency += took;
+			worst = took > worst ? took : worst;
+		}
+	}
+	uint64_t elapsed = VirtualW5500::get_time() - start;
+	if (qos == 0)
+		for (uint32_t i=0; i < broker.messages.size() && i < count; i++)
+		{
+			uint64_t took = broker.messages[i].time - published_at[i];
+			latency += took;
+			worst = took > worst ? took : worst;
+		}
+	uint32_t rate = (uint64_t) count * sizeof(payload) * 1000000ull / (elapsed ? elapsed : 1);
+	printf("  QoS %u, window %u: %u messages of %u bytes in %llu ms, %u kB/s; %s mean %llu us, worst %llu us\n",
+			qos, window, count, (uint32_t) sizeof(payload), (unsigned long long) (elapsed / 1000000), rate,
+			qos == 0 ? "delivery" : "PUBACK", (unsigned long long) (latency / count / 1000),
+			(unsigned long long) (worst / 1000));
+
+	CHECK(done == count);
+	CHECK(broker.messages.size() == count);
+	bool in_order = true;
+	for (uint32_t i=0; i < broker.messages.size(); i++)
+	{
+		MqttBroker::Message& message = broker.messages[i];
+		in_order &= message.payload.size() == sizeof(payload) && message.payload[0] == (uint8_t) i;
+		in_order &= !(message.flags & 0x08);  // Nothing sent twice.
+	}
+	CHECK(in_order);
+	CHECK(client.get_inflight() == 0);
+	if (qos == 1)
+	{
+		CHECK(statistics->acknowledged == count);
+		CHECK(latency / count >= 2 * chip.latency);  // At least a round trip.
+	}
+	CHECK(statistics->disconnects == 0);
+	chip.latency = 100000;
+	client.disconnect();
+	return rate;
+}
+
+
+/**
+ * A QoS 1 message whose PUBACK does not come within MQTT_ACK_TIMEOUT drops the connection. The client reconnects,
+ * resumes the session and sends the message again with DUP and the same packet identifier, and the PUBACK for that
+ * releases it.
+ */
+static void test_ack_timeout(void)
+{
+	MqttBroker broker(&chip);
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	client.connect();
+	run(client, 100);
+	CHECK(client.is_connected());
+
+	broker.acknowledging = false;
+	uint8_t data[2] = { 7, 8 };
+	CHECK(client.publish("a/b", data, sizeof(data), 1));
+	CHECK(client.publish("a/c", data, sizeof(data), 1));
+	uint32_t published = HAL_GetTick();
+	uint32_t ms = 0;
+	for (; ms < 2 * MQTT_ACK_TIMEOUT && client.is_connected(); ms++)
+	{
+		client.poll();
+		osDelay(1);
+	}
+	uint32_t dropped = HAL_GetTick() - published;
+	MqttClient::Statistics* statistics = client.get_statistics();
+	CHECK(!client.is_connected());
+	CHECK(dropped >= MQTT_ACK_TIMEOUT && dropped < MQTT_ACK_TIMEOUT + 10);
+	CHECK(statistics->disconnects == 1);
+	CHECK(client.get_inflight() == 2);
+
+	broker.acknowledging = true;
+	broker.session_present = true;
+	run(client, MQTT_RECONNECT_MAX);
+	CHECK(client.is_connected());
+	run(client, 10, false);
+	printf("  PUBACK timeout: dropped after %u ms, reconnected and resent %u\n", dropped, statistics->resent);
+	CHECK(broker.connects == 2);
+	CHECK(broker.messages.size() == 4);
+	if (broker.messages.size() == 4)
+		for (uint32_t i=0; i < 2; i++)
+		{
+			MqttBroker::Message& first = broker.messages[i];
+			MqttBroker::Message& again = broker.messages[i + 2];
+			CHECK(!(first.flags & 0x08) && (again.flags & 0x08));
+			CHECK(again.id == first.id && again.topic == first.topic && again.payload == first.payload);
+		}
+	CHECK(statistics->resent == 2);
+	CHECK(statistics->acknowledged == 2);
+	CHECK(client.get_inflight() == 0);
+	client.disconnect();
+}
+
+
+/**
+ * Keeps the topics and payloads of the messages passed to it.
+ */
+class Recorder : public MqttClient::IHandler
+{
+public:
+	void on_message(const char* topic, uint16_t topic_length, const uint8_t* payload, uint32_t length) override
+	{
+		topics.push_back(std::string(topic, topic_length));
+		payloads.push_back(std::string((const char*) payload, length));
+	}
+
+	std::vector<std::string> topics;
+	std::vector<std::string> payloads;
+};
+
+
+/**
+ * Filters subscribed to before connecting are sent on connecting. A message is passed to the handler of every filter
+ * that matches its topic, and a QoS 1 one is acknowledged; one that matches none is counted. After unsubscribe() the
+ * filter's buffer may be reused and its messages stop, and a subscription the broker refuses is counted.
+ */
+static void test_subscribe(void)
+{
+	MqttBroker broker(&chip);
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	Recorder temperatures, sensors, refused;
+	char filter[16] = "sensors/#";
+	CHECK(client.subscribe("sensors/+/temp", &temperatures, 1));
+	CHECK(client.subscribe(filter, &sensors));
+	CHECK(!client.subscribe("sensors/#/temp", &sensors));
+	client.connect();
+	run(client, 100);
+	CHECK(client.is_connected());
+	run(client, 10, false);
+	CHECK(broker.subscribed.size() == 2 && broker.subscribed[0] == "sensors/+/temp" &&
+			broker.subscribed[1] == "sensors/#");
+
+	broker.publish(broker.last_socket, "sensors/kitchen/temp", "21.5", 7);
+	broker.publish(broker.last_socket, "sensors", "up");
+	broker.publish(broker.last_socket, "doors/front", "open");
+	run(client, 10, false);
+	MqttClient::Statistics* statistics = client.get_statistics();
+	CHECK(temperatures.topics.size() == 1 && temperatures.payloads[0] == "21.5");
+	CHECK(sensors.topics.size() == 2 && sensors.topics[0] == "sensors/kitchen/temp" && sensors.topics[1] == "sensors");
+	CHECK(broker.acknowledged.size() == 1 && broker.acknowledged[0] == 7);
+	CHECK(statistics->received == 3);
+	CHECK(statistics->unmatched == 1);
+
+	CHECK(client.unsubscribe(filter));
+	strcpy(filter, "xxxxxxx/#");
+	CHECK(!client.unsubscribe("sensors/#"));
+	run(client, 10, false);
+	CHECK(broker.unsubscribed.size() == 1 && broker.unsubscribed[0] == "sensors/#");
+	broker.publish(broker.last_socket, "sensors/hall/temp", "19.0");
+	run(client, 10, false);
+	CHECK(temperatures.topics.size() == 2 && sensors.topics.size() == 2);
+
+	broker.granting = false;
+	CHECK(client.subscribe("secret/#", &refused));
+	run(client, 10, false);
+	CHECK(broker.subscribed.size() == 3);
+	CHECK(statistics->refused == 1);
+	printf("  subscribe: %u received, %u unmatched, %u refused\n", statistics->received, statistics->unmatched,
+			statistics->refused);
+	client.disconnect();
+}
+
+
+int main(void)
+{
+	test_connect_does_not_block();
+	test_session_expiry();
+	test_session_resumed();
+	test_ack_timeout();
+	test_subscribe();
+	uint32_t qos0 = test_throughput(0, 1);
+	uint32_t window1 = test_throughput(1, 1);
+	uint32_t window4 = test_throughput(1, 4);
+	CHECK(window4 > 3 * window1);
+	CHECK(qos0 > window4);
+	return check_result("MqttClientTest");
+}
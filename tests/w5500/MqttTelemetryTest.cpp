@@ -0,0 +1,119 @@
+/**
+ * \file       tests/w5500/MqttTelemetryTest.cpp
+ * \brief      Runs an MqttTelemetry against an MqttBroker that grants topic aliases, across reconnections.
+ */
+
+#include "toolbox.h"
+#include "comms/tcpip/MqttTelemetry.h"
+#include "MqttBroker.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const IPv4Address BrokerIp(10, 0, 0, 2);
+
+
+/**
+ * Polls a client, every millisecond, until it is connected.
+ */
+static bool run(MqttClient& client)
+{
+	for (uint32_t i=0; i < MQTT_RECONNECT_MAX + MQTT_ACK_TIMEOUT && !client.is_connected(); i++)
+	{
+		client.poll();
+		osDelay(1);
+	}
+	return client.is_connected();
+}
+
+
+/**
+ * Closes the connection from the broker's side, and lets the client notice.
+ */
+static void lose_connection(MqttBroker& broker, MqttClient& client)
+{
+	broker.close(broker.last_socket);
+	for (uint32_t i=0; i < 10 && client.is_connected(); i++)
+	{
+		client.poll();
+		osDelay(1);
+	}
+}
+
+
+/**
+ * Later messages carry only the alias, and the broker finds their topics.
+ */
+static void test_aliases(void)
+{
+	MqttBroker broker(&chip);
+	broker.topic_alias_maximum = 8;
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	MqttTelemetry telemetry(&client);
+	uint8_t x = telemetry.add_topic("sensors/x");
+	client.connect();
+	CHECK(run(client));
+
+	uint8_t data[2] = { 1, 2 };
+	for (uint8_t i=0; i < 3; i++)
+		CHECK(telemetry.publish(x, data, sizeof(data)));
+	CHECK(telemetry.flush());
+	osDelay(1);
+	CHECK(broker.errors == 0);
+	CHECK(broker.messages.size() == 3);
+	for (MqttBroker::Message& message : broker.messages)
+		CHECK(message.topic == "sensors/x" && message.alias == 1);
+	CHECK(telemetry.get_statistics()->bytes_saved == 2 * strlen("sensors/x"));
+	client.disconnect();
+}
+
+
+/**
+ * A topic named in a batch that is dropped is named again in the next one, not given by alias alone.
+ */
+static void test_dropped_batch(void)
+{
+	MqttBroker broker(&chip);
+	broker.topic_alias_maximum = 8;
+	Socket socket(&w5500);
+	MqttClient client(&socket, BrokerIp, "test");
+	MqttTelemetry telemetry(&client);
+	uint8_t x = telemetry.add_topic("sensors/x");
+	uint8_t z = telemetry.add_topic("sensors/z");
+	client.connect();
+	CHECK(run(client));
+
+	uint8_t data[2] = { 1, 2 };
+	CHECK(telemetry.publish(x, data, sizeof(data)));
+	CHECK(telemetry.flush());
+
+	// A batch that relies on the alias of x, which the reconnection forgets, so it cannot be sent.
+	CHECK(telemetry.publish(x, data, sizeof(data)));
+	lose_connection(broker, client);
+	CHECK(run(client));
+	telemetry.publish(z, data, sizeof(data));
+	telemetry.flush();
+
+	CHECK(telemetry.publish(z, data, sizeof(data)));
+	CHECK(telemetry.publish(x, data, sizeof(data)));
+	CHECK(telemetry.flush());
+	osDelay(1);
+	CHECK(broker.errors == 0);
+	CHECK(client.is_connected());
+	CHECK(broker.messages.size() >= 3);
+	CHECK(broker.messages.back().topic == "sensors/x");
+	CHECK(telemetry.get_statistics()->dropped >= 1);
+	client.disconnect();
+}
+
+
+int main(void)
+{
+	test_aliases();
+	test_dropped_batch();
+	return check_result("MqttTelemetryTest");
+}
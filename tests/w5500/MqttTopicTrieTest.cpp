@@ -0,0 +1,160 @@
+/**
+ * \file       tests/w5500/MqttTopicTrieTest.cpp
+ * \brief      Matches topics against an MqttTopicTrie: the `+` and `#` wildcards, "a/#" matching "a", topics beginning
+ *             with `$`, removing filters, filters whose buffers are reused, and running out of nodes and names.
+ */
+
+#include "toolbox.h"
+#include "comms/tcpip/MqttTopicTrie.h"
+#include "Check.h"
+
+
+/**
+ * Gets the values of the filters that match a topic, as a bit mask.
+ */
+static uint32_t matches(MqttTopicTrie& trie, const char* topic)
+{
+	uint32_t found = 0;
+	uint8_t count = trie.match(topic, strlen(topic), [&](uint8_t value) { found |= 1u << value; });
+	CHECK(count == __builtin_popcount(found));
+	return found;
+}
+
+
+/**
+ * `+` matches exactly one level, which may be empty, and `#` matches the rest, including nothing, so that "a/#"
+ * matches "a". Invalid filters are refused.
+ */
+static void test_wildcards(void)
+{
+	MqttTopicTrie trie;
+	CHECK(trie.insert("a/b/c", 0));
+	CHECK(trie.insert("a/+/c", 1));
+	CHECK(trie.insert("a/#", 2));
+	CHECK(trie.insert("#", 3));
+	CHECK(trie.insert("+/+", 4));
+	CHECK(trie.insert("+", 5));
+
+	CHECK(matches(trie, "a/b/c") == 0x0f);
+	CHECK(matches(trie, "a/x/c") == 0x0e);
+	CHECK(matches(trie, "a//c") == 0x0e);
+	CHECK(matches(trie, "a/b") == 0x1c);
+	CHECK(matches(trie, "a") == 0x2c);
+	CHECK(matches(trie, "a/b/c/d") == 0x0c);
+	CHECK(matches(trie, "b/c") == 0x18);
+	CHECK(matches(trie, "/") == 0x18);
+	CHECK(trie.match("a/b/c", 0, [](uint8_t) {}) == 0);
+	CHECK(matches(trie, "a/b/cd") == 0x0c);  // Only the first 5 characters are the topic.
+	CHECK(trie.match("a/b/cd", 5, [](uint8_t) {}) == 4);
+
+	const char* invalid[] = { "", "a/#/c", "a#", "a/b+", "+a/b", "##" };
+	for (const char* filter : invalid)
+	{
+		CHECK(!MqttTopicTrie::is_valid(filter));
+		CHECK(!trie.insert(filter, 6));
+	}
+	CHECK(MqttTopicTrie::is_valid("/+/"));
+}
+
+
+/**
+ * A topic beginning with `$` is not matched by a filter beginning with a wildcard, only by one naming its first level.
+ */
+static void test_dollar(void)
+{
+	MqttTopicTrie trie;
+	CHECK(trie.insert("#", 0));
+	CHECK(trie.insert("+/broker/load", 1));
+	CHECK(trie.insert("$SYS/#", 2));
+	CHECK(trie.insert("$SYS/+/load", 3));
+
+	CHECK(matches(trie, "$SYS/broker/load") == 0x0c);
+	CHECK(matches(trie, "$SYS") == 0x04);
+	CHECK(matches(trie, "SYS/broker/load") == 0x03);
+	CHECK(matches(trie, "a/$SYS") == 0x01);
+}
+
+
+/**
+ * A removed filter stops matching and reports its value once; its nodes are reused when it is inserted again. The
+ * trie copies the names of the levels, so a filter's buffer may be reused while it is in the trie or after.
+ */
+static void test_remove(void)
+{
+	MqttTopicTrie trie;
+	char filter[16] = "a/b";
+	CHECK(trie.insert(filter, 0));
+	CHECK(trie.insert("a/+", 1));
+	uint8_t used = trie.get_used();
+	CHECK(used == 4);
+	CHECK(trie.get_names_used() == 3);
+
+	strcpy(filter, "zz/q");
+	CHECK(matches(trie, "a/b") == 0x03);
+	CHECK(matches(trie, "zz/q") == 0x00);
+
+	CHECK(trie.remove("a/b") == 0);
+	CHECK(trie.remove("a/b") == MqttTopicTrie::None);
+	CHECK(trie.remove("a/c") == MqttTopicTrie::None);
+	CHECK(trie.remove("a") == MqttTopicTrie::None);
+	CHECK(matches(trie, "a/b") == 0x02);
+
+	strcpy(filter, "a/b");
+	CHECK(trie.insert(filter, 5));
+	CHECK(trie.get_used() == used);
+	CHECK(matches(trie, "a/b") == 0x22);
+	CHECK(trie.insert("a/b", 6));  // A second insert changes the value.
+	CHECK(matches(trie, "a/b") == 0x42);
+
+	trie.clear();
+	CHECK(trie.get_used() == 1 && trie.get_names_used() == 0);
+	CHECK(matches(trie, "a/b") == 0);
+}
+
+
+/**
+ * Once all MQTT_MAX_TOPIC_NODES nodes or MQTT_MAX_TOPIC_NAMES bytes of names are used, insert() fails without
+ * disturbing the filters already in the trie, and filters made of levels it already has can still be inserted.
+ */
+static void test_exhaustion(void)
+{
+	MqttTopicTrie trie;
+	char filter[16];
+	uint8_t inserted = 0;
+	for (; inserted < MQTT_MAX_TOPIC_NODES; inserted++)
+	{
+		snprintf(filter, sizeof(filter), "t%u", inserted);
+		if (!trie.insert(filter, inserted % 32))
+			break;
+	}
+	printf("  %u one-level filters fill %u nodes\n", inserted, trie.get_used());
+	CHECK(inserted == MQTT_MAX_TOPIC_NODES - 1);
+	CHECK(trie.get_used() == MQTT_MAX_TOPIC_NODES);
+	CHECK(!trie.insert("t0/more", 0));
+	CHECK(!trie.insert("+", 0));
+	CHECK(trie.insert("t3", 7));
+	CHECK(matches(trie, "t3") == 1u << 7);
+	CHECK(matches(trie, "t30") == 1u << 30);
+
+	// A long name runs out of bytes for names before it runs out of nodes.
+	trie.clear();
+	char name[MQTT_MAX_TOPIC_NAMES / 2 + 2];
+	memset(name, 'n', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	CHECK(trie.insert(name, 0));
+	name[0] = 'm';
+	CHECK(!trie.insert(name, 1));
+	CHECK(trie.get_used() == 2);
+	name[0] = 'n';
+	CHECK(matches(trie, name) == 0x01);
+}
+
+
+int main(void)
+{
+	test_wildcards();
+	test_dollar();
+	test_remove();
+	test_exhaustion();
+	return check_result("MqttTopicTrieTest");
+}
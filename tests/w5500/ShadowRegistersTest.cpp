@@ -0,0 +1,197 @@
+/**
+ * \file       tests/w5500/ShadowRegistersTest.cpp
+ * \brief      Counts the SPI frames that send(), recv() and status() spend with the socket registers that Ethernet
+ *             shadows, and checks that a shadowed status still follows the connection.
+ */
+
+#include "toolbox.h"
+#include "comms/ethernet/w5500/TcpClient.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+static SocketEvents events(&w5500);
+
+void HAL_GPIO_EXTI_Callback(uint16_t pin)
+{
+	(void) pin;
+	events.on_interrupt();
+}
+
+static const uint8_t PeerIp[4] = { 10, 0, 0, 2 };
+
+
+static uint8_t pattern(uint32_t i)
+{
+	return (uint8_t) (i * 11 + (i >> 8));
+}
+
+
+/**
+ * Checks what it receives against the pattern.
+ */
+class Peer : public VirtualW5500::ITcpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		for (uint16_t i=0; i < length; i++)
+			if (data[i] != pattern(received + i))
+				errors++;
+		received += length;
+	}
+
+
+	uint32_t received = 0;
+	uint32_t errors = 0;
+};
+
+
+static void connect(Peer& peer, TcpClient& client, uint16_t port)
+{
+	chip.add_tcp_peer(PeerIp, port, &peer);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, port));
+}
+
+
+/**
+ * Sending 1460-byte segments into a 16 KB buffer reads Sn_TX_WR once, and Sn_TX_FSR only when the space last seen runs
+ * out.
+ */
+static void test_send(void)
+{
+	const uint8_t tx[8] = { 16, 0, 0, 0, 0, 0, 0, 0 };
+	const uint8_t rx[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	CHECK(w5500.set_buffer_sizes(tx, rx));
+	Peer peer;
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	connect(peer, client, 4000);
+
+	const uint32_t segments = 500;
+	uint8_t buffer[1460];
+	uint32_t frames = chip.frames;
+	for (uint32_t i=0; i < segments; i++)
+	{
+		for (uint16_t j=0; j < sizeof(buffer); j++)
+			buffer[j] = pattern(i * sizeof(buffer) + j);
+		CHECK(socket.send(buffer, sizeof(buffer)) == sizeof(buffer));
+	}
+	frames = chip.frames - frames;
+	osDelay(10);
+	printf("  send 1460 B into 16 KB: %u.%02u SPI frames per call\n", frames / segments,
+			frames * 100 / segments % 100);
+	CHECK(peer.received == segments * sizeof(buffer));
+	CHECK(peer.errors == 0);
+	CHECK(frames < segments * 13 / 2);
+	socket.close();
+
+	const uint8_t even[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	CHECK(w5500.set_buffer_sizes(even, even));
+}
+
+
+/**
+ * Reading 64 bytes at a time from 4 KB arrivals reads Sn_RX_RSR once for each arrival, not for each read.
+ */
+static void test_recv(void)
+{
+	const uint8_t tx[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	const uint8_t rx[8] = { 4, 2, 2, 2, 2, 2, 2, 0 };
+	CHECK(w5500.set_buffer_sizes(tx, rx));
+	Peer peer;
+	Socket socket(&w5500);
+	socket.set_buffer_needs(2048, 4096);
+	TcpClient client(&socket);
+	connect(peer, client, 4001);
+	SOCKET s = socket.get_socket();
+
+	uint32_t reads = 0, received = 0, errors = 0, frames = 0;
+	uint8_t arrival[4096];
+	for (uint8_t k=0; k < 16; k++)
+	{
+		for (uint16_t i=0; i < sizeof(arrival); i++)
+			arrival[i] = pattern(received + i);
+		chip.send_tcp(s, arrival, sizeof(arrival));
+		osDelay(1);
+
+		uint32_t start = chip.frames;
+		for (uint16_t n=0; n < sizeof(arrival); n += 64)
+		{
+			uint8_t buffer[64];
+			int16_t got = socket.recv(buffer, sizeof(buffer));
+			reads++;
+			for (int16_t i=0; i < got; i++)
+				if (buffer[i] != pattern(received + i))
+					errors++;
+			received += got > 0 ? got : 0;
+		}
+		frames += chip.frames - start;
+	}
+	printf("  recv 64 B from 4 KB arrivals: %u.%02u SPI frames per call\n", frames / reads, frames * 100 / reads % 100);
+	CHECK(received == 16 * sizeof(arrival));
+	CHECK(errors == 0);
+	CHECK(frames < reads * 9 / 2);
+	socket.close();
+
+	const uint8_t even[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	CHECK(w5500.set_buffer_sizes(even, even));
+}
+
+
+/**
+ * With SocketEvents, status() costs no SPI until an event or a command changes the state, and then reads the new one.
+ * Without, it reads Sn_SR every time.
+ */
+static void test_status(void)
+{
+	for (bool use_events : { false, true })
+	{
+		Peer peer;
+		Socket socket(&w5500);
+		if (use_events)
+			socket.set_events(&events);
+		TcpClient client(&socket);
+		connect(peer, client, use_events ? 4003 : 4002);
+
+		uint32_t frames = chip.frames;
+		for (uint32_t i=0; i < 1000; i++)
+			CHECK(socket.status() == SnSR::ESTABLISHED);
+		frames = chip.frames - frames;
+		printf("  status() %s: %u.%02u SPI frames per call\n", use_events ? "with events" : "polling", frames / 1000,
+				frames / 10 % 100);
+		if (use_events)
+			CHECK(frames < 20);
+		else
+			CHECK(frames >= 1000);
+
+		// The peer closes: the DISCON event makes the next status() read the chip.
+		chip.close_tcp(socket.get_socket());
+		osDelay(1);
+		CHECK(socket.status() == SnSR::CLOSE_WAIT);
+
+		// And so does a command.
+		socket.disconnect();
+		osDelay(1);
+		CHECK(socket.status() == SnSR::CLOSED);
+		socket.close();
+		if (use_events)
+			events.disable(socket.get_socket());
+	}
+}
+
+
+int main(void)
+{
+	// An instant network, so that only the driver's own frames are counted, not its polling while the wire is busy.
+	chip.latency = 0;
+	chip.wire_rate = 1000000000000ull;
+	test_send();
+	test_recv();
+	test_status();
+	return check_result("ShadowRegistersTest");
+}
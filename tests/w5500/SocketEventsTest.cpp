@@ -0,0 +1,170 @@
+/**
+ * \file       tests/w5500/SocketEventsTest.cpp
+ * \brief      Checks that SocketEvents delivers each socket's events from INTn, and what it saves over polling Sn_IR.
+ */
+
+#include "toolbox.h"
+#include "comms/ethernet/w5500/TcpClient.h"
+#include "comms/ethernet/w5500/Udp.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+static SocketEvents events(&w5500);
+
+void HAL_GPIO_EXTI_Callback(uint16_t pin)
+{
+	(void) pin;
+	events.on_interrupt();
+}
+
+static const uint8_t PeerIp[4] = { 10, 0, 0, 2 };
+
+
+/**
+ * Counts what it receives.
+ */
+class Sink : public VirtualW5500::ITcpPeer, public VirtualW5500::IUdpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		(void) data;
+		received += length;
+	}
+
+
+	void on_datagram(const VirtualW5500::Endpoint& from, const uint8_t* data, uint16_t length) override
+	{
+		(void) from;
+		(void) data;
+		received += length;
+		datagrams++;
+	}
+
+
+	uint32_t received = 0;
+	uint32_t datagrams = 0;
+};
+
+
+/**
+ * Sends 1 MB over TCP with a slow SEND_OK, waiting for it by polling Sn_IR or through SocketEvents.
+ * @returns The SPI frames spent.
+ */
+static uint32_t send_megabyte(bool use_events, uint16_t port, uint64_t* elapsed)
+{
+	Sink sink;
+	chip.add_tcp_peer(PeerIp, port, &sink);
+	Socket socket(&w5500);
+	if (use_events)
+		socket.set_events(&events);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, port));
+
+	static uint8_t buffer[1460];
+	uint32_t frames = chip.frames;
+	uint64_t start = VirtualW5500::get_time();
+	for (uint32_t sent=0; sent < (1 << 20); sent += sizeof(buffer))
+		socket.send(buffer, (1 << 20) - sent < sizeof(buffer) ? (1 << 20) - sent : sizeof(buffer));
+	frames = chip.frames - frames;
+	*elapsed = VirtualW5500::get_time() - start;
+	osDelay(10);
+	CHECK(sink.received == (1 << 20));
+	socket.close();
+	if (use_events)
+		events.disable(socket.get_socket());
+	return frames;
+}
+
+
+/**
+ * Waiting for SEND_OK through INTn costs no SPI while the chip is busy, and takes no longer.
+ */
+static void test_send_ok_latency(void)
+{
+	chip.send_ok_time = 1000000;
+	uint64_t polled_time, events_time;
+	uint32_t polled = send_megabyte(false, 2000, &polled_time);
+	uint32_t interrupted = send_megabyte(true, 2001, &events_time);
+	chip.send_ok_time = 0;
+	printf("  1 MB with a 1 ms SEND_OK: %u SPI frames in %llu ms polling, %u in %llu ms with events\n", polled,
+			(unsigned long long) (polled_time / 1000000), interrupted, (unsigned long long) (events_time / 1000000));
+	CHECK(interrupted * 10 < polled);
+	CHECK(events_time <= polled_time + polled_time / 100);
+}
+
+
+/**
+ * Events go to the socket they belong to, and only sockets that SIR flags are read.
+ */
+static void test_dispatch(void)
+{
+	Sink sink;
+	chip.add_udp_peer(PeerIp, 3000, &sink);
+	Socket a(&w5500), b(&w5500);
+	a.set_events(&events);
+	b.set_events(&events);
+	Udp udp_a(&a), udp_b(&b);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(udp_a.begin(ip, 3001));
+	CHECK(udp_b.begin(ip, 3002));
+	SOCKET sa = a.get_socket(), sb = b.get_socket();
+	CHECK(sa != sb);
+
+	VirtualW5500::Endpoint from = { { 10, 0, 0, 2 }, 3000 };
+	uint8_t data[4] = { 1, 2, 3, 4 };
+	uint32_t interrupts = events.get_interrupts();
+	SocketEvents::Counters before_a = *events.get_counters(sa), before_b = *events.get_counters(sb);
+	chip.send_datagram(from, 3002, data, sizeof(data));
+	osDelay(1);
+	CHECK(events.get_interrupts() == interrupts + 1);
+	CHECK(a.wait(SnIR::RECV, 0) == 0);
+	CHECK(b.wait(SnIR::RECV, 0) == SnIR::RECV);
+	CHECK(events.get_counters(sa)->reads == before_a.reads);
+	CHECK(events.get_counters(sb)->reads == before_b.reads + 1);
+	CHECK(events.get_counters(sb)->received == before_b.received + 1);
+
+	// A datagram that arrives while dispatch() is clearing another gives no new edge, since INTn is still low, but is
+	// not lost. Try it at each point of the dispatch.
+	uint32_t lost = 0;
+	for (uint64_t at=0; at < 40000; at += 500)
+	{
+		chip.send_datagram(from, 3001, data, sizeof(data));
+		osDelay(1);
+		chip.send_datagram(from, 3002, data, sizeof(data));
+		VirtualW5500::advance(chip.latency - at);
+		CHECK(a.wait(SnIR::RECV, 10) == SnIR::RECV);
+		if (b.wait(SnIR::RECV, 10) != SnIR::RECV)
+			lost++;
+		uint8_t buffer[16];
+		while (udp_a.parsePacket() > 0)
+			udp_a.read(buffer, sizeof(buffer));
+		while (udp_b.parsePacket() > 0)
+			udp_b.read(buffer, sizeof(buffer));
+		CHECK(!chip.is_interrupting());
+	}
+	CHECK(lost == 0);
+
+	// Nothing is read over SPI while nothing happens.
+	uint32_t frames = chip.frames;
+	CHECK(a.wait(SnIR::RECV, 100) == 0);
+	CHECK(chip.frames == frames);
+
+	udp_a.stop();
+	udp_b.stop();
+	events.disable(sa);
+	events.disable(sb);
+}
+
+
+int main(void)
+{
+	test_send_ok_latency();
+	test_dispatch();
+	return check_result("SocketEventsTest");
+}
@@ -0,0 +1,110 @@
+/**
+ * \file       tests/w5500/SocketPollTest.cpp
+ * \brief      Checks what SocketPoll reports without a SocketEvents, and what each sweep costs in SPI frames.
+ */
+
+#include "toolbox.h"
+#include "comms/ethernet/w5500/TcpClient.h"
+#include "comms/ethernet/w5500/SocketPoll.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static const uint8_t PeerIp[4] = { 10, 0, 0, 2 };
+
+
+/**
+ * Counts what it receives.
+ */
+class Sink : public VirtualW5500::ITcpPeer
+{
+public:
+	void on_data(uint8_t s, const uint8_t* data, uint16_t length) override
+	{
+		(void) s;
+		(void) data;
+		received += length;
+	}
+
+
+	uint32_t received = 0;
+};
+
+
+/**
+ * Once a send has completed, sweeps waiting for data cost one read of SIR each, and the next send does not wait for a
+ * SEND_OK that the sweep has already cleared.
+ */
+static void test_send_ok_cleared(void)
+{
+	Sink sink;
+	chip.add_tcp_peer(PeerIp, 2000, &sink);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 2000));
+
+	uint8_t data[100] = {0};
+	CHECK(socket.send(data, sizeof(data)) == sizeof(data));
+	CHECK(socket.is_sending());
+	osDelay(1);
+
+	SocketPoll poller(&w5500);
+	PollEntry entry = { &socket, SnIR::RECV, 0 };
+	CHECK(poller.poll(&entry, 1, 0) == 0);
+	CHECK(!socket.is_sending());
+
+	uint32_t frames = chip.frames, sweeps = poller.get_sweeps();
+	CHECK(poller.poll(&entry, 1, 10) == 0);
+	frames = chip.frames - frames;
+	sweeps = poller.get_sweeps() - sweeps;
+	printf("  idle: %u SPI frames in %u sweeps\n", frames, sweeps);
+	CHECK(sweeps > 0);
+	CHECK(frames <= sweeps + 1);
+
+	CHECK(socket.send(data, sizeof(data)) == sizeof(data));
+	osDelay(1);
+	CHECK(sink.received == 2 * sizeof(data));
+	socket.close();
+}
+
+
+/**
+ * SEND_OK is ready while a send is outstanding only once it has completed; RECV is ready once data arrives.
+ */
+static void test_ready(void)
+{
+	Sink sink;
+	chip.add_tcp_peer(PeerIp, 2001, &sink);
+	Socket socket(&w5500);
+	TcpClient client(&socket);
+	IPv4Address ip(PeerIp[0], PeerIp[1], PeerIp[2], PeerIp[3]);
+	CHECK(client.connect(ip, 2001));
+
+	SocketPoll poller(&w5500);
+	PollEntry entry = { &socket, SnIR::SEND_OK | SnIR::RECV, 0 };
+	chip.send_ok_time = 1000000;
+	uint8_t data[100] = {0};
+	CHECK(socket.send(data, sizeof(data)) == sizeof(data));
+	CHECK(poller.poll(&entry, 1, 0) == 0);
+	CHECK(poller.poll(&entry, 1, 10) == 1);
+	CHECK(entry.ready == SnIR::SEND_OK);
+	chip.send_ok_time = 0;
+
+	chip.send_tcp(socket.get_socket(), data, sizeof(data));
+	osDelay(1);
+	CHECK(poller.poll(&entry, 1, 0) == 1);
+	CHECK(entry.ready == (SnIR::SEND_OK | SnIR::RECV));
+	socket.close();
+}
+
+
+int main(void)
+{
+	test_send_ok_cleared();
+	test_ready();
+	return check_result("SocketPollTest");
+}
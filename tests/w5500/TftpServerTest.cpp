@@ -0,0 +1,485 @@
+/**
+ * \file       tests/w5500/TftpServerTest.cpp
+ * \brief      Reads a file from a TftpServer with windowsize over a network that duplicates and loses datagrams, and
+ *             writes files to it with blksize 1024 and windowsize, with and without loss.
+ */
+
+#include "toolbox.h"
+
+struct Constants
+{
+	static constexpr uint32_t TftpTimeout = 10000;
+};
+
+#include "comms/tcpip/TftpServer.h"
+#include "Check.h"
+
+static VirtualW5500 chip;
+static SPI_HandleTypeDef hspi;
+static GPIO_TypeDef cs;
+Ethernet w5500(hspi, &cs, 0);
+
+static constexpr uint32_t FileSize = 200 * 512 + 100;
+static constexpr uint16_t Window = 4;
+
+
+static uint8_t pattern(uint32_t i)
+{
+	return (uint8_t) (i * 13 + (i >> 9));
+}
+
+
+static uint16_t read_file(char* filename, uint16_t block_id, uint8_t* data, uint16_t length)
+{
+	(void) filename;
+	uint32_t offset = (block_id - 1) * 512u;
+	uint16_t n = offset >= FileSize ? 0 : FileSize - offset < length ? FileSize - offset : length;
+	for (uint16_t i=0; i < n; i++)
+		data[i] = pattern(offset + i);
+	return n;
+}
+
+
+/**
+ * Reads one file with windowsize, acknowledging each window, and once the last block in order when one is missing or
+ * a window comes again.
+ * The network in front of it loses some DATA and ACKs, and delivers some ACKs twice, the copy a little later.
+ */
+class Client : public VirtualW5500::IUdpPeer
+{
+public:
+	Client(uint32_t loss, uint32_t duplicates) : loss(loss), duplicates(duplicates)
+	{
+		chip.add_udp_peer(self.ip, self.port, this);
+	}
+
+
+	void request(void)
+	{
+		static const char rrq[] = "\0\1file\0octet\0windowsize\0004";
+		chip.send_datagram(self, TftpServer::tftp_port, (const uint8_t*) rrq, sizeof(rrq));
+	}
+
+
+	void on_datagram(const VirtualW5500::Endpoint& from, const uint8_t* data, uint16_t length) override
+	{
+		(void) from;
+		uint16_t opcode = data[0] << 8 | data[1];
+		if (opcode == TftpServer::OpcodeOptionAcknowledge)
+		{
+			ack(0);
+			return;
+		}
+		if (opcode != TftpServer::OpcodeData)
+			return;
+		packets++;
+		if (chance(loss))
+			return;
+
+		uint16_t block = data[2] << 8 | data[3];
+		if (block < expected)
+		{
+			// A window sent again because our acknowledgement was lost: say once where we are.
+			if (!nacked)
+				ack(expected - 1);
+			nacked = true;
+			return;
+		}
+		if (done)
+			return;
+		if (block > expected)
+		{
+			// The server starts the next window from the block asked for.
+			if (!nacked)
+				ack(expected - 1);
+			nacked = true;
+			in_window = 0;
+			return;
+		}
+
+		for (uint16_t i=4; i < length; i++)
+			if (data[i] != pattern(received + i - 4))
+				errors++;
+		received += length - 4;
+		expected++;
+		nacked = false;
+		done = length - 4 < 512;
+		if (done || ++in_window == Window)
+		{
+			ack(block);
+			in_window = 0;
+		}
+	}
+
+
+	VirtualW5500::Endpoint self = { { 10, 0, 0, 2 }, 3000 };
+	uint32_t loss;  /// Datagrams lost in each thousand.
+	uint32_t duplicates;  /// ACKs duplicated in each thousand.
+	uint32_t packets = 0;  /// DATA packets sent by the server.
+	uint32_t received = 0;
+	uint32_t errors = 0;
+	uint16_t expected = 1;
+	uint16_t in_window = 0;
+	bool nacked = false;
+	bool done = false;
+
+private:
+	void ack(uint16_t block)
+	{
+		uint8_t packet[4] = { 0, TftpServer::OpcodeAcknowledge, (uint8_t) (block >> 8), (uint8_t) block };
+		if (chance(loss))
+			return;
+		chip.send_datagram(self, TftpServer::tftp_port, packet, sizeof(packet));
+		if (chance(duplicates))
+		{
+			VirtualW5500::Endpoint from = self;
+			std::vector<uint8_t> copy(packet, packet + 4);
+			chip.schedule(300000, [from, copy]() { chip.send_datagram(from, TftpServer::tftp_port, copy.data(), 4); });
+		}
+	}
+
+
+	bool chance(uint32_t per_thousand)
+	{
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) % 1000 < per_thousand;
+	}
+
+
+	uint32_t seed = 1;
+};
+
+
+static void transfer(Client& client, uint32_t* ms)
+{
+	Socket socket(&w5500);
+	TftpServer server(&socket);
+	server.set_read_callback(read_file);
+	CHECK(server.begin());
+	client.request();
+	for (*ms=0; *ms < 600000 && !client.done; (*ms)++)
+	{
+		server.poll();
+		osDelay(1);
+	}
+	for (uint32_t i=0; i < 2 * TFTP_RETRANSMIT_INTERVAL; i++)
+	{
+		server.poll();
+		osDelay(1);
+	}
+	socket.close();
+}
+
+
+/**
+ * A duplicated ACK sends nothing: each block goes out once.
+ */
+static void test_duplicate_acks(void)
+{
+	Client client(0, 500);
+	uint32_t ms;
+	transfer(client, &ms);
+	uint32_t blocks = FileSize / 512 + 1;
+	printf("  %u blocks with half the ACKs duplicated: %u DATA packets in %u ms\n", blocks, client.packets, ms);
+	CHECK(client.done);
+	CHECK(client.received == FileSize);
+	CHECK(client.errors == 0);
+	CHECK(client.packets == blocks);
+}
+
+
+/**
+ * With loss as well, the file still arrives, and what is sent again is only what was lost and the rest of its window.
+ */
+static void test_lossy(void)
+{
+	Client client(50, 300);
+	uint32_t ms;
+	transfer(client, &ms);
+	uint32_t blocks = FileSize / 512 + 1;
+	printf("  %u blocks with 5%% loss and 30%% of ACKs duplicated: %u DATA packets in %u ms\n", blocks, client.packets,
+			ms);
+	CHECK(client.done);
+	CHECK(client.received == FileSize);
+	CHECK(client.errors == 0);
+	CHECK(client.packets < blocks * 2);
+}
+
+
+/**
+ * What the data callback was given for a write: each piece in the order passed, and whether its data was as sent.
+ */
+static std::vector<uint16_t> piece_ids;
+static std::vector<uint16_t> piece_sizes;
+static uint32_t piece_errors;
+
+
+static void write_file(char* filename, uint16_t block_id, uint8_t* data, uint16_t length)
+{
+	(void) filename;
+	if (block_id == 0)
+	{
+		piece_ids.clear();
+		piece_sizes.clear();
+		piece_errors = 0;
+		return;
+	}
+	piece_ids.push_back(block_id);
+	piece_sizes.push_back(length);
+	uint32_t offset = (block_id - 1) * 512u;
+	for (uint16_t i=0; i < length; i++)
+		if (data[i] != pattern(offset + i))
+			piece_errors++;
+}
+
+
+/**
+ * Writes one file with blksize 1024 and windowsize 16, sending each window from the block after the last acknowledged
+ * and sending it again after 3 s without an acknowledgement. The network in front of it loses some datagrams each way,
+ * and the blocks to lose the first time are also set.
+ */
+class Writer : public VirtualW5500::IUdpPeer
+{
+public:
+	Writer(uint32_t size, uint32_t loss) : size(size), loss(loss)
+	{
+		last = size / 1024 + 1;
+		chip.add_udp_peer(self.ip, self.port, this);
+	}
+
+
+	void request(void)
+	{
+		static const char wrq[] = "\0\2file\0octet\0blksize\0001024\0windowsize\00016";
+		if (!chance(loss))
+			chip.send_datagram(self, TftpServer::tftp_port, (const uint8_t*) wrq, sizeof(wrq));
+		sent_at = HAL_GetTick();
+		if (started == 0)
+			started = sent_at;
+	}
+
+
+	/**
+	 * Sends the window again, or the request, if nothing has been acknowledged for a while.
+	 */
+	void tick(void)
+	{
+		if (done || HAL_GetTick() - sent_at < 3000)
+			return;
+		timeouts++;
+		if (window == 0)
+			request();
+		else
+			send_window();
+	}
+
+
+	void on_datagram(const VirtualW5500::Endpoint& from, const uint8_t* data, uint16_t length) override
+	{
+		(void) from;
+		if (chance(loss))
+			return;
+		uint16_t opcode = data[0] << 8 | data[1];
+		if (opcode == TftpServer::OpcodeOptionAcknowledge && window == 0)
+		{
+			for (const char* p = (const char*) data + 2; p < (const char*) data + length; p += strlen(p) + 1)
+			{
+				const char* value = p + strlen(p) + 1;
+				if (strcmp(p, "blksize") == 0)
+					block_size = atoi(value);
+				else if (strcmp(p, "windowsize") == 0)
+					window = atoi(value);
+				p = value;
+			}
+			send_window();
+			return;
+		}
+		if (opcode != TftpServer::OpcodeAcknowledge || window == 0)
+			return;
+
+		uint16_t block = data[2] << 8 | data[3];
+		if (block + 1 < base || block >= base + sent)
+			return;  // Stale.
+		uint16_t end = base + sent - 1;
+		if (block < end && block + 1 != base && early++ == 0)  // The server saw a block out of order: resume there.
+			first_early = HAL_GetTick() - started;
+		base = block + 1;
+		if (base > last)
+			done = true;
+		else
+			send_window();
+	}
+
+
+	VirtualW5500::Endpoint self = { { 10, 0, 0, 2 }, 3001 };
+	uint32_t size;
+	uint32_t loss;  /// Datagrams lost in each thousand.
+	uint16_t last;  /// The last block, shorter than 1024 bytes and perhaps empty.
+	uint16_t block_size = 512;  /// As agreed.
+	uint16_t window = 0;  /// As agreed; 0 until the options are acknowledged.
+	std::vector<uint16_t> lose;  /// Blocks to lose the first time they are sent.
+	uint32_t packets = 0;  /// DATA packets sent.
+	uint32_t early = 0;  /// Acknowledgements that moved the window on by less than it held.
+	uint32_t first_early = 0;  /// Milliseconds from the request to the first of them.
+	uint32_t timeouts = 0;
+	uint32_t dropped = 0;  /// Blocks that arrived when the server's receive buffer was full.
+	bool done = false;
+
+private:
+	void send_window(void)
+	{
+		for (sent = 0; sent < window && base + sent <= last; sent++)
+		{
+			uint16_t block = base + sent;
+			uint32_t offset = (block - 1) * 1024u;
+			uint16_t n = size - offset < 1024 ? size - offset : 1024;
+			uint8_t packet[4 + 1024] = { 0, TftpServer::OpcodeData, (uint8_t) (block >> 8), (uint8_t) block };
+			for (uint16_t i=0; i < n; i++)
+				packet[4 + i] = pattern(offset + i);
+			packets++;
+			bool lost = chance(loss);
+			for (uint32_t i=0; i < lose.size(); i++)
+				if (lose[i] == block)
+				{
+					lost = true;
+					lose.erase(lose.begin() + i);
+					break;
+				}
+			if (!lost)
+				chip.send_datagram(self, TftpServer::tftp_port, packet, 4 + n);
+		}
+		sent_at = HAL_GetTick();
+	}
+
+
+	bool chance(uint32_t per_thousand)
+	{
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) % 1000 < per_thousand;
+	}
+
+
+	uint16_t base = 1;  /// The first block not acknowledged.
+	uint16_t sent = 0;  /// The blocks of the window sent.
+	uint32_t sent_at = 0;
+	uint32_t started = 0;
+	uint32_t seed = 7;
+};
+
+
+/**
+ * Writes a file to a server whose socket has a receive buffer of the given size.
+ * @returns The time the transfer took in milliseconds.
+ */
+static uint32_t write(Writer& writer, uint8_t rx_kb)
+{
+	static const uint8_t Even[8] = { 2, 2, 2, 2, 2, 2, 2, 2 };
+	uint8_t rx[8] = { rx_kb, 1, 1, 1, 1, 1, 1, 1 };
+	rx[7] = 16 - rx_kb - 6;
+	CHECK(w5500.set_buffer_sizes(Even, rx));
+
+	Socket socket(&w5500);
+	socket.set_buffer_needs(1, rx_kb * 1024);
+	TftpServer server(&socket);
+	server.set_data_callback(write_file);
+	CHECK(server.begin());
+	uint32_t dropped = chip.dropped;
+	writer.request();
+	uint32_t ms = 0;
+	for (; ms < 600000 && !writer.done; ms++)
+	{
+		server.poll();
+		writer.tick();
+		osDelay(1);
+	}
+	writer.dropped = chip.dropped - dropped;
+	socket.close();
+	CHECK(w5500.set_buffer_sizes(Even, Even));
+	return ms;
+}
+
+
+/**
+ * Checks that the data callback saw the whole file in order, in 512-byte pieces, ending with one shorter.
+ */
+static void check_pieces(uint32_t size)
+{
+	CHECK(piece_errors == 0);
+	CHECK(piece_ids.size() == size / 512 + 1);
+	uint32_t total = 0;
+	for (uint32_t i=0; i < piece_ids.size(); i++)
+	{
+		CHECK(piece_ids[i] == i + 1);
+		CHECK(piece_sizes[i] == (i + 1 < piece_ids.size() ? 512 : size % 512));
+		total += piece_sizes[i];
+	}
+	CHECK(total == size);
+}
+
+
+/**
+ * The window agreed for a write is limited to the blocks that the socket's receive buffer can hold: with blksize 1024,
+ * 1 in the 2 KB of a socket by default and 7 in 8 KB. Each 1024-byte block reaches the data callback as two pieces, and
+ * a last block of 0 or 512 bytes is followed by an empty piece.
+ */
+static void test_write_window(void)
+{
+	const uint8_t sizes[] = { 2, 8 };
+	const uint16_t windows[] = { 1, 7 };
+	const uint32_t lengths[] = { 40 * 1024 + 100, 40 * 1024 + 512, 40 * 1024 };
+	for (uint8_t i=0; i < 2; i++)
+		for (uint32_t length : lengths)
+		{
+			Writer writer(length, 0);
+			uint32_t ms = write(writer, sizes[i]);
+			CHECK(writer.done);
+			CHECK(writer.block_size == 1024);
+			CHECK(writer.window == windows[i]);
+			CHECK(writer.packets == writer.last);
+			CHECK(writer.dropped == 0);
+			check_pieces(length);
+			printf("  write of %u bytes with %u KB to receive: window %u, %u pieces, the last %u bytes, in %u ms\n",
+					length, sizes[i], writer.window, (uint32_t) piece_ids.size(), piece_sizes.back(), ms);
+		}
+}
+
+
+/**
+ * A block lost from the middle of a write window is answered at once with the last block in order, and the client
+ * starts the next window there. That window can arrive while the rest of the old one is still in the chip, so some of
+ * it may be dropped and the transfer may need the retransmission timer, but the file still arrives whole, as it does
+ * with random loss.
+ */
+static void test_write_lossy(void)
+{
+	Writer scripted(40 * 1024 + 512, 0);
+	scripted.lose = { 3, 10 };
+	uint32_t ms = write(scripted, 8);
+	printf("  blocks 3 and 10 lost once: the first early ACK after %u ms; %u DATA packets, %u early ACKs, %u dropped "
+			"behind them, %u timeouts, in %u ms\n", scripted.first_early, scripted.packets, scripted.early,
+			scripted.dropped, scripted.timeouts, ms);
+	CHECK(scripted.done);
+	CHECK(scripted.early >= 2);
+	CHECK(scripted.first_early < 5);  // Not the server's retransmission timer.
+	CHECK(scripted.timeouts == 0);
+	check_pieces(40 * 1024 + 512);
+
+	Writer writer(40 * 1024 + 512, 50);
+	ms = write(writer, 8);
+	CHECK(writer.done);
+	check_pieces(40 * 1024 + 512);
+	printf("  %u blocks with 5%% loss: %u DATA packets, %u early ACKs, %u dropped, %u timeouts, in %u ms\n",
+			writer.last, writer.packets, writer.early, writer.dropped, writer.timeouts, ms);
+	CHECK(writer.early > 0);
+	CHECK(writer.packets < 3u * writer.last);
+}
+
+
+int main(void)
+{
+	test_duplicate_acks();
+	test_lossy();
+	test_write_window();
+	test_write_lossy();
+	return check_result("TftpServerTest");
+}
@@ -0,0 +1,988 @@
+/**
+ * \file       tests/w5500/VirtualW5500.h
+ * \class      VirtualW5500
+ * \brief      Models a W5500 at the register level, and the network behind it, for host builds of the W5500 driver.
+ * \notes      Include this from the toolbox.h of a host build, in place of the HAL. It provides the subset of the HAL
+ *             that Ethernet uses (SPI, the chip select, HAL_GetTick(), the DWT cycle counter and osDelay()), and
+ *             calls HAL_GPIO_EXTI_Callback() when INTn falls, as the EXTI interrupt would.
+ *
+ *             Time is virtual. It moves on by the cost of each SPI transfer at 20 MHz, by a little on each read of
+ *             the clock, so that busy-waits end, and by the whole delay in osDelay(). The network is a list of peers,
+ *             each an object in the test, and everything crossing it is delayed by the one-way latency.
+ *
+ * <code>
+ * VirtualW5500 chip;  // Holds the chip's 256 KB of buffers, so not on the stack.
+ * SPI_HandleTypeDef hspi;
+ * Ethernet w5500(hspi, nullptr, 0);
+ * chip.add_udp_peer(server_ip, 53, &resolver);
+ * </code>
+ */
+
+#ifndef TESTS_W5500_VIRTUALW5500_H_
+#define TESTS_W5500_VIRTUALW5500_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <vector>
+
+#ifndef VIRTUAL_HCLK_FREQUENCY
+#define VIRTUAL_HCLK_FREQUENCY (168000000)
+#endif
+
+// There are no threads in a simulation. Defining this selects the RTOS path of Timer, whose stubs are below.
+#ifndef USING_FREERTOS
+#define USING_FREERTOS (0)
+#endif
+
+
+/**
+ * A W5500 and the hosts it talks to.
+ *
+ * Commands complete at once, so Sn_CR always reads zero. Sn_IR bits are set only where Sn_IMR allows, SIR shows the
+ * sockets whose Sn_IR is not zero, and INTn is low while SIR has a bit that SIMR enables. Each socket has its own
+ * 16 KB of buffer memory, masked to the size set in Sn_TXBUF_SIZE and Sn_RXBUF_SIZE as the chip masks it.
+ *
+ * A SEND leaves the wire at wire_rate and raises SEND_OK when it has; the peer sees the data one latency later. For
+ * TCP, the space in the transmit buffer is freed one round trip after the data went out, when the acknowledgement
+ * would arrive. Data from a peer that does not fit in the receive buffer waits, as a real sender's would, until a
+ * RECV command makes room. A datagram that does not fit is dropped.
+ */
+class VirtualW5500
+{
+public:
+	/**
+	 * An IP address and port.
+	 */
+	typedef struct Endpoint
+	{
+		uint8_t ip[4];
+		uint16_t port;
+	} Endpoint;
+
+
+	/**
+	 * A host that receives UDP datagrams on one port.
+	 */
+	class IUdpPeer
+	{
+	public:
+		virtual ~IUdpPeer()
+		{
+			if (chip != nullptr)
+				chip->remove_peer(this);
+		}
+
+
+		/**
+		 * Called when a datagram arrives.
+		 * @param from The chip's address and the source port of the socket that sent it.
+		 * @param data The datagram.
+		 * @param length Its length.
+		 */
+		virtual void on_datagram(const Endpoint& from, const uint8_t* data, uint16_t length) = 0;
+	};
+
+
+	/**
+	 * A host that accepts TCP connections on one port. A connection is known by the number of the chip socket.
+	 */
+	class ITcpPeer
+	{
+	public:
+		virtual ~ITcpPeer()
+		{
+			if (chip != nullptr)
+				chip->remove_peer(this);
+		}
+
+
+		/**
+		 * Called to ask whether to accept a connection. A host that does not answers nothing, and the chip times out.
+		 */
+		virtual bool accepts(void)
+		{
+			return true;
+		}
+
+
+		/**
+		 * Called when a connection is established.
+		 */
+		virtual void on_connect(uint8_t s)
+		{
+			(void) s;
+		}
+
+
+		/**
+		 * Called when data arrives on a connection.
+		 */
+		virtual void on_data(uint8_t s, const uint8_t* data, uint16_t length) = 0;
+
+
+		/**
+		 * Called when the chip closes a connection, gracefully or not.
+		 */
+		virtual void on_close(uint8_t s)
+		{
+			(void) s;
+		}
+	};
+
+
+	static constexpr uint8_t Sockets = 8;
+	static constexpr uint32_t BufferMemory = 16384;
+
+
+	VirtualW5500()
+	{
+		chip = this;
+		reset();
+	}
+
+
+	~VirtualW5500()
+	{
+		chip = nullptr;
+	}
+
+
+	/**
+	 * Gets the time.
+	 * @returns The time in nanoseconds.
+	 */
+	static uint64_t get_time(void)
+	{
+		return time;
+	}
+
+
+	/**
+	 * Lets time pass, delivering whatever falls due meanwhile.
+	 * @param nanoseconds The time to pass.
+	 */
+	static void advance(uint64_t nanoseconds)
+	{
+		uint64_t until = time + nanoseconds;
+		if (chip == nullptr)
+		{
+			time = until;
+			return;
+		}
+		while (!chip->busy)
+		{
+			uint32_t next = chip->next_event(until);
+			if (next == NoEvent)
+				break;
+			Event event = chip->events[next];
+			chip->events.erase(chip->events.begin() + next);
+			if (event.at > time)
+				time = event.at;
+			chip->busy = true;
+			event.action();
+			chip->busy = false;
+		}
+		if (until > time)
+			time = until;
+	}
+
+
+	/**
+	 * Gets the DWT cycle count that corresponds to the time.
+	 * @returns The cycle count.
+	 */
+	static uint32_t get_cycles(void)
+	{
+		uint64_t per_us = VIRTUAL_HCLK_FREQUENCY / 1000000;
+		return (uint32_t) (time / 1000 * per_us + time % 1000 * per_us / 1000);
+	}
+
+
+	/**
+	 * Runs an action after a delay.
+	 * @param delay The delay in nanoseconds.
+	 * @param action The action.
+	 */
+	void schedule(uint64_t delay, std::function<void(void)> action)
+	{
+		events.push_back({ time + delay, sequence++, action });
+	}
+
+
+	/**
+	 * Adds a host that receives datagrams sent to an address and port, or broadcast to the port. A peer is removed
+	 * when it is destroyed.
+	 */
+	void add_udp_peer(const uint8_t ip[4], uint16_t port, IUdpPeer* peer)
+	{
+		UdpPeer entry = { { { ip[0], ip[1], ip[2], ip[3] }, port }, peer };
+		udp_peers.push_back(entry);
+	}
+
+
+	/**
+	 * Adds a host that accepts connections to an address and port. A peer is removed when it is destroyed, and its
+	 * connections are dropped.
+	 */
+	void add_tcp_peer(const uint8_t ip[4], uint16_t port, ITcpPeer* peer)
+	{
+		TcpPeer entry = { { { ip[0], ip[1], ip[2], ip[3] }, port }, peer, ++peer_ids };
+		tcp_peers.push_back(entry);
+	}
+
+
+	/**
+	 * Removes a host.
+	 */
+	void remove_peer(const void* peer)
+	{
+		for (uint32_t i=udp_peers.size(); i-- > 0; )
+			if (udp_peers[i].peer == peer)
+				udp_peers.erase(udp_peers.begin() + i);
+		for (uint32_t i=tcp_peers.size(); i-- > 0; )
+			if (tcp_peers[i].peer == peer)
+			{
+				for (SocketModel& m : sockets)
+					if (m.peer == tcp_peers[i].id)
+						m.peer = 0;
+				tcp_peers.erase(tcp_peers.begin() + i);
+			}
+	}
+
+
+	/**
+	 * Sends a datagram from a host to the UDP socket bound to a port.
+	 * @param from The address and port of the host.
+	 * @param port The destination port.
+	 * @param data The datagram.
+	 * @param length Its length.
+	 */
+	void send_datagram(const Endpoint& from, uint16_t port, const uint8_t* data, uint16_t length)
+	{
+		std::vector<uint8_t> datagram(data, data + length);
+		schedule(latency, [this, from, port, datagram]()
+		{
+			for (uint8_t s=0; s < Sockets; s++)
+				if (sockets[s].status == 0x22 && get16(sockets[s].regs + 0x04) == port)
+				{
+					deliver_datagram(s, from, datagram);
+					return;
+				}
+			unreachable++;
+		});
+	}
+
+
+	/**
+	 * Sends data from a peer on a connection.
+	 * @param s The chip socket of the connection.
+	 */
+	void send_tcp(uint8_t s, const uint8_t* data, uint16_t length)
+	{
+		std::vector<uint8_t> bytes(data, data + length);
+		uint32_t generation = sockets[s].generation;
+		schedule(latency, [this, s, generation, bytes]()
+		{
+			SocketModel& m = sockets[s];
+			if (m.generation != generation || (m.status != 0x17 && m.status != 0x18))
+				return;
+			m.held.insert(m.held.end(), bytes.begin(), bytes.end());
+			take_held(s);
+		});
+	}
+
+
+	/**
+	 * Closes a connection from the peer's side, with a FIN that follows any data it sent.
+	 * @param s The chip socket of the connection.
+	 */
+	void close_tcp(uint8_t s)
+	{
+		uint32_t generation = sockets[s].generation;
+		schedule(latency, [this, s, generation]()
+		{
+			SocketModel& m = sockets[s];
+			if (m.generation != generation)
+				return;
+			if (m.status == 0x17)
+				m.status = 0x1C;
+			else if (m.status == 0x18)
+				m.status = 0x00;
+			else
+				return;
+			m.peer = 0;
+			raise(s, 0x02);
+		});
+	}
+
+
+	/**
+	 * Drops a connection without telling the chip, as when the peer's host goes away.
+	 * @param s The chip socket of the connection.
+	 */
+	void drop_tcp(uint8_t s)
+	{
+		sockets[s].peer = 0;
+	}
+
+
+	/**
+	 * Gets the socket status, as Sn_SR reads.
+	 */
+	uint8_t get_status(uint8_t s)
+	{
+		return sockets[s].status;
+	}
+
+
+	/**
+	 * Determines whether INTn is low.
+	 */
+	bool is_interrupting(void)
+	{
+		return get_sir() & common[0x18];
+	}
+
+
+	/**
+	 * Clocks one byte through the SPI interface.
+	 * @param out The byte from the host.
+	 * @returns The byte from the chip.
+	 */
+	uint8_t transfer(uint8_t out)
+	{
+		uint8_t in = 0;
+		if (position == 0)
+			address = out << 8;
+		else if (position == 1)
+			address |= out;
+		else if (position == 2)
+			control = out;
+		else
+		{
+			if (control & 0x04)
+				write(address, out);
+			else
+				in = read(address);
+			address++;
+		}
+		position++;
+		return in;
+	}
+
+
+	/**
+	 * Starts an SPI frame, as the chip select falling does.
+	 */
+	void select(void)
+	{
+		position = 0;
+		frames++;
+	}
+
+
+	/**
+	 * Counts and times a blocking HAL call that moves bytes over SPI.
+	 */
+	void spi_call(uint16_t length)
+	{
+		calls++;
+		bytes += length;
+		advance(spi_call_time + (uint64_t) length * spi_byte_time);
+	}
+
+
+	/**
+	 * Resets the chip, as writing RST to MR does.
+	 */
+	void reset(void)
+	{
+		memset(common, 0, sizeof(common));
+		common[0x39] = 0x04;
+		for (uint8_t s=0; s < Sockets; s++)
+		{
+			SocketModel& m = sockets[s];
+			memset(m.regs, 0, sizeof(m.regs));
+			m.regs[0x1E] = 2;
+			m.regs[0x1F] = 2;
+			m.regs[0x2C] = 0xff;
+			m.status = 0;
+			m.interrupt = 0;
+			clear_pointers(m);
+			m.peer = 0;
+			m.generation++;
+		}
+		interrupt_line = false;
+	}
+
+
+	inline static VirtualW5500* chip = nullptr;
+
+	uint64_t latency = 100000;  /// One-way delay of the network in nanoseconds.
+	uint64_t wire_rate = 12500000;  /// Bytes per second on the wire: 100 Mbit/s.
+	uint64_t send_ok_time = 0;  /// Further delay before SEND_OK, in nanoseconds.
+	uint64_t connect_timeout = 1800000000;  /// Time before an unanswered CONNECT times out: RTR x (RCR + 1).
+	uint64_t spi_call_time = 2500;  /// The cost of one blocking HAL call, in nanoseconds.
+	uint64_t spi_byte_time = 400;  /// The cost of one byte at 20 MHz.
+	uint64_t clock_read_time = 200;  /// The cost of reading the clock, so that busy-waits move time on.
+	uint16_t interrupt_pin = 0;  /// Passed to HAL_GPIO_EXTI_Callback().
+
+	uint32_t frames = 0;  /// Chip selects.
+	uint32_t calls = 0;  /// Blocking SPI HAL calls.
+	uint64_t bytes = 0;  /// Bytes over SPI, including the frame headers.
+	uint32_t dropped = 0;  /// Datagrams that did not fit in a receive buffer.
+	uint32_t unreachable = 0;  /// Datagrams sent to a port with no socket or no peer.
+
+private:
+	static constexpr uint32_t NoEvent = 0xffffffff;
+
+	typedef struct Event
+	{
+		uint64_t at;
+		uint64_t sequence;
+		std::function<void(void)> action;
+	} Event;
+
+	typedef struct UdpPeer
+	{
+		Endpoint endpoint;
+		IUdpPeer* peer;
+	} UdpPeer;
+
+	typedef struct TcpPeer
+	{
+		Endpoint endpoint;
+		ITcpPeer* peer;
+		uint32_t id;  /// Names the peer in scheduled events, which may outlive it.
+	} TcpPeer;
+
+	typedef struct SocketModel
+	{
+		uint8_t regs[0x30];  /// The registers that hold what was written.
+		uint8_t tx[BufferMemory];
+		uint8_t rx[BufferMemory];
+		uint8_t status;  /// Sn_SR.
+		uint8_t interrupt;  /// Sn_IR.
+		uint16_t tx_read;  /// Sn_TX_RD: the end of the data acknowledged.
+		uint16_t tx_sent;  /// The end of the data a SEND command has taken.
+		uint16_t rx_read;  /// Sn_RX_RD as of the last RECV command.
+		uint16_t rx_write;  /// Sn_RX_WR.
+		std::vector<uint8_t> held;  /// Data from the peer that does not fit yet.
+		uint32_t peer;  /// The id of the peer connected, or 0.
+		uint32_t generation;  /// Changes when the socket is opened or closed, so that stale events are dropped.
+	} SocketModel;
+
+
+	static uint16_t get16(const uint8_t* p)
+	{
+		return (uint16_t) (p[0] << 8 | p[1]);
+	}
+
+
+	static void clear_pointers(SocketModel& m)
+	{
+		m.tx_read = m.tx_sent = m.rx_read = m.rx_write = 0;
+		memset(m.regs + 0x20, 0, 0x0c);
+		m.held.clear();
+	}
+
+
+	static uint16_t tx_size(const SocketModel& m)
+	{
+		return m.regs[0x1F] * 1024;
+	}
+
+
+	static uint16_t rx_size(const SocketModel& m)
+	{
+		return m.regs[0x1E] * 1024;
+	}
+
+
+	uint32_t next_event(uint64_t until)
+	{
+		uint32_t next = NoEvent;
+		for (uint32_t i=0; i < events.size(); i++)
+			if (events[i].at <= until && (next == NoEvent || events[i].at < events[next].at
+					|| (events[i].at == events[next].at && events[i].sequence < events[next].sequence)))
+				next = i;
+		return next;
+	}
+
+
+	ITcpPeer* find_peer(uint32_t id)
+	{
+		for (TcpPeer& p : tcp_peers)
+			if (p.id == id)
+				return p.peer;
+		return nullptr;
+	}
+
+
+	uint8_t get_sir(void)
+	{
+		uint8_t sir = 0;
+		for (uint8_t s=0; s < Sockets; s++)
+			if (sockets[s].interrupt)
+				sir |= 1 << s;
+		return sir;
+	}
+
+
+	/**
+	 * Updates INTn, calling the EXTI callback when it falls.
+	 */
+	void update_interrupt(void);
+
+
+	/**
+	 * Sets Sn_IR bits that Sn_IMR allows.
+	 */
+	void raise(uint8_t s, uint8_t bits)
+	{
+		sockets[s].interrupt |= bits & sockets[s].regs[0x2C];
+		update_interrupt();
+	}
+
+
+	uint8_t read(uint16_t addr)
+	{
+		uint8_t block = control >> 3;
+		if (block == 0)
+		{
+			if (addr == 0x17)
+				return get_sir();
+			return addr < sizeof(common) ? common[addr] : 0;
+		}
+
+		SocketModel& m = sockets[(block - 1) / 4];
+		switch ((block - 1) % 4)
+		{
+			case 0:
+				break;
+			case 1:
+				return tx_size(m) ? m.tx[addr & (tx_size(m) - 1)] : 0;
+			case 2:
+				return rx_size(m) ? m.rx[addr & (rx_size(m) - 1)] : 0;
+			default:
+				return 0;
+		}
+
+		uint16_t value;
+		switch (addr)
+		{
+			case 0x01:
+				return 0;
+			case 0x02:
+				return m.interrupt;
+			case 0x03:
+				return m.status;
+			case 0x20:
+			case 0x21:
+				value = tx_size(m) - (uint16_t) (m.tx_sent - m.tx_read);
+				break;
+			case 0x22:
+			case 0x23:
+				value = m.tx_read;
+				break;
+			case 0x26:
+			case 0x27:
+				value = m.rx_write - m.rx_read;
+				break;
+			case 0x2A:
+			case 0x2B:
+				value = m.rx_write;
+				break;
+			default:
+				return addr < sizeof(m.regs) ? m.regs[addr] : 0;
+		}
+		return addr & 1 ? (uint8_t) value : (uint8_t) (value >> 8);
+	}
+
+
+	void write(uint16_t addr, uint8_t value)
+	{
+		uint8_t block = control >> 3;
+		if (block == 0)
+		{
+			if (addr >= sizeof(common) || addr == 0x17)
+				return;
+			common[addr] = value;
+			if (addr == 0x00 && (value & 0x80))
+				reset();
+			if (addr == 0x18)
+				update_interrupt();
+			return;
+		}
+
+		uint8_t s = (block - 1) / 4;
+		SocketModel& m = sockets[s];
+		switch ((block - 1) % 4)
+		{
+			case 0:
+				break;
+			case 1:
+				if (tx_size(m))
+					m.tx[addr & (tx_size(m) - 1)] = value;
+				return;
+			case 2:
+				if (rx_size(m))
+					m.rx[addr & (rx_size(m) - 1)] = value;
+				return;
+			default:
+				return;
+		}
+
+		if (addr == 0x01)
+			command(s, value);
+		else if (addr == 0x02)
+		{
+			m.interrupt &= ~value;
+			update_interrupt();
+		}
+		else if (addr < sizeof(m.regs))
+		{
+			m.regs[addr] = value;
+			if (addr == 0x2C)
+				update_interrupt();
+		}
+	}
+
+
+	/**
+	 * Carries out a write to Sn_CR.
+	 */
+	void command(uint8_t s, uint8_t cmd)
+	{
+		SocketModel& m = sockets[s];
+		switch (cmd)
+		{
+			case 0x01:  // OPEN
+			{
+				static const uint8_t statuses[] = { 0x00, 0x13, 0x22, 0x32, 0x42 };
+				uint8_t mode = m.regs[0x00] & 0x0f;
+				m.generation++;
+				clear_pointers(m);
+				m.peer = 0;
+				m.status = mode < sizeof(statuses) ? statuses[mode] : 0x00;
+				break;
+			}
+
+			case 0x02:  // LISTEN
+				if (m.status == 0x13)
+					m.status = 0x14;
+				break;
+
+			case 0x04:  // CONNECT
+				if (m.status == 0x13)
+					connect(s);
+				break;
+
+			case 0x08:  // DISCON
+				disconnect(s);
+				break;
+
+			case 0x10:  // CLOSE
+				if (m.peer != 0)
+				{
+					uint32_t peer = m.peer;
+					schedule(latency, [this, peer, s]()
+					{
+						if (find_peer(peer) != nullptr)
+							find_peer(peer)->on_close(s);
+					});
+				}
+				m.peer = 0;
+				m.status = 0x00;
+				m.generation++;
+				clear_pointers(m);
+				break;
+
+			case 0x20:  // SEND
+			case 0x21:
+			case 0x22:
+				send(s);
+				break;
+
+			case 0x40:  // RECV
+				m.rx_read = get16(m.regs + 0x28);
+				take_held(s);
+				break;
+		}
+	}
+
+
+	void connect(uint8_t s)
+	{
+		SocketModel& m = sockets[s];
+		Endpoint to = { { m.regs[0x0C], m.regs[0x0D], m.regs[0x0E], m.regs[0x0F] }, get16(m.regs + 0x10) };
+		uint32_t peer = 0;
+		for (TcpPeer& p : tcp_peers)
+			if (p.endpoint.port == to.port && !memcmp(p.endpoint.ip, to.ip, 4) && p.peer->accepts())
+				peer = p.id;
+
+		m.status = 0x15;
+		uint32_t generation = m.generation;
+		if (peer == 0)
+		{
+			schedule(connect_timeout, [this, s, generation]()
+			{
+				if (sockets[s].generation != generation || sockets[s].status != 0x15)
+					return;
+				sockets[s].status = 0x00;
+				raise(s, 0x08);
+			});
+			return;
+		}
+		schedule(2 * latency, [this, s, generation, peer]()
+		{
+			if (sockets[s].generation != generation || sockets[s].status != 0x15 || find_peer(peer) == nullptr)
+				return;
+			sockets[s].status = 0x17;
+			sockets[s].peer = peer;
+			raise(s, 0x01);
+			find_peer(peer)->on_connect(s);
+		});
+	}
+
+
+	void disconnect(uint8_t s)
+	{
+		SocketModel& m = sockets[s];
+		if (m.status != 0x17 && m.status != 0x1C)
+		{
+			m.status = 0x00;
+			m.generation++;
+			return;
+		}
+
+		bool passive = m.status == 0x1C;
+		m.status = passive ? 0x1D : 0x18;
+		uint32_t peer = m.peer;
+		uint32_t generation = m.generation;
+		schedule(latency, [this, peer, s]()
+		{
+			if (find_peer(peer) != nullptr)
+				find_peer(peer)->on_close(s);
+		});
+		// The peer answers with its own FIN; after a passive close the chip only waits for the ACK of its FIN.
+		schedule(2 * latency, [this, s, generation]()
+		{
+			SocketModel& m = sockets[s];
+			if (m.generation != generation || (m.status != 0x18 && m.status != 0x1D))
+				return;
+			m.status = 0x00;
+			m.peer = 0;
+			raise(s, 0x02);
+		});
+	}
+
+
+	void send(uint8_t s)
+	{
+		SocketModel& m = sockets[s];
+		uint16_t end = get16(m.regs + 0x24);
+		uint16_t length = end - m.tx_sent;
+		std::vector<uint8_t> data(length);
+		for (uint16_t i=0; i < length; i++)
+			data[i] = m.tx[(uint16_t) (m.tx_sent + i) & (tx_size(m) - 1)];
+		m.tx_sent = end;
+
+		uint64_t wire = (uint64_t) length * 1000000000ull / wire_rate;
+		uint32_t generation = m.generation;
+		if (m.status == 0x22)
+		{
+			Endpoint from = { { common[0x0F], common[0x10], common[0x11], common[0x12] }, get16(m.regs + 0x04) };
+			Endpoint to = { { m.regs[0x0C], m.regs[0x0D], m.regs[0x0E], m.regs[0x0F] }, get16(m.regs + 0x10) };
+			schedule(wire + send_ok_time, [this, s, generation, end]()
+			{
+				if (sockets[s].generation != generation)
+					return;
+				sockets[s].tx_read = end;
+				raise(s, 0x10);
+			});
+			schedule(wire + latency, [this, from, to, data]()
+			{
+				bool broadcast = to.ip[0] == 255 && to.ip[1] == 255 && to.ip[2] == 255 && to.ip[3] == 255;
+				bool delivered = false;
+				for (UdpPeer& p : udp_peers)
+					if (p.endpoint.port == to.port && (broadcast || !memcmp(p.endpoint.ip, to.ip, 4)))
+					{
+						p.peer->on_datagram(from, data.data(), data.size());
+						delivered = true;
+					}
+				if (!delivered)
+					unreachable++;
+			});
+		}
+		else if (m.status == 0x17 || m.status == 0x1C)
+		{
+			uint32_t peer = m.peer;
+			schedule(wire + send_ok_time, [this, s, generation]()
+			{
+				if (sockets[s].generation == generation)
+					raise(s, 0x10);
+			});
+			schedule(wire + latency, [this, s, generation, peer, data]()
+			{
+				if (sockets[s].generation == generation && peer != 0 && sockets[s].peer == peer)
+					find_peer(peer)->on_data(s, data.data(), data.size());
+			});
+			schedule(wire + 2 * latency, [this, s, generation, end]()
+			{
+				if (sockets[s].generation == generation && sockets[s].peer != 0)
+					sockets[s].tx_read = end;
+			});
+		}
+	}
+
+
+	void deliver_datagram(uint8_t s, const Endpoint& from, const std::vector<uint8_t>& data)
+	{
+		SocketModel& m = sockets[s];
+		uint16_t used = m.rx_write - m.rx_read;
+		if (used + 8 + data.size() > rx_size(m))
+		{
+			dropped++;
+			return;
+		}
+		uint8_t header[8] = { from.ip[0], from.ip[1], from.ip[2], from.ip[3], (uint8_t) (from.port >> 8),
+				(uint8_t) from.port, (uint8_t) (data.size() >> 8), (uint8_t) data.size() };
+		for (uint8_t i=0; i < 8; i++)
+			m.rx[m.rx_write++ & (rx_size(m) - 1)] = header[i];
+		for (uint8_t byte : data)
+			m.rx[m.rx_write++ & (rx_size(m) - 1)] = byte;
+		raise(s, 0x04);
+	}
+
+
+	/**
+	 * Moves data that a peer sent into the receive buffer, as far as it fits.
+	 */
+	void take_held(uint8_t s)
+	{
+		SocketModel& m = sockets[s];
+		uint16_t space = rx_size(m) - (uint16_t) (m.rx_write - m.rx_read);
+		uint32_t n = m.held.size() < space ? m.held.size() : space;
+		if (n == 0)
+			return;
+		for (uint32_t i=0; i < n; i++)
+			m.rx[m.rx_write++ & (rx_size(m) - 1)] = m.held[i];
+		m.held.erase(m.held.begin(), m.held.begin() + n);
+		raise(s, 0x04);
+	}
+
+
+	inline static uint64_t time = 0;
+
+	uint8_t common[0x40];
+	SocketModel sockets[Sockets] = {};
+	std::vector<Event> events;
+	std::vector<UdpPeer> udp_peers;
+	std::vector<TcpPeer> tcp_peers;
+	uint64_t sequence = 0;
+	uint32_t peer_ids = 0;
+	bool busy = false;
+	bool interrupt_line = false;
+	uint16_t position = 0;
+	uint16_t address = 0;
+	uint8_t control = 0;
+};
+
+
+// Core.
+inline uint32_t __get_PRIMASK(void) { return 0; }
+inline void __disable_irq(void) {}
+inline void __set_PRIMASK(uint32_t primask) { (void) primask; }
+
+/**
+ * Reads as the cycle count of the virtual clock. Each read costs a little time, as a busy-wait does.
+ */
+typedef struct VirtualCycleCounter
+{
+	operator uint32_t() const
+	{
+		VirtualW5500::advance(VirtualW5500::chip != nullptr ? VirtualW5500::chip->clock_read_time : 200);
+		return VirtualW5500::get_cycles();
+	}
+	VirtualCycleCounter& operator=(uint32_t value) { (void) value; return *this; }
+} VirtualCycleCounter;
+
+typedef struct { uint32_t CTRL; VirtualCycleCounter CYCCNT; } DWT_Type;
+typedef struct { uint32_t DEMCR; } CoreDebug_Type;
+inline DWT_Type virtual_dwt;
+inline CoreDebug_Type virtual_core_debug;
+#define DWT (&virtual_dwt)
+#define CoreDebug (&virtual_core_debug)
+#define DWT_CTRL_CYCCNTENA_Msk (0x00000001)
+#define CoreDebug_DEMCR_TRCENA_Msk (0x01000000)
+
+inline uint32_t HAL_GetTick(void)
+{
+	VirtualW5500::advance(VirtualW5500::chip != nullptr ? VirtualW5500::chip->clock_read_time : 200);
+	return (uint32_t) (VirtualW5500::get_time() / 1000000);
+}
+
+inline uint32_t HAL_RCC_GetHCLKFreq(void) { return VIRTUAL_HCLK_FREQUENCY; }
+
+
+// RTOS: a delay runs the simulation.
+typedef void* osMutexId_t;
+#define osOK (0)
+#define osWaitForever (0xffffffffu)
+inline osMutexId_t osMutexNew(void) { return nullptr; }
+inline int32_t osAcquireMutex(osMutexId_t mutex, uint32_t timeout) { (void) mutex; (void) timeout; return osOK; }
+inline int32_t osReleaseMutex(osMutexId_t mutex) { (void) mutex; return osOK; }
+inline int32_t osDelay(uint32_t ticks) { VirtualW5500::advance((uint64_t) ticks * 1000000); return osOK; }
+
+
+// SPI and GPIO. Any pin written low selects the chip.
+typedef enum { HAL_OK = 0x00, HAL_ERROR = 0x01, HAL_BUSY = 0x02, HAL_TIMEOUT = 0x03 } HAL_StatusTypeDef;
+typedef enum { GPIO_PIN_RESET = 0, GPIO_PIN_SET } GPIO_PinState;
+typedef struct { uint32_t ODR; } GPIO_TypeDef;
+typedef struct { uint32_t unused; } SPI_HandleTypeDef;
+
+extern void HAL_GPIO_EXTI_Callback(uint16_t pin) __attribute__((weak));
+
+inline void VirtualW5500::update_interrupt(void)
+{
+	bool low = is_interrupting();
+	bool fell = low && !interrupt_line;
+	interrupt_line = low;
+	if (fell && HAL_GPIO_EXTI_Callback != nullptr)
+		HAL_GPIO_EXTI_Callback(interrupt_pin);
+}
+
+inline void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state)
+{
+	(void) port;
+	(void) pin;
+	if (state == GPIO_PIN_RESET)
+		VirtualW5500::chip->select();
+}
+
+inline HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout)
+{
+	(void) hspi;
+	(void) timeout;
+	for (uint16_t i=0; i < size; i++)
+		VirtualW5500::chip->transfer(data[i]);
+	VirtualW5500::chip->spi_call(size);
+	return HAL_OK;
+}
+
+inline HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size, uint32_t timeout)
+{
+	(void) hspi;
+	(void) timeout;
+	for (uint16_t i=0; i < size; i++)
+		data[i] = VirtualW5500::chip->transfer(0);
+	VirtualW5500::chip->spi_call(size);
+	return HAL_OK;
+}
+
+
+#endif /* TESTS_W5500_VIRTUALW5500_H_ */
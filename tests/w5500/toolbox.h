@@ -0,0 +1,47 @@
+///	@file       tests/w5500/toolbox.h
+///	@brief      Configuration for the W5500 host tests, which run the driver and the protocols over VirtualW5500.h.
+
+#ifndef INC_TOOLBOX_H_
+#define INC_TOOLBOX_H_
+
+#include <stdint.h>
+#include "VirtualW5500.h"
+
+#define HIGH (GPIO_PIN_SET)
+#define LOW (GPIO_PIN_RESET)
+
+// Network
+#define NETWORK_DHCP_RETRY_INTERVAL (1000)
+#define DHCP_MAX_RETRY_INTERVAL (64000)
+#define DHCP_REQUEST_RETRIES (4)
+
+// Ethernet, DNS, DHCP, etc. using Wiznet W5500 modile.
+#define ENABLE_W5500 (1)
+#define W5500_USE_DMA (0)
+#define W5500_SPI_TIMEOUT (100)
+#define TFTP_MAX_BLOCK_SIZE (1024)
+#define TFTP_MAX_WINDOW_SIZE (16)
+#define TFTP_RETRANSMIT_INTERVAL (1000)
+#define DNS_CACHE_SIZE (8)
+#define DNS_TIMEOUT (1000)
+#define DNS_NEGATIVE_TTL (10)
+#define DNS_MAX_TTL (3600)
+#define MQTT_MAX_INFLIGHT (8)
+#define MQTT_MAX_PACKET_SIZE (256)
+#define MQTT_MAX_SUBSCRIPTIONS (8)
+#define MQTT_MAX_TOPIC_NODES (32)
+#define MQTT_TELEMETRY_TOPICS (16)
+#define MQTT_TELEMETRY_BUFFER (512)
+#define MQTT_TELEMETRY_INTERVAL (100)
+#define MQTT_ACK_TIMEOUT (5000)
+#define MQTT_RECONNECT_MIN (500)
+#define MQTT_RECONNECT_MAX (30000)
+#define MQTT_SESSION_EXPIRY (32)
+
+// Timer
+#define TIMER_OVERFLOW_INTERVAL (0xffffffff/2)
+
+// Generics
+#define GENERICS_ALLOW_NEW (0)
+
+#endif
@@ -19,6 +19,18 @@
 
 // CAN
 #define CAN_DEFAULT_BITRATE (125000)
+#define CAN_FILTER_BANKS (14)  // Hardware filter banks available to CanBus (14 on single-CAN parts).
+#define CAN_FILTER_MAX_ENTRIES (32)  // The most COB-ID masks that handlers can register before they are packed.
+#define CAN_STATISTICS_WATCH_MAX (4)  // COB-IDs whose inter-arrival times CanStatistics can track.
+#define CAN_STATISTICS_JITTER_BINS (16)  // Histogram bins per watched COB-ID.
+#define CAN_STATISTICS_HISTORY (60)  // Error counter samples kept by CanStatistics.
+#define CAN_TRACE_FILTERS (8)  // COB-ID masks that CanTrace can record; with none, every frame is recorded.
+#define CANOPEN_SDO_MAX_TRANSFERS (4)  // SDO transfers that can be in progress at once, as client or server.
+#define CANOPEN_SDO_TIMEOUT (500)  // Milliseconds without progress before an SDO transfer is aborted.
+#define CANOPEN_SDO_BLOCK_SIZE (127)  // Segments per block in SDO block transfers (1-127).
+#define CANOPEN_PDO_SCHEDULER_MAX_PDOS (8)  // TPDOs that CanOpenPdoScheduler can schedule.
+#define VIRTUAL_CAN_MAX_NODES (16)  // Nodes that can be attached to a VirtualCanBus.
+#define VIRTUAL_HCLK_FREQUENCY (168000000)  // The core clock that VirtualCanHal.h reports, for the DWT cycle counter.
 
 // Fan
 #define FAN_MAX_ERROR (0.17)
@@ -27,6 +39,10 @@
 #define FAN_RPM_PER_DEGREE (800)  // The fan will go this much faster for every degree C difference between internal and external temperatures.
 #define FAN_SPEED_SEEK_DILIGENCE (8)  // How actively the dog should chase its tail (lower is more aggressive).
 
+// Motors
+#define ZLAC8015_QUEUE_LENGTH (32)  // SDO requests that can wait to be sent to each ZLAC8015 drive.
+#define ZLAC8015_SDO_TIMEOUT (20)  // Milliseconds to wait for a ZLAC8015 to answer an SDO request.
+
 // Battery task things.
 #define BATTERY_COMMS_LOST_TIMEOUT (5)  // After this many seconds we declare comms with battery broken.
 
@@ -35,10 +51,24 @@
 #define NETWORK_ENABLE_RANDOMIZE_MAC (0)
 #define NETWORK_DEFAULT_MAC { 0x00, 0x08, 0xdc, 0xff, 0xff, 0xff }
 #define NETWORK_DHCP_RETRY_INTERVAL (1000) // milliseconds
+#define DHCP_MAX_RETRY_INTERVAL (64000)  // Milliseconds between DHCP retransmissions at most.
+#define DHCP_REQUEST_RETRIES (4)  // REQUESTs sent for an offer before DhcpClient starts again with DISCOVER.
 
 // Fault
 #define FAULT_ENABLE_LED_SUPPORT (1)
 
+// Log
+#define LOG_TAIL_SIZE (512)  // Bytes of recent log output kept in RAM for crash dumps (0 to disable).
+
+// Crash dump
+#define CRASHDUMP_REGION_SIZE (0x2000)  // Bytes reserved at the top of external FLASH, a multiple of the sector size.
+#define CRASHDUMP_STACK_WINDOW (1024)  // Bytes of stack captured, starting at the exception frame.
+
+// Memory usage
+#define MEMORYUSAGE_MAX_TASKS (8)  // The most RTOS tasks reported in a snapshot.
+#define MEMORYUSAGE_REPORT_INTERVAL (60000)  // milliseconds
+#define MEMORYUSAGE_STACK_MARGIN (64)  // Raise StackOverflow when fewer than this many bytes of a stack have stayed free.
+
 // NeoPixel
 #define ENABLE_NEOPIXEL_BUILTIN_PATTERNS (1)	// Whether or not to include build-in patterns.
 #define ENABLE_NEOPIXEL_DEMO_PATTERN (1)		// Whether or not to include the demo pattern.
@@ -68,6 +98,28 @@
 
 // Ethernet, DNS, DHCP, etc. using Wiznet W5500 modile.
 #define ENABLE_W5500 (1)
+#define W5500_USE_DMA (0)  // Whether to move socket data to and from the W5500 with DMA.
+#define W5500_DMA_THRESHOLD (64)  // Shorter transfers use blocking SPI calls.
+#define W5500_SPI_TIMEOUT (100)  // Milliseconds allowed for one SPI transfer.
+#define W5500_EVENTS_THREAD_FLAG (0x10)  // Thread flag that SocketEvents sets on a thread waiting for a socket.
+#define TFTP_MAX_BLOCK_SIZE (1024)  // Largest TFTP block that TftpServer agrees to; a multiple of 512, at most 1024.
+#define TFTP_MAX_WINDOW_SIZE (16)  // Most TFTP blocks per acknowledgement that TftpServer agrees to.
+#define TFTP_RETRANSMIT_INTERVAL (1000)  // Milliseconds before TftpServer resends a window or acknowledgement.
+#define DNS_CACHE_SIZE (8)  // Hostnames whose answers DnsClient keeps.
+#define DNS_TIMEOUT (1000)  // Milliseconds that DnsClient waits for an answer.
+#define DNS_NEGATIVE_TTL (10)  // Seconds that DnsClient remembers a failed lookup.
+#define DNS_MAX_TTL (3600)  // Seconds that DnsClient keeps an answer at most.
+#define MQTT_MAX_INFLIGHT (4)  // QoS 1 messages that MqttClient lets await PUBACK at once.
+#define MQTT_MAX_PACKET_SIZE (256)  // Largest MQTT packet kept for resending, and largest received.
+#define MQTT_MAX_SUBSCRIPTIONS (8)  // Topic filters that MqttClient may subscribe to at once.
+#define MQTT_MAX_TOPIC_NODES (32)  // Topic levels, across all filters, that MqttTopicTrie can hold.
+#define MQTT_TELEMETRY_TOPICS (16)  // Topics that MqttTelemetry may publish to.
+#define MQTT_TELEMETRY_BUFFER (512)  // Bytes that MqttTelemetry collects before a write; at most the socket's TX buffer.
+#define MQTT_TELEMETRY_INTERVAL (100)  // Milliseconds that a reading may wait in MqttTelemetry for others to join it.
+#define MQTT_ACK_TIMEOUT (5000)  // Milliseconds to wait for TCP, CONNACK, PUBACK or PINGRESP before reconnecting.
+#define MQTT_RECONNECT_MIN (500)  // Milliseconds before MqttClient first tries to reconnect.
+#define MQTT_RECONNECT_MAX (30000)  // Longest wait between attempts to reconnect.
+#define MQTT_SESSION_EXPIRY (32)  // Seconds that the broker keeps an MqttClient session after the connection is lost.
 
 // Displays
 #define ENABLE_ILI9488_DMA (0)  // Stopped working.
@@ -65,7 +65,7 @@ public:
 	 */
 	static uint32_t lsb_uint32_to_uint32(uint8_t* data)
 	{
-		return data[0] | data[1] << 8 | data[2] << 16 | data[3];
+		return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
 	}
 
 
@@ -76,7 +76,7 @@ public:
 	 */
 	static int32_t lsb_int32_to_int32(uint8_t* data)
 	{
-		return data[0] | data[1] << 8 | data[2] << 16 | data[3];
+		return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
 	}
 
 
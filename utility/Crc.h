@@ -43,6 +43,34 @@ public:
 		return crc;
 	}
 
+	static uint16_t crc16_ccitt(const void* buffer, uint32_t len, uint16_t start=0x0000)
+	{
+		uint8_t* buf = (uint8_t*) buffer;
+		uint16_t crc = start;
+		unsigned int i = 0;
+		char bit = 0;
+
+		for (i = 0; i < len; i++)
+		{
+			crc ^= (uint16_t) buf[i] << 8;
+
+			for (bit = 0; bit < 8; bit++)
+			{
+				if (crc & 0x8000)
+				{
+					crc <<= 1;
+					crc ^= 0x1021;
+				}
+				else
+				{
+					crc <<= 1;
+				}
+			}
+		}
+
+		return crc;
+	}
+
 	static uint32_t crc32(const void* buffer, uint32_t len, uint32_t polynomial, uint32_t start=0)
 	{
 		uint8_t* buf = (uint8_t*) buffer;